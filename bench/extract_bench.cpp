@@ -0,0 +1,182 @@
+#include "../include/minidocker/layer_extractor.hpp"
+#include "../include/minidocker/parallel_inflater.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include <zstd.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+//Measures layer extraction speed for gzip (streaming and on all cores), single frame zstd and multi frame zstd
+//(how zstd:chunked and pzstd lay out a blob), and checks every extracted file against the tar
+//usage: extract_bench [MiB of tar, default 256]
+static const size_t file_size = 256 * 1024;
+static const size_t zstd_frame_size = 4 * 1024 * 1024;
+
+static void appendTarHeader(string& tar, const string& name, size_t size)
+{
+	char header[512] = {};
+	snprintf(header, 100, "%s", name.c_str());
+	snprintf(header + 100, 8, "%07o", 0644);
+	snprintf(header + 108, 8, "%07o", 0);
+	snprintf(header + 116, 8, "%07o", 0);
+	snprintf(header + 124, 12, "%011zo", size);
+	snprintf(header + 136, 12, "%011o", 0);
+	header[156] = '0';
+	memcpy(header + 257, "ustar", 6);
+	memcpy(header + 263, "00", 2);
+	memset(header + 148, ' ', 8);
+	unsigned int checksum = 0;
+	for (unsigned char c : header) checksum += c;
+	snprintf(header + 148, 8, "%06o", checksum);
+	tar.append(header, sizeof(header));
+}
+
+//files of repeated words with some noise in between, compresses about as well as binaries and text in a real layer
+static string buildTar(size_t total_bytes)
+{
+	static const char* words[] = { "lib", "usr", "share", "bin", "x86_64", "linux", "gnu", "python3", "site-packages", "ELF" };
+	string tar;
+	tar.reserve(total_bytes + total_bytes / 256 + 1024);
+	unsigned int seed = 42;
+	for (size_t file = 0; tar.size() < total_bytes; file++) {
+		appendTarHeader(tar, "data/file" + to_string(file), file_size);
+		size_t start = tar.size();
+		while (tar.size() - start < file_size) {
+			seed = seed * 1103515245 + 12345;
+			if ((seed >> 16) % 4 == 0) {
+				tar.push_back(static_cast<char>(seed >> 8));
+			} else {
+				tar.append(words[(seed >> 16) % 10]);
+			}
+		}
+		tar.resize(start + file_size);
+	}
+	tar.append(1024, '\0');
+	return tar;
+}
+
+static string gzipCompress(const string& input)
+{
+	z_stream zs = {};
+	deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY); // 15 + 16 -> gzip header
+	string output(deflateBound(&zs, input.size()), '\0');
+	zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+	zs.avail_in = input.size();
+	zs.next_out = reinterpret_cast<Bytef*>(&output[0]);
+	zs.avail_out = output.size();
+	deflate(&zs, Z_FINISH);
+	output.resize(zs.total_out);
+	deflateEnd(&zs);
+	return output;
+}
+
+static string zstdCompress(const string& input, size_t frame_size)
+{
+	string output;
+	for (size_t pos = 0; pos < input.size(); pos += frame_size) {
+		size_t len = min(frame_size, input.size() - pos);
+		string frame(ZSTD_compressBound(len), '\0');
+		size_t written = ZSTD_compress(&frame[0], frame.size(), input.data() + pos, len, 3);
+		if (ZSTD_isError(written)) {
+			cerr << "zstd compression failed : " << ZSTD_getErrorName(written) << "\n";
+			exit(1);
+		}
+		output.append(frame.data(), written);
+	}
+	return output;
+}
+
+//the tar's regular files (the only entries buildTar writes) have to be in dir with the same contents, and nothing else
+static bool matchesTar(const string& dir, const string& tar)
+{
+	size_t entries = 0;
+	for (size_t pos = 0; pos + 512 <= tar.size() && tar[pos] != '\0'; entries++) {
+		string name(tar.data() + pos, strnlen(tar.data() + pos, 100));
+		size_t size = strtoull(string(tar.data() + pos + 124, 12).c_str(), nullptr, 8);
+		error_code ec;
+		if (fs::file_size(dir + "/" + name, ec) != size || ec) return false;
+		ifstream ifs(dir + "/" + name, ios::binary);
+		stringstream contents;
+		contents << ifs.rdbuf();
+		if (contents.str().compare(0, string::npos, tar, pos + 512, size) != 0) return false;
+		pos += 512 + (size + 511) / 512 * 512;
+	}
+	size_t files = 0;
+	for (const fs::directory_entry& entry : fs::recursive_directory_iterator(dir)) {
+		if (!entry.is_directory()) files++;
+	}
+	return files == entries;
+}
+
+static double extractThroughput(const string& blob, const string& tar, bool& matches)
+{
+	char dir_template[] = "/tmp/extract_bench.XXXXXX";
+	if (!mkdtemp(dir_template)) {
+		cerr << "couldn't create a temporary directory\n";
+		exit(1);
+	}
+	auto start = chrono::steady_clock::now();
+	{
+		minidocker::LayerExtractor extractor(dir_template);
+		//roughly what curl hands to the write callback
+		for (size_t pos = 0; pos < blob.size(); pos += 16 * 1024) {
+			extractor.write(blob.data() + pos, min<size_t>(16 * 1024, blob.size() - pos));
+		}
+		extractor.finish();
+	}
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+	matches = matchesTar(dir_template, tar);
+	fs::remove_all(dir_template);
+	return (static_cast<double>(tar.size()) / (1024.0 * 1024.0)) / elapsed.count();
+}
+
+int main(int argc, char* argv[])
+{
+	size_t total_mib = argc > 1 ? strtoul(argv[1], nullptr, 10) : 256;
+	if (total_mib == 0) {
+		cerr << "usage: " << argv[0] << " [MiB of tar]\n";
+		return 1;
+	}
+
+	string tar = buildTar(total_mib * 1024 * 1024);
+	string gzip_blob = gzipCompress(tar);
+	//MINIDOCKER_GZIP_THREADS for the run, null leaves it as it is
+	const struct { string m_name; string m_blob; const char* m_gzip_threads; } runs[] = {
+		{ "gzip streaming", gzip_blob, "1" },
+		{ "gzip x" + to_string(minidocker::ParallelInflater::getThreadCount()), gzip_blob, nullptr },
+		{ "zstd", zstdCompress(tar, tar.size()), nullptr },
+		{ "zstd 4MiB frames", zstdCompress(tar, zstd_frame_size), nullptr },
+	};
+
+	cout << fixed << setprecision(1);
+	cout << "extracted a " << tar.size() / (1024 * 1024) << " MiB tar, throughput is of uncompressed bytes\n";
+	const char* configured_threads = getenv("MINIDOCKER_GZIP_THREADS");
+	string saved_threads = configured_threads ? configured_threads : "";
+	bool all_match = true;
+	for (const auto& run : runs) {
+		if (run.m_gzip_threads) setenv("MINIDOCKER_GZIP_THREADS", run.m_gzip_threads, 1);
+		bool matches = false;
+		double mbps = extractThroughput(run.m_blob, tar, matches);
+		all_match = all_match && matches;
+		if (configured_threads) {
+			setenv("MINIDOCKER_GZIP_THREADS", saved_threads.c_str(), 1);
+		} else {
+			unsetenv("MINIDOCKER_GZIP_THREADS");
+		}
+		cout << setw(18) << run.m_name << " : " << mbps << " MiB/s (" << run.m_blob.size() / (1024 * 1024) << " MiB compressed)"
+			<< (matches ? "" : " (EXTRACTED TREE DIFFERS FROM THE TAR)") << "\n";
+	}
+	return all_match ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+#include "../include/minidocker/layer_whiteouts.hpp"
+#include "../include/minidocker/rootfs_materializer.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+//Measures how long copying the layers of an image into a container dir takes : fs::copy of every layer (how
+//prepareContainerFs used to copy them), and the materializer on one and on all threads
+//Run it on btrfs or xfs to see reflinks, on ext4 files are copied with copy_file_range
+//usage: materialize_bench [layers, default 4] [files per layer, default 5000] [dir, default /tmp]
+static const size_t files_per_dir = 100;
+
+//every layer rewrites a tenth of the files below it and deletes another tenth, like package upgrades do
+static void buildLayers(const string& dir, size_t layers, size_t files, vector<string>& layer_dirs)
+{
+	unsigned int seed = 42;
+	for (size_t layer = 0; layer < layers; layer++) {
+		string layer_dir = dir + "/layer" + to_string(layer);
+		for (size_t file = 0; file < files; file++) {
+			seed = seed * 1103515245 + 12345;
+			size_t index = layer == 0 || (seed >> 16) % 5 == 0 ? file + layer * files : (seed >> 8) % (layer * files);
+			string file_dir = layer_dir + "/usr/lib/d" + to_string(index / files_per_dir);
+			fs::create_directories(file_dir);
+			string path = file_dir + "/f" + to_string(index);
+			if (layer > 0 && (seed >> 16) % 10 == 1) {
+				ofstream(file_dir + "/.wh.f" + to_string(index));
+				continue;
+			}
+			//mostly small files, some bigger ones, roughly what a distro layer holds
+			size_t size = (seed >> 16) % 8 == 0 ? 256 * 1024 : 1024 + (seed >> 8) % (16 * 1024);
+			ofstream(path, ios::binary) << string(size, static_cast<char>('a' + index % 26));
+		}
+		layer_dirs.push_back(layer_dir);
+	}
+}
+
+static set<string> listTree(const string& dir)
+{
+	set<string> paths;
+	for (const fs::directory_entry& entry : fs::recursive_directory_iterator(dir)) {
+		paths.insert(fs::relative(entry.path(), dir).string() + ":" + to_string(entry.is_regular_file() ? entry.file_size() : 0));
+	}
+	return paths;
+}
+
+template <typename Copy>
+static double timeCopy(const string& target_dir, Copy copy)
+{
+	fs::remove_all(target_dir);
+	fs::create_directories(target_dir);
+	auto start = chrono::steady_clock::now();
+	copy();
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[])
+{
+	size_t layers = argc > 1 ? strtoul(argv[1], nullptr, 10) : 4;
+	size_t files = argc > 2 ? strtoul(argv[2], nullptr, 10) : 5000;
+	string base_dir = argc > 3 ? argv[3] : "/tmp";
+	if (layers == 0 || files == 0) {
+		cerr << "usage: " << argv[0] << " [layers] [files per layer] [dir]\n";
+		return 1;
+	}
+
+	string dir = base_dir + "/materialize_bench." + to_string(getpid());
+	vector<string> layer_dirs;
+	buildLayers(dir, layers, files, layer_dirs);
+	string target_dir = dir + "/rootfs";
+
+	cout << fixed << setprecision(3);
+	cout << "copying " << layers << " layer(s) of " << files << " file(s) into " << target_dir << "\n";
+	double seconds = timeCopy(target_dir, [&]() {
+		for (const string& layer_dir : layer_dirs) {
+			fs::copy(layer_dir, target_dir, fs::copy_options::recursive | fs::copy_options::overwrite_existing | fs::copy_options::copy_symlinks);
+		}
+	});
+	cout << setw(22) << "fs::copy" << " : " << seconds << "s (whiteouts not applied)\n";
+
+	//what a correct merge of the layers looks like, the materializer has to end up with the same tree
+	timeCopy(target_dir, [&]() {
+		for (const string& layer_dir : layer_dirs) {
+			minidocker::LayerWhiteouts::mergeLayer(layer_dir, target_dir, false);
+		}
+	});
+	set<string> expected = listTree(target_dir);
+
+	unsigned int thread_counts[] = { 1, minidocker::RootfsMaterializer::getThreadCount() };
+	for (unsigned int thread_count : thread_counts) {
+		minidocker::RootfsMaterializer materializer(thread_count);
+		seconds = timeCopy(target_dir, [&]() { materializer.materialize(layer_dirs, target_dir); });
+		bool matches = listTree(target_dir) == expected;
+		cout << setw(22) << "materializer x" + to_string(thread_count) << " : " << seconds << "s, " << materializer.getFileCount()
+			<< " file(s), " << materializer.getClonedCount() << " reflinked, " << materializer.getCopiedBytes() / (1024 * 1024)
+			<< " MiB copied" << (matches ? "" : " (TREE DIFFERS FROM A LAYER MERGE)") << "\n";
+	}
+
+	fs::remove_all(dir);
+	return 0;
+}
@@ -0,0 +1,63 @@
+#include "../include/minidocker/sha256.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//Measures how fast layer blobs can be verified, compared to what a download link can deliver
+//usage: sha256_bench [MiB to hash, default 512] [write size in KiB, default 16 - roughly what curl hands to the write callback]
+static double hashThroughput(minidocker::Sha256::Implementation implementation, const vector<char>& chunk, size_t total_bytes, string& digest)
+{
+	minidocker::Sha256 hasher(implementation);
+	auto start = chrono::steady_clock::now();
+	for (size_t hashed = 0; hashed < total_bytes; hashed += chunk.size()) {
+		hasher.update(chunk.data(), chunk.size());
+	}
+	digest = hasher.finalDigest();
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+	return (static_cast<double>(total_bytes) / (1024.0 * 1024.0)) / elapsed.count();
+}
+
+int main(int argc, char* argv[])
+{
+	size_t total_mib = argc > 1 ? strtoul(argv[1], nullptr, 10) : 512;
+	size_t chunk_kib = argc > 2 ? strtoul(argv[2], nullptr, 10) : 16;
+	if (total_mib == 0 || chunk_kib == 0) {
+		cerr << "usage: " << argv[0] << " [MiB to hash] [write size in KiB]\n";
+		return 1;
+	}
+
+	vector<char> chunk(chunk_kib * 1024);
+	unsigned int seed = 42;
+	for (char& c : chunk) {
+		seed = seed * 1103515245 + 12345;
+		c = static_cast<char>(seed >> 16);
+	}
+	size_t total_bytes = (total_mib * 1024 * 1024 / chunk.size()) * chunk.size();
+
+	string auto_digest, portable_digest;
+	double auto_mbps = hashThroughput(minidocker::Sha256::Implementation::AUTO, chunk, total_bytes, auto_digest);
+	double portable_mbps = hashThroughput(minidocker::Sha256::Implementation::PORTABLE, chunk, total_bytes, portable_digest);
+
+	cout << fixed << setprecision(1);
+	cout << "hashed " << total_mib << " MiB in " << chunk_kib << " KiB writes\n";
+	cout << setw(14) << minidocker::Sha256::getImplementationName() << " : " << auto_mbps << " MiB/s\n";
+	cout << setw(14) << "portable" << " : " << portable_mbps << " MiB/s\n";
+
+	if (auto_digest != portable_digest) {
+		cerr << "digest mismatch between implementations!\n";
+		return 1;
+	}
+
+	//line rates in MiB/s for comparison
+	const pair<const char*, double> links[] = { { "1 Gbit/s", 119.2 }, { "10 Gbit/s", 1192.1 }, { "25 Gbit/s", 2980.2 } };
+	for (const auto& link : links) {
+		cout << setw(14) << link.first << " : " << (auto_mbps >= link.second ? "keeps up" : "slower than the link")
+			<< " (" << auto_mbps / link.second << "x line rate)\n";
+	}
+	return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef MINIDOCKER_BACKGROUND_TASK_H
+#define MINIDOCKER_BACKGROUND_TASK_H
+#include <string>
+#include <vector>
+
+namespace minidocker
+{
+	//Housekeeping that runs in a fresh mini-docker process ("images prune --background", "images prune --trash", ...)
+	//instead of a thread, so it outlives the command that started it and shares nothing with a running container
+	class BackgroundTask
+	{
+	public:
+		//starts "mini-docker <args>" detached (adopted by init, no terminal, output discarded) and returns right away
+		//false if it couldn't be started
+		static bool start(const std::vector<std::string>& args);
+		//idle CPU and IO priority, for the task itself : whatever the containers do comes first
+		static void lowerPriority();
+	};
+}
+
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef MINIDOCKER_CACHE_SERVER_H
+#define MINIDOCKER_CACHE_SERVER_H
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "image_store.hpp"
+
+namespace minidocker
+{
+	class Image;
+	class RegistryClient;
+
+	//A layer blob being fetched from upstream into a temporary file next to where it will be stored
+	//every request for it reads the file as it grows, so a blob crosses the uplink once no matter how many nodes ask for it
+	struct BlobFill
+	{
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		int m_fd = -1;
+		std::string m_temp_path;
+		uint64_t m_written = 0;
+		bool m_done = false;
+		bool m_failed = false;
+		long m_http_code = 0; //of the upstream response when it failed, 0 if it never answered
+		std::string m_error;
+
+		~BlobFill();
+	};
+
+	//mini-docker serve-cache : a read-only registry v2 endpoint (pull-through mirror) over the local image store
+	//Manifests and blobs are served from the store, misses are fetched from the configured registry (and its mirrors) and kept
+	//Nodes point MINIDOCKER_REGISTRY_MIRRORS at it, so only the node running it pulls from the internet
+	class CacheServer
+	{
+	public:
+		//listen_address is "<host>:<port>", ":<port>" or just "<port>" to listen on every interface
+		explicit CacheServer(const std::string& listen_address);
+		//accepts connections until the process is stopped, each one is served by its own thread
+		void run();
+
+	private:
+		struct Request
+		{
+			std::string m_method;
+			std::string m_path;
+			std::map<std::string, std::string> m_headers; //lower case names
+			std::vector<std::string> m_accept;
+		};
+
+		std::string m_host;
+		std::string m_port;
+		ImageStore m_image_store;
+		std::shared_ptr<RegistryClient> m_registry_client;
+		std::mutex m_upstreams_mutex;
+		std::map<std::string, std::shared_ptr<Image>> m_upstreams; //by repository, so tokens are reused
+		std::mutex m_fills_mutex;
+		std::map<std::string, std::shared_ptr<BlobFill>> m_fills; //by digest
+		std::mutex m_log_mutex;
+
+		void handleConnection(int fd);
+		bool handleRequest(int fd, const Request& request);
+		bool serveManifest(int fd, const Request& request, const std::string& name, const std::string& reference);
+		bool serveBlob(int fd, const Request& request, const std::string& name, const std::string& digest);
+		bool serveStoredBlob(int fd, const Request& request, const std::string& path, const std::string& digest);
+		bool serveFillingBlob(int fd, const Request& request, BlobFill& fill, const std::string& path, const std::string& digest);
+		bool probeUpstreamBlob(int fd, const std::string& name, const std::string& digest);
+		std::shared_ptr<BlobFill> startFill(const std::string& name, const std::string& digest, const std::string& path);
+		void fillBlob(std::shared_ptr<Image> upstream, std::string name, std::string digest, std::string path, std::shared_ptr<BlobFill> fill);
+		std::shared_ptr<Image> getUpstream(const std::string& name);
+		void log(const Request& request, int status, const std::string& source);
+
+		static bool readRequest(int fd, std::string& buffer, Request& request);
+		static bool sendAll(int fd, const char* data, size_t len);
+		//status line and headers, the body (if any) is sent separately
+		static bool sendHead(int fd, int status, const std::vector<std::string>& headers);
+		static bool sendResponse(int fd, int status, const std::vector<std::string>& headers, const std::string& body, bool head);
+		static bool sendError(int fd, int status, const std::string& code, const std::string& message, bool head);
+		static bool parseRange(const std::string& value, uint64_t& start, uint64_t& end, bool& open_ended);
+		static std::string getStatusText(int status);
+	};
+}
+
+
+#endif
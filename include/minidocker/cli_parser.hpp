@@ -1,6 +1,7 @@
 #ifndef MINIDOCKER_CLI_PARSER_H
 #define MINIDOCKER_CLI_PARSER_H
 #include <string>
+#include <vector>
 #include "image_args.hpp"
 
 namespace minidocker
@@ -12,11 +13,33 @@ namespace minidocker
 		std::string m_container_command;
 		std::string m_container_args;
 		ImageArgs m_image_args;
+		std::vector<ImageArgs> m_pull_image_args; //pull only, every image to pull
+		PruneArgs m_prune_args;
+		std::string m_archive_path; //save and load only
+		ImageArgs m_push_target_args; //push only, name, tag and registry to push to
+
+		void parseImagesCommand(int argc, char* argv[]);
+		void parseArchiveCommand(int argc, char* argv[]);
+		void parsePushCommand(int argc, char* argv[]);
+		static PullPolicy parsePullPolicy(const std::string& value);
+		static ImageArgs parseImageReference(const std::string& reference);
+		static void readReferenceFile(const std::string& path, std::vector<std::string>& references);
 	public:
 		CLIParser(int argc, char* argv[]);
 		std::string getDockerCommand() const;
 		std::string getSubCommand() const;
 		ImageArgs getDockerImageArgs() const;
+		//pull <image> [<image>...] and --from-file, in the order they were given
+		std::vector<ImageArgs> getPullImageArgs() const;
+		PruneArgs getPruneArgs() const;
+		//save -o <file> and load -i <file>, the image archive
+		std::string getArchivePath() const;
+		//push <image> [<target>], the target is the image itself if it isn't given
+		ImageArgs getPushTargetArgs() const;
+		//serve-cache only, "<host>:<port>" the mirror listens on
+		std::string getListenAddress() const;
+		//images snapshot only, the manifest whose rootfs snapshot is built
+		std::string getSnapshotManifest() const;
 	};
 }
 
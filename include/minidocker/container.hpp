@@ -2,11 +2,20 @@
 #define MINIDOCKER_CONTAINER_H
 
 #include "image.hpp"
+#include "rootfs_image.hpp"
+#include "user_mapping.hpp"
 #include <sys/types.h>
+#include <atomic>
+#include <map>
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace minidocker
 {
+	class LazyFs;
+	class LayerLock;
+
 	class Container
 	{
 	private:
@@ -14,6 +23,26 @@ namespace minidocker
 		Image m_image;
 		std::string m_hostname;
 		std::string m_container_fs_dir;
+		//false for MINIDOCKER_DEFAULT_FS, only a dir the container created is removed with it
+		bool m_owns_container_fs = false;
+		//set when the container fs is an overlay (the default), it holds the mounts and the upper dir
+		std::string m_container_dir;
+		//lock on the container's dir in "containers", it tells a running container from a crashed one
+		int m_container_dir_fd = -1;
+		//where the flattened image is mounted, under m_container_dir
+		std::string m_rootfs_image_dir;
+		//FUSE mounts serving the layers that weren't downloaded yet, by the layer dir they stand in for
+		std::map<std::string, std::unique_ptr<LazyFs>> m_lazy_mounts;
+		//shared locks on the layers the container uses, the garbage collector leaves them alone
+		std::vector<std::unique_ptr<LayerLock>> m_layer_locks;
+		//the ids of the container (its subordinate ids with MINIDOCKER_USERNS_REMAP)
+		UserMapping m_user_mapping;
+		//a user namespace with the container's maps, for the idmapped mounts of its rootfs
+		int m_userns_fd = -1;
+		//idmapped mounts of the lower dirs (or the copied rootfs), unmounted with the container fs
+		std::vector<std::string> m_idmapped_dirs;
+		//short links to the lower dirs, when there are too many of them for the mount options
+		std::string m_lower_links_dir;
 
 		//util functions
 		void mapRootUserInContainer(pid_t pid);
@@ -25,6 +54,22 @@ namespace minidocker
 		static void unmountProc(const std::string& container_fs_dir);
 		static void cleanupCgroup(std::string& hostname);
 		void prepareContainerFs(const std::string& hostname);
+		void lockExtractedLayers();
+		//false if the whiteouts of some layer can't be read by overlayfs, the layers are copied then
+		bool convertLayerWhiteouts();
+		void resetContainerFs(const std::string& host_container_dir);
+		void mountOverlayContainerFs(const std::string& host_container_dir);
+		//the lazily pulled layers are downloaded and extracted before the container starts, when they can't be mounted
+		void pullLazyLayers();
+		void mountRootfsImage(const std::string& host_container_dir, RootfsImageFormat format);
+		//overlay of the lower dirs (topmost first) at <host_container_dir>/rootfs, writes go to <host_container_dir>/upper
+		void mountOverlay(const std::string& host_container_dir, const std::vector<std::string>& lower_dirs);
+		//"<lower_links_dir>/<container id>/<n>" links to the lower dirs, returned in the same order
+		std::vector<std::string> linkLowerDirs(const std::string& host_container_dir, const std::vector<std::string>& lower_dirs);
+		//idmapped mount of dir at target, the container sees the owners of its files as its own ids
+		std::string mountIdmapped(const std::string& dir, const std::string& target);
+		void unmountIdmappedDirs();
+		void downloadLazyLayers(const std::atomic<bool>& cancelled);
 		void fetchMinidockerDefaultFs();
 		static std::string resolveExecutablePath(const std::string& command, char** envp);
 
@@ -0,0 +1,37 @@
+#ifndef MINIDOCKER_CONTAINER_REAPER_H
+#define MINIDOCKER_CONTAINER_REAPER_H
+#include <cstddef>
+#include <set>
+#include <string>
+#include <sys/types.h>
+
+namespace minidocker
+{
+	//Deletes the directories of finished containers without keeping mini-docker from exiting
+	//A container dir is renamed into "/var/lib/minidocker/trash" (a single rename, it's gone from "containers" at once),
+	//and a detached "images prune --trash" deletes whatever is in the trash at idle CPU and IO priority, on several threads
+	//Trash a reaper didn't get to (it was killed, or the host went down) is deleted by the next one,
+	//so are the dirs of containers that crashed before their teardown : a running container holds a lock on its dir
+	class ContainerReaper
+	{
+	public:
+		//moves the directory to the trash and starts a reaper, or deletes it right away if it can't be moved
+		static void discard(const std::string& dir);
+		//deletes everything in the trash, one reaper at a time (another one already at it is left to it)
+		//a background reaper lowers its priority first, returns the number of trash entries deleted
+		static size_t reap(bool background);
+		//locks a container dir for as long as the returned fd is open, -1 if it couldn't be locked
+		static int lockContainerDir(const std::string& dir);
+
+	private:
+		static bool moveToTrash(const std::string& dir);
+		static void startBackgroundReap();
+		//moves the unlocked dirs in "containers" to the trash, mounts a crashed run left in them are detached first
+		static size_t sweepContainerDirs();
+		//returns the entries that couldn't be deleted, reaped is increased by the ones that were
+		static std::set<std::string> emptyTrash(dev_t trash_dev, size_t& reaped);
+	};
+}
+
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef MINIDOCKER_CONTENT_STORE_H
+#define MINIDOCKER_CONTENT_STORE_H
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+namespace minidocker
+{
+	//how identical files of extracted layers share their data, MINIDOCKER_LAYER_DEDUP
+	enum class DedupMode
+	{
+		OFF,
+		HARDLINK,
+		REFLINK
+	};
+
+	//Content addressed store of the regular files extracted from layers, "/var/lib/minidocker/files"
+	//HARDLINK - identical files become links to one inode, so they must also agree on mode, owner and mtime (a link shares them)
+	//REFLINK - files with the same content share their data extents but stay separate inodes (copy-on-write, btrfs or xfs)
+	//Either way a file that many images carry (libc, CA bundles, ...) takes its disk space and page cache once
+	//Layer directories are only ever read (copied into containers or used as read-only overlay layers), so sharing inodes is safe
+	class ContentStore
+	{
+	public:
+		//reads MINIDOCKER_LAYER_DEDUP ("hardlink" or "reflink"), OFF if it's unset or invalid
+		static DedupMode getDedupMode();
+		//swaps the file that was just extracted to parent_fd/name (still open as fd, readable) for the stored copy with the
+		//same content, or adds it to the store if there is none yet
+		//returns the bytes saved, a file that can't be deduplicated is simply kept as it is
+		static uint64_t dedupFile(DedupMode mode, int parent_fd, const std::string& name, int fd, const std::string& digest);
+		//removes stored files that no layer uses anymore, returns the bytes freed
+		//a hardlinked file is unused once the store holds its only link, a reflinked one once nothing reused it for max_unused_age
+		static uint64_t prune(time_t max_unused_age);
+
+	private:
+		static uint64_t hardlinkFile(int parent_fd, const std::string& name, int fd, const std::string& digest);
+		static uint64_t reflinkFile(int fd, const std::string& digest);
+		static std::string getStorePath(const std::string& key);
+	};
+}
+
+
+#endif
@@ -5,65 +5,101 @@
 
 namespace minidocker
 {
-    class UserMapException: ContainerRuntimeException {
+    class UserMapException : public ContainerRuntimeException {
     public:
         explicit UserMapException(const std::string& message)
             : ContainerRuntimeException(message) {}
     };
 
-    class CgroupLimitException : ContainerRuntimeException {
+    class CgroupLimitException : public ContainerRuntimeException {
     public:
         explicit CgroupLimitException(const std::string& message)
             : ContainerRuntimeException(message) {}
     };
 
-    class HostnameException : ContainerRuntimeException {
+    class HostnameException : public ContainerRuntimeException {
     public:
         explicit HostnameException(const std::string& message)
             : ContainerRuntimeException(message) {}
     };
 
-    class MountException : ContainerRuntimeException {
+    class MountException : public ContainerRuntimeException {
     public:
         explicit MountException(const std::string& message)
             : ContainerRuntimeException(message) {}
     };
 
-    class UnmountException : ContainerRuntimeException {
+    class UnmountException : public ContainerRuntimeException {
     public:
         explicit UnmountException(const std::string& message)
             : ContainerRuntimeException(message) {}
     };
 
-    class CleanupCgroupException : ContainerRuntimeException {
+    class CleanupCgroupException : public ContainerRuntimeException {
     public:
         explicit CleanupCgroupException(const std::string& message)
             : ContainerRuntimeException(message) {}
     };
 
-    class ImageManifestException : ImageException {
+    class RootfsImageException : public ContainerRuntimeException {
+    public:
+        explicit RootfsImageException(const std::string& message)
+            : ContainerRuntimeException(message) {}
+    };
+
+    class RootfsSnapshotException : public ContainerRuntimeException {
+    public:
+        explicit RootfsSnapshotException(const std::string& message)
+            : ContainerRuntimeException(message) {}
+    };
+
+    class ImageManifestException : public ImageException {
     public:
         explicit ImageManifestException(const std::string& message)
             : ImageException(message) {}
     };
 
-    class ImageConfigException : ImageException {
+    class ImageConfigException : public ImageException {
     public:
         explicit ImageConfigException(const std::string& message)
             : ImageException(message) {}
     };
 
-    class ImageTarballException : ImageException {
+    class ImageTarballException : public ImageException {
     public:
         explicit ImageTarballException(const std::string& message)
             : ImageException(message) {}
     };
 
-    class ImageExtractionException : ImageException {
+    class ImageExtractionException : public ImageException {
     public:
         explicit ImageExtractionException(const std::string& message)
             : ImageException(message) {}
     };
+
+    class ImageAuthException : public ImageException {
+    public:
+        explicit ImageAuthException(const std::string& message)
+            : ImageException(message) {}
+    };
+
+    class CacheServerException : public ImageException {
+    public:
+        explicit CacheServerException(const std::string& message)
+            : ImageException(message) {}
+    };
+
+    class ImageArchiveException : public ImageException {
+    public:
+        explicit ImageArchiveException(const std::string& message)
+            : ImageException(message) {}
+    };
+
+    class ImagePushException : public ImageException {
+    public:
+        explicit ImagePushException(const std::string& message)
+            : ImageException(message) {}
+    };
 }
 
 #endif
\ No newline at end of file
@@ -1,18 +1,38 @@
 #ifndef MINIDOCKER_IMAGE_H
 #define MINIDOCKER_IMAGE_H
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
 #include <nlohmann/json.hpp>
 #include "image_args.hpp"
+#include "image_store.hpp"
 
 namespace minidocker
 {
+	class RegistryClient;
+	class LazyLayer;
+	class PullReport;
+	struct RegistryResponse;
+	struct AuthChallenge;
+	struct LayerDownloadJob;
+	struct LayerDownloadResult;
+	struct LayerTimings;
+	struct FetchRecord;
+	class OciArchiveWriter;
+	class OciArchiveReader;
+
 	struct ImageLayer
 	{
 		std::string m_media_type;
 		std::string m_image_digest;
 		std::string m_image_size;
+		std::map<std::string, std::string> m_annotations;
 	};
 
 	//for now supported config details : Cmd, Entrypoint, Env, WorkingDir
@@ -22,6 +42,7 @@ namespace minidocker
 		std::vector<std::string> m_entrypoint;
 		std::vector<std::string> m_env;
 		std::string m_working_dir;
+		std::vector<std::string> m_diff_ids; //digests of the uncompressed layers, rootfs.diff_ids
 	};
 
 	struct ImageManifest
@@ -40,30 +61,101 @@ namespace minidocker
 		std::string m_type;
 		std::string m_image_name;
 		std::string m_image_tag;
-		std::string m_bearer_token;
+		PullPolicy m_pull_policy = PullPolicy::MISSING;
+		bool m_lazy_pull = false;
+		ImageStore m_image_store;
+		std::vector<std::string> m_registry_urls; //mirrors first, the registry itself last
+		std::string m_repository_actions = "pull"; //"pull,push" for the target of a push
+		std::map<std::string, std::string> m_bearer_tokens; //by registry host
+		std::shared_ptr<std::mutex> m_token_mutex = std::make_shared<std::mutex>(); //layers of a lazy pull are fetched from other threads
 		ImageManifest m_image_manifest;
+		std::string m_manifest_digest; //of the platform manifest fetchManifest() ended up with
+		std::string m_config_digest;
+		std::vector<std::shared_ptr<const LazyLayer>> m_lazy_layers; //TOC of every layer that is served lazily, null for the others
+		std::shared_ptr<RegistryClient> m_registry_client;
+		std::string m_report_path;
+		std::shared_ptr<PullReport> m_pull_report;
 
 		//util functions
 		std::pair<std::string, std::string> getHostArchAndOS();
-		static size_t writeCallback(void* contents, size_t size, size_t nmemb, std::string* output);
-		static size_t writeFileCallback(char* ptr, size_t size, size_t nmemb, void* userdata);
-		std::string getToken(const std::string& auth_url);
-		void updateTokenIfUnauthorized(const std::string& header_str);
+		std::string getToken(const AuthChallenge& challenge);
+		std::string getRepositoryScope() const;
+		void updateTokenIfUnauthorized(const std::string& host, const std::string& header_str);
+		//runs a request with the bearer token of its host, once more with a fresh token if the registry answers 401
+		RegistryResponse registryRequest(const std::string& url, const std::function<RegistryResponse(const std::vector<std::string>&)>& request);
+		RegistryResponse registryGet(const std::string& url, const std::vector<std::string>& headers, bool follow_redirects,
+			const std::function<bool(const char*, size_t)>& body_handler = nullptr);
 		void parseManifest(nlohmann::json manifest_json, const std::string& image_name, const std::string& image_tag);
 		void parseConfigDetails(nlohmann::json config_json);
 		void fetchConfigDetails(nlohmann::json manifest_json);
-		void fetchManifest();
 		void fetchManifest(std::string image_name, std::string image_tag);
-		void downloadImageLayer(const std::string& blob_url, const std::string& image_tar_path);
-		static void extractImageLayer(const std::string& image_tar_path, const std::string& image_layer_dir);
+		static bool keepLayerTarballs();
+		static void extractImageLayer(const std::string& image_tar_path, const std::string& image_layer_dir, const std::string& image_digest,
+			LayerTimings& timings);
+		//extracts the len bytes of a blob at offset in fd, the tarball of a layer or its entry in an image archive
+		static void extractImageLayer(int fd, uint64_t offset, uint64_t len, const std::string& image_layer_dir, const std::string& image_digest,
+			LayerTimings& timings);
+		void saveLayerBlob(OciArchiveWriter& archive, const ImageLayer& layer, const std::string& blob_name);
+		void loadLayers(const OciArchiveReader& archive);
+		static void recordResponse(FetchRecord& record, const RegistryResponse& response);
+		void writePullReport() const;
+		LayerDownloadJob getDownloadJob(const ImageLayer& layer, bool keep_tarballs) const;
+		std::vector<LayerDownloadResult> downloadLayers(std::vector<LayerDownloadJob> jobs, const std::atomic<bool>* cancelled);
+		//every job is downloaded through the image it belongs to, with that image's token
+		static std::vector<LayerDownloadResult> downloadLayers(std::vector<std::pair<Image*, LayerDownloadJob>> jobs, const std::atomic<bool>* cancelled);
+		static std::string normalizeRegistryUrl(std::string url);
+		bool openLazyLayer(size_t index);
 		void processImageLayers();
+		//returns the layer errors of every image, empty for the images that were pulled completely
+		static std::vector<std::string> processImageLayers(const std::vector<Image*>& images);
 	public:
 		Image(const std::string& docker_command);
-		Image(const ImageArgs& image_args);
+		//images pulled one after another can pass the same client to reuse its connections
+		Image(const ImageArgs& image_args, std::shared_ptr<RegistryClient> registry_client = nullptr);
 		std::string getDockerCommand() const;
 		std::string getImageType() const;
 		void pull();
+		//resolves the tag to the manifest of this platform and its config, storing both, but leaves the layers alone
+		void fetchManifest();
+		//pulls several images at once : all manifests are resolved concurrently, then the union of their layers is downloaded
+		//under one concurrency limit, so a layer shared by several images is only downloaded once
+		//an image that fails doesn't stop the others, the failures are thrown together at the end
+		static void pullAll(const std::vector<ImageArgs>& image_args);
 		ImageManifest getImageManifest() const;
+		std::string getImageName() const;
+		std::string getImageTag() const;
+		//digests of the manifest and config fetchManifest() resolved
+		std::string getManifestDigest() const;
+		std::string getConfigDigest() const;
+		//a local copy of the compressed blob, from the image store (serve-cache, configs) or a kept tarball, empty if there is none
+		std::string findStoredBlob(const std::string& digest, uint64_t size) const;
+		//writes the image as an OCI image layout tar archive, with its original compressed layer blobs
+		//blobs that aren't stored locally are streamed from the registry into the archive
+		void save(const std::string& archive_path);
+		//stores the images of an archive written by save (or docker save, skopeo, ...) and extracts their layers, like a pull would
+		static void load(const std::string& archive_path);
+
+		//TOCs of the layers a lazy pull (--lazy) left to be fetched on demand, in the order of the manifest layers
+		std::vector<std::shared_ptr<const LazyLayer>> getLazyLayers() const;
+		//len bytes of a layer blob starting at offset, safe to call from several threads
+		std::string fetchBlobRange(const std::string& image_digest, uint64_t offset, uint64_t len);
+		//downloads and extracts the lazily served layers like a regular pull would, until done or cancelled
+		void downloadLazyLayers(const std::atomic<bool>& cancelled);
+		//where the layer is (or will be) extracted
+		static std::string getImageLayerDir(const ImageLayer& layer);
+
+		//GET of "<registry url><path>" on every configured endpoint in turn, until one of them serves it (2xx or 304)
+		//the response of the last endpoint is returned if none does, a body handler gets the body of the one that served it
+		RegistryResponse registryFetch(const std::string& path, const std::vector<std::string>& headers, bool follow_redirects,
+			const std::function<bool(const char*, size_t)>& body_handler = nullptr);
+		//request of another method to an url of this image's registry, with the same token handling as registryFetch
+		//(the push target asks for push access), the body is read from body_source
+		RegistryResponse registrySend(const std::string& method, const std::string& url, const std::vector<std::string>& headers,
+			uint64_t body_size = 0, const std::function<size_t(char*, size_t, uint64_t)>& body_source = nullptr);
+		//"<scheme>://<host>/v2/" of the registry itself, the one a push goes to
+		std::string getRegistryUrl() const;
+		//"<scheme>://<host>/v2/" of the mirrors in MINIDOCKER_REGISTRY_MIRRORS followed by MINIDOCKER_REGISTRY (Docker Hub by default)
+		static std::vector<std::string> getRegistryUrls();
 	};
 }
 
@@ -1,13 +1,36 @@
 #ifndef MINIDOCKER_IMAGE_ARGS_H
 #define MINIDOCKER_IMAGE_ARGS_H
+#include <cstdint>
 #include <string>
 
 namespace minidocker
 {
+	//when to contact the registry for an image
+	//ALWAYS - revalidate the manifest of the tag, MISSING - only if something isn't stored locally, NEVER - local store only
+	enum class PullPolicy
+	{
+		ALWAYS,
+		MISSING,
+		NEVER
+	};
+
 	struct ImageArgs
 	{
 		std::string name;
 		std::string tag;
+		PullPolicy pull_policy = PullPolicy::MISSING;
+		bool lazy_pull = false; //run only, start the container before seekable layers are downloaded
+		std::string report_path; //--report, where the JSON pull report is written (empty for none)
+		std::string push_registry; //push only, set on the target : the registry it's pushed to, instead of the configured ones
+	};
+
+	//images prune [--budget=<size>]
+	struct PruneArgs
+	{
+		uint64_t budget = 0; //bytes, 0 means no budget
+		bool budget_set = false; //otherwise MINIDOCKER_LAYER_CACHE_BUDGET applies
+		bool background = false; //started by a pull that left the cache over budget
+		bool trash = false; //started by a container teardown, only empties the trash
 	};
 }
 
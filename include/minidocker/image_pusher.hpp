@@ -0,0 +1,50 @@
+#ifndef MINIDOCKER_IMAGE_PUSHER_H
+#define MINIDOCKER_IMAGE_PUSHER_H
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "image.hpp"
+#include "image_args.hpp"
+#include "image_store.hpp"
+
+namespace minidocker
+{
+	class RegistryClient;
+
+	//Pushes a locally stored image to a registry with the v2 upload protocol
+	//Every blob (config and layers) is checked with a HEAD first and skipped if the registry has it already, a blob that was pushed
+	//to another repository of the registry is mounted from there, anything else is uploaded in chunks, several blobs at a time
+	//The manifest goes last, once everything it refers to is there, so the tag never points to an incomplete image
+	//Requests go through the target Image, which asks the registry for tokens with push access
+	class ImagePusher
+	{
+	private:
+		std::shared_ptr<RegistryClient> m_registry_client;
+		Image m_source;
+		Image m_target;
+		PullPolicy m_pull_policy;
+		ImageStore m_image_store;
+		std::string m_registry_url; //"<scheme>://<host>/v2/" of the target
+		std::string m_registry_host;
+
+		void pushBlob(const std::string& digest, uint64_t size);
+		//opens an upload session and returns its location, or an empty one if the registry mounted the blob instead
+		std::string startUpload(const std::string& digest);
+		void uploadBlob(std::string location, const std::string& path, const std::string& digest, uint64_t size);
+		void pushManifest();
+		//local copy of the blob, fetched from the source registry into the image store if there is none
+		std::string getBlobFile(const std::string& digest, uint64_t size);
+		static std::string resolveLocation(const std::string& location, const std::string& request_url);
+	public:
+		//target_args.push_registry is the registry to push to, MINIDOCKER_REGISTRY if it's empty
+		ImagePusher(const ImageArgs& source_args, const ImageArgs& target_args);
+		void push();
+
+		//MINIDOCKER_MAX_CONCURRENT_UPLOADS, blobs uploaded at the same time
+		static size_t getMaxConcurrentUploads();
+	};
+}
+
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef MINIDOCKER_IMAGE_STORE_H
+#define MINIDOCKER_IMAGE_STORE_H
+#include <string>
+#include <vector>
+
+namespace minidocker
+{
+	//What a tag resolved to the last time the registry was asked
+	//m_digest is the digest of the manifest or index the tag pointed to, m_etag is sent back with If-None-Match to revalidate it
+	struct StoredReference
+	{
+		std::string m_digest;
+		std::string m_etag;
+	};
+
+	//Local copy of the JSON documents of pulled images (indexes, manifests and configs)
+	//Documents are stored by their digest under "blobs/sha256/<hex>", tags point to them from "refs/<image name>/<tag>"
+	//Together with the extracted layers this is all run needs, so a stored image starts without talking to the registry
+	class ImageStore
+	{
+	private:
+		std::string m_store_dir;
+
+		std::string getReferencePath(const std::string& image_name, const std::string& image_tag) const;
+		std::string getPushedPath(const std::string& registry_host, const std::string& digest) const;
+		static void writeFileAtomically(const std::string& path, const std::string& content);
+	public:
+		explicit ImageStore(const std::string& store_dir = getDefaultStoreDir());
+
+		bool getReference(const std::string& image_name, const std::string& image_tag, StoredReference& reference) const;
+		void putReference(const std::string& image_name, const std::string& image_tag, const StoredReference& reference);
+		//digests every stored tag points to
+		std::vector<std::string> getReferencedDigests() const;
+		//false if the document isn't stored or doesn't match its digest anymore
+		bool getBlob(const std::string& digest, std::string& content) const;
+		//stores the document under its sha256 digest and returns that digest
+		std::string putBlob(const std::string& content);
+		//where a blob with this digest is (or would be) stored, empty for a malformed digest
+		//layer blobs kept by serve-cache live there too
+		std::string getBlobPath(const std::string& digest) const;
+		//repository of a registry a blob was last pushed to, so pushes of other repositories can mount it from there
+		//kept under "pushed/<registry host>/", empty if the blob was never pushed there
+		std::string getPushedRepository(const std::string& registry_host, const std::string& digest) const;
+		void putPushedRepository(const std::string& registry_host, const std::string& digest, const std::string& repository);
+
+		static std::string getDefaultStoreDir();
+	};
+}
+
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef MINIDOCKER_LAYER_CACHE_H
+#define MINIDOCKER_LAYER_CACHE_H
+#include <cstdint>
+#include <ctime>
+#include <set>
+#include <string>
+#include <vector>
+#include "image_args.hpp"
+
+namespace minidocker
+{
+	//An extracted layer in the cache, as seen by the garbage collector
+	struct CachedLayer
+	{
+		std::string m_digest;
+		uint64_t m_size = 0; //bytes on disk
+		time_t m_last_used = 0;
+		bool m_referenced = false; //by an image tag in the image store
+	};
+
+	//Keeps "/var/lib/minidocker/layers" and the download leftovers in "/tmp/minidocker" in check
+	//Every layer has a usage record in "/var/lib/minidocker/layer-usage/<hex>" : its size, and its mtime is when it was last pulled or run
+	//Layers are evicted least recently used first, layers no stored tag refers to go before all others,
+	//and layers a running container or a pull holds the lock of are never touched
+	class LayerCache
+	{
+	public:
+		//marks the layer as used just now, the first time its size is recorded as well
+		static void recordUse(const std::string& image_digest);
+		//removes leftovers and unreferenced layers, then evicts layers until the cache fits the budget
+		//a background prune only evicts down to the budget, one layer at a time and at idle priority
+		static void prune(const PruneArgs& prune_args);
+		//if the cache is over budget, starts a detached "images prune --background" and returns right away
+		static void startBackgroundEviction();
+
+		//reads MINIDOCKER_LAYER_CACHE_BUDGET, 0 (no budget) if it's unset or invalid
+		static uint64_t getBudget();
+		//"20G", "512MiB", "1048576", ... (binary units)
+		static bool parseSize(const std::string& value, uint64_t& size);
+		//referenced_manifests, if given, gets the manifests (and indexes) the tags point to
+		static std::set<std::string> getReferencedLayers(std::set<std::string>* referenced_manifests = nullptr);
+
+	private:
+		static std::vector<CachedLayer> listLayers();
+		static bool evictLayer(const CachedLayer& layer);
+		static uint64_t removeLeftovers();
+		static uint64_t getDiskUsage(const std::string& path);
+		static uint64_t readUsageRecord(const std::string& image_digest, const std::string& image_layer_dir);
+		static std::string getUsagePath(const std::string& image_digest);
+	};
+}
+
+
+#endif
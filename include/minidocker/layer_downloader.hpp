@@ -0,0 +1,86 @@
+#ifndef MINIDOCKER_LAYER_DOWNLOADER_H
+#define MINIDOCKER_LAYER_DOWNLOADER_H
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+#include "pull_report.hpp"
+
+namespace minidocker
+{
+	class RegistryClient;
+	class Sha256;
+
+	//A single layer blob that has to be fetched from the registry and extracted into m_image_layer_dir
+	//While downloading, the raw blob is journaled to "<m_image_tar_path>.partial" so an interrupted pull can resume
+	//Once verified it's renamed to m_image_tar_path if m_keep_tarball is set (debugging aid), otherwise removed
+	//m_image_size is the size from the manifest, 0 if unknown
+	struct LayerDownloadJob
+	{
+		std::string m_image_digest;
+		std::string m_blob_url;
+		std::string m_image_layer_dir;
+		std::string m_image_tar_path;
+		uint64_t m_image_size = 0;
+		bool m_keep_tarball = false;
+	};
+
+	//Outcome of a job once the downloader is done with it
+	//a failed job doesn't affect the other jobs running alongside it
+	struct LayerDownloadResult
+	{
+		std::string m_image_digest;
+		std::string m_blob_url;
+		bool m_success = false;
+		std::string m_error;
+		LayerTimings m_timings;
+	};
+
+	//Downloads several layers at once using the curl multi interface
+	//Every job gets its own easy handle from the registry client's pool, but all of them are driven from a single thread
+	//Large blobs are split into byte ranges that are fetched over several connections and written into place with pwrite,
+	//the bytes are hashed and extracted in order as soon as they are contiguous
+	//Layers are hashed and extracted straight from the write callback, the bytes go from the socket to the layer directory in one pass
+	//Extraction happens in a staging directory that only replaces m_image_layer_dir once the digest matched
+	class LayerDownloader
+	{
+	public:
+		//returns the bearer token that should currently be sent to the registry
+		using TokenProvider = std::function<std::string()>;
+		//refreshes the bearer token using the headers of a 401 response
+		using TokenRefresher = std::function<void(const std::string& header_str)>;
+
+		LayerDownloader(RegistryClient& registry_client, TokenProvider token_provider, TokenRefresher token_refresher,
+			size_t max_concurrent_downloads, size_t segments_per_layer);
+		void addJob(const LayerDownloadJob& job);
+		//for a job that needs a token of its own, like a layer of another repository than the rest
+		void addJob(const LayerDownloadJob& job, TokenProvider token_provider, TokenRefresher token_refresher);
+		//cancelled is polled about once a second, a cancelled run returns with the unfinished jobs failed
+		std::vector<LayerDownloadResult> run(const std::atomic<bool>* cancelled = nullptr);
+
+		//reads MINIDOCKER_MAX_CONCURRENT_DOWNLOADS, falls back to the default if it's unset or invalid
+		static size_t getMaxConcurrentDownloads();
+		//reads MINIDOCKER_DOWNLOAD_SEGMENTS, the number of connections a large layer is downloaded over (1 disables splitting)
+		static size_t getSegmentsPerLayer();
+		//directory a layer is extracted into before it's verified
+		static std::string getStagingDir(const std::string& image_layer_dir);
+
+	private:
+		RegistryClient& m_registry_client;
+		TokenProvider m_token_provider;
+		TokenRefresher m_token_refresher;
+		size_t m_max_concurrent_downloads;
+		size_t m_segments_per_layer;
+		std::vector<LayerDownloadJob> m_jobs;
+		std::vector<std::pair<TokenProvider, TokenRefresher>> m_job_tokens; //of every job in m_jobs
+
+		static void verifyDownloadedLayer(const LayerDownloadJob& job, Sha256& hasher);
+		static void publishLayer(const LayerDownloadJob& job);
+	};
+}
+
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef MINIDOCKER_LAYER_EXTRACTOR_H
+#define MINIDOCKER_LAYER_EXTRACTOR_H
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <zlib.h>
+#include <zstd.h>
+#include "content_store.hpp"
+#include "parallel_inflater.hpp"
+#include "sha256.hpp"
+
+namespace minidocker
+{
+	//Extracts a (optionally gzip or zstd compressed) layer tarball into a directory while the bytes are still arriving
+	//Bytes are pushed in with write() as they come off the socket, so no temporary tarball is needed
+	//Memory usage stays bounded: only a fixed inflate buffer, the current tar header and a few pending zstd frames
+	//(at most 64 MiB of their decompressed output at once) are kept around
+	//zstd frames are independent of each other, so blobs made of many frames are decompressed on several threads
+	//Large gzip blobs are decompressed on several threads as well, see ParallelInflater
+	class LayerExtractor
+	{
+	private:
+		enum class Compression { UNKNOWN, NONE, GZIP, ZSTD };
+		enum class TarState { HEADER, FILE_DATA, META_DATA, SKIP_DATA, PADDING, END_OF_ARCHIVE };
+
+		//Header fields of the entry currently being extracted, pax/GNU extensions are already applied
+		struct TarEntry
+		{
+			std::string m_path;
+			std::string m_link_path;
+			char m_type = '0';
+			mode_t m_mode = 0;
+			uid_t m_uid = 0;
+			gid_t m_gid = 0;
+			time_t m_mtime = 0;
+			uint64_t m_size = 0;
+			dev_t m_dev_major = 0;
+			dev_t m_dev_minor = 0;
+		};
+
+		//Directory metadata is applied at the end, as extracting files into them changes their mtime
+		struct DeferredDirectory
+		{
+			std::string m_path;
+			mode_t m_mode;
+			uid_t m_uid;
+			gid_t m_gid;
+			time_t m_mtime;
+		};
+
+		std::string m_target_dir;
+		int m_root_fd = -1;
+		bool m_preserve_owner;
+		bool m_finished = false;
+
+		Compression m_compression = Compression::UNKNOWN;
+		z_stream m_zstream;
+		bool m_zstream_initialized = false;
+		bool m_gzip_member_ended = false;
+		std::vector<unsigned char> m_inflate_buffer;
+		std::unique_ptr<ParallelInflater> m_parallel_inflater; //until it's known whether the blob is big enough for it, it only buffers
+		std::string m_magic; //first bytes of the blob, until the compression can be told apart
+
+		ZSTD_DStream* m_zstd_stream = nullptr;
+		bool m_zstd_streaming_frame = false; //current frame is too big to collect, it's decompressed as it arrives
+		std::vector<unsigned char> m_zstd_input; //compressed bytes that weren't decompressed yet
+		std::vector<std::pair<size_t, size_t>> m_zstd_frames; //offset and size of the complete frames in m_zstd_input
+		size_t m_zstd_scanned = 0; //end of the last complete frame in m_zstd_input
+
+		TarState m_tar_state = TarState::HEADER;
+		uint64_t m_tar_bytes = 0; //decompressed bytes of the tar stream so far
+		unsigned char m_header[512];
+		size_t m_header_filled = 0;
+		size_t m_zero_blocks = 0;
+		uint64_t m_remaining = 0;
+		uint64_t m_padding = 0;
+		TarEntry m_entry;
+		int m_file_fd = -1;
+		int m_file_parent_fd = -1; //m_cached_parent_fd while the file is written, not owned
+		std::string m_file_name;
+		char m_meta_type = 0;
+		std::string m_meta_data;
+
+		//pax / GNU long name values that apply to the next entry only
+		std::string m_next_path;
+		std::string m_next_link_path;
+		std::string m_pax_size;
+		std::string m_pax_uid;
+		std::string m_pax_gid;
+		std::string m_pax_mtime;
+
+		std::string m_cached_parent_path;
+		int m_cached_parent_fd = -1;
+		std::vector<DeferredDirectory> m_deferred_directories;
+
+		DedupMode m_dedup_mode;
+		bool m_hash_file = false; //current file is hashed so it can be deduplicated once written
+		Sha256 m_file_hasher;
+		uint64_t m_deduped_bytes = 0;
+		bool m_whiteouts_converted = true; //every whiteout so far is in the overlayfs format, see LayerWhiteouts
+
+		void detectCompression(const unsigned char* data, size_t len);
+		void gzipChunk(const unsigned char* data, size_t len);
+		void endParallelInflate();
+		void inflateChunk(const unsigned char* data, size_t len);
+		void zstdChunk(const unsigned char* data, size_t len);
+		void collectZstdFrames(bool final);
+		void decompressZstdFrames();
+		//frames [begin, end) of m_zstd_frames, the ones with a known content size in parallel
+		void decompressZstdGroup(size_t begin, size_t end, const std::vector<unsigned long long>& content_sizes);
+		bool streamZstd(const unsigned char* data, size_t len, size_t& consumed);
+		void consumeTar(const unsigned char* data, size_t len);
+		void processHeader();
+		void processMetaEntry();
+		void parsePaxRecords(const std::string& records);
+		void beginEntry();
+		void finishFileEntry();
+		int openParentDir(const std::string& parent_path);
+		int walkToDir(const std::string& path, bool create);
+		void splitPath(const std::string& path, std::string& parent, std::string& name) const;
+		void removeExisting(int parent_fd, const std::string& name, bool keep_directory);
+		void applyMetadata(int parent_fd, const std::string& name, const TarEntry& entry, bool is_symlink);
+		void applyDeferredDirectories();
+		void closeFds();
+
+		static bool sanitizePath(std::string& path);
+		static uint64_t parseNumeric(const unsigned char* field, size_t len);
+		static std::string parseString(const unsigned char* field, size_t len);
+	public:
+		LayerExtractor(const std::string& target_dir);
+		~LayerExtractor();
+		LayerExtractor(const LayerExtractor&) = delete;
+		LayerExtractor& operator=(const LayerExtractor&) = delete;
+
+		//feeds the next chunk of the (compressed) tarball
+		void write(const char* data, size_t len);
+		//must be called once the whole tarball was fed, throws if the stream was truncated
+		void finish();
+
+		//size of the tar stream extracted so far, after decompression
+		uint64_t getUncompressedBytes() const;
+		//"gzip", "zstd", "none", or "unknown" before the first bytes arrived
+		std::string getCompressionName() const;
+		//disk space saved by sharing files with other layers, see ContentStore
+		uint64_t getDedupedBytes() const;
+	};
+}
+
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef MINIDOCKER_LAYER_LOCK_H
+#define MINIDOCKER_LAYER_LOCK_H
+#include <string>
+
+namespace minidocker
+{
+	//Per-digest lock (flock on "/var/lib/minidocker/locks/<hex>.lock") held while a layer is downloaded and extracted,
+	//so concurrent mini-docker processes fetch every layer once and the others wait for it instead of racing on the same files
+	//Containers hold it shared while they use the layer, which keeps the garbage collector away from it
+	//The kernel drops the lock when the holder exits, a crashed pull never leaves a layer locked
+	class LayerLock
+	{
+	public:
+		//opens (creating if needed) the lock file, doesn't lock yet
+		explicit LayerLock(const std::string& image_digest);
+		~LayerLock();
+		LayerLock(const LayerLock&) = delete;
+		LayerLock& operator=(const LayerLock&) = delete;
+
+		//false if another process (or another LayerLock of this one) holds it
+		bool tryLock();
+		//blocks until the lock is free
+		void lock();
+		//shared with other readers, excludes an exclusive holder
+		bool tryLockShared();
+		void lockShared();
+		void unlock();
+		const std::string& getDigest() const;
+
+		static std::string getLockPath(const std::string& image_digest);
+
+	private:
+		int m_fd = -1;
+		bool m_locked = false;
+		std::string m_digest;
+		std::string m_path;
+
+		bool acquire(int operation);
+	};
+}
+
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef MINIDOCKER_LAYER_WHITEOUTS_H
+#define MINIDOCKER_LAYER_WHITEOUTS_H
+#include <string>
+#include <sys/stat.h>
+
+namespace minidocker
+{
+	//How an extracted layer records what it deletes from the layers below it
+	//A layer tarball has OCI whiteouts : an empty ".wh.<name>" file deletes <name>, ".wh..wh..opq" hides everything below in its directory
+	//Extracted layers use the overlayfs format instead, so a layer dir is an overlay lower dir as it is : a 0/0 character device
+	//named <name>, and a "trusted.overlay.opaque" xattr on the directory
+	//A layer dir carries "trusted.minidocker.whiteouts" once all of its whiteouts are in the overlayfs format
+	class LayerWhiteouts
+	{
+	public:
+		//turns the whiteout entry name (".wh.<name>" or ".wh..wh..opq") of a layer into its overlayfs form in parent_fd,
+		//<name> must not exist there anymore
+		//false if that isn't allowed (no CAP_MKNOD or trusted xattrs), the caller keeps the OCI entry then
+		static bool apply(int parent_fd, const std::string& name);
+		//marks the layer dir as having overlayfs whiteouts only
+		static void markConverted(int layer_fd);
+		static bool isConverted(const std::string& layer_dir);
+		//converts the OCI whiteouts of a layer extracted before they were converted on extraction, the layer must be locked
+		//false if some of them couldn't be converted
+		static bool convertLayer(const std::string& layer_dir);
+
+		static bool isWhiteout(const struct stat& st);
+		static bool isOpaque(const std::string& dir);
+		//applies the layer on top of target_dir, whiteouts (either format) delete what the layers below put there
+		//files are hard linked when link_files is set (the layer dir and target_dir must be on one file system), copied otherwise
+		static void mergeLayer(const std::string& layer_dir, const std::string& target_dir, bool link_files);
+	};
+}
+
+
+#endif
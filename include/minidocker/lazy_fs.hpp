@@ -0,0 +1,57 @@
+#ifndef MINIDOCKER_LAZY_FS_H
+#define MINIDOCKER_LAZY_FS_H
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "lazy_layer.hpp"
+
+namespace minidocker
+{
+	//Read-only FUSE file system serving one lazily pulled layer, spoken straight over /dev/fuse (no libfuse needed)
+	//The tree comes from the layer's TOC, file contents are fetched chunk by chunk with Range requests on first read
+	//and kept in m_cache_dir, so every chunk crosses the network once
+	//It's meant as an overlayfs lower dir, whiteouts are presented the way overlayfs expects them
+	class LazyFs
+	{
+	public:
+		//mounts the layer on mount_dir right away, requests are served by a few threads until the object is destroyed
+		LazyFs(std::shared_ptr<const LazyLayer> layer, LazyLayer::RangeReader reader, const std::string& mount_dir, const std::string& cache_dir);
+		~LazyFs();
+		LazyFs(const LazyFs&) = delete;
+		LazyFs& operator=(const LazyFs&) = delete;
+
+		//once the whole layer was downloaded and extracted, files that weren't fetched yet are read from there
+		void useExtractedLayer(const std::string& image_layer_dir);
+
+	private:
+		std::shared_ptr<const LazyLayer> m_layer;
+		LazyLayer::RangeReader m_reader;
+		std::string m_mount_dir;
+		std::string m_cache_dir;
+		int m_fuse_fd = -1;
+		std::atomic<bool> m_stopping{ false };
+		std::vector<std::thread> m_threads;
+
+		std::mutex m_mutex; //guards everything below
+		std::map<size_t, int> m_cache_fds;
+		std::map<size_t, std::vector<bool>> m_cached_chunks;
+		std::string m_image_layer_dir;
+
+		void serve();
+		void handleRequest(const char* request, size_t len);
+		void reply(uint64_t unique, int error, const void* data, size_t len);
+		int readFile(size_t index, uint64_t offset, uint32_t size, std::string& data);
+		bool readExtractedFile(size_t index, uint64_t offset, uint64_t len, std::string& data);
+		int getCacheFd(size_t index);
+		std::string getPath(size_t index) const;
+	};
+}
+
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef MINIDOCKER_LAZY_LAYER_H
+#define MINIDOCKER_LAZY_LAYER_H
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace minidocker
+{
+	struct ImageLayer;
+
+	//Compressed range of a layer blob that decompresses to one piece of a file
+	struct LazyChunk
+	{
+		uint64_t m_file_offset = 0;
+		uint64_t m_size = 0;
+		uint64_t m_blob_offset = 0;
+		uint64_t m_blob_end = 0;
+		uint64_t m_inner_offset = 0; //where the chunk starts in the decompressed range
+		std::string m_digest; //sha256 of the decompressed chunk, empty if the TOC has none
+		bool m_zeros = false; //a hole, nothing has to be fetched
+	};
+
+	//A file, directory, symlink, ... of the layer, the index in LazyLayer::getEntries() is its inode number - 1
+	//Whiteouts are already in overlayfs form: a 0/0 char device, or the opaque flag on the directory
+	struct LazyEntry
+	{
+		std::string m_name;
+		size_t m_parent = 0;
+		mode_t m_mode = 0;
+		uid_t m_uid = 0;
+		gid_t m_gid = 0;
+		time_t m_mtime = 0;
+		uint64_t m_size = 0;
+		dev_t m_rdev = 0;
+		uint32_t m_nlink = 1;
+		bool m_opaque = false;
+		std::string m_link_target;
+		std::map<std::string, size_t> m_children; //hardlinks point to the entry of the file they link to
+		std::map<std::string, std::string> m_xattrs;
+		std::vector<LazyChunk> m_chunks;
+	};
+
+	//Table of contents of a seekable layer blob (eStargz or zstd:chunked)
+	//Every regular file is stored as independently compressed chunks, the TOC says where each of them is in the blob,
+	//so a file can be read with a Range request without downloading the layer
+	class LazyLayer
+	{
+	public:
+		//reads len bytes of the blob starting at offset
+		using RangeReader = std::function<std::string(uint64_t offset, uint64_t len)>;
+
+		//true if the manifest annotations of the layer point to a TOC
+		static bool isSeekable(const ImageLayer& layer);
+
+		//fetches the TOC through the reader, checks it against the digest from the annotations and builds the tree
+		LazyLayer(const ImageLayer& layer, const RangeReader& reader);
+
+		const std::vector<LazyEntry>& getEntries() const;
+		const std::string& getDigest() const;
+		//decompresses the bytes of a chunk fetched from [m_blob_offset, m_blob_end) and verifies them
+		std::string decodeChunk(const LazyChunk& chunk, const std::string& compressed) const;
+
+	private:
+		std::string m_digest;
+		std::vector<LazyEntry> m_entries;
+
+		std::string fetchEstargzToc(const ImageLayer& layer, const RangeReader& reader, uint64_t& toc_offset);
+		std::string fetchZstdChunkedToc(const ImageLayer& layer, const RangeReader& reader, uint64_t& toc_offset);
+		void buildTree(const std::string& toc, uint64_t toc_offset);
+		size_t makeEntry(const std::string& path, bool create_dirs);
+	};
+}
+
+
+#endif
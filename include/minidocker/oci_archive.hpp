@@ -0,0 +1,73 @@
+#ifndef MINIDOCKER_OCI_ARCHIVE_H
+#define MINIDOCKER_OCI_ARCHIVE_H
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+
+namespace minidocker
+{
+	//"blobs/<algorithm>/<hex>", where a blob lives in an OCI image layout, empty for a malformed digest
+	std::string getOciBlobName(const std::string& digest);
+
+	//Writes a tar archive of an OCI image layout ("oci-layout", "index.json", "blobs/sha256/<hex>"), see Image::save
+	//Blob files are copied into it by the kernel (copy_file_range, or sendfile across file systems), never through a userspace buffer
+	class OciArchiveWriter
+	{
+	private:
+		std::string m_path;
+		std::string m_tmp_path;
+		int m_fd = -1;
+		uint64_t m_offset = 0;
+		uint64_t m_file_remaining = 0; //bytes of the entry started with beginFile() that weren't written yet
+		bool m_in_file = false;
+		bool m_committed = false;
+
+		void writeAll(const char* data, size_t len);
+		void writeHeader(const std::string& name, uint64_t size);
+		void writePadding();
+	public:
+		//the archive is written next to path and only renamed into place by commit()
+		explicit OciArchiveWriter(const std::string& path);
+		~OciArchiveWriter();
+		OciArchiveWriter(const OciArchiveWriter&) = delete;
+		OciArchiveWriter& operator=(const OciArchiveWriter&) = delete;
+
+		void addFile(const std::string& name, const std::string& content);
+		//the whole file at source_path, its size must not change while it's copied
+		void addFileFrom(const std::string& name, const std::string& source_path);
+		//for data that arrives in pieces (a blob streamed from the registry), exactly size bytes must be written before endFile()
+		void beginFile(const std::string& name, uint64_t size);
+		void write(const char* data, size_t len);
+		void endFile();
+		//ends the archive and renames it into place
+		void commit();
+	};
+
+	//Reads an image layout archive written by save (or docker save, skopeo, ...), see Image::load
+	//Only the tar headers are read up front, files are read at their offset in the archive when they're needed
+	class OciArchiveReader
+	{
+	private:
+		std::string m_path;
+		int m_fd = -1;
+		std::map<std::string, std::pair<uint64_t, uint64_t>> m_entries; //regular files by name -> offset and size of their data
+
+		void readEntries();
+	public:
+		explicit OciArchiveReader(const std::string& path);
+		~OciArchiveReader();
+		OciArchiveReader(const OciArchiveReader&) = delete;
+		OciArchiveReader& operator=(const OciArchiveReader&) = delete;
+
+		bool getEntry(const std::string& name, uint64_t& offset, uint64_t& size) const;
+		//content of a small file (JSON documents), throws if it's missing or bigger than max_size
+		std::string readFile(const std::string& name, size_t max_size) const;
+		//the archive itself, for reading a big file at its offset
+		int getFd() const;
+	};
+}
+
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef MINIDOCKER_PARALLEL_INFLATER_H
+#define MINIDOCKER_PARALLEL_INFLATER_H
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace minidocker
+{
+	//Decompresses one gzip member on several threads
+	//Compressed bytes are collected into batches that are split into chunks, every chunk but the first starts at a deflate block
+	//found by probing bit offsets, and is decoded without knowing the 32 KiB of output before it. Bytes copied out of that
+	//unknown window are found by decoding the start of the chunk a second time, and filled in once the previous chunk is done.
+	//A chunk is only used if the chunk before it ended exactly where it started, so a wrongly guessed block start costs time
+	//but never corrupts the output
+	class ParallelInflater
+	{
+	public:
+		using OutputHandler = std::function<void(const unsigned char* data, size_t len)>;
+
+		ParallelInflater(unsigned int thread_count, OutputHandler output_handler);
+
+		//buffers the next bytes of the member, nothing is decoded until a whole batch is there
+		void write(const unsigned char* data, size_t len);
+		//decodes whatever is still buffered, ended() tells whether the member was complete
+		void finish();
+		//true once the member's trailer was read and checked
+		bool ended() const;
+		//true once the first batch was decoded, before that the buffered bytes can still be handed to a streaming decoder
+		bool started() const;
+		//the bytes buffered but not decoded, after ended() these are the bytes that follow the member
+		std::vector<unsigned char> takeInput();
+
+		//size of a batch, a member that is smaller isn't worth the threads
+		size_t getBatchSize() const;
+		//MINIDOCKER_GZIP_THREADS, or the number of cores (capped)
+		static unsigned int getThreadCount();
+
+	private:
+		enum class State { HEADER, DEFLATE, TRAILER, ENDED };
+
+		//Output of one chunk, only what lies before m_end_output (the last block boundary reached) is used
+		struct Chunk
+		{
+			uint64_t m_start_bit = 0;
+			bool m_has_start = false;
+			bool m_speculative = false;
+			std::vector<unsigned char> m_output;
+			size_t m_end_output = 0;
+			uint64_t m_end_bit = 0;
+			bool m_stream_end = false;
+			std::string m_error;
+			std::vector<unsigned char> m_window_offsets; //start of the second decode, see findMarkers()
+		};
+
+		unsigned int m_thread_count;
+		OutputHandler m_output_handler;
+		State m_state = State::HEADER;
+		bool m_started = false;
+		std::vector<unsigned char> m_input;
+		unsigned int m_bit_offset = 0; //the deflate stream continues at this bit of m_input[0]
+		std::vector<unsigned char> m_window; //last 32 KiB of output
+		unsigned long m_crc;
+		uint64_t m_total_out = 0;
+
+		void process(bool final);
+		bool parseHeader();
+		void parseTrailer();
+		bool decodeBatch(bool final);
+		uint64_t findBlockStart(uint64_t from_bit, uint64_t to_bit) const;
+		void decodeChunk(Chunk& chunk, const std::vector<uint64_t>& stop_bits) const;
+		void findMarkers(Chunk& chunk) const;
+		void emitChunk(Chunk& chunk);
+	};
+}
+
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef MINIDOCKER_PULL_REPORT_H
+#define MINIDOCKER_PULL_REPORT_H
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace minidocker
+{
+	//adds the time spent in its scope to a number of seconds
+	class ScopedTimer
+	{
+	public:
+		explicit ScopedTimer(double& seconds) : m_seconds(seconds), m_start(std::chrono::steady_clock::now()) {}
+		~ScopedTimer() { m_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count(); }
+		ScopedTimer(const ScopedTimer&) = delete;
+		ScopedTimer& operator=(const ScopedTimer&) = delete;
+	private:
+		double& m_seconds;
+		std::chrono::steady_clock::time_point m_start;
+	};
+
+	//How a layer made it onto the disk, filled in by whoever downloaded or extracted it
+	//Layers are extracted while they download, so the download time includes the extraction time
+	struct LayerTimings
+	{
+		uint64_t m_bytes_downloaded = 0; //over the network, including bytes of retried ranges
+		uint64_t m_resumed_bytes = 0; //taken from the .partial file of an earlier pull
+		double m_ttfb = 0; //seconds from the first request to the first byte of the blob
+		double m_download_seconds = 0;
+		long m_redirects = 0;
+		int m_token_refreshes = 0;
+		int m_connections = 0; //one per request, segments of a split blob each count
+		double m_extract_seconds = 0; //spent hashing, decompressing and writing files
+		uint64_t m_uncompressed_bytes = 0; //of the tar stream
+		std::string m_compression;
+		uint64_t m_deduped_bytes = 0; //files shared with other layers, MINIDOCKER_LAYER_DEDUP
+	};
+
+	//A manifest, index or config, either taken from the image store or fetched from a registry
+	struct FetchRecord
+	{
+		std::string m_kind; //"manifest", "index" or "config"
+		std::string m_reference; //tag or digest
+		std::string m_source; //"store", "revalidated" (304) or "registry"
+		std::string m_url; //empty when nothing was requested
+		long m_http_code = 0;
+		double m_ttfb = 0;
+		double m_seconds = 0;
+		uint64_t m_bytes = 0;
+		long m_redirects = 0;
+	};
+
+	struct LayerRecord
+	{
+		std::string m_digest;
+		uint64_t m_size = 0; //from the manifest
+		std::string m_source; //"cache", "tarball", "registry", "lazy" or "other process"
+		std::string m_endpoint; //registry (or mirror) that served the blob
+		bool m_success = true;
+		std::string m_error;
+		LayerTimings m_timings;
+	};
+
+	//Everything worth knowing about one pull, written as JSON with --report=<file> so pulls can be compared across machines
+	//Lazily pulled layers can fetch from other threads, so recording is thread safe
+	class PullReport
+	{
+	public:
+		void start(const std::string& image, const std::vector<std::string>& registry_urls);
+		void addFetch(const FetchRecord& record);
+		void addLayer(const LayerRecord& record);
+		//a 401 made us refresh the bearer token, from_auth_server if it took a round trip to the auth server
+		void countTokenRefresh(bool from_auth_server);
+		void setPhaseSeconds(const std::string& phase, double seconds);
+		void finish(bool success, const std::string& error);
+
+		nlohmann::json toJson() const;
+		//replaces the file atomically, returns false if it couldn't be written
+		bool write(const std::string& path) const;
+		static bool writeJson(const std::string& path, const nlohmann::json& report);
+
+	private:
+		mutable std::mutex m_mutex;
+		std::string m_image;
+		std::vector<std::string> m_registry_urls;
+		std::string m_started_at;
+		std::chrono::steady_clock::time_point m_start;
+		double m_total_seconds = 0;
+		bool m_success = false;
+		std::string m_error;
+		std::vector<FetchRecord> m_fetches;
+		std::vector<LayerRecord> m_layers;
+		std::vector<std::pair<std::string, double>> m_phases;
+		int m_token_refreshes = 0;
+		int m_token_fetches = 0;
+	};
+}
+
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef MINIDOCKER_REGISTRY_CLIENT_H
+#define MINIDOCKER_REGISTRY_CLIENT_H
+#include <curl/curl.h>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include "token_cache.hpp"
+#include <string>
+#include <vector>
+
+namespace minidocker
+{
+	struct RegistryResponse
+	{
+		CURLcode m_curl_code = CURLE_OK;
+		long m_http_code = 0;
+		std::string m_body;
+		std::string m_headers;
+		//for the pull report, times are in seconds since the request started
+		double m_ttfb = 0;
+		double m_total_time = 0;
+		long m_redirect_count = 0;
+		uint64_t m_bytes = 0; //body bytes received, including the ones handed to a body handler
+		std::string m_url;
+	};
+
+	//One HTTP client for everything a pull talks to (auth server, registry, blob storage)
+	//It keeps a pool of easy handles, each with its own open connections, and a share handle for DNS and TLS sessions,
+	//so a pull only pays for a handful of handshakes no matter how many requests it makes
+	//HTTP/2 is negotiated when the server supports it, letting requests to the same host share one connection
+	//It can be owned by a single Image or shared by several of them
+	class RegistryClient
+	{
+	private:
+		CURLSH* m_share = nullptr;
+		CURLM* m_multi = nullptr;
+		std::vector<CURL*> m_idle_handles;
+		std::mutex m_pool_mutex;
+		std::mutex m_share_mutexes[CURL_LOCK_DATA_LAST];
+		TokenCache m_token_cache;
+
+		void applyDefaults(CURL* curl);
+		static void lockShare(CURL* curl, curl_lock_data data, curl_lock_access access, void* userptr);
+		static void unlockShare(CURL* curl, curl_lock_data data, void* userptr);
+	public:
+		//receives the body of a successful (2xx) response as it arrives, returning false aborts the transfer
+		using BodyHandler = std::function<bool(const char* data, size_t len)>;
+		//fills buffer with up to len bytes of a request body starting at offset, returns how many (0 aborts the request)
+		//reads by offset, so a request that has to be repeated (a token refresh) can send the same body again
+		using BodySource = std::function<size_t(char* buffer, size_t len, uint64_t offset)>;
+
+		RegistryClient();
+		~RegistryClient();
+		RegistryClient(const RegistryClient&) = delete;
+		RegistryClient& operator=(const RegistryClient&) = delete;
+
+		//blocking GET, headers are full header lines like "Accept: ..."
+		//with a body handler a successful body isn't kept in m_body, error responses still are
+		RegistryResponse get(const std::string& url, const std::vector<std::string>& headers, bool follow_redirects,
+			const BodyHandler& body_handler = nullptr);
+
+		//blocking request of any other method ("HEAD", "POST", "PATCH", "PUT"), redirects aren't followed
+		//a body of body_size bytes is read from body_source, the response body is kept in m_body
+		RegistryResponse send(const std::string& method, const std::string& url, const std::vector<std::string>& headers,
+			uint64_t body_size = 0, const BodySource& body_source = nullptr);
+
+		//easy handles with the shared defaults applied (stalled transfers time out), for callers that drive transfers
+		//on the multi handle themselves
+		CURL* acquireHandle();
+		void releaseHandle(CURL* curl);
+		CURLM* getMultiHandle();
+		//bearer tokens of every registry this client talked to
+		TokenCache& getTokenCache();
+
+		//value of the last header with this name (case insensitive) in raw response headers, empty if there is none
+		//with redirects the headers of several responses are in there, the last one is from the final response
+		static std::string getHeader(const std::string& header_str, const std::string& name);
+		//"registry-1.docker.io" for "https://registry-1.docker.io/v2/..."
+		static std::string getHost(const std::string& url);
+	};
+}
+
+
+#endif
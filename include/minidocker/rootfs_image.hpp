@@ -0,0 +1,49 @@
+#ifndef MINIDOCKER_ROOTFS_IMAGE_H
+#define MINIDOCKER_ROOTFS_IMAGE_H
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace minidocker
+{
+	struct ImageLayer;
+	class LayerLock;
+
+	//file system the layers of an image are flattened into, MINIDOCKER_ROOTFS_IMAGE
+	enum class RootfsImageFormat
+	{
+		NONE,
+		EROFS_IMAGE, //EROFS alone is taken by errno.h
+		SQUASHFS_IMAGE
+	};
+
+	//The layers of an image flattened into one compressed, read-only file system image, "/var/lib/minidocker/rootfs/<hex>.erofs"
+	//(or ".squashfs") named after the chain ID of the image's layers, so tags and manifests with the same layers share it
+	//A container mounts it through a loop device with an overlay on top, so starting one takes a mount whatever the size of the image,
+	//and the image's files are a single inode on the host instead of one per file and layer
+	//Building it needs mkfs.erofs (erofs-utils) or mksquashfs (squashfs-tools), it's made from the image's rootfs snapshot,
+	//and it's locked like a layer (LayerLock on "<hex>.erofs")
+	class RootfsImage
+	{
+	public:
+		//reads MINIDOCKER_ROOTFS_IMAGE ("erofs" or "squashfs"), NONE if it's unset or invalid
+		static RootfsImageFormat getFormat();
+		static std::string getImagePath(const std::string& chain_id, RootfsImageFormat format);
+		//builds the image of the extracted layers (chain_ids from RootfsSnapshot::getChainIds), unless it's built already
+		//returns the path of the image, image_lock, if given, gets a shared lock on it
+		static std::string build(const std::vector<ImageLayer>& layers, const std::vector<std::string>& chain_ids, RootfsImageFormat format,
+			std::unique_ptr<LayerLock>* image_lock = nullptr);
+		//attaches the image to a free loop device (read only, detached again once it's unmounted) and mounts it at target_dir
+		static void mount(const std::string& image_path, RootfsImageFormat format, const std::string& target_dir);
+		//removes the images of layer stacks no stored image has and the leftovers of builds that died, returns the bytes freed
+		static uint64_t prune(const std::set<std::string>& referenced_chain_ids);
+
+	private:
+		static void runMkfs(const std::vector<std::string>& args);
+	};
+}
+
+
+#endif
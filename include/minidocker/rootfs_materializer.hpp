@@ -0,0 +1,67 @@
+#ifndef MINIDOCKER_ROOTFS_MATERIALIZER_H
+#define MINIDOCKER_ROOTFS_MATERIALIZER_H
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+namespace minidocker
+{
+	//Copies the layers of an image into one directory, for hosts that can't mount an overlay of them
+	//The layers are scanned on all threads and merged in memory first (whiteouts and opaque directories of upper layers applied),
+	//so only the files that end up in the rootfs are written, once. Files are then written by the same threads : a FICLONE reflink
+	//on btrfs/xfs (no data is copied), copy_file_range elsewhere (copied by the kernel), read/write as a last resort.
+	//Ownership, mode and times are set on the open file, directories get theirs once everything in them is written
+	class RootfsMaterializer
+	{
+	public:
+		explicit RootfsMaterializer(unsigned int thread_count);
+
+		//merges the layer dirs (lowest first) into target_dir, which should be empty
+		void materialize(const std::vector<std::string>& layer_dirs, const std::string& target_dir);
+
+		uint64_t getFileCount() const;
+		uint64_t getClonedCount() const;
+		uint64_t getCopiedBytes() const;
+		//MINIDOCKER_MATERIALIZE_THREADS, or the number of cores (capped)
+		static unsigned int getThreadCount();
+
+	private:
+		//what a layer has at a path, in the order the layer was walked (a directory before its entries)
+		struct LayerEntry
+		{
+			std::string m_path; //relative to the layer dir
+			struct stat m_stat;
+			bool m_whiteout = false; //deletes m_path of the layers below
+			bool m_opaque = false; //a directory hiding what the layers below have in it
+		};
+
+		//where an entry of the rootfs comes from
+		struct RootfsEntry
+		{
+			size_t m_layer = 0;
+			struct stat m_stat;
+		};
+
+		void scanLayer(const std::string& layer_dir, std::vector<LayerEntry>& entries) const;
+		void mergeEntries(size_t layer, const std::vector<LayerEntry>& entries);
+		void removeTree(const std::string& path);
+		void writeEntry(const std::string& path, const RootfsEntry& entry);
+		void copyFile(const std::string& source, int source_fd, int target_fd, const struct stat& st);
+		void runOnThreads(size_t count, const std::function<void(size_t)>& task);
+
+		unsigned int m_thread_count;
+		std::vector<std::string> m_layer_dirs;
+		std::string m_target_dir;
+		std::map<std::string, RootfsEntry> m_entries;
+		std::atomic<uint64_t> m_file_count{ 0 };
+		std::atomic<uint64_t> m_cloned_count{ 0 };
+		std::atomic<uint64_t> m_copied_bytes{ 0 };
+	};
+}
+
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef MINIDOCKER_ROOTFS_SNAPSHOT_H
+#define MINIDOCKER_ROOTFS_SNAPSHOT_H
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace minidocker
+{
+	struct ImageLayer;
+	struct ImageManifest;
+	class LayerLock;
+
+	//Fully applied rootfs trees of layer stacks, "/var/lib/minidocker/snapshots/<hex>" named after the OCI chain ID of the stack :
+	//ChainID(L0) = DiffID(L0), ChainID(L0|...|Ln) = sha256(ChainID(L0|...|Ln-1) + " " + DiffID(Ln))
+	//The snapshot of a stack is the nearest snapshot below it (the lowest layer's dir for the first one) with the layers above
+	//merged on top, whiteouts applied, as a hard link farm : its files are the inodes of the layer dirs, only its directories take space
+	//An image gets the snapshot of its whole stack, and of the stacks in between that another stored image has too
+	//A container of a deep image mounts the topmost snapshot as its single lower dir once it's there, the first one mounts the
+	//layers and builds it in the background. Snapshots are never written to, and are locked like layers (LayerLock on the chain ID)
+	class RootfsSnapshot
+	{
+	public:
+		//MINIDOCKER_ROOTFS_SNAPSHOTS, on unless it's "0" or "off"
+		static bool isEnabled();
+		//chain ID of every stack of the image's layers, lowest first
+		//images whose config has no diff_ids (or not one per layer) are chained over their layer digests instead
+		static std::vector<std::string> getChainIds(const ImageManifest& manifest);
+		static std::string getSnapshotDir(const std::string& chain_id);
+		//the topmost snapshot of the stack if it's built, empty otherwise (or for a single layer), never waits for a build
+		//snapshot_lock, if given, gets a shared lock on it
+		static std::string findSnapshot(const std::vector<std::string>& chain_ids, std::unique_ptr<LayerLock>* snapshot_lock = nullptr);
+		//builds the snapshots the stack is still missing and returns the topmost one, the lowest layer's dir for a single layer
+		//snapshot_lock, if given, gets a shared lock on it
+		static std::string build(const std::vector<ImageLayer>& layers, const std::vector<std::string>& chain_ids,
+			std::unique_ptr<LayerLock>* snapshot_lock = nullptr);
+		//"images snapshot <manifest digest>" in a detached process, false if it couldn't be started
+		static bool startBackgroundBuild(const std::string& manifest_digest);
+		//builds the snapshots of a stored manifest's layers, at idle priority
+		static void buildForManifest(const std::string& manifest_digest);
+		//chain IDs of every stack of the stored manifests' layers
+		static std::set<std::string> getReferencedChainIds(const std::set<std::string>& manifest_digests);
+		//removes the snapshots of stacks no stored manifest has and the leftovers of builds that died, returns the bytes freed
+		static uint64_t prune(const std::set<std::string>& referenced_chain_ids);
+
+	private:
+		//chain IDs of the stacks more than one stored image manifest has
+		static std::set<std::string> getSharedChainIds();
+	};
+}
+
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef MINIDOCKER_SHA256_H
+#define MINIDOCKER_SHA256_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace minidocker
+{
+	//Streaming SHA-256, used to verify registry blobs against their digest while they are being downloaded
+	//The compression function is picked once at startup: SHA-NI on x86, the ARMv8 crypto extension on arm64,
+	//and a portable implementation when the CPU has neither
+	class Sha256
+	{
+	public:
+		enum class Implementation { AUTO, PORTABLE };
+		using CompressFunction = void (*)(uint32_t state[8], const unsigned char* blocks, size_t num_blocks);
+
+		Sha256(Implementation implementation = Implementation::AUTO);
+		void reset();
+		void update(const void* data, size_t len);
+		//finalizes the hash and returns it as "sha256:<hex>", the form used by image manifests
+		std::string finalDigest();
+		uint64_t getBytesHashed() const;
+
+		//name of the implementation AUTO resolves to on this CPU
+		static std::string getImplementationName();
+		static std::string digestOf(const std::string& data);
+
+	private:
+		uint32_t m_state[8];
+		unsigned char m_buffer[64];
+		size_t m_buffer_len = 0;
+		uint64_t m_total_len = 0;
+		CompressFunction m_compress;
+	};
+}
+
+
+#endif
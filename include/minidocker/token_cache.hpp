@@ -0,0 +1,60 @@
+#ifndef MINIDOCKER_TOKEN_CACHE_H
+#define MINIDOCKER_TOKEN_CACHE_H
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace minidocker
+{
+	//Parameters of a "WWW-Authenticate: Bearer realm=...,service=...,scope=..." challenge
+	struct AuthChallenge
+	{
+		std::string m_scheme;
+		std::string m_realm;
+		std::string m_service;
+		std::string m_scope;
+	};
+
+	struct CachedToken
+	{
+		std::string m_token;
+		time_t m_expires_at = 0;
+	};
+
+	//Bearer tokens by (realm, service, scope), kept in memory and in a root only file so later invocations can reuse them
+	//The challenge of every registry host is remembered as well, that's what lets a request carry a token before the registry asks for one
+	class TokenCache
+	{
+	private:
+		std::string m_cache_path;
+		std::map<std::string, CachedToken> m_tokens;
+		std::map<std::string, AuthChallenge> m_challenges;
+		std::mutex m_mutex;
+
+		static std::string getTokenKey(const std::string& realm, const std::string& service, const std::string& scope);
+		bool canPersist() const;
+		void load();
+		void save();
+	public:
+		explicit TokenCache(const std::string& cache_path = getDefaultCachePath());
+
+		//a token that is valid for a while longer, empty if there is none
+		std::string lookup(const std::string& realm, const std::string& service, const std::string& scope);
+		//looks up the token for a scope on a registry host, using the challenge that host sent last time
+		std::string lookupForHost(const std::string& host, const std::string& scope);
+		void store(const std::string& realm, const std::string& service, const std::string& scope, const CachedToken& token);
+		void storeChallenge(const std::string& host, const AuthChallenge& challenge);
+		//drops a token the registry rejected even though it hadn't expired yet
+		void invalidate(const std::string& realm, const std::string& service, const std::string& scope);
+
+		static std::string getDefaultCachePath();
+		//finds the last WWW-Authenticate header in raw response headers and parses it
+		static bool parseChallenge(const std::string& header_str, AuthChallenge& challenge);
+		//builds a cache entry from a token server response, honoring expires_in and issued_at
+		static CachedToken parseTokenResponse(const std::string& response_body);
+	};
+}
+
+
+#endif
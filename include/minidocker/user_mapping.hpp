@@ -0,0 +1,60 @@
+#ifndef MINIDOCKER_USER_MAPPING_H
+#define MINIDOCKER_USER_MAPPING_H
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+namespace minidocker
+{
+	//ids m_inside to m_inside + m_count - 1 of the container are host ids m_outside to m_outside + m_count - 1
+	struct IdRange
+	{
+		uint32_t m_inside = 0;
+		uint32_t m_outside = 0;
+		uint32_t m_count = 0;
+	};
+
+	//The host ids the user namespace of a container maps its ids to
+	//By default the user running mini-docker is root in the container and no other id is mapped ("0 <uid> 1")
+	//With MINIDOCKER_USERNS_REMAP=<user> (a name or uid) the container gets that user's ranges from /etc/subuid and /etc/subgid,
+	//container ids 0, 1, ... are the host ids of the ranges in order, so every owner the files of an image have is mapped
+	//The files keep the owners they were extracted with, a container sees them through idmapped mounts (mount_setattr with
+	//MOUNT_ATTR_IDMAP) of the layers, instead of a chown of every file of its rootfs
+	class UserMapping
+	{
+	public:
+		//reads MINIDOCKER_USERNS_REMAP, the default mapping if it's unset or the user has no subordinate ids
+		UserMapping();
+
+		//true when the container's ids are subordinate ids, its rootfs has to be idmapped then
+		bool isRemapped() const;
+		//host ids of the container's root
+		uid_t getRootUid() const;
+		gid_t getRootGid() const;
+		//writes the uid and gid maps of the user namespace pid is in
+		void apply(pid_t pid) const;
+		//called in the user namespace once the maps are written, the process still has the ids it was cloned with
+		//they aren't mapped when the container's root is a subordinate id, and exec would drop its capabilities
+		void switchToRoot() const;
+		//a user namespace with these maps that nothing runs in, for idmapped mounts
+		//the returned fd keeps it alive, the process that created it is gone
+		int createUserNamespace() const;
+
+		//bind mounts source at target, the ids of its files shown through the maps of the user namespace
+		//needs a kernel and file system with idmapped mount support (5.12+, overlayfs lower dirs 5.19+)
+		static void mountIdmapped(const std::string& source, const std::string& target, int userns_fd);
+
+	private:
+		std::vector<IdRange> m_uid_ranges;
+		std::vector<IdRange> m_gid_ranges;
+		bool m_remapped = false;
+
+		//the ranges of "<user>:<start>:<count>" lines, the user's name or uid
+		static std::vector<IdRange> readSubordinateIds(const std::string& path, const std::string& user_name, uid_t uid);
+		static void writeMap(const std::string& path, const std::vector<IdRange>& ranges);
+	};
+}
+
+
+#endif
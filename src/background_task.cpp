@@ -0,0 +1,47 @@
+#include "../include/minidocker/background_task.hpp"
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace minidocker
+{
+	bool BackgroundTask::start(const vector<string>& args)
+	{
+		//built before the fork, the child only makes async-signal-safe calls
+		vector<string> arg_strings = { "mini-docker" };
+		arg_strings.insert(arg_strings.end(), args.begin(), args.end());
+		vector<char*> argv;
+		for (string& arg : arg_strings) {
+			argv.push_back(&arg[0]);
+		}
+		argv.push_back(nullptr);
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			//the grandchild is adopted by init, nobody has to wait for it
+			setsid();
+			if (fork() != 0) _exit(0);
+			int null_fd = open("/dev/null", O_RDWR);
+			dup2(null_fd, STDIN_FILENO);
+			dup2(null_fd, STDOUT_FILENO);
+			dup2(null_fd, STDERR_FILENO);
+			execv("/proc/self/exe", argv.data());
+			_exit(127);
+		}
+		if (pid < 0) return false;
+		waitpid(pid, nullptr, 0);
+		return true;
+	}
+
+	void BackgroundTask::lowerPriority()
+	{
+		setpriority(PRIO_PROCESS, 0, 19);
+		syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, 3 << 13 /* IOPRIO_CLASS_IDLE */);
+	}
+}
@@ -0,0 +1,686 @@
+#include "../include/minidocker/cache_server.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include "../include/minidocker/image.hpp"
+#include "../include/minidocker/image_args.hpp"
+#include "../include/minidocker/registry_client.hpp"
+#include "../include/minidocker/sha256.hpp"
+#include <curl/curl.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+using namespace std;
+
+namespace fs = std::filesystem;
+static const size_t max_request_head_size = 64 * 1024;
+static const size_t stream_buffer_size = 1024 * 1024;
+static const int idle_connection_timeout = 60; //seconds a keep-alive connection may sit idle
+
+namespace
+{
+	string toLower(string value)
+	{
+		transform(value.begin(), value.end(), value.begin(), [](unsigned char c) { return tolower(c); });
+		return value;
+	}
+
+	string trim(const string& value)
+	{
+		size_t start = value.find_first_not_of(" \t");
+		size_t end = value.find_last_not_of(" \t\r");
+		return start == string::npos ? "" : value.substr(start, end - start + 1);
+	}
+
+	bool writeAll(int fd, const char* data, size_t len)
+	{
+		while (len > 0) {
+			ssize_t n = write(fd, data, len);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			data += n;
+			len -= static_cast<size_t>(n);
+		}
+		return true;
+	}
+
+	string getHeaderValue(const map<string, string>& headers, const string& name)
+	{
+		auto it = headers.find(name);
+		return it == headers.end() ? "" : it->second;
+	}
+
+	//"sha256:" and 64 lowercase hex characters, anything else from a client never gets near the image store
+	bool isSha256Digest(const string& digest)
+	{
+		return digest.size() == 71 && digest.rfind("sha256:", 0) == 0 &&
+			all_of(digest.begin() + 7, digest.end(), [](char c) { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+	}
+}
+
+namespace minidocker
+{
+	BlobFill::~BlobFill()
+	{
+		if (m_fd >= 0) close(m_fd);
+	}
+
+	CacheServer::CacheServer(const string& listen_address) : m_registry_client(make_shared<RegistryClient>())
+	{
+		size_t colon = listen_address.rfind(':');
+		if (colon == string::npos) {
+			m_port = listen_address;
+		} else {
+			m_host = listen_address.substr(0, colon);
+			m_port = listen_address.substr(colon + 1);
+		}
+		//"[::]:5000" for IPv6
+		if (m_host.size() >= 2 && m_host.front() == '[' && m_host.back() == ']') {
+			m_host = m_host.substr(1, m_host.size() - 2);
+		}
+
+		char* end = nullptr;
+		long port = strtol(m_port.c_str(), &end, 10);
+		if (m_port.empty() || *end != '\0' || port <= 0 || port > 65535) {
+			throw CLIParserException("Invalid listen address \"" + listen_address + "\", expected <host>:<port> or <port>\n");
+		}
+	}
+
+	void CacheServer::run()
+	{
+		struct addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		struct addrinfo* addresses = nullptr;
+		int rc = getaddrinfo(m_host.empty() ? nullptr : m_host.c_str(), m_port.c_str(), &hints, &addresses);
+		if (rc != 0) {
+			throw CacheServerException("Couldn't resolve listen address " + m_host + ":" + m_port + " : " + gai_strerror(rc));
+		}
+
+		int listen_fd = -1;
+		int listen_errno = 0;
+		for (struct addrinfo* address = addresses; address && listen_fd < 0; address = address->ai_next) {
+			listen_fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+			if (listen_fd < 0) continue;
+			int one = 1;
+			setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (bind(listen_fd, address->ai_addr, address->ai_addrlen) != 0 || listen(listen_fd, 128) != 0) {
+				listen_errno = errno;
+				close(listen_fd);
+				listen_fd = -1;
+			}
+		}
+		freeaddrinfo(addresses);
+		if (listen_fd < 0) {
+			throw CacheServerException("Couldn't listen on " + m_host + ":" + m_port + " : " + strerror(listen_errno));
+		}
+
+		//a client hanging up in the middle of a blob must not take the server down with it
+		signal(SIGPIPE, SIG_IGN);
+
+		cout << "Serving the local image store as a registry mirror on " << (m_host.empty() ? "*" : m_host) << ":" << m_port << "\n";
+		for (const string& url : Image::getRegistryUrls()) {
+			cout << "Upstream : " << url << "\n";
+		}
+		cout << flush;
+
+		while (true) {
+			int client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (client_fd < 0) {
+				if (errno != EINTR) {
+					cerr << "Warning: couldn't accept a connection : " << strerror(errno) << "\n";
+				}
+				continue;
+			}
+			thread([this, client_fd]() { handleConnection(client_fd); }).detach();
+		}
+	}
+
+	void CacheServer::handleConnection(int fd)
+	{
+		struct timeval timeout = { idle_connection_timeout, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		//requests on a keep-alive connection are answered one after another
+		string buffer;
+		Request request;
+		while (readRequest(fd, buffer, request)) {
+			bool keep_alive = false;
+			try {
+				keep_alive = handleRequest(fd, request);
+			} catch (const exception& ex) {
+				cerr << "Warning: " << request.m_method << " " << request.m_path << " failed : " << ex.what() << "\n";
+				sendError(fd, 500, "UNKNOWN", ex.what(), request.m_method == "HEAD");
+			}
+			if (!keep_alive || toLower(getHeaderValue(request.m_headers, "connection")) == "close") break;
+		}
+		close(fd);
+	}
+
+	bool CacheServer::readRequest(int fd, string& buffer, Request& request)
+	{
+		size_t head_end;
+		while ((head_end = buffer.find("\r\n\r\n")) == string::npos) {
+			if (buffer.size() > max_request_head_size) return false;
+			char chunk[8192];
+			ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			buffer.append(chunk, static_cast<size_t>(n));
+		}
+		string head = buffer.substr(0, head_end);
+		buffer.erase(0, head_end + 4);
+
+		request = Request();
+		size_t line_end = head.find("\r\n");
+		string request_line = head.substr(0, line_end);
+		size_t first_space = request_line.find(' ');
+		size_t second_space = request_line.find(' ', first_space + 1);
+		if (first_space == string::npos || second_space == string::npos) return false;
+		request.m_method = request_line.substr(0, first_space);
+		request.m_path = request_line.substr(first_space + 1, second_space - first_space - 1);
+		request.m_path = request.m_path.substr(0, request.m_path.find('?'));
+
+		while (line_end != string::npos) {
+			size_t start = line_end + 2;
+			line_end = head.find("\r\n", start);
+			string line = head.substr(start, line_end == string::npos ? string::npos : line_end - start);
+			size_t colon = line.find(':');
+			if (colon == string::npos) continue;
+			string name = toLower(trim(line.substr(0, colon)));
+			string value = trim(line.substr(colon + 1));
+			if (name == "accept") {
+				//several media types can come in one header or in several of them
+				size_t pos = 0;
+				while (pos <= value.size()) {
+					size_t comma = value.find(',', pos);
+					if (comma == string::npos) comma = value.size();
+					string media_type = trim(value.substr(pos, comma - pos));
+					if (!media_type.empty()) request.m_accept.push_back(media_type);
+					pos = comma + 1;
+				}
+			}
+			request.m_headers[name] = value;
+		}
+		return true;
+	}
+
+	bool CacheServer::handleRequest(int fd, const Request& request)
+	{
+		bool head = request.m_method == "HEAD";
+		if (request.m_method != "GET" && !head) {
+			sendError(fd, 405, "UNSUPPORTED", "serve-cache is a read-only mirror", false);
+			log(request, 405, "");
+			return false;
+		}
+
+		//API version check clients do before anything else
+		if (request.m_path == "/v2" || request.m_path == "/v2/") {
+			return sendResponse(fd, 200, { "Content-Type: application/json" }, "{}", head);
+		}
+
+		//"/v2/<name>/manifests/<reference>" and "/v2/<name>/blobs/<digest>", the name can contain slashes itself
+		if (request.m_path.rfind("/v2/", 0) == 0) {
+			string rest = request.m_path.substr(4);
+			size_t manifests = rest.rfind("/manifests/");
+			size_t blobs = rest.rfind("/blobs/");
+			if (manifests != string::npos && manifests > 0 && (blobs == string::npos || manifests > blobs)) {
+				return serveManifest(fd, request, rest.substr(0, manifests), rest.substr(manifests + 11));
+			}
+			if (blobs != string::npos && blobs > 0) {
+				return serveBlob(fd, request, rest.substr(0, blobs), rest.substr(blobs + 7));
+			}
+		}
+		log(request, 404, "");
+		return sendError(fd, 404, "NAME_UNKNOWN", "unknown path " + request.m_path, head);
+	}
+
+	bool CacheServer::serveManifest(int fd, const Request& request, const string& name, const string& reference)
+	{
+		bool head = request.m_method == "HEAD";
+		bool by_digest = reference.rfind("sha256:", 0) == 0;
+		if (by_digest && !isSha256Digest(reference)) {
+			log(request, 400, "");
+			return sendError(fd, 400, "DIGEST_INVALID", "invalid digest " + reference, head);
+		}
+		string content;
+		string digest;
+		string source;
+
+		//a manifest fetched by digest can't change, a tag is revalidated with upstream every time
+		if (by_digest && m_image_store.getBlob(reference, content)) {
+			digest = reference;
+			source = "cached";
+		} else {
+			StoredReference stored;
+			bool have_stored = !by_digest && m_image_store.getReference(name, reference, stored) &&
+				m_image_store.getBlob(stored.m_digest, content);
+
+			vector<string> headers;
+			for (const string& media_type : request.m_accept) {
+				headers.push_back("Accept: " + media_type);
+			}
+			if (headers.empty()) {
+				headers = {
+					"Accept: application/vnd.docker.distribution.manifest.list.v2+json",
+					"Accept: application/vnd.docker.distribution.manifest.v2+json",
+					"Accept: application/vnd.oci.image.index.v1+json",
+					"Accept: application/vnd.oci.image.manifest.v1+json" };
+			}
+			if (have_stored && !stored.m_etag.empty()) {
+				headers.push_back("If-None-Match: " + stored.m_etag);
+			}
+
+			RegistryResponse response;
+			string error;
+			try {
+				response = getUpstream(name)->registryFetch(name + "/manifests/" + reference, headers, false);
+				if (response.m_curl_code != CURLE_OK) error = curl_easy_strerror(response.m_curl_code);
+			} catch (const ImageException& ex) {
+				error = ex.what();
+			}
+
+			if (error.empty() && response.m_http_code == 304 && have_stored) {
+				digest = stored.m_digest;
+				source = "revalidated";
+			} else if (error.empty() && response.m_http_code == 200) {
+				if (by_digest && Sha256::digestOf(response.m_body) != reference) {
+					log(request, 502, "upstream");
+					return sendError(fd, 502, "MANIFEST_INVALID", "upstream manifest doesn't match digest " + reference, head);
+				}
+				content = response.m_body;
+				digest = m_image_store.putBlob(content);
+				if (!by_digest) {
+					m_image_store.putReference(name, reference, { digest, RegistryClient::getHeader(response.m_headers, "ETag") });
+				}
+				source = "upstream";
+			} else if (have_stored) {
+				//upstream is down or refusing, the copy from last time is better than nothing
+				digest = stored.m_digest;
+				source = "stale";
+			} else if (error.empty() && response.m_http_code >= 400 && response.m_http_code < 500) {
+				log(request, static_cast<int>(response.m_http_code), "upstream");
+				return sendResponse(fd, static_cast<int>(response.m_http_code), { "Content-Type: application/json" }, response.m_body, head);
+			} else {
+				if (error.empty()) error = "HTTP " + to_string(response.m_http_code);
+				log(request, 502, "upstream");
+				return sendError(fd, 502, "UNKNOWN", "couldn't fetch the manifest from upstream : " + error, head);
+			}
+		}
+
+		string etag = "\"" + digest + "\"";
+		vector<string> headers = { "Docker-Content-Digest: " + digest, "ETag: " + etag };
+		if (getHeaderValue(request.m_headers, "if-none-match") == etag) {
+			log(request, 304, source);
+			return sendResponse(fd, 304, headers, "", true);
+		}
+
+		string media_type = "application/vnd.docker.distribution.manifest.v2+json";
+		json manifest_json = json::parse(content, nullptr, false);
+		if (!manifest_json.is_discarded() && manifest_json.contains("mediaType") && manifest_json["mediaType"].is_string()) {
+			media_type = manifest_json["mediaType"].get<string>();
+		}
+		headers.push_back("Content-Type: " + media_type);
+		log(request, 200, source);
+		return sendResponse(fd, 200, headers, content, head);
+	}
+
+	bool CacheServer::serveBlob(int fd, const Request& request, const string& name, const string& digest)
+	{
+		bool head = request.m_method == "HEAD";
+		if (!isSha256Digest(digest)) {
+			log(request, 400, "");
+			return sendError(fd, 400, "DIGEST_INVALID", "invalid digest " + digest, head);
+		}
+		string path = m_image_store.getBlobPath(digest);
+
+		if (head) {
+			if (fs::exists(path)) return serveStoredBlob(fd, request, path, digest);
+			//existence checks don't start a download
+			return probeUpstreamBlob(fd, name, digest);
+		}
+
+		shared_ptr<BlobFill> fill = startFill(name, digest, path);
+		if (!fill) {
+			return serveStoredBlob(fd, request, path, digest);
+		}
+		return serveFillingBlob(fd, request, *fill, path, digest);
+	}
+
+	bool CacheServer::serveStoredBlob(int fd, const Request& request, const string& path, const string& digest)
+	{
+		bool head = request.m_method == "HEAD";
+		int file_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (file_fd < 0 || fstat(file_fd, &st) != 0) {
+			if (file_fd >= 0) close(file_fd);
+			log(request, 404, "");
+			return sendError(fd, 404, "BLOB_UNKNOWN", "blob " + digest + " isn't stored", head);
+		}
+		uint64_t size = static_cast<uint64_t>(st.st_size);
+
+		int status = 200;
+		uint64_t start = 0;
+		uint64_t end = size == 0 ? 0 : size - 1;
+		bool open_ended = false;
+		vector<string> headers = { "Content-Type: application/octet-stream", "Docker-Content-Digest: " + digest, "Accept-Ranges: bytes" };
+		if (parseRange(getHeaderValue(request.m_headers, "range"), start, end, open_ended)) {
+			if (start >= size) {
+				close(file_fd);
+				log(request, 416, "cached");
+				return sendResponse(fd, 416, { "Content-Range: bytes */" + to_string(size) }, "", head);
+			}
+			if (open_ended || end >= size) end = size - 1;
+			status = 206;
+			headers.push_back("Content-Range: bytes " + to_string(start) + "-" + to_string(end) + "/" + to_string(size));
+		}
+		uint64_t length = size == 0 ? 0 : end - start + 1;
+		headers.push_back("Content-Length: " + to_string(length));
+		log(request, status, "cached");
+
+		bool ok = sendHead(fd, status, headers);
+		//the kernel copies straight from the page cache to the socket
+		off_t offset = static_cast<off_t>(start);
+		uint64_t remaining = head ? 0 : length;
+		while (ok && remaining > 0) {
+			ssize_t n = sendfile(fd, file_fd, &offset, min<uint64_t>(remaining, stream_buffer_size * 16));
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) ok = false;
+			else remaining -= static_cast<uint64_t>(n);
+		}
+		close(file_fd);
+		return ok;
+	}
+
+	bool CacheServer::serveFillingBlob(int fd, const Request& request, BlobFill& fill, const string& path, const string& digest)
+	{
+		uint64_t start = 0;
+		uint64_t end = 0;
+		bool open_ended = false;
+		bool ranged = parseRange(getHeaderValue(request.m_headers, "range"), start, end, open_ended);
+		{
+			unique_lock<mutex> lock(fill.m_mutex);
+			//the size isn't known before the download is done, an open range has to wait for it
+			fill.m_cond.wait(lock, [&]() {
+				return fill.m_done || fill.m_failed || (!(ranged && open_ended) && fill.m_written > start);
+			});
+			if (fill.m_failed && fill.m_written <= start) {
+				int status = fill.m_http_code == 404 ? 404 : 502;
+				log(request, status, "upstream");
+				return sendError(fd, status, status == 404 ? "BLOB_UNKNOWN" : "UNKNOWN",
+					"couldn't fetch blob " + digest + " from upstream : " + fill.m_error, false);
+			}
+			if (fill.m_done) {
+				lock.unlock();
+				return serveStoredBlob(fd, request, path, digest);
+			}
+		}
+
+		//the bytes are passed on while they arrive, the length is only known for a closed range
+		vector<string> headers = { "Content-Type: application/octet-stream", "Docker-Content-Digest: " + digest };
+		uint64_t limit = 0;
+		if (ranged) {
+			headers.push_back("Content-Range: bytes " + to_string(start) + "-" + to_string(end) + "/*");
+			headers.push_back("Content-Length: " + to_string(end - start + 1));
+			limit = end + 1;
+		} else {
+			headers.push_back("Transfer-Encoding: chunked");
+		}
+		int status = ranged ? 206 : 200;
+		log(request, status, "filling");
+		if (!sendHead(fd, status, headers)) return false;
+
+		vector<char> buffer(stream_buffer_size);
+		uint64_t position = start;
+		while (!ranged || position < limit) {
+			uint64_t available = 0;
+			bool done = false;
+			{
+				unique_lock<mutex> lock(fill.m_mutex);
+				fill.m_cond.wait(lock, [&]() { return fill.m_done || fill.m_failed || fill.m_written > position; });
+				//a cut off response tells the client to resume from what it got
+				if (fill.m_failed) return false;
+				available = fill.m_written;
+				done = fill.m_done;
+			}
+			if (available <= position) {
+				//the blob ended before the requested range did
+				if (ranged || !done) return false;
+				break;
+			}
+
+			size_t len = static_cast<size_t>(min<uint64_t>(buffer.size(), (ranged ? min(available, limit) : available) - position));
+			ssize_t n = pread(fill.m_fd, buffer.data(), len, static_cast<off_t>(position));
+			if (n <= 0) return false;
+			if (!ranged) {
+				char chunk_head[32];
+				int head_len = snprintf(chunk_head, sizeof(chunk_head), "%zx\r\n", static_cast<size_t>(n));
+				if (!sendAll(fd, chunk_head, static_cast<size_t>(head_len))) return false;
+			}
+			if (!sendAll(fd, buffer.data(), static_cast<size_t>(n))) return false;
+			if (!ranged && !sendAll(fd, "\r\n", 2)) return false;
+			position += static_cast<uint64_t>(n);
+		}
+		return ranged || sendAll(fd, "0\r\n\r\n", 5);
+	}
+
+	bool CacheServer::probeUpstreamBlob(int fd, const string& name, const string& digest)
+	{
+		Request request;
+		request.m_method = "HEAD";
+		request.m_path = "/v2/" + name + "/blobs/" + digest;
+
+		RegistryResponse response;
+		try {
+			//the body is refused right away, only the status and headers are of interest
+			response = getUpstream(name)->registryFetch(name + "/blobs/" + digest, {}, true, [](const char*, size_t) { return false; });
+		} catch (const ImageException& ex) {
+			log(request, 502, "upstream");
+			return sendError(fd, 502, "UNKNOWN", ex.what(), true);
+		}
+
+		if (response.m_http_code == 200) {
+			vector<string> headers = { "Content-Type: application/octet-stream", "Docker-Content-Digest: " + digest };
+			string length = RegistryClient::getHeader(response.m_headers, "Content-Length");
+			if (!length.empty()) headers.push_back("Content-Length: " + length);
+			log(request, 200, "upstream");
+			return sendHead(fd, 200, headers);
+		}
+		int status = response.m_http_code == 404 ? 404 : 502;
+		log(request, status, "upstream");
+		return sendError(fd, status, status == 404 ? "BLOB_UNKNOWN" : "UNKNOWN", "upstream couldn't serve blob " + digest, true);
+	}
+
+	shared_ptr<BlobFill> CacheServer::startFill(const string& name, const string& digest, const string& path)
+	{
+		shared_ptr<Image> upstream = getUpstream(name);
+
+		lock_guard<mutex> lock(m_fills_mutex);
+		//checked under the lock, a fill renames its file into place and unregisters in one go
+		if (fs::exists(path)) return nullptr;
+		auto it = m_fills.find(digest);
+		if (it != m_fills.end()) return it->second;
+
+		auto fill = make_shared<BlobFill>();
+		fs::create_directories(fs::path(path).parent_path());
+		fill->m_temp_path = path + ".fill." + to_string(getpid());
+		fill->m_fd = open(fill->m_temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fill->m_fd < 0) {
+			throw CacheServerException("Couldn't create " + fill->m_temp_path + " : " + strerror(errno));
+		}
+		m_fills[digest] = fill;
+
+		//the download belongs to no request, it carries on even if the client that started it goes away
+		thread(&CacheServer::fillBlob, this, upstream, name, digest, path, fill).detach();
+		return fill;
+	}
+
+	void CacheServer::fillBlob(shared_ptr<Image> upstream, string name, string digest, string path, shared_ptr<BlobFill> fill)
+	{
+		Sha256 hasher;
+		RegistryResponse response;
+		string error;
+		try {
+			//blob fetching can respond with 307 Redirect responses, so redirects are followed
+			response = upstream->registryFetch(name + "/blobs/" + digest, {}, true, [&](const char* data, size_t len) {
+				if (!writeAll(fill->m_fd, data, len)) return false;
+				hasher.update(data, len);
+				{
+					lock_guard<mutex> lock(fill->m_mutex);
+					fill->m_written += len;
+				}
+				fill->m_cond.notify_all();
+				return true;
+			});
+			if (response.m_curl_code != CURLE_OK || response.m_http_code != 200) {
+				error = string(curl_easy_strerror(response.m_curl_code)) + ", HTTP " + to_string(response.m_http_code);
+			} else if (hasher.finalDigest() != digest) {
+				error = "blob doesn't match its digest";
+			}
+		} catch (const exception& ex) {
+			error = ex.what();
+		}
+
+		{
+			lock_guard<mutex> fills_lock(m_fills_mutex);
+			lock_guard<mutex> lock(fill->m_mutex);
+			if (error.empty() && rename(fill->m_temp_path.c_str(), path.c_str()) != 0) {
+				error = "couldn't store the blob : " + string(strerror(errno));
+			}
+			if (error.empty()) {
+				fill->m_done = true;
+			} else {
+				fill->m_failed = true;
+				fill->m_http_code = response.m_http_code;
+				fill->m_error = error;
+				unlink(fill->m_temp_path.c_str());
+			}
+			m_fills.erase(digest);
+		}
+		fill->m_cond.notify_all();
+
+		lock_guard<mutex> lock(m_log_mutex);
+		if (error.empty()) {
+			cout << "Stored " << digest << " (" << hasher.getBytesHashed() << " bytes) from upstream" << endl;
+		} else {
+			cerr << "Warning: couldn't fetch " << name << "@" << digest << " from upstream : " << error << "\n";
+		}
+	}
+
+	shared_ptr<Image> CacheServer::getUpstream(const string& name)
+	{
+		lock_guard<mutex> lock(m_upstreams_mutex);
+		shared_ptr<Image>& upstream = m_upstreams[name];
+		if (!upstream) {
+			ImageArgs image_args;
+			image_args.name = name;
+			image_args.tag = "latest";
+			upstream = make_shared<Image>(image_args, m_registry_client);
+		}
+		return upstream;
+	}
+
+	void CacheServer::log(const Request& request, int status, const string& source)
+	{
+		lock_guard<mutex> lock(m_log_mutex);
+		cout << request.m_method << " " << request.m_path << " " << status << (source.empty() ? "" : " (" + source + ")") << endl;
+	}
+
+	bool CacheServer::sendAll(int fd, const char* data, size_t len)
+	{
+		while (len > 0) {
+			ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			data += n;
+			len -= static_cast<size_t>(n);
+		}
+		return true;
+	}
+
+	bool CacheServer::sendHead(int fd, int status, const vector<string>& headers)
+	{
+		string head = "HTTP/1.1 " + to_string(status) + " " + getStatusText(status) + "\r\n";
+		head += "Docker-Distribution-API-Version: registry/2.0\r\n";
+		for (const string& header : headers) {
+			head += header + "\r\n";
+		}
+		head += "\r\n";
+		return sendAll(fd, head.data(), head.size());
+	}
+
+	bool CacheServer::sendResponse(int fd, int status, const vector<string>& headers, const string& body, bool head)
+	{
+		vector<string> all_headers = headers;
+		all_headers.push_back("Content-Length: " + to_string(body.size()));
+		if (!sendHead(fd, status, all_headers)) return false;
+		return head || sendAll(fd, body.data(), body.size());
+	}
+
+	bool CacheServer::sendError(int fd, int status, const string& code, const string& message, bool head)
+	{
+		json error = { { "errors", json::array({ { { "code", code }, { "message", message } } }) } };
+		return sendResponse(fd, status, { "Content-Type: application/json" }, error.dump(), head);
+	}
+
+	bool CacheServer::parseRange(const string& value, uint64_t& start, uint64_t& end, bool& open_ended)
+	{
+		//only a single "bytes=<start>-[<end>]" range is supported, anything else gets the whole blob
+		if (value.rfind("bytes=", 0) != 0 || value.find(',') != string::npos) return false;
+		string range = value.substr(6);
+		size_t dash = range.find('-');
+		if (dash == string::npos || dash == 0) return false;
+
+		char* parse_end = nullptr;
+		string first = range.substr(0, dash);
+		start = strtoull(first.c_str(), &parse_end, 10);
+		if (*parse_end != '\0' || !isdigit(static_cast<unsigned char>(first[0]))) return false;
+
+		string last = range.substr(dash + 1);
+		open_ended = last.empty();
+		if (open_ended) return true;
+		end = strtoull(last.c_str(), &parse_end, 10);
+		return *parse_end == '\0' && isdigit(static_cast<unsigned char>(last[0])) && end >= start;
+	}
+
+	string CacheServer::getStatusText(int status)
+	{
+		switch (status) {
+		case 200: return "OK";
+		case 206: return "Partial Content";
+		case 304: return "Not Modified";
+		case 400: return "Bad Request";
+		case 401: return "Unauthorized";
+		case 403: return "Forbidden";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 416: return "Range Not Satisfiable";
+		case 429: return "Too Many Requests";
+		case 500: return "Internal Server Error";
+		case 502: return "Bad Gateway";
+		default: return "Status";
+		}
+	}
+}
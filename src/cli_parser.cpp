@@ -1,8 +1,11 @@
 #include "../include/minidocker/cli_parser.hpp"
 #include "../include/minidocker/custom_specific_exceptions.hpp"
+#include "../include/minidocker/layer_cache.hpp"
 #include <string>
 #include <algorithm>
+#include <fstream>
 #include <utility>
+#include <vector>
 
 using namespace std;
 
@@ -10,19 +13,91 @@ namespace minidocker
 {
 	CLIParser::CLIParser(int argc, char* argv[])
 	{
-		//Currently assuming order  - <command> <subCommand> <containerCommand> <containerArgs>
+		//Currently assuming order  - <command> <subCommand> [options] <containerCommand> <containerArgs>
 		//first arg is the file name/cli name itself (in this case ./mini-docker)
 		if (argc < 3) {
 			throw CLIParserException(
 				"There should be at least three arguments provided to the command line tool\n"
-				"Format : <command> <subCommand> <containerCommand> <containerArgs>\n"
+				"Format : <command> <subCommand> [options] <containerCommand> <containerArgs>\n"
 			);
 		}
 		m_sub_command = argv[1];
-		m_container_command = argv[2];
+
+		transform(m_sub_command.begin(), m_sub_command.end(), m_sub_command.begin(),
+			[](unsigned char c) { return tolower(c); }); //transforming string in-place to lower case characters
+
+		//images <action> [options] - the action comes first, there is no container command
+		if (m_sub_command == "images") {
+			parseImagesCommand(argc, argv);
+			return;
+		}
+
+		//save <image> -o <file> and load -i <file> - no container command either
+		if (m_sub_command == "save" || m_sub_command == "load") {
+			parseArchiveCommand(argc, argv);
+			return;
+		}
+
+		//push <image> [<target>] - no container command either
+		if (m_sub_command == "push") {
+			parsePushCommand(argc, argv);
+			return;
+		}
+
+		//pull needs to check the registry by default, run is fine with whatever is stored locally
+		PullPolicy pullPolicy = m_sub_command == "pull" ? PullPolicy::ALWAYS : PullPolicy::MISSING;
+		bool lazyPull = false;
+		string reportPath;
+		vector<string> references; //pull only
+
+		//options of pull and run come before the image, everything after it belongs to the container
+		//run-command has no options, its command is taken as it is even if it starts with "--"
+		bool hasOptions = m_sub_command == "pull" || m_sub_command == "run";
+		int argInd = 2;
+		while (hasOptions && argInd < argc && string(argv[argInd]).rfind("--", 0) == 0) {
+			string option = argv[argInd];
+			if (option.rfind("--pull=", 0) == 0) {
+				pullPolicy = parsePullPolicy(option.substr(7));
+			} else if (option == "--lazy" && m_sub_command == "run") {
+				lazyPull = true;
+			} else if (option.rfind("--report=", 0) == 0 && option.size() > 9) {
+				reportPath = option.substr(9);
+			} else if (option.rfind("--from-file=", 0) == 0 && m_sub_command == "pull") {
+				readReferenceFile(option.substr(12), references);
+			} else {
+				throw CLIParserException("Unrecognized option : " + option + "\n");
+			}
+			argInd++;
+		}
+
+		//pull takes any number of images, from the command line and from --from-file
+		if (m_sub_command == "pull") {
+			references.insert(references.begin(), argv + argInd, argv + argc);
+			if (references.empty()) {
+				throw CLIParserException("Missing image to pull\nFormat : pull [options] <image> [<image>...]\n");
+			}
+			for (const string& reference : references) {
+				ImageArgs imageArgs = parseImageReference(reference);
+				imageArgs.pull_policy = pullPolicy;
+				imageArgs.report_path = reportPath;
+				m_pull_image_args.push_back(imageArgs);
+			}
+			m_container_command = references.front();
+			m_image_args = m_pull_image_args.front();
+			return;
+		}
+
+		if (argInd >= argc) {
+			throw CLIParserException(
+				"Missing container command or image after the options\n"
+				"Format : <command> <subCommand> [options] <containerCommand> <containerArgs>\n"
+			);
+		}
+
+		m_container_command = argv[argInd];
 		m_container_args = " ";
 		if (argc >= 3) {
-			int argInd = 3;
+			argInd++;
 			while (argInd < argc) {
 				m_container_args += argv[argInd];
 				m_container_args.append(" ");
@@ -30,18 +105,25 @@ namespace minidocker
 			}
 		}
 
-		transform(m_sub_command.begin(), m_sub_command.end(), m_sub_command.begin(),
-			[](unsigned char c) { return tolower(c); }); //transforming string in-place to lower case characters
-
 		//In case of Image rather than direct command execution
+		ImageArgs imageArgs = parseImageReference(m_container_command);
+		imageArgs.pull_policy = pullPolicy;
+		imageArgs.lazy_pull = lazyPull;
+		imageArgs.report_path = reportPath;
+
+		m_image_args = imageArgs;
+	}
+
+	ImageArgs CLIParser::parseImageReference(const string& reference)
+	{
 		ImageArgs imageArgs;
-		auto pos = m_container_command.find(':');
+		auto pos = reference.find(':');
 		if (pos == string::npos) {
-			imageArgs.name = m_container_command;
+			imageArgs.name = reference;
 			imageArgs.tag = "latest";
 		} else {
-			imageArgs.name = m_container_command.substr(0, pos);
-			string tempTag = m_container_command.substr(pos + 1);
+			imageArgs.name = reference.substr(0, pos);
+			string tempTag = reference.substr(pos + 1);
 
 			if (tempTag.empty()) {
 				tempTag = "latest";
@@ -49,8 +131,130 @@ namespace minidocker
 
 			imageArgs.tag = tempTag;
 		}
+		return imageArgs;
+	}
 
-		m_image_args = imageArgs;
+	void CLIParser::readReferenceFile(const string& path, vector<string>& references)
+	{
+		//one image per line, blank lines and lines starting with # are skipped
+		ifstream ifs(path);
+		if (!ifs) {
+			throw CLIParserException("Couldn't read image list " + path + "\n");
+		}
+		string line;
+		while (getline(ifs, line)) {
+			size_t start = line.find_first_not_of(" \t\r");
+			if (start == string::npos || line[start] == '#') continue;
+			size_t end = line.find_last_not_of(" \t\r");
+			references.push_back(line.substr(start, end - start + 1));
+		}
+	}
+
+	void CLIParser::parseImagesCommand(int argc, char* argv[])
+	{
+		string action = argv[2];
+		if (action != "prune" && action != "gc" && action != "snapshot") {
+			throw CLIParserException("Unrecognized images action : " + action + "\nFormat : images prune [--budget=<size>]\n");
+		}
+		m_container_command = action;
+
+		//images snapshot <manifest digest> - started by a container of an image whose rootfs snapshot isn't built yet
+		if (action == "snapshot") {
+			if (argc != 4) {
+				throw CLIParserException("Format : images snapshot <manifest digest>\n");
+			}
+			m_container_args = argv[3];
+			return;
+		}
+
+		for (int argInd = 3; argInd < argc; argInd++) {
+			string option = argv[argInd];
+			if (option.rfind("--budget=", 0) == 0) {
+				if (!LayerCache::parseSize(option.substr(9), m_prune_args.budget)) {
+					throw CLIParserException("Invalid budget \"" + option.substr(9) + "\", expected a size like 20G or 512M\n");
+				}
+				m_prune_args.budget_set = true;
+			} else if (option == "--background") {
+				m_prune_args.background = true;
+			} else if (option == "--trash") {
+				m_prune_args.trash = true;
+			} else {
+				throw CLIParserException("Unrecognized option : " + option + "\n");
+			}
+		}
+	}
+
+	void CLIParser::parseArchiveCommand(int argc, char* argv[])
+	{
+		bool save = m_sub_command == "save";
+		string format = save ? "save [--pull=<policy>] <image> -o <file>" : "load -i <file>";
+		string path_flag = save ? "-o" : "-i";
+		string path_option = save ? "--output=" : "--input=";
+		PullPolicy pullPolicy = PullPolicy::MISSING;
+		string image;
+
+		//the archive path can come before or after the image
+		for (int argInd = 2; argInd < argc; argInd++) {
+			string arg = argv[argInd];
+			if (arg == path_flag && argInd + 1 < argc) {
+				m_archive_path = argv[++argInd];
+			} else if (arg.rfind(path_option, 0) == 0 && arg.size() > path_option.size()) {
+				m_archive_path = arg.substr(path_option.size());
+			} else if (save && arg.rfind("--pull=", 0) == 0) {
+				pullPolicy = parsePullPolicy(arg.substr(7));
+			} else if (save && image.empty() && arg[0] != '-') {
+				image = arg;
+			} else {
+				throw CLIParserException("Unrecognized argument : " + arg + "\nFormat : " + format + "\n");
+			}
+		}
+		if (m_archive_path.empty() || (save && image.empty())) {
+			throw CLIParserException(string(m_archive_path.empty() ? "Missing archive file" : "Missing image to save") + "\nFormat : " + format + "\n");
+		}
+
+		if (save) {
+			m_image_args = parseImageReference(image);
+			m_image_args.pull_policy = pullPolicy;
+		}
+		m_container_command = save ? image : m_archive_path;
+	}
+
+	void CLIParser::parsePushCommand(int argc, char* argv[])
+	{
+		string format = "push [--registry=<url>] [--pull=<policy>] <image>[:<tag>] [<target>[:<tag>]]";
+		PullPolicy pullPolicy = PullPolicy::MISSING;
+		string registry;
+		vector<string> references;
+
+		for (int argInd = 2; argInd < argc; argInd++) {
+			string arg = argv[argInd];
+			if (arg.rfind("--registry=", 0) == 0 && arg.size() > 11) {
+				registry = arg.substr(11);
+			} else if (arg.rfind("--pull=", 0) == 0) {
+				pullPolicy = parsePullPolicy(arg.substr(7));
+			} else if (references.size() < 2 && arg[0] != '-') {
+				references.push_back(arg);
+			} else {
+				throw CLIParserException("Unrecognized argument : " + arg + "\nFormat : " + format + "\n");
+			}
+		}
+		if (references.empty()) {
+			throw CLIParserException("Missing image to push\nFormat : " + format + "\n");
+		}
+
+		m_image_args = parseImageReference(references.front());
+		m_image_args.pull_policy = pullPolicy;
+		m_push_target_args = parseImageReference(references.back());
+		m_push_target_args.push_registry = registry;
+		m_container_command = references.front();
+	}
+
+	PullPolicy CLIParser::parsePullPolicy(const string& value)
+	{
+		if (value == "always") return PullPolicy::ALWAYS;
+		if (value == "missing") return PullPolicy::MISSING;
+		if (value == "never") return PullPolicy::NEVER;
+		throw CLIParserException("Invalid pull policy \"" + value + "\", expected one of : always, missing, never\n");
 	}
 
 	string CLIParser::getSubCommand() const
@@ -68,5 +272,36 @@ namespace minidocker
 		return m_image_args;
 	}
 
+	vector<ImageArgs> CLIParser::getPullImageArgs() const
+	{
+		return m_pull_image_args;
+	}
+
+	PruneArgs CLIParser::getPruneArgs() const
+	{
+		return m_prune_args;
+	}
+
+	string CLIParser::getArchivePath() const
+	{
+		return m_archive_path;
+	}
+
+	ImageArgs CLIParser::getPushTargetArgs() const
+	{
+		return m_push_target_args;
+	}
+
+	string CLIParser::getListenAddress() const
+	{
+		//takes the place of the image, e.g. mini-docker serve-cache 0.0.0.0:5000
+		return m_container_command;
+	}
+
+	string CLIParser::getSnapshotManifest() const
+	{
+		return m_container_args;
+	}
+
 
 }
\ No newline at end of file
@@ -1,13 +1,24 @@
 #include "../include/minidocker/image.hpp"
 #include "../include/minidocker/container.hpp"
+#include "../include/minidocker/container_reaper.hpp"
 #include "../include/minidocker/custom_specific_exceptions.hpp"
+#include "../include/minidocker/lazy_fs.hpp"
+#include "../include/minidocker/layer_cache.hpp"
+#include "../include/minidocker/layer_lock.hpp"
+#include "../include/minidocker/layer_whiteouts.hpp"
+#include "../include/minidocker/rootfs_image.hpp"
+#include "../include/minidocker/rootfs_materializer.hpp"
+#include "../include/minidocker/rootfs_snapshot.hpp"
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
 #include <cstdlib>
 #include <string>
 #include <sched.h>
+#include <fcntl.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <iostream>
 #include <sys/wait.h>
@@ -18,6 +29,10 @@
 #include <random>
 #include <algorithm>
 #include <climits>
+#include <set>
+#include <cstring>
+#include <thread>
+#include <chrono>
 
 using namespace std;
 
@@ -25,6 +40,39 @@ namespace fs = std::filesystem;
 static string cache_dir = "/var/lib/minidocker/layers";
 static string tar_dir = "/tmp/minidocker";
 static string container_dir = "/var/lib/minidocker/containers";
+static const size_t max_mount_options = 4096; //a page, the kernel doesn't take more
+static string lower_links_dir = "/var/lib/minidocker/l"; //short names for the lower dirs of images with many layers
+
+namespace
+{
+	//the new mount API takes the lower dirs one at a time ("lowerdir+", Linux 6.8+), so there's no limit on their number
+	//false if the kernel doesn't have it, the overlay is mounted with mount(2) then
+	bool mountOverlayLayerByLayer(const vector<string>& lower_dirs, const string& upper_dir, const string& work_dir, const string& target)
+	{
+#if defined(FSOPEN_CLOEXEC) && defined(SYS_fsopen)
+		int fs_fd = static_cast<int>(syscall(SYS_fsopen, "overlay", FSOPEN_CLOEXEC));
+		if (fs_fd < 0) return false;
+		bool configured = true;
+		for (const string& lower_dir : lower_dirs) {
+			if (syscall(SYS_fsconfig, fs_fd, FSCONFIG_SET_STRING, "lowerdir+", lower_dir.c_str(), 0) != 0) {
+				configured = false;
+				break;
+			}
+		}
+		configured = configured && syscall(SYS_fsconfig, fs_fd, FSCONFIG_SET_STRING, "upperdir", upper_dir.c_str(), 0) == 0
+			&& syscall(SYS_fsconfig, fs_fd, FSCONFIG_SET_STRING, "workdir", work_dir.c_str(), 0) == 0
+			&& syscall(SYS_fsconfig, fs_fd, FSCONFIG_CMD_CREATE, nullptr, nullptr, 0) == 0;
+		int mount_fd = configured ? static_cast<int>(syscall(SYS_fsmount, fs_fd, FSMOUNT_CLOEXEC, 0)) : -1;
+		close(fs_fd);
+		if (mount_fd < 0) return false;
+		int result = static_cast<int>(syscall(SYS_move_mount, mount_fd, "", AT_FDCWD, target.c_str(), MOVE_MOUNT_F_EMPTY_PATH));
+		close(mount_fd);
+		return result == 0;
+#else
+		return false;
+#endif
+	}
+}
 
 namespace minidocker
 {
@@ -35,8 +83,31 @@ namespace minidocker
 
 	Container::~Container()
 	{
-		//remove the container file system once the execution is done
-		fs::remove_all(m_container_fs_dir);
+		//the idmapped mounts hold on to the user namespace themselves
+		if (m_userns_fd >= 0) close(m_userns_fd);
+		//the overlay resolved its lower dirs when it was mounted, the links aren't needed anymore
+		if (!m_lower_links_dir.empty()) {
+			error_code ec;
+			fs::remove_all(m_lower_links_dir, ec);
+		}
+		if (!m_container_dir.empty()) {
+			//the overlay and the lazily served layers under it have to be unmounted before their directories are removed
+			umount2(m_container_fs_dir.c_str(), MNT_DETACH);
+			m_lazy_mounts.clear();
+			unmountIdmappedDirs();
+			if (!m_rootfs_image_dir.empty()) {
+				//the loop device goes with it
+				umount2(m_rootfs_image_dir.c_str(), MNT_DETACH);
+			}
+			//renamed into the trash and deleted in the background, the next container doesn't wait for it
+			ContainerReaper::discard(m_container_dir);
+		} else if (m_owns_container_fs) {
+			//remove the container file system once the execution is done, MINIDOCKER_DEFAULT_FS (run-command) isn't the container's to remove
+			unmountIdmappedDirs();
+			ContainerReaper::discard(m_container_fs_dir);
+		}
+		//the dir is in the trash by now, a sweep for crashed runs won't find it
+		if (m_container_dir_fd >= 0) close(m_container_dir_fd);
 	}
 
 	Image Container::getImage()
@@ -77,43 +148,9 @@ namespace minidocker
 
 	void Container::mapRootUserInContainer(pid_t pid)
 	{
-		pid_t host_uid = getuid();
-		gid_t host_gid = getgid();
-
 		// This is done so the current user executing the command in the cli becomes the root user in the isolated environment
-		// Write to /proc/[pid]/setgroups to "deny" group changes
-		// Required before gid_map changes, so as to prevent permission escalations by changing groups
-		{
-			ofstream setgroups("/proc/" + to_string(pid) + "/setgroups");
-			if (setgroups) {
-				setgroups << "deny";
-			} 
-			else {
-				throw UserMapException("setgroups write failed");
-			}
-		}
-
-		// Write uid_map
-		{
-			ofstream uid_map("/proc/" + to_string(pid) + "/uid_map");
-			if (uid_map) {
-				uid_map << "0 " << host_uid << " 1";
-			}
-			else {
-				throw UserMapException("uid_map write failed");
-			}
-		}
-
-		// Write gid_map
-		{
-			ofstream gid_map("/proc/" + std::to_string(pid) + "/gid_map");
-			if (gid_map) {
-				gid_map << "0 " << host_gid << " 1";
-			}
-			else {
-				throw UserMapException("gid_map write failed");
-			}
-		}
+		// With MINIDOCKER_USERNS_REMAP the root user and every other id of the container are subordinate ids of the user instead
+		m_user_mapping.apply(pid);
 	}
 
 	string Container::generateHostName()
@@ -352,24 +389,322 @@ namespace minidocker
 		m_container_fs_dir = host_container_dir;
 
 		fs::create_directories(host_container_dir);
+		m_owns_container_fs = true;
+		//so a sweep for the dirs of crashed runs leaves it alone
+		m_container_dir_fd = ContainerReaper::lockContainerDir(host_container_dir);
+		bool overlay_layers = convertLayerWhiteouts();
+		lockExtractedLayers();
+		vector<shared_ptr<const LazyLayer>> lazy_layers = m_image.getLazyLayers();
+		if (any_of(lazy_layers.begin(), lazy_layers.end(), [](const shared_ptr<const LazyLayer>& layer) { return layer != nullptr; })) {
+			try {
+				mountOverlayContainerFs(host_container_dir);
+				cout << "Success\n\n";
+				return;
+			} catch (const ContainerRuntimeException& ex) {
+				//e.g. a remapped container on a kernel that can't idmap the FUSE mounts of the lazy layers
+				cerr << "Warning: " << ex.what() << ", downloading the lazily pulled layers instead\n";
+			}
+			unmountIdmappedDirs();
+			m_lazy_mounts.clear();
+			resetContainerFs(host_container_dir);
+			pullLazyLayers();
+			overlay_layers = convertLayerWhiteouts();
+		}
+
+		//a flattened image is mounted as it is, however many layers and files the image has
+		RootfsImageFormat rootfs_format = RootfsImage::getFormat();
+		if (rootfs_format != RootfsImageFormat::NONE) {
+			try {
+				mountRootfsImage(host_container_dir, rootfs_format);
+				cout << "Success\n\n";
+				return;
+			} catch (const ContainerRuntimeException& ex) {
+				cerr << "Warning: " << ex.what() << ", using the image layers instead\n";
+			}
+			resetContainerFs(host_container_dir);
+		}
+
+		//a deep image mounts as fast as a single layer one, the snapshot of all its layers is the only lower dir
+		//the first container doesn't wait for it to be built, it uses the layers while it's built in the background
 		ImageManifest image_manifest = m_image.getImageManifest();
+		string snapshot_dir;
+		unique_ptr<LayerLock> snapshot_lock;
+		if (image_manifest.m_image_layers.size() > 1 && RootfsSnapshot::isEnabled()) {
+			snapshot_dir = RootfsSnapshot::findSnapshot(RootfsSnapshot::getChainIds(image_manifest), &snapshot_lock);
+			if (snapshot_dir.empty() && RootfsSnapshot::startBackgroundBuild(m_image.getManifestDigest())) {
+				cout << "Building the rootfs snapshot of the image in the background\n";
+			}
+		}
+		if (!snapshot_dir.empty()) {
+			try {
+				m_layer_locks.push_back(move(snapshot_lock));
+				m_container_dir = host_container_dir;
+				mountOverlay(host_container_dir, { snapshot_dir });
+				cout << "Success\n\n";
+				return;
+			} catch (const ContainerRuntimeException& ex) {
+				cerr << "Warning: " << ex.what() << ", using the image layers instead\n";
+			}
+			resetContainerFs(host_container_dir);
+		}
+
+		//the layer dirs are the lower dirs of an overlay, nothing is copied however big the image is
+		if (overlay_layers) {
+			try {
+				mountOverlayContainerFs(host_container_dir);
+				cout << "Success\n\n";
+				return;
+			} catch (const ContainerRuntimeException& ex) {
+				cerr << "Warning: " << ex.what() << ", copying the image layers instead\n";
+			}
+			resetContainerFs(host_container_dir);
+		} else {
+			cerr << "Warning: the whiteouts of the image layers can't be used by overlayfs, copying the image layers instead\n";
+		}
+
+		vector<string> image_layer_dirs;
 		for (const ImageLayer& layer : image_manifest.m_image_layers) {
-			string digest_clean = layer.m_image_digest.substr(layer.m_image_digest.find(":") + 1); // remove "sha256:"
-			string image_layer_dir = cache_dir + "/" + digest_clean;
+			string image_layer_dir = Image::getImageLayerDir(layer);
 
 			if (!fs::exists(image_layer_dir)) {
 				throw ContainerRuntimeException("Image Layer doesn't exist! Container FS can't be created successfully!\nAborting...\n\n");
 			}
+			image_layer_dirs.push_back(image_layer_dir);
+		}
+		//the snapshot has the layers merged already, there's one tree to copy
+		if (!snapshot_dir.empty() && fs::is_directory(snapshot_dir)) {
+			image_layer_dirs = { snapshot_dir };
+		}
 
-			fs::copy(image_layer_dir, host_container_dir,
-				fs::copy_options::recursive |
-				fs::copy_options::overwrite_existing |
-				fs::copy_options::copy_symlinks);
+		//only what's left after the whiteouts of upper layers is copied, reflinked where the file system can
+		RootfsMaterializer materializer(RootfsMaterializer::getThreadCount());
+		auto start = chrono::steady_clock::now();
+		materializer.materialize(image_layer_dirs, host_container_dir);
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << "Copied " << materializer.getFileCount() << " file(s) (" << materializer.getClonedCount() << " reflinked, "
+			<< materializer.getCopiedBytes() / (1024 * 1024) << " MiB copied) in " << seconds << "s\n";
+		if (m_user_mapping.isRemapped()) {
+			//the copy keeps the owners of the layers, the container sees it through an idmapped mount on top of it
+			mountIdmapped(host_container_dir, host_container_dir);
 		}
 
 		cout << "Success\n\n";
 	}
 
+	bool Container::convertLayerWhiteouts()
+	{
+		//layers extracted before whiteouts were converted on extraction are converted once, by the first container that needs them
+		bool converted = true;
+		for (const ImageLayer& layer : m_image.getImageManifest().m_image_layers) {
+			string image_layer_dir = Image::getImageLayerDir(layer);
+			if (!fs::exists(image_layer_dir) || LayerWhiteouts::isConverted(image_layer_dir)) continue;
+			//not while another container uses the layer, this one copies it instead
+			LayerLock layer_lock(layer.m_image_digest);
+			if (!layer_lock.tryLock()) {
+				converted = false;
+				continue;
+			}
+			converted = LayerWhiteouts::convertLayer(image_layer_dir) && converted;
+		}
+		return converted;
+	}
+
+	void Container::resetContainerFs(const string& host_container_dir)
+	{
+		//whatever a failed mount left behind, so the layers can be copied into an empty dir
+		if (!m_container_dir.empty()) umount2(m_container_fs_dir.c_str(), MNT_DETACH);
+		if (!m_rootfs_image_dir.empty()) umount2(m_rootfs_image_dir.c_str(), MNT_DETACH);
+		unmountIdmappedDirs();
+		if (!m_lower_links_dir.empty()) {
+			fs::remove_all(m_lower_links_dir);
+			m_lower_links_dir.clear();
+		}
+		m_rootfs_image_dir.clear();
+		m_container_dir.clear();
+		m_container_fs_dir = host_container_dir;
+		//the dir itself stays, its lock is on it
+		for (const fs::directory_entry& entry : fs::directory_iterator(host_container_dir)) {
+			fs::remove_all(entry.path());
+		}
+	}
+
+	void Container::lockExtractedLayers()
+	{
+		//layers that are still served lazily get locked once their background download is done
+		set<string> locked_digests;
+		for (const unique_ptr<LayerLock>& layer_lock : m_layer_locks) {
+			locked_digests.insert(layer_lock->getDigest());
+		}
+		for (const ImageLayer& layer : m_image.getImageManifest().m_image_layers) {
+			if (locked_digests.count(layer.m_image_digest) > 0 || !fs::exists(Image::getImageLayerDir(layer))) continue;
+			auto layer_lock = make_unique<LayerLock>(layer.m_image_digest);
+			layer_lock->lockShared();
+			LayerCache::recordUse(layer.m_image_digest);
+			locked_digests.insert(layer.m_image_digest);
+			m_layer_locks.push_back(move(layer_lock));
+		}
+	}
+
+	void Container::pullLazyLayers()
+	{
+		atomic<bool> cancelled(false);
+		m_image.downloadLazyLayers(cancelled);
+		//layers another process was downloading already, their lock is exclusive until they're extracted
+		for (const ImageLayer& layer : m_image.getImageManifest().m_image_layers) {
+			if (fs::exists(Image::getImageLayerDir(layer))) continue;
+			LayerLock layer_lock(layer.m_image_digest);
+			layer_lock.lockShared();
+			if (!fs::exists(Image::getImageLayerDir(layer))) {
+				throw ContainerRuntimeException("Image Layer " + layer.m_image_digest + " couldn't be downloaded! Container FS can't be created successfully!\nAborting...\n\n");
+			}
+		}
+		lockExtractedLayers();
+	}
+
+	void Container::mountOverlayContainerFs(const string& host_container_dir)
+	{
+		//the container fs is an overlay of the extracted layers, and of FUSE mounts standing in for the layers that
+		//weren't downloaded yet (lazy pull), whatever the container writes goes to the upper dir
+		m_container_dir = host_container_dir;
+		ImageManifest image_manifest = m_image.getImageManifest();
+		vector<shared_ptr<const LazyLayer>> lazy_layers = m_image.getLazyLayers();
+		map<string, string> mounted_dirs;
+		vector<string> lower_dirs;
+		for (size_t i = 0; i < image_manifest.m_image_layers.size(); i++) {
+			const ImageLayer& layer = image_manifest.m_image_layers[i];
+			string image_layer_dir = Image::getImageLayerDir(layer);
+			string lower_dir = image_layer_dir;
+
+			if (mounted_dirs.count(image_layer_dir) > 0) {
+				lower_dir = mounted_dirs[image_layer_dir];
+			} else if (!fs::exists(image_layer_dir)) {
+				if (i >= lazy_layers.size() || !lazy_layers[i]) {
+					throw ContainerRuntimeException("Image Layer doesn't exist! Container FS can't be created successfully!\nAborting...\n\n");
+				}
+				lower_dir = host_container_dir + "/lazy/" + to_string(i);
+				string digest = layer.m_image_digest;
+				m_lazy_mounts[image_layer_dir] = make_unique<LazyFs>(lazy_layers[i],
+					[this, digest](uint64_t offset, uint64_t len) { return m_image.fetchBlobRange(digest, offset, len); },
+					lower_dir, host_container_dir + "/lazy-cache/" + to_string(i));
+				mounted_dirs[image_layer_dir] = lower_dir;
+			}
+			//overlayfs wants the topmost layer first
+			lower_dirs.insert(lower_dirs.begin(), lower_dir);
+		}
+		mountOverlay(host_container_dir, lower_dirs);
+	}
+
+	void Container::mountRootfsImage(const string& host_container_dir, RootfsImageFormat format)
+	{
+		//built after the pull, or now for images pulled before flattening was turned on
+		ImageManifest image_manifest = m_image.getImageManifest();
+		//the garbage collector leaves the image alone while the container runs
+		unique_ptr<LayerLock> image_lock;
+		string image_path = RootfsImage::build(image_manifest.m_image_layers, RootfsSnapshot::getChainIds(image_manifest), format, &image_lock);
+		m_layer_locks.push_back(move(image_lock));
+
+		m_container_dir = host_container_dir;
+		m_rootfs_image_dir = host_container_dir + "/image";
+		fs::create_directories(m_rootfs_image_dir);
+		RootfsImage::mount(image_path, format, m_rootfs_image_dir);
+		mountOverlay(host_container_dir, { m_rootfs_image_dir });
+	}
+
+	void Container::mountOverlay(const string& host_container_dir, const vector<string>& image_dirs)
+	{
+		m_container_fs_dir = host_container_dir + "/rootfs";
+		fs::create_directories(m_container_fs_dir);
+		fs::create_directories(host_container_dir + "/upper");
+		fs::create_directories(host_container_dir + "/work");
+		//the shared layers are never chowned, every container sees them through idmapped mounts with its own ids
+		//copied up and new files land in the upper dir with the host ids of the container's ids already
+		vector<string> lower_dirs = image_dirs;
+		if (m_user_mapping.isRemapped()) {
+			for (size_t i = 0; i < lower_dirs.size(); i++) {
+				lower_dirs[i] = mountIdmapped(image_dirs[i], host_container_dir + "/idmapped/" + to_string(i));
+			}
+			//the root of the overlay is the upper dir, it belongs to the container's root
+			if (lchown((host_container_dir + "/upper").c_str(), m_user_mapping.getRootUid(), m_user_mapping.getRootGid()) != 0) {
+				throw MountException("Couldn't mount the container filesystem! (" + string(strerror(errno)) + ")");
+			}
+		}
+		if (mountOverlayLayerByLayer(lower_dirs, host_container_dir + "/upper", host_container_dir + "/work", m_container_fs_dir)) {
+			return;
+		}
+
+		string upper_options = ",upperdir=" + host_container_dir + "/upper,workdir=" + host_container_dir + "/work";
+		string lower_option;
+		for (const string& lower_dir : lower_dirs) {
+			lower_option += (lower_option.empty() ? "" : ":") + lower_dir;
+		}
+
+		//older kernels take all the options in one page, images with many layers don't fit in it with absolute paths
+		//their lower dirs are given as short links instead ("/var/lib/minidocker/l/<container id>/<n>", like docker's "l/<id>")
+		if (lower_option.size() + upper_options.size() + 9 >= max_mount_options) {
+			lower_option.clear();
+			for (const string& lower_link : linkLowerDirs(host_container_dir, lower_dirs)) {
+				lower_option += (lower_option.empty() ? "" : ":") + lower_link;
+			}
+		}
+
+		string options = "lowerdir=" + lower_option + upper_options;
+		if (mount("overlay", m_container_fs_dir.c_str(), "overlay", 0, options.c_str()) != 0) {
+			throw MountException("Couldn't mount the container filesystem! (" + string(strerror(errno)) + ")");
+		}
+	}
+
+	vector<string> Container::linkLowerDirs(const string& host_container_dir, const vector<string>& lower_dirs)
+	{
+		string container_id = fs::path(host_container_dir).filename().string();
+		if (container_id.rfind("minidocker-", 0) == 0) container_id = container_id.substr(11);
+		m_lower_links_dir = lower_links_dir + "/" + container_id;
+		error_code ec;
+		fs::remove_all(m_lower_links_dir, ec);
+		fs::create_directories(m_lower_links_dir);
+
+		vector<string> lower_links;
+		for (size_t i = 0; i < lower_dirs.size(); i++) {
+			string lower_link = m_lower_links_dir + "/" + to_string(i);
+			if (symlink(lower_dirs[i].c_str(), lower_link.c_str()) != 0) {
+				throw MountException("Couldn't link the lower dir " + lower_dirs[i] + " (" + string(strerror(errno)) + ")");
+			}
+			lower_links.push_back(lower_link);
+		}
+		return lower_links;
+	}
+
+	string Container::mountIdmapped(const string& dir, const string& target)
+	{
+		if (m_userns_fd < 0) {
+			m_userns_fd = m_user_mapping.createUserNamespace();
+		}
+		fs::create_directories(target);
+		UserMapping::mountIdmapped(dir, target, m_userns_fd);
+		m_idmapped_dirs.push_back(target);
+		return target;
+	}
+
+	void Container::unmountIdmappedDirs()
+	{
+		//the latest first, the copied rootfs is idmapped onto itself
+		for (auto it = m_idmapped_dirs.rbegin(); it != m_idmapped_dirs.rend(); ++it) {
+			umount2(it->c_str(), MNT_DETACH);
+		}
+		m_idmapped_dirs.clear();
+	}
+
+	void Container::downloadLazyLayers(const atomic<bool>& cancelled)
+	{
+		m_image.downloadLazyLayers(cancelled);
+		lockExtractedLayers();
+		//reads of files that weren't fetched yet don't need the registry any more
+		for (auto& [image_layer_dir, lazy_fs] : m_lazy_mounts) {
+			if (fs::exists(image_layer_dir)) {
+				lazy_fs->useExtractedLayer(image_layer_dir);
+			}
+		}
+	}
+
 	string Container::resolveExecutablePath(const string& command, char** envp) {
 
 		// If command is already an absolute or relative path
@@ -429,6 +764,7 @@ namespace minidocker
 
 			//Isolate the resource and set the limits
 			Container* cur_container = static_cast<Container*>(arg);
+			cur_container->m_user_mapping.switchToRoot();
 
 			string hostname = cur_container->getHostname();
 			setHostNameForContainer(hostname);
@@ -469,6 +805,7 @@ namespace minidocker
 
 			//Isolate the resource and set the limits
 			Container* cur_container = static_cast<Container*>(arg);
+			cur_container->m_user_mapping.switchToRoot();
 
 			string hostname = cur_container->getHostname();
 			setHostNameForContainer(hostname);
@@ -552,6 +889,22 @@ namespace minidocker
 
 			fetchMinidockerDefaultFs();
 			generateHostName();
+			if (m_user_mapping.isRemapped()) {
+				//MINIDOCKER_DEFAULT_FS is left as it is, the container gets an idmapped view of it
+				//the container dir is only the container's once the view is mounted, the destructor unmounts and discards it
+				string host_container_dir = container_dir + "/" + m_hostname;
+				string idmapped_fs_dir;
+				try {
+					idmapped_fs_dir = mountIdmapped(m_container_fs_dir, host_container_dir + "/rootfs");
+				} catch (const ContainerRuntimeException&) {
+					error_code ec;
+					fs::remove_all(host_container_dir, ec);
+					throw;
+				}
+				m_container_dir = host_container_dir;
+				m_container_fs_dir = idmapped_fs_dir;
+				m_container_dir_fd = ContainerReaper::lockContainerDir(m_container_dir);
+			}
 
 			STACK_SIZE = 1024*1024; //clone() -> doesn't create stack on its own like fork, we have to create it manually
 			char* stack = new char[STACK_SIZE];
@@ -588,6 +941,8 @@ namespace minidocker
 
 			string hostname = generateHostName();
 			prepareContainerFs(hostname);
+			//with the layers of this container locked, the cache can be brought back within its budget
+			LayerCache::startBackgroundEviction();
 
 			STACK_SIZE = 16*1024 * 1024; //clone() -> doesn't create stack on its own like fork, we have to create it manually
 			char* stack = new char[STACK_SIZE];
@@ -601,9 +956,21 @@ namespace minidocker
 			mapRootUserInContainer(pid);
 			limitResourceUsageUsingCgroups(pid, m_hostname);
 
+			//lazily served layers are downloaded in the background while the container runs, so the next run finds them extracted
+			atomic<bool> download_cancelled(false);
+			thread background_download;
+			if (!m_lazy_mounts.empty()) {
+				background_download = thread(&Container::downloadLazyLayers, this, ref(download_cancelled));
+			}
+
 			int status;
 			cout << "\nRunning the container... \n\n";
 			waitpid(pid, &status, 0);
+			if (background_download.joinable()) {
+				//an unfinished download is journaled, the next pull resumes it
+				download_cancelled = true;
+				background_download.join();
+			}
 			if (!WIFEXITED(status)) {
 				throw ContainerRuntimeException("Couldn't containerize image successfully!");
 			}
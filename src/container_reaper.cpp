@@ -0,0 +1,250 @@
+#include "../include/minidocker/container_reaper.hpp"
+#include "../include/minidocker/background_task.hpp"
+#include "../include/minidocker/layer_lock.hpp"
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+static string trash_dir = "/var/lib/minidocker/trash"; //next to "containers", a rename into it never crosses file systems
+static string container_dir = "/var/lib/minidocker/containers";
+static string lower_links_dir = "/var/lib/minidocker/l"; //"<container id>/<n>" links to the lower dirs of a container's overlay
+static const time_t stale_grace_seconds = 60; //a container dir this new may not be locked by its container yet
+static const unsigned int reaper_threads = 4;
+static const int split_depth = 3; //the levels walked on one thread before the subtrees below are handed to all of them
+
+namespace
+{
+	bool isDirectory(int dir_fd, const struct dirent* entry)
+	{
+		if (entry->d_type != DT_UNKNOWN) return entry->d_type == DT_DIR;
+		struct stat st;
+		return fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+	}
+
+	//unlinks the files of the directory and returns its subdirectories, nothing on another file system (a mount left behind)
+	vector<string> removeFiles(const string& path, dev_t trash_dev)
+	{
+		vector<string> subdirs;
+		int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0) return subdirs;
+		struct stat st;
+		DIR* dir = fstat(fd, &st) == 0 && st.st_dev == trash_dev ? fdopendir(fd) : nullptr;
+		if (!dir) {
+			close(fd);
+			return subdirs;
+		}
+		while (struct dirent* entry = readdir(dir)) {
+			string name = entry->d_name;
+			if (name == "." || name == "..") continue;
+			if (isDirectory(fd, entry)) {
+				subdirs.push_back(path + "/" + name);
+			} else {
+				unlinkat(fd, name.c_str(), 0);
+			}
+		}
+		closedir(dir);
+		return subdirs;
+	}
+
+	void removeTree(const string& path, dev_t trash_dev)
+	{
+		for (const string& subdir : removeFiles(path, trash_dev)) {
+			removeTree(subdir, trash_dev);
+		}
+		rmdir(path.c_str());
+	}
+
+	//what a crashed run left mounted under dir (the overlay, idmapped and lazily served layers), deepest first
+	void unmountUnder(const string& dir)
+	{
+		vector<string> mount_points;
+		ifstream mountinfo("/proc/self/mountinfo");
+		string line;
+		while (getline(mountinfo, line)) {
+			stringstream ss(line);
+			string field, mount_point;
+			for (int i = 0; i < 5 && ss >> field; i++) {
+				if (i == 4) mount_point = field;
+			}
+			if (mount_point.rfind(dir + "/", 0) == 0) mount_points.push_back(mount_point);
+		}
+		sort(mount_points.begin(), mount_points.end(), [](const string& a, const string& b) { return a.size() > b.size(); });
+		for (const string& mount_point : mount_points) {
+			umount2(mount_point.c_str(), MNT_DETACH);
+		}
+	}
+
+	vector<string> listTrash()
+	{
+		vector<string> entries;
+		error_code ec;
+		for (fs::directory_iterator it(trash_dir, ec), end; !ec && it != end; it.increment(ec)) {
+			entries.push_back(it->path().string());
+		}
+		return entries;
+	}
+}
+
+namespace minidocker
+{
+	void ContainerReaper::discard(const string& dir)
+	{
+		if (moveToTrash(dir)) {
+			startBackgroundReap();
+			return;
+		}
+		error_code ec;
+		fs::remove_all(dir, ec);
+	}
+
+	bool ContainerReaper::moveToTrash(const string& dir)
+	{
+		error_code ec;
+		fs::create_directories(trash_dir, ec);
+		string trash_path = trash_dir + "/" + fs::path(dir).filename().string() + "." + to_string(time(nullptr)) + "." + to_string(getpid());
+		return rename(dir.c_str(), trash_path.c_str()) == 0;
+	}
+
+	void ContainerReaper::startBackgroundReap()
+	{
+		//a fresh process, like the background prune : it outlives this one and deletes the trash at its own pace
+		if (!BackgroundTask::start({ "images", "prune", "--trash" })) {
+			cerr << "Warning: couldn't start deleting the container dir in the background, it stays in " << trash_dir << "\n";
+		}
+	}
+
+	int ContainerReaper::lockContainerDir(const string& dir)
+	{
+		//held until the container is torn down, the kernel drops it with a crashed run
+		int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	size_t ContainerReaper::sweepContainerDirs()
+	{
+		size_t swept = 0;
+		time_t now = time(nullptr);
+		error_code ec;
+		for (fs::directory_iterator it(container_dir, ec), end; !ec && it != end; it.increment(ec)) {
+			string dir = it->path().string();
+			struct stat st;
+			if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || now - st.st_mtime < stale_grace_seconds) continue;
+			//a running container holds the lock on its dir
+			int fd = lockContainerDir(dir);
+			if (fd < 0) continue;
+			unmountUnder(dir);
+			if (moveToTrash(dir)) swept++;
+			close(fd);
+		}
+
+		//the links of overlays whose container is gone
+		for (fs::directory_iterator it(lower_links_dir, ec), end; !ec && it != end; it.increment(ec)) {
+			error_code exists_ec;
+			if (fs::exists(container_dir + "/minidocker-" + it->path().filename().string(), exists_ec)) continue;
+			error_code remove_ec;
+			fs::remove_all(it->path(), remove_ec);
+		}
+		return swept;
+	}
+
+	size_t ContainerReaper::reap(bool background)
+	{
+		LayerLock reaper_lock("trash");
+		if (background) {
+			if (!reaper_lock.tryLock()) return 0;
+			BackgroundTask::lowerPriority();
+		} else {
+			reaper_lock.lock();
+		}
+
+		struct stat trash_st;
+		size_t reaped = 0;
+		sweepContainerDirs();
+		while (lstat(trash_dir.c_str(), &trash_st) == 0) {
+			set<string> left = emptyTrash(trash_st.st_dev, reaped);
+			//a reaper started while this one held the lock gave up on it, whatever its teardown moved in is this one's
+			reaper_lock.unlock();
+			vector<string> entries = listTrash();
+			bool added = any_of(entries.begin(), entries.end(), [&](const string& entry) { return left.count(entry) == 0; });
+			if (!added || !reaper_lock.tryLock()) break;
+		}
+		return reaped;
+	}
+
+	set<string> ContainerReaper::emptyTrash(dev_t trash_dev, size_t& reaped)
+	{
+		//containers that finish meanwhile add to the trash, it's emptied until it stays empty
+		while (true) {
+			vector<string> entries = listTrash();
+			if (entries.empty()) return {};
+
+			//the top levels of every entry are walked here, the subtrees below them are deleted in parallel
+			vector<string> skeleton;
+			vector<string> level;
+			for (const string& entry : entries) {
+				struct stat st;
+				if (lstat(entry.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)) {
+					unlink(entry.c_str());
+				} else {
+					level.push_back(entry);
+				}
+			}
+			for (int depth = 0; depth < split_depth && !level.empty(); depth++) {
+				vector<string> next_level;
+				for (const string& dir : level) {
+					skeleton.push_back(dir);
+					vector<string> subdirs = removeFiles(dir, trash_dev);
+					next_level.insert(next_level.end(), subdirs.begin(), subdirs.end());
+				}
+				level.swap(next_level);
+			}
+
+			atomic<size_t> next(0);
+			vector<thread> threads;
+			for (unsigned int t = 0; t < min<size_t>(reaper_threads, level.size()); t++) {
+				threads.emplace_back([&]() {
+					for (size_t i = next++; i < level.size(); i = next++) {
+						removeTree(level[i], trash_dev);
+					}
+				});
+			}
+			for (thread& t : threads) {
+				t.join();
+			}
+			//deepest first, the skeleton was collected a level at a time
+			for (auto it = skeleton.rbegin(); it != skeleton.rend(); ++it) {
+				rmdir(it->c_str());
+			}
+
+			set<string> left;
+			error_code ec;
+			for (const string& entry : entries) {
+				if (fs::exists(fs::symlink_status(entry, ec))) left.insert(entry);
+			}
+			reaped += entries.size() - left.size();
+			//what's left is on another file system or can't be deleted, trying again won't help
+			if (!left.empty()) return left;
+		}
+	}
+}
@@ -0,0 +1,162 @@
+#include "../include/minidocker/content_store.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+static string store_dir = "/var/lib/minidocker/files"; //next to the layers, links and reflinks don't cross file systems
+static const time_t abandoned_tmp_age = 60 * 60; //a store file that was never renamed into place
+
+namespace minidocker
+{
+	DedupMode ContentStore::getDedupMode()
+	{
+		const char* value = getenv("MINIDOCKER_LAYER_DEDUP");
+		if (!value || string(value) == "" || string(value) == "0" || string(value) == "off") {
+			return DedupMode::OFF;
+		}
+		if (string(value) == "hardlink") return DedupMode::HARDLINK;
+		if (string(value) == "reflink") return DedupMode::REFLINK;
+		cerr << "Warning: ignoring invalid MINIDOCKER_LAYER_DEDUP value \"" << value << "\"\n";
+		return DedupMode::OFF;
+	}
+
+	string ContentStore::getStorePath(const string& key)
+	{
+		//fanned out by the first two hex digits, a single directory with every file of every image gets slow
+		return store_dir + "/" + key.substr(0, 2) + "/" + key;
+	}
+
+	uint64_t ContentStore::dedupFile(DedupMode mode, int parent_fd, const string& name, int fd, const string& digest)
+	{
+		if (digest.size() != 64) return 0;
+		if (mode == DedupMode::HARDLINK) return hardlinkFile(parent_fd, name, fd, digest);
+		if (mode == DedupMode::REFLINK) return reflinkFile(fd, digest);
+		return 0;
+	}
+
+	uint64_t ContentStore::hardlinkFile(int parent_fd, const string& name, int fd, const string& digest)
+	{
+		struct stat st;
+		if (fstat(fd, &st) != 0) return 0;
+		//a link shares the inode, so the metadata is part of the key
+		string store_path = getStorePath(digest + "-" + to_string(st.st_mode & 07777) + "-" + to_string(st.st_uid) + "-" +
+			to_string(st.st_gid) + "-" + to_string(st.st_mtim.tv_sec));
+		//the stored copy is linked next to the file first and then renamed over it, the path never goes missing
+		string tmp_name = ".dedup." + to_string(getpid()) + "." + to_string(st.st_ino);
+
+		for (int attempt = 0; attempt < 2; attempt++) {
+			if (linkat(AT_FDCWD, store_path.c_str(), parent_fd, tmp_name.c_str(), 0) == 0) {
+				if (renameat(parent_fd, tmp_name.c_str(), parent_fd, name.c_str()) != 0) {
+					unlinkat(parent_fd, tmp_name.c_str(), 0);
+					return 0;
+				}
+				return static_cast<uint64_t>(st.st_blocks) * 512;
+			}
+			//EMLINK (too many links to the stored copy) and the like just leave the file as it is
+			if (errno != ENOENT) return 0;
+
+			//first file with this content, the store keeps a link to it
+			error_code ec;
+			fs::create_directories(fs::path(store_path).parent_path(), ec);
+			if (linkat(parent_fd, name.c_str(), AT_FDCWD, store_path.c_str(), 0) == 0 || errno != EEXIST) {
+				return 0;
+			}
+			//another extraction stored the same file just now, link to that one instead
+		}
+		return 0;
+	}
+
+	uint64_t ContentStore::reflinkFile(int fd, const string& digest)
+	{
+		//checked once, a file system without reflinks won't grow them during a pull
+		static atomic<bool> unsupported(false);
+		if (unsupported) return 0;
+		auto checkSupport = [](int error) {
+			if (error == EOPNOTSUPP || error == EXDEV || error == EINVAL || error == ENOTTY) {
+				if (!unsupported.exchange(true)) {
+					cerr << "Warning: the layer cache's file system doesn't support reflinks, files aren't deduplicated\n";
+				}
+			}
+		};
+
+		struct stat st;
+		if (fstat(fd, &st) != 0) return 0;
+		string store_path = getStorePath(digest);
+		int store_fd = open(store_path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (store_fd >= 0) {
+			uint64_t saved = 0;
+			struct stat store_st;
+			if (fstat(store_fd, &store_st) == 0 && store_st.st_size == st.st_size) {
+				//the file's own extents are swapped for the stored copy's ones
+				if (ioctl(fd, FICLONE, store_fd) == 0) {
+					saved = static_cast<uint64_t>(st.st_blocks) * 512;
+					//cloning counts as a write, the file gets back the metadata it was extracted with
+					fchmod(fd, st.st_mode & 07777);
+					struct timespec times[2] = { st.st_atim, st.st_mtim };
+					futimens(fd, times);
+					//a stored copy that keeps being reused isn't pruned
+					futimens(store_fd, nullptr);
+				} else {
+					checkSupport(errno);
+				}
+			}
+			close(store_fd);
+			return saved;
+		}
+		if (errno != ENOENT) return 0;
+
+		//first file with this content, the store gets a clone of it
+		error_code ec;
+		fs::create_directories(fs::path(store_path).parent_path(), ec);
+		string tmp_path = store_path + ".tmp." + to_string(getpid()) + "." + to_string(st.st_ino);
+		int tmp_fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+		if (tmp_fd < 0) return 0;
+		bool cloned = ioctl(tmp_fd, FICLONE, fd) == 0;
+		if (!cloned) checkSupport(errno);
+		close(tmp_fd);
+		if (!cloned || rename(tmp_path.c_str(), store_path.c_str()) != 0) {
+			unlink(tmp_path.c_str());
+		}
+		return 0;
+	}
+
+	uint64_t ContentStore::prune(time_t max_unused_age)
+	{
+		uint64_t freed = 0;
+		time_t now = time(nullptr);
+		error_code ec;
+		for (fs::recursive_directory_iterator it(store_dir, ec), end; !ec && it != end; it.increment(ec)) {
+			string path = it->path().string();
+			struct stat st;
+			if (lstat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+			//hardlinked files are named "<digest>-<mode>-<uid>-<gid>-<mtime>", reflinked ones just "<digest>"
+			string name = it->path().filename().string();
+			bool unused;
+			if (name.find(".tmp.") != string::npos) {
+				unused = now - st.st_mtime >= abandoned_tmp_age;
+			} else if (name.find('-') != string::npos) {
+				unused = st.st_nlink == 1;
+			} else {
+				unused = now - st.st_mtime >= max_unused_age;
+			}
+			if (!unused || unlink(path.c_str()) != 0) continue;
+			//the extents of a reflinked file may still be used by layers, only a last link is sure to free its blocks
+			if (st.st_nlink == 1 && name.find('-') != string::npos) {
+				freed += static_cast<uint64_t>(st.st_blocks) * 512;
+			}
+		}
+		return freed;
+	}
+}
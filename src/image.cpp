@@ -1,16 +1,40 @@
 #include "../include/minidocker/image.hpp"
 #include "../include/minidocker/custom_specific_exceptions.hpp"
 #include "../include/minidocker/image_args.hpp"
+#include "../include/minidocker/image_store.hpp"
+#include "../include/minidocker/lazy_layer.hpp"
+#include "../include/minidocker/layer_cache.hpp"
+#include "../include/minidocker/layer_downloader.hpp"
+#include "../include/minidocker/layer_extractor.hpp"
+#include "../include/minidocker/layer_lock.hpp"
+#include "../include/minidocker/oci_archive.hpp"
+#include "../include/minidocker/pull_report.hpp"
+#include "../include/minidocker/registry_client.hpp"
+#include "../include/minidocker/rootfs_image.hpp"
+#include "../include/minidocker/rootfs_snapshot.hpp"
+#include "../include/minidocker/sha256.hpp"
+#include "../include/minidocker/token_cache.hpp"
 #include <curl/curl.h>
-#include <regex>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <string>
 #include <sys/utsname.h>
 #include <utility>
 #include <filesystem>
 #include <fstream>
 #include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <nlohmann/json.hpp>
 using json = nlohmann::json;
 
@@ -20,16 +44,105 @@ namespace fs = std::filesystem;
 static string cache_dir = "/var/lib/minidocker/layers";
 static string tar_dir = "/tmp/minidocker";
 static string container_dir = "/var/lib/minidocker/containers";
+static string default_registry = "https://registry-1.docker.io";
+static const size_t max_concurrent_resolves = 8; //manifests resolved at the same time by a batch pull
+static const size_t max_archived_document_size = 4 * 1024 * 1024; //indexes, manifests and configs of an image archive
+
+namespace
+{
+    //"io.containerd.image.name" (save, docker save) holds the whole reference, "org.opencontainers.image.ref.name" often just the tag
+    bool parseArchivedReference(const json& descriptor, string& name, string& tag)
+    {
+        if (!descriptor.contains("annotations") || !descriptor["annotations"].is_object()) return false;
+        const json& annotations = descriptor["annotations"];
+        string reference;
+        for (const char* key : { "io.containerd.image.name", "org.opencontainers.image.ref.name" }) {
+            if (annotations.contains(key) && annotations[key].is_string()) {
+                reference = annotations[key].get<string>();
+                break;
+            }
+        }
+        //a bare tag doesn't say which image it belongs to
+        if (reference.find_first_of("/:@") == string::npos) return false;
+
+        size_t at = reference.find('@');
+        size_t colon = reference.rfind(':');
+        size_t slash = reference.rfind('/');
+        if (at != string::npos) {
+            name = reference.substr(0, at);
+            tag = reference.substr(at + 1);
+        } else if (colon != string::npos && (slash == string::npos || colon > slash)) {
+            name = reference.substr(0, colon);
+            tag = reference.substr(colon + 1);
+        } else {
+            name = reference;
+            tag = "latest";
+        }
+        //images are pulled from the configured registry, "docker.io/library/alpine" is stored as "library/alpine"
+        if (name.rfind("docker.io/", 0) == 0) name = name.substr(10);
+        return !name.empty() && !tag.empty();
+    }
+
+    //stores an index or manifest of the archive along with the documents it refers to (not the layers)
+    //false if the archive doesn't have it, an index only brings the platforms that were saved
+    bool storeArchivedDocument(const minidocker::OciArchiveReader& archive, minidocker::ImageStore& image_store, const string& digest)
+    {
+        string blob_name = minidocker::getOciBlobName(digest);
+        uint64_t offset, size;
+        if (blob_name.empty() || !archive.getEntry(blob_name, offset, size)) return false;
+        string content = archive.readFile(blob_name, max_archived_document_size);
+        if (minidocker::Sha256::digestOf(content) != digest) {
+            throw minidocker::ImageArchiveException(blob_name + " of the archive doesn't match its digest !");
+        }
+        image_store.putBlob(content);
+
+        json document = json::parse(content, nullptr, false);
+        if (document.is_discarded()) return true;
+        if (document.contains("manifests") && document["manifests"].is_array()) {
+            for (const auto& manifest : document["manifests"]) {
+                if (manifest.contains("digest") && manifest["digest"].is_string()) {
+                    storeArchivedDocument(archive, image_store, manifest["digest"].get<string>());
+                }
+            }
+        }
+        if (document.contains("layers") && document.contains("config") && document["config"].is_object() &&
+            document["config"].contains("digest") && document["config"]["digest"].is_string()) {
+            string config_digest = document["config"]["digest"].get<string>();
+            if (!storeArchivedDocument(archive, image_store, config_digest)) {
+                throw minidocker::ImageArchiveException("Config " + config_digest + " is missing from the archive !");
+            }
+        }
+        return true;
+    }
+}
 
 //TODO: make sure files created in case of error is deleted like .tar and folder for image layer
 namespace minidocker
 {
 	Image::Image(const string& docker_command) : m_docker_command(docker_command), m_type("SINGLE_COMMAND") {}
 
-	Image::Image(const ImageArgs& image_args) : m_type("DOCKER_IMAGE")
+	Image::Image(const ImageArgs& image_args, shared_ptr<RegistryClient> registry_client)
+		: m_type("DOCKER_IMAGE"), m_registry_client(move(registry_client))
 	{
 		m_image_name = image_args.name;
 		m_image_tag = image_args.tag;
+		m_pull_policy = image_args.pull_policy;
+		m_lazy_pull = image_args.lazy_pull;
+		m_report_path = image_args.report_path;
+		m_pull_report = make_shared<PullReport>();
+		m_registry_urls = getRegistryUrls();
+		if (!image_args.push_registry.empty()) {
+			string url = normalizeRegistryUrl(image_args.push_registry);
+			if (url.empty()) {
+				throw ImagePushException("Invalid registry \"" + image_args.push_registry + "\" to push to !");
+			}
+			//mirrors are read-only, a push only talks to the registry itself
+			m_registry_urls = { url };
+			m_repository_actions = "pull,push";
+		}
+		if (!m_registry_client) {
+			m_registry_client = make_shared<RegistryClient>();
+		}
 
         if (m_image_name.find('/') == string::npos) {
             m_image_name = "library/" + m_image_name;  // Default namespace - for example if we want to pull ubuntu - we need to use library/ubuntu
@@ -66,59 +179,201 @@ namespace minidocker
         return { arch, os };
     }
 
-    size_t Image::writeCallback(void* contents, size_t size, size_t nmemb, string* output)
+    string Image::getToken(const AuthChallenge& challenge)
 	{
-        size_t total = size * nmemb;
-        output->append((char*)contents, total);
-        return total;
+        //a cross repository mount asks for access to two repositories, every scope is a parameter of its own
+        string token_url = challenge.m_realm + "?service=" + challenge.m_service;
+        size_t start = 0;
+        while (start < challenge.m_scope.size()) {
+            size_t end = challenge.m_scope.find(' ', start);
+            if (end == string::npos) end = challenge.m_scope.size();
+            if (end > start) token_url += "&scope=" + challenge.m_scope.substr(start, end - start);
+            start = end + 1;
+        }
+        RegistryResponse response = m_registry_client->get(token_url, {}, false);
+        if (response.m_curl_code != CURLE_OK || response.m_http_code != 200) {
+            throw ImageAuthException("Couldn't authenticate to " + token_url + " !");
+        }
+
+        CachedToken token = TokenCache::parseTokenResponse(response.m_body);
+        m_registry_client->getTokenCache().store(challenge.m_realm, challenge.m_service, challenge.m_scope, token);
+        return token.m_token;
     }
 
-    size_t Image::writeFileCallback(char* ptr, size_t size, size_t nmemb, void* userdata) {
-        std::ofstream* out = static_cast<std::ofstream*>(userdata);
-        if (!out || !out->is_open()) return 0;
-        out->write(ptr, size * nmemb);
-        return size * nmemb;
+    string Image::getRepositoryScope() const
+    {
+        return "repository:" + m_image_name + ":" + m_repository_actions;
     }
 
-    string Image::getToken(const string& auth_url)
+    void Image::updateTokenIfUnauthorized(const string& host, const string& header_str)
 	{
-        CURL* curl = curl_easy_init();
-        string response;
-        if (curl) {
-            curl_easy_setopt(curl, CURLOPT_URL, auth_url.c_str());
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallback);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-            curl_easy_perform(curl);
-            curl_easy_cleanup(curl);
-
-            smatch match;
-            regex token_regex("\"token\"\\s*:\\s*\"([^\"]+)\"");
-        	if (regex_search(response, match, token_regex)) {
-        		return match[1];
-        	} else {
-                throw ImageException("Couldn't authenticate to " + auth_url + " !");
-        	}
+        AuthChallenge challenge;
+        if (!TokenCache::parseChallenge(header_str, challenge)) {
+            throw ImageAuthException("Registry refused the request without a bearer token challenge!");
+        }
+        //a push target asks for pull and push at once, a pull-only token from its HEAD checks would be refused by the uploads
+        if (challenge.m_scope.empty() || challenge.m_scope == "repository:" + m_image_name + ":pull") {
+            challenge.m_scope = getRepositoryScope();
         }
-        return "";
-    }
 
-    void Image::updateTokenIfUnauthorized(const string& header_str)
-	{
-        smatch match;
-        regex realm_regex(R"~(realm="([^"]+)")~");
-        regex service_regex(R"~(service="([^"]+)")~");
-        regex scope_regex(R"~(scope="([^"]+)")~");
-
-        string realm, service, scope;
-        if (regex_search(header_str, match, realm_regex)) realm = match[1];
-        if (regex_search(header_str, match, service_regex)) service = match[1];
-        if (regex_search(header_str, match, scope_regex)) scope = match[1];
-
-        string token_url = realm + "?service=" + service + "&scope=" + scope;
-        string token = getToken(token_url);
-        m_bearer_token = token;
+        //remembered so the next request to this registry can send a token right away
+        TokenCache& token_cache = m_registry_client->getTokenCache();
+        token_cache.storeChallenge(host, challenge);
+
+        //a cached token that was just rejected has to be fetched again, any other cached one is worth a try
+        string& bearer_token = m_bearer_tokens[host];
+        string cached_token = token_cache.lookup(challenge.m_realm, challenge.m_service, challenge.m_scope);
+        if (!cached_token.empty() && cached_token != bearer_token) {
+            bearer_token = cached_token;
+            m_pull_report->countTokenRefresh(false);
+            return;
+        }
+        token_cache.invalidate(challenge.m_realm, challenge.m_service, challenge.m_scope);
+        bearer_token = getToken(challenge);
+        m_pull_report->countTokenRefresh(true);
 	}
 
+    RegistryResponse Image::registryRequest(const string& url, const function<RegistryResponse(const vector<string>&)>& request)
+    {
+        //every registry and mirror hands out its own tokens
+        string host = RegistryClient::getHost(url);
+        string token;
+        {
+            lock_guard<mutex> lock(*m_token_mutex);
+            //a cached token from an earlier pull of this repository saves the 401 round trip
+            string& bearer_token = m_bearer_tokens[host];
+            if (bearer_token.empty()) {
+                bearer_token = m_registry_client->getTokenCache().lookupForHost(host, getRepositoryScope());
+            }
+            token = bearer_token;
+        }
+
+        vector<string> auth_headers;
+        if (!token.empty()) {
+            auth_headers.push_back("Authorization: Bearer " + token);
+        }
+        RegistryResponse response = request(auth_headers);
+
+        if (response.m_http_code == 401) {
+            {
+                lock_guard<mutex> lock(*m_token_mutex);
+                //another thread might have refreshed the token already while this request was running
+                if (m_bearer_tokens[host] == token) {
+                    //Update token as unauthorized error
+                    updateTokenIfUnauthorized(host, response.m_headers);
+                }
+                token = m_bearer_tokens[host];
+            }
+
+            // Retry with Bearer token
+            response = request({ "Authorization: Bearer " + token });
+        }
+        return response;
+    }
+
+    RegistryResponse Image::registryGet(const string& url, const vector<string>& headers, bool follow_redirects,
+        const function<bool(const char*, size_t)>& body_handler)
+    {
+        return registryRequest(url, [&](const vector<string>& auth_headers) {
+            vector<string> request_headers = headers;
+            request_headers.insert(request_headers.end(), auth_headers.begin(), auth_headers.end());
+            return m_registry_client->get(url, request_headers, follow_redirects, body_handler);
+        });
+    }
+
+    RegistryResponse Image::registrySend(const string& method, const string& url, const vector<string>& headers, uint64_t body_size,
+        const function<size_t(char*, size_t, uint64_t)>& body_source)
+    {
+        return registryRequest(url, [&](const vector<string>& auth_headers) {
+            vector<string> request_headers = headers;
+            request_headers.insert(request_headers.end(), auth_headers.begin(), auth_headers.end());
+            return m_registry_client->send(method, url, request_headers, body_size, body_source);
+        });
+    }
+
+    string Image::getRegistryUrl() const
+    {
+        return m_registry_urls.back();
+    }
+
+    RegistryResponse Image::registryFetch(const string& path, const vector<string>& headers, bool follow_redirects,
+        const function<bool(const char*, size_t)>& body_handler)
+    {
+        RegistryResponse response;
+        for (size_t i = 0; i < m_registry_urls.size(); i++) {
+            bool last = i + 1 == m_registry_urls.size();
+            //once part of a body was handed out, another endpoint can't take over anymore
+            bool body_started = false;
+            function<bool(const char*, size_t)> handler;
+            if (body_handler) {
+                handler = [&](const char* data, size_t len) { body_started = true; return body_handler(data, len); };
+            }
+
+            string error;
+            try {
+                response = registryGet(m_registry_urls[i] + path, headers, follow_redirects, handler);
+                bool served = response.m_curl_code == CURLE_OK &&
+                    ((response.m_http_code >= 200 && response.m_http_code < 300) || response.m_http_code == 304);
+                if (served || body_started || last) break;
+                error = response.m_curl_code != CURLE_OK ? string(curl_easy_strerror(response.m_curl_code)) : "HTTP " + to_string(response.m_http_code);
+            } catch (const ImageAuthException& ex) {
+                if (last) throw;
+                error = ex.what();
+            }
+            cerr << "Warning: " << m_registry_urls[i] << " couldn't serve " << path << " (" << error << "), trying " << m_registry_urls[i + 1] << "\n";
+        }
+        return response;
+    }
+
+    string Image::normalizeRegistryUrl(string url)
+    {
+        //"mirror.local:5000", "http://mirror.local:5000" and "https://mirror.local:5000/v2/" all end up as the latter
+        while (!url.empty() && (url.back() == '/' || url.back() == ' ')) url.pop_back();
+        url.erase(0, url.find_first_not_of(' '));
+        if (url.size() >= 3 && url.compare(url.size() - 3, 3, "/v2") == 0) url.erase(url.size() - 3);
+        if (url.find("://") == string::npos) url = "https://" + url;
+        if ((url.rfind("https://", 0) != 0 && url.rfind("http://", 0) != 0) || RegistryClient::getHost(url).empty()) {
+            return "";
+        }
+        return url + "/v2/";
+    }
+
+    vector<string> Image::getRegistryUrls()
+    {
+        vector<string> urls;
+        const char* mirrors = getenv("MINIDOCKER_REGISTRY_MIRRORS");
+        if (mirrors) {
+            string value = mirrors;
+            size_t start = 0;
+            while (start <= value.size()) {
+                size_t end = value.find(',', start);
+                if (end == string::npos) end = value.size();
+                string mirror = value.substr(start, end - start);
+                start = end + 1;
+                if (mirror.find_first_not_of(' ') == string::npos) continue;
+
+                string url = normalizeRegistryUrl(mirror);
+                if (url.empty()) {
+                    cerr << "Warning: ignoring invalid MINIDOCKER_REGISTRY_MIRRORS value \"" << mirror << "\"\n";
+                } else {
+                    urls.push_back(url);
+                }
+            }
+        }
+
+        string registry = default_registry;
+        const char* value = getenv("MINIDOCKER_REGISTRY");
+        if (value && *value) {
+            if (normalizeRegistryUrl(value).empty()) {
+                cerr << "Warning: ignoring invalid MINIDOCKER_REGISTRY value \"" << value << "\"\n";
+            } else {
+                registry = value;
+            }
+        }
+        urls.push_back(normalizeRegistryUrl(registry));
+        return urls;
+    }
+
     void Image::parseConfigDetails(json config_json)
     {
         string image_name = m_image_name;
@@ -178,6 +433,14 @@ namespace minidocker
                 image_config.m_working_dir = "";
             }
 
+            //not part of "config", the layers' uncompressed digests the chain IDs of the rootfs snapshots are made of
+            if (config_json.contains("rootfs") && config_json["rootfs"].is_object() && config_json["rootfs"].contains("diff_ids")
+                && config_json["rootfs"]["diff_ids"].is_array()) {
+                for (const auto& diff_id : config_json["rootfs"]["diff_ids"]) {
+                    if (diff_id.is_string()) image_config.m_diff_ids.push_back(diff_id.get<string>());
+                }
+            }
+
             m_image_manifest.m_image_config = image_config;
         }
         else {
@@ -202,73 +465,45 @@ namespace minidocker
             if (configJson.contains("digest") && configJson["digest"].is_string())
             {
                 string digest = configJson["digest"];
-                string registry_url = "https://registry-1.docker.io/v2/" + image_name + "/blobs/" + digest;
-
-                CURL* curl = curl_easy_init();
+                m_config_digest = digest;
                 string response;
-
-                long http_code = 0;
-
-                if (curl) {
-                    struct curl_slist* headers = nullptr;
-                    headers = curl_slist_append(headers, "Accept: application/vnd.oci.image.config.v1+json");
-                    headers = curl_slist_append(headers, "Accept: application/vnd.docker.container.image.v1+json");
-                    string auth_header;
-                    if (!m_bearer_token.empty())
-                    {
-                        auth_header = "Authorization: Bearer " + m_bearer_token;
-                        headers = curl_slist_append(headers, auth_header.c_str());
-                    }
-
-                    curl_easy_setopt(curl, CURLOPT_URL, registry_url.c_str());
-                    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-                    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallback);
-                    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-
-                    string header_str;
-                    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, writeCallback);
-                    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &header_str);
-
-                    //blob fetching can respond with 307 Redirect responses
-                    //this is to handle redirect
-                    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-                    curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5L); // limit to 5 redirects
-                    curl_easy_setopt(curl, CURLOPT_AUTOREFERER, 1L);
-                    //Also avoid curl writing http errors into the response
-                    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
-
-                    curl_easy_perform(curl);
-                    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+                FetchRecord fetch_record;
+                fetch_record.m_kind = "config";
+                fetch_record.m_reference = digest;
+                fetch_record.m_source = "store";
+
+                //a config is addressed by its digest, a stored copy never needs revalidation
+                if (m_image_store.getBlob(digest, response)) {
+                    cout << "Using locally stored config\n";
+                } else if (m_pull_policy == PullPolicy::NEVER) {
+                    throw ImageConfigException("Config for " + image_name + ":" + m_image_tag + " isn't stored locally and pulling is disabled (--pull=never) !");
+                } else {
+                    //blob fetching can respond with 307 Redirect responses, so redirects are followed
+                    RegistryResponse registry_response = registryFetch(image_name + "/blobs/" + digest, {
+                        "Accept: application/vnd.oci.image.config.v1+json",
+                        "Accept: application/vnd.docker.container.image.v1+json" }, true);
+                    long http_code = registry_response.m_http_code;
+                    recordResponse(fetch_record, registry_response);
+                    m_pull_report->addFetch(fetch_record);
+                    //avoid parsing http error pages as the config
+                    response = http_code == 200 ? registry_response.m_body : "";
 
                     if (http_code == 401) {
-
-                        //Update token as unauthorized error
-                        updateTokenIfUnauthorized(header_str);
-
-                        // Retry with Bearer token
-                        auth_header = "Authorization: Bearer " + m_bearer_token;
-                        headers = curl_slist_append(headers, auth_header.c_str());
-
-                        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-                        response.clear();
-                        curl_easy_perform(curl);
-                        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+                        throw ImageConfigException("401 UNAUTHORIZED ERROR - while trying to fetch config for " + image_name + ":" + m_image_tag + " !");
                     }
 
-                    curl_easy_cleanup(curl);
-                    curl_slist_free_all(headers);
+                    if (response.empty()) {
+                        throw ImageConfigException("Couldn't get the config for " + image_name + ":" + m_image_tag + " !");
+                    }
 
+                    //a config that doesn't match its digest is either corrupted or not the one the manifest refers to
+                    if (digest.rfind("sha256:", 0) == 0 && Sha256::digestOf(response) != digest) {
+                        throw ImageConfigException("Config of " + image_name + ":" + m_image_tag + " doesn't match digest " + digest + " !");
+                    }
+                    m_image_store.putBlob(response);
                 }
-                else {
-                    throw ImageConfigException("Couldn't initialize curl to get config of image!");
-                }
-
-                if (response.empty()) {
-                    throw ImageConfigException("Couldn't get the config for " + image_name + ":" + m_image_tag + " !");
-                }
-
-                if (http_code == 401) {
-                    throw ImageConfigException("401 UNAUTHORIZED ERROR - while trying to fetch config for " + image_name + ":" + m_image_tag + " !");
+                if (fetch_record.m_url.empty()) {
+                    m_pull_report->addFetch(fetch_record);
                 }
 
                 json config_json = json::parse(response);
@@ -325,6 +560,12 @@ namespace minidocker
                 img_layer.m_media_type = layer["mediaType"].get<string>();
                 img_layer.m_image_digest = layer["digest"].get<string>();
                 img_layer.m_image_size = to_string(layer["size"].get<int64_t>());
+                //seekable layers (eStargz, zstd:chunked) say where their table of contents is in here
+                if (layer.contains("annotations") && layer["annotations"].is_object()) {
+                    for (const auto& [key, value] : layer["annotations"].items()) {
+                        if (value.is_string()) img_layer.m_annotations[key] = value.get<string>();
+                    }
+                }
 
                 image_manifest.m_image_layers.push_back(move(img_layer));
             }
@@ -342,74 +583,84 @@ namespace minidocker
         if (image_name.find('/') == string::npos) {
             image_name = "library/" + image_name;  // Default namespace - for example if we want to pull ubuntu - we need to use library/ubuntu
         }
-        string registry_url = "https://registry-1.docker.io/v2/" + image_name + "/manifests/" + image_tag;
+        bool by_digest = image_tag.rfind("sha256:", 0) == 0;
 
-        CURL* curl = curl_easy_init();
+        //look for the manifest (or index) in the image store first
         string response;
+        StoredReference reference;
+        bool stored = false;
+        FetchRecord fetch_record;
+        fetch_record.m_reference = image_tag;
+        fetch_record.m_source = "store";
+        if (by_digest) {
+            stored = m_image_store.getBlob(image_tag, response);
+        } else if (m_image_store.getReference(image_name, image_tag, reference)) {
+            stored = m_image_store.getBlob(reference.m_digest, response);
+        }
 
-        long http_code = 0;
-
-        if (curl) {
-            struct curl_slist* headers = nullptr;
-            headers = curl_slist_append(headers, "Accept: application/vnd.docker.distribution.manifest.list.v2+json");
-            headers = curl_slist_append(headers, "Accept: application/vnd.docker.distribution.manifest.v2+json");
-            string auth_header;
-            if (!m_bearer_token.empty())
-            {
-	            auth_header = "Authorization: Bearer " + m_bearer_token;
-				headers = curl_slist_append(headers, auth_header.c_str());
+        //a manifest fetched by digest can't change, a tag is only checked with the registry again if the policy asks for it
+        if (stored && (by_digest || m_pull_policy != PullPolicy::ALWAYS)) {
+            cout << "Using locally stored manifest for " << image_name << ":" << image_tag << "\n";
+        } else if (!stored && m_pull_policy == PullPolicy::NEVER) {
+            throw ImageManifestException("Manifest for " + image_name + ":" + image_tag + " isn't stored locally and pulling is disabled (--pull=never) !");
+        } else {
+            vector<string> headers = {
+                "Accept: application/vnd.docker.distribution.manifest.list.v2+json",
+                "Accept: application/vnd.docker.distribution.manifest.v2+json" };
+            //the registry answers 304 without a body if the tag still points to the stored manifest
+            if (stored && !reference.m_etag.empty()) {
+                headers.push_back("If-None-Match: " + reference.m_etag);
             }
-        	
 
-            curl_easy_setopt(curl, CURLOPT_URL, registry_url.c_str());
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallback);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+            RegistryResponse registry_response = registryFetch(image_name + "/manifests/" + image_tag, headers, false);
+            long http_code = registry_response.m_http_code;
+            recordResponse(fetch_record, registry_response);
 
-            string header_str;
-            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, writeCallback);
-            curl_easy_setopt(curl, CURLOPT_HEADERDATA, &header_str);
+            if (stored && http_code == 304) {
+                fetch_record.m_source = "revalidated";
+                cout << "Locally stored manifest for " << image_name << ":" << image_tag << " is up to date\n";
+            } else {
+                response = registry_response.m_body;
+                //the kind is only known once it parsed, a failed fetch is reported as a manifest
+                fetch_record.m_kind = "manifest";
+                if (http_code != 200) {
+                    m_pull_report->addFetch(fetch_record);
+                }
 
-            curl_easy_perform(curl);
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+                if (response.empty()){
+                    throw ImageManifestException("Couldn't get the manifest for " + image_name + ":" + image_tag + " !");
+                }
 
-            if (http_code == 401) {
+                if (http_code == 401){
+                    throw ImageManifestException("401 UNAUTHORIZED ERROR - while trying to fetch manifest for " + image_name + ":" + image_tag + " !");
+                }
 
-                //Update token as unauthorized error
-                updateTokenIfUnauthorized(header_str);
+                if (http_code != 200){
+                    throw ImageManifestException("HTTP " + to_string(http_code) + " ERROR - while trying to fetch manifest for " + image_name + ":" + image_tag + " !");
+                }
 
-                // Retry with Bearer token
-                auth_header = "Authorization: Bearer " + m_bearer_token;
-                headers = curl_slist_append(headers, auth_header.c_str());
+                //when fetched by digest, the manifest has to hash to exactly that digest
+                if (by_digest && Sha256::digestOf(response) != image_tag) {
+                    throw ImageManifestException("Manifest of " + image_name + " doesn't match digest " + image_tag + " !");
+                }
 
-                curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-                response.clear();
-                curl_easy_perform(curl);
-                curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+                string digest = m_image_store.putBlob(response);
+                if (!by_digest) {
+                    m_image_store.putReference(image_name, image_tag, { digest, RegistryClient::getHeader(registry_response.m_headers, "ETag") });
+                }
             }
-
-            curl_easy_cleanup(curl);
-            curl_slist_free_all(headers);
-
-        } else {
-            throw ImageManifestException("Couldn't initialize curl to get manifest of image!");
-        }
-
-        if (response.empty()){
-            throw ImageManifestException("Couldn't get the manifest for " + image_name + ":" + image_tag + " !");
-        }
-
-        if (http_code == 401){
-            throw ImageManifestException("401 UNAUTHORIZED ERROR - while trying to fetch manifest for " + image_name + ":" + image_tag + " !");
         }
 
         //In case of multiple platform wise image version available it won't give us an image list, so first we need to select the appropriate version based on our host details
         //We finally need the layers of the image, so if we don't receive it we make a call with the digest of the image matching our architecture
         //Then we will get the Image Manifest with layers of the image to unpack
 		json manifest_json = json::parse(response);
-        if (manifest_json.contains("mediaType") &&
+        bool is_index = manifest_json.contains("mediaType") &&
             (manifest_json["mediaType"] == "application/vnd.docker.distribution.manifest.list.v2+json" ||
-                manifest_json["mediaType"] == "application/vnd.oci.image.index.v1+json")) {
+                manifest_json["mediaType"] == "application/vnd.oci.image.index.v1+json");
+        fetch_record.m_kind = is_index ? "index" : "manifest";
+        m_pull_report->addFetch(fetch_record);
+        if (is_index) {
 
             auto [host_arch, host_os] = getHostArchAndOS();
 
@@ -426,6 +677,7 @@ namespace minidocker
             throw ImageManifestException("No suitable manifest found for " + host_arch + "/" + host_os + " in " + image_name + ":" + image_tag);
         }
 
+        m_manifest_digest = Sha256::digestOf(response);
         parseManifest(manifest_json, image_name, image_tag);
         //Now that we have the actual Image Manifest, We need to get the config details
 		fetchConfigDetails(manifest_json);
@@ -439,116 +691,700 @@ namespace minidocker
         return fetchManifest(m_image_name, m_image_tag);
     }
 
-    void Image::downloadImageLayer(const string& blob_url, const string& image_tar_path) {
-        // Skip download if tarball already exists
-        if (fs::exists(image_tar_path)) {
-            cout << "Tarball already exists. Skipping download.\n";
-            return;
-        }
+    bool Image::keepLayerTarballs()
+    {
+        //debug mode - keep a copy of every downloaded blob in tar_dir, extraction doesn't need it
+        const char* value = getenv("MINIDOCKER_KEEP_LAYER_TARBALLS");
+        return value && string(value) != "0" && string(value) != "";
+    }
 
-        CURL* curl = curl_easy_init();
-        if (!curl) throw ImageTarballException("Couldn't initialize curl to download tarball of layer!");
-
-        ofstream ofs(image_tar_path, ios::binary);
-        if (!ofs) throw ImageTarballException("Failed to open tarball file!");
-
-        struct curl_slist* headers = nullptr;
-        string auth_header;
-        if (!m_bearer_token.empty()) {
-            auth_header = "Authorization: Bearer " + m_bearer_token;
-            headers = curl_slist_append(headers, auth_header.c_str());
-        }
-        curl_easy_setopt(curl, CURLOPT_URL, blob_url.c_str());
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ofs);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeFileCallback);
-
-        string header_str;
-        long http_code = 0;
-        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, writeCallback);
-        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &header_str);
-
-        //blob fetching can respond with 307 Redirect responses
-        //this is to handle redirect
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5L); // limit to 5 redirects
-        curl_easy_setopt(curl, CURLOPT_AUTOREFERER, 1L);
-        //Also avoid curl writing http errors into the tar file
-        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
-
-        CURLcode res = curl_easy_perform(curl);
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-        if (http_code == 401) {
-            //Update token as unauthorized error
-            updateTokenIfUnauthorized(header_str);
-            // Retry with Bearer token
-            auth_header = "Authorization: Bearer " + m_bearer_token;
-            headers = curl_slist_append(headers, auth_header.c_str());
+    void Image::extractImageLayer(const string& image_tar_path, const string& image_layer_dir, const string& image_digest,
+        LayerTimings& timings) {
 
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-            res = curl_easy_perform(curl);
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+        if (fs::exists(image_layer_dir)) {
+            cout << "Image Layer already extracted. Skipping.\n";
+            return;
         }
 
-        curl_easy_cleanup(curl);
-        curl_slist_free_all(headers);
-        
-        ofs.close();
-        if (http_code == 401) {
-            throw ImageTarballException("401 UNAUTHORIZED ERROR - while trying to download tarball of image layer!");
+        int fd = open(image_tar_path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        try {
+            if (fd < 0 || fstat(fd, &st) != 0) {
+                throw ImageExtractionException("Failed to extract tarball for Image Layer! Couldn't open tarball " + image_tar_path + " !");
+            }
+            extractImageLayer(fd, 0, static_cast<uint64_t>(st.st_size), image_layer_dir, image_digest, timings);
+        } catch (const exception&) {
+            //a corrupted tarball shouldn't be picked up again later on
+            if (fd >= 0) close(fd);
+            error_code ec;
+            fs::remove(image_tar_path, ec);
+            throw;
+        }
+        close(fd);
+        //the layer dir is all that's needed from now on
+        if (!keepLayerTarballs()) {
+            fs::remove(image_tar_path);
         }
+        cout << "Extracted Image Layer\n";
+    }
 
-        if (res != CURLE_OK || http_code != 200) {
-            throw ImageTarballException("Failed to download layer!");
+    void Image::extractImageLayer(int fd, uint64_t offset, uint64_t len, const string& image_layer_dir, const string& image_digest,
+        LayerTimings& timings) {
+
+        //extract into a staging dir that only becomes the layer dir once the tarball matched its digest
+        string staging_dir = LayerDownloader::getStagingDir(image_layer_dir);
+        try {
+            posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(len), POSIX_FADV_SEQUENTIAL);
+            fs::remove_all(staging_dir);
+            Sha256 hasher;
+            {
+                ScopedTimer timer(timings.m_extract_seconds);
+                LayerExtractor extractor(staging_dir);
+                vector<char> buffer(1024 * 1024);
+                while (len > 0) {
+                    ssize_t n = pread(fd, buffer.data(), static_cast<size_t>(min<uint64_t>(buffer.size(), len)), static_cast<off_t>(offset));
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) {
+                        throw ImageExtractionException(n == 0 ? string("Tarball ended early !") : "Couldn't read tarball : " + string(strerror(errno)));
+                    }
+                    hasher.update(buffer.data(), static_cast<size_t>(n));
+                    extractor.write(buffer.data(), static_cast<size_t>(n));
+                    offset += static_cast<uint64_t>(n);
+                    len -= static_cast<uint64_t>(n);
+                }
+                if (image_digest.rfind("sha256:", 0) == 0 && hasher.finalDigest() != image_digest) {
+                    throw ImageExtractionException("Tarball doesn't match digest " + image_digest + " !");
+                }
+                extractor.finish();
+                timings.m_uncompressed_bytes = extractor.getUncompressedBytes();
+                timings.m_compression = extractor.getCompressionName();
+                timings.m_deduped_bytes = extractor.getDedupedBytes();
+            }
+            fs::rename(staging_dir, image_layer_dir);
+        } catch (const exception& ex) {
+            //a partially extracted layer shouldn't be picked up again later on
+            error_code ec;
+            fs::remove_all(staging_dir, ec);
+            throw ImageExtractionException("Failed to extract tarball for Image Layer! " + string(ex.what()));
         }
+    }
+
+    string Image::getImageLayerDir(const ImageLayer& layer)
+    {
+        string digest_clean = layer.m_image_digest.substr(layer.m_image_digest.find(":") + 1); // remove "sha256:"
+        return cache_dir + "/" + digest_clean;
+    }
 
-        cout << "Downloaded tarball of Image Layer\n";
+    LayerDownloadJob Image::getDownloadJob(const ImageLayer& layer, bool keep_tarballs) const
+    {
+        string digest_clean = layer.m_image_digest.substr(layer.m_image_digest.find(":") + 1); // remove "sha256:"
+        //the blob url is filled in by downloadLayers for the endpoint it's downloaded from
+        return { layer.m_image_digest, "", getImageLayerDir(layer),
+            tar_dir + "/" + digest_clean + ".tar", strtoull(layer.m_image_size.c_str(), nullptr, 10), keep_tarballs };
     }
 
-    void Image::extractImageLayer(const string& image_tar_path, const string& image_layer_dir) {
+    vector<LayerDownloadResult> Image::downloadLayers(vector<LayerDownloadJob> jobs, const atomic<bool>* cancelled)
+    {
+        vector<pair<Image*, LayerDownloadJob>> image_jobs;
+        for (LayerDownloadJob& job : jobs) {
+            image_jobs.emplace_back(this, move(job));
+        }
+        return downloadLayers(move(image_jobs), cancelled);
+    }
 
-        if (fs::exists(image_layer_dir)) {
-            cout << "Image Layer already extracted. Skipping.\n";
-            return;
+    vector<LayerDownloadResult> Image::downloadLayers(vector<pair<Image*, LayerDownloadJob>> jobs, const atomic<bool>* cancelled)
+    {
+        vector<LayerDownloadResult> results;
+        if (jobs.empty()) return results;
+        //images pulled together share the client and the registry configuration
+        const Image& first_image = *jobs.front().first;
+        const vector<string>& registry_urls = first_image.m_registry_urls;
+        for (size_t i = 0; i < registry_urls.size() && !jobs.empty(); i++) {
+            bool last = i + 1 == registry_urls.size();
+            string host = RegistryClient::getHost(registry_urls[i]);
+
+            //layers are downloaded concurrently, the token is shared so a refresh by one transfer is picked up by the others
+            //every image has its own token, it's scoped to the image's repository
+            auto tokenProvider = [host](Image* image) {
+                return [image, host]() { lock_guard<mutex> lock(*image->m_token_mutex); return image->m_bearer_tokens[host]; };
+            };
+            auto tokenRefresher = [host](Image* image) {
+                return [image, host](const string& header_str) { lock_guard<mutex> lock(*image->m_token_mutex); image->updateTokenIfUnauthorized(host, header_str); };
+            };
+            LayerDownloader downloader(*first_image.m_registry_client, tokenProvider(jobs.front().first), tokenRefresher(jobs.front().first),
+                LayerDownloader::getMaxConcurrentDownloads(), LayerDownloader::getSegmentsPerLayer());
+            for (auto& [image, job] : jobs) {
+                job.m_blob_url = registry_urls[i] + image->m_image_name + "/blobs/" + job.m_image_digest;
+                downloader.addJob(job, tokenProvider(image), tokenRefresher(image));
+            }
+            vector<LayerDownloadResult> attempt = downloader.run(cancelled);
+
+            //layers that failed are tried on the next endpoint, their journal lets it pick up where this one stopped
+            vector<pair<Image*, LayerDownloadJob>> failed_jobs;
+            for (size_t j = 0; j < attempt.size(); j++) {
+                if (attempt[j].m_success || last || (cancelled && *cancelled)) {
+                    results.push_back(attempt[j]);
+                } else {
+                    cerr << "Warning: " << registry_urls[i] << " couldn't serve layer " << attempt[j].m_image_digest << " (" << attempt[j].m_error
+                        << "), trying " << registry_urls[i + 1] << "\n";
+                    failed_jobs.push_back(jobs[j]);
+                }
+            }
+            jobs = move(failed_jobs);
         }
+        return results;
+    }
 
-        fs::create_directories(image_layer_dir);
-        string cmd = "tar -xf " + image_tar_path + " -C " + image_layer_dir;
-        if (system(cmd.c_str()) != 0) {
-            throw ImageExtractionException("Failed to extract tarball for Image Layer!");
+    bool Image::openLazyLayer(size_t index)
+    {
+        const ImageLayer& layer = m_image_manifest.m_image_layers[index];
+        try {
+            string digest = layer.m_image_digest;
+            m_lazy_layers[index] = make_shared<const LazyLayer>(layer,
+                [this, digest](uint64_t offset, uint64_t len) { return fetchBlobRange(digest, offset, len); });
+            return true;
+        } catch (const exception& ex) {
+            cerr << "Warning: couldn't read the table of contents of " << layer.m_image_digest << ", downloading it instead : " << ex.what() << "\n";
+            return false;
         }
-        cout << "Extracted Image Layer\n";
     }
 
     void Image::processImageLayers() {
+        string download_errors = processImageLayers({ this }).front();
+        if (!download_errors.empty()) {
+            throw ImageTarballException("Failed to download image layer(s):" + download_errors);
+        }
+        cout << "Success\n\n";
+    }
+
+    vector<string> Image::processImageLayers(const vector<Image*>& images) {
         cout << "Processing each image layer...\n";
-        fs::create_directories(tar_dir);
+        bool keep_tarballs = keepLayerTarballs();
+        fs::create_directories(tar_dir); //in-flight downloads are journaled there so they can be resumed
         fs::create_directories(cache_dir);
 
-        for (const ImageLayer& layer : m_image_manifest.m_image_layers) {
-            cout << "\nProcessing Image Layer : " << layer.m_image_digest <<"\n";
-            string blob_url = "https://registry-1.docker.io/v2/" + m_image_name + "/blobs/" + layer.m_image_digest;
+        //a layer shared by several images is only processed for the first of them, the others go by its outcome
+        map<string, pair<size_t, size_t>> owners; //digest -> image and layer index
+        map<string, string> layer_errors; //digest -> why the layer couldn't be pulled
+        //where each layer came from, for the pull reports
+        vector<vector<LayerRecord>> layer_records(images.size());
+
+        vector<pair<Image*, LayerDownloadJob>> jobs;
+        //every layer this process downloads stays locked until it's published, other processes wait for it
+        vector<unique_ptr<LayerLock>> layer_locks;
+        vector<pair<size_t, size_t>> busy_layers;
+        for (size_t image_index = 0; image_index < images.size(); image_index++) {
+            Image& image = *images[image_index];
+            const vector<ImageLayer>& layers = image.m_image_manifest.m_image_layers;
+            image.m_lazy_layers.assign(layers.size(), nullptr);
+            layer_records[image_index].resize(layers.size());
+            for (size_t i = 0; i < layers.size(); i++) {
+                const ImageLayer& layer = layers[i];
+                cout << "\nProcessing Image Layer : " << layer.m_image_digest <<"\n";
+                LayerRecord& layer_record = layer_records[image_index][i];
+                layer_record.m_digest = layer.m_image_digest;
+                layer_record.m_size = strtoull(layer.m_image_size.c_str(), nullptr, 10);
+                layer_record.m_source = "registry";
+
+                auto owner = owners.emplace(layer.m_image_digest, make_pair(image_index, i));
+                if (!owner.second) {
+                    const Image& owner_image = *images[owner.first->second.first];
+                    cout << "Image Layer is shared with " << owner_image.m_image_name << ":" << owner_image.m_image_tag << ", it's only pulled once\n";
+                    layer_record.m_source = "other image";
+                    continue;
+                }
 
-            string digest_clean = layer.m_image_digest.substr(layer.m_image_digest.find(":") + 1); // remove "sha256:"
-            string image_layer_dir = cache_dir + "/"+ digest_clean;
-            string image_tar_path = tar_dir + "/" + digest_clean + ".tar";
-            if (fs::exists(image_layer_dir)) {
-                cout << "Image Layer already extracted. Skipping.\n";
-            } else if (fs::exists(image_tar_path)) {
-	            cout << "Tarball already exists. Skipping download.\n";
-                extractImageLayer(image_tar_path, image_layer_dir);
+                //a layer that can't be pulled fails the images that need it, the other layers and images carry on
+                try {
+                    LayerDownloadJob job = image.getDownloadJob(layer, keep_tarballs);
+                    if (fs::exists(job.m_image_layer_dir)) {
+                        cout << "Image Layer already extracted. Skipping.\n";
+                        layer_record.m_source = "cache";
+                    } else if (fs::exists(job.m_image_tar_path)) {
+                        cout << "Tarball already exists. Skipping download.\n";
+                        layer_record.m_source = "tarball";
+                        LayerLock layer_lock(layer.m_image_digest);
+                        layer_lock.lock();
+                        extractImageLayer(job.m_image_tar_path, job.m_image_layer_dir, layer.m_image_digest, layer_record.m_timings);
+                    } else if (image.m_pull_policy == PullPolicy::NEVER) {
+                        throw ImageTarballException("Image Layer isn't stored locally and pulling is disabled (--pull=never) !");
+                    } else if (image.m_lazy_pull && LazyLayer::isSeekable(layer) && image.openLazyLayer(i)) {
+                        //only its table of contents was fetched, files are fetched when the container reads them
+                        cout << "Seekable Image Layer, its files will be fetched on first access\n";
+                        layer_record.m_source = "lazy";
+                    } else {
+                        auto layer_lock = make_unique<LayerLock>(layer.m_image_digest);
+                        if (!layer_lock->tryLock()) {
+                            cout << "Image Layer is being pulled by another mini-docker process, waiting for it after our own downloads\n";
+                            busy_layers.emplace_back(image_index, i);
+                        } else if (fs::exists(job.m_image_layer_dir)) {
+                            //the process that held the lock finished it just now
+                            cout << "Image Layer already extracted. Skipping.\n";
+                            layer_record.m_source = "other process";
+                        } else {
+                            jobs.emplace_back(&image, job);
+                            layer_locks.push_back(move(layer_lock));
+                        }
+                    }
+                } catch (const ImageException& ex) {
+                    layer_errors[layer.m_image_digest] = ex.what();
+                    layer_record.m_success = false;
+                    layer_record.m_error = ex.what();
+                }
+            }
+        }
+
+        //a failed layer doesn't stop the others, whatever got downloaded is still cached
+        vector<LayerDownloadResult> download_results;
+        if (!jobs.empty()) {
+            cout << "\nDownloading " << jobs.size() << " image layer(s), up to "
+                << LayerDownloader::getMaxConcurrentDownloads() << " at a time...\n";
+            download_results = downloadLayers(jobs, nullptr);
+        }
+        layer_locks.clear();
+
+        //once the other process is done with a layer it's either extracted or it gave up and this one takes over
+        jobs.clear();
+        for (auto [image_index, i] : busy_layers) {
+            Image& image = *images[image_index];
+            const ImageLayer& layer = image.m_image_manifest.m_image_layers[i];
+            auto layer_lock = make_unique<LayerLock>(layer.m_image_digest);
+            layer_lock->lock();
+            if (fs::exists(getImageLayerDir(layer))) {
+                cout << "Image Layer " << layer.m_image_digest << " was pulled by another mini-docker process\n";
+                layer_records[image_index][i].m_source = "other process";
             } else {
-                downloadImageLayer(blob_url,image_tar_path);
-                extractImageLayer(image_tar_path, image_layer_dir);
+                jobs.emplace_back(&image, image.getDownloadJob(layer, keep_tarballs));
+                layer_locks.push_back(move(layer_lock));
             }
         }
-        cout << "Success\n\n";
+        if (!jobs.empty()) {
+            cout << "\nDownloading " << jobs.size() << " image layer(s) another mini-docker process didn't finish...\n";
+            for (LayerDownloadResult& result : downloadLayers(jobs, nullptr)) {
+                download_results.push_back(move(result));
+            }
+        }
+        layer_locks.clear();
+
+        for (const LayerDownloadResult& result : download_results) {
+            auto [image_index, i] = owners[result.m_image_digest];
+            LayerRecord& layer_record = layer_records[image_index][i];
+            layer_record.m_endpoint = result.m_blob_url;
+            layer_record.m_success = result.m_success;
+            layer_record.m_error = result.m_error;
+            layer_record.m_timings = result.m_timings;
+            if (!result.m_success) {
+                layer_errors[result.m_image_digest] = result.m_error;
+            }
+        }
+
+        //an image is pulled once all of its layers are, including the ones it shares with other images
+        vector<string> download_errors(images.size());
+        RootfsImageFormat rootfs_format = RootfsImage::getFormat();
+        for (size_t image_index = 0; image_index < images.size(); image_index++) {
+            Image& image = *images[image_index];
+            const vector<ImageLayer>& layers = image.m_image_manifest.m_image_layers;
+            for (size_t i = 0; i < layers.size(); i++) {
+                LayerRecord& layer_record = layer_records[image_index][i];
+                auto error = layer_errors.find(layers[i].m_image_digest);
+                if (error != layer_errors.end()) {
+                    download_errors[image_index] += "\n\t" + error->first + " : " + error->second;
+                    layer_record.m_success = false;
+                    layer_record.m_error = error->second;
+                }
+                image.m_pull_report->addLayer(layer_record);
+            }
+
+            if (download_errors[image_index].empty()) {
+                //keeps the layers of this image at the back of the eviction queue
+                for (const ImageLayer& layer : layers) {
+                    LayerCache::recordUse(layer.m_image_digest);
+                }
+
+                //optional post-pull step, containers of the image then mount one file system image instead of assembling its layers
+                bool lazy = any_of(image.m_lazy_layers.begin(), image.m_lazy_layers.end(),
+                    [](const shared_ptr<const LazyLayer>& layer) { return layer != nullptr; });
+                if (rootfs_format != RootfsImageFormat::NONE && !lazy) {
+                    try {
+                        RootfsImage::build(layers, RootfsSnapshot::getChainIds(image.m_image_manifest), rootfs_format);
+                    } catch (const ContainerRuntimeException& ex) {
+                        cerr << "Warning: couldn't flatten " << image.m_image_name << ":" << image.m_image_tag << " : " << ex.what() << "\n";
+                    }
+                }
+            }
+        }
+        return download_errors;
     }
 
     void Image::pull()
     {
+        m_pull_report->start(m_image_name + ":" + m_image_tag, m_registry_urls);
+        try {
+            double manifest_seconds = 0;
+            {
+                ScopedTimer timer(manifest_seconds);
+                fetchManifest();
+            }
+            m_pull_report->setPhaseSeconds("manifest", manifest_seconds);
+
+            double layer_seconds = 0;
+            {
+                ScopedTimer timer(layer_seconds);
+                processImageLayers();
+            }
+            m_pull_report->setPhaseSeconds("layers", layer_seconds);
+        } catch (const exception& ex) {
+            //a failed pull is the one most worth a report
+            m_pull_report->finish(false, ex.what());
+            writePullReport();
+            throw;
+        }
+        m_pull_report->finish(true, "");
+        writePullReport();
+    }
+
+    void Image::pullAll(const vector<ImageArgs>& image_args)
+    {
+        //a reference listed twice is pulled once
+        vector<unique_ptr<Image>> owned_images;
+        vector<Image*> images;
+        set<string> references;
+        shared_ptr<RegistryClient> registry_client = make_shared<RegistryClient>();
+        for (const ImageArgs& args : image_args) {
+            if (!references.insert(args.name + ":" + args.tag).second) continue;
+            owned_images.push_back(make_unique<Image>(args, registry_client));
+            images.push_back(owned_images.back().get());
+        }
+        if (images.size() == 1) {
+            images.front()->pull();
+            return;
+        }
+
+        //all manifests are resolved before any layer is downloaded, so the layers every image needs are known up front
+        cout << "Resolving the manifests of " << images.size() << " images...\n";
+        vector<string> errors(images.size());
+        {
+            atomic<size_t> next_image(0);
+            vector<thread> threads;
+            for (size_t t = 0; t < min(images.size(), max_concurrent_resolves); t++) {
+                threads.emplace_back([&]() {
+                    for (size_t i = next_image++; i < images.size(); i = next_image++) {
+                        Image& image = *images[i];
+                        image.m_pull_report->start(image.m_image_name + ":" + image.m_image_tag, image.m_registry_urls);
+                        double manifest_seconds = 0;
+                        try {
+                            ScopedTimer timer(manifest_seconds);
+                            image.fetchManifest();
+                        } catch (const exception& ex) {
+                            errors[i] = ex.what();
+                        }
+                        image.m_pull_report->setPhaseSeconds("manifest", manifest_seconds);
+                    }
+                });
+            }
+            for (thread& worker : threads) {
+                worker.join();
+            }
+        }
+
+        //layers of every resolved image, a layer shared by several of them is downloaded for the first one only
+        vector<Image*> resolved_images;
+        vector<size_t> resolved_indexes;
+        map<string, size_t> layer_users;
+        for (size_t i = 0; i < images.size(); i++) {
+            if (!errors[i].empty()) continue;
+            resolved_images.push_back(images[i]);
+            resolved_indexes.push_back(i);
+            set<string> digests;
+            for (const ImageLayer& layer : images[i]->m_image_manifest.m_image_layers) {
+                if (digests.insert(layer.m_image_digest).second) layer_users[layer.m_image_digest]++;
+            }
+        }
+        size_t shared_layers = count_if(layer_users.begin(), layer_users.end(), [](const auto& users) { return users.second > 1; });
+        cout << "\n" << resolved_images.size() << " of " << images.size() << " image(s) resolved, " << layer_users.size()
+            << " distinct layer(s), " << shared_layers << " of them shared by several images\n";
+
+        double layer_seconds = 0;
+        vector<string> download_errors;
+        {
+            ScopedTimer timer(layer_seconds);
+            download_errors = processImageLayers(resolved_images);
+        }
+        for (size_t j = 0; j < resolved_images.size(); j++) {
+            resolved_images[j]->m_pull_report->setPhaseSeconds("layers", layer_seconds);
+            if (!download_errors[j].empty()) {
+                errors[resolved_indexes[j]] = "Failed to download image layer(s):" + download_errors[j];
+            }
+        }
+
+        string failures;
+        json batch_reports = json::array();
+        uint64_t bytes_downloaded = 0;
+        for (size_t i = 0; i < images.size(); i++) {
+            Image& image = *images[i];
+            string reference = image.m_image_name + ":" + image.m_image_tag;
+            image.m_pull_report->finish(errors[i].empty(), errors[i]);
+            json report = image.m_pull_report->toJson();
+            bytes_downloaded += report["totals"]["bytes_downloaded"].get<uint64_t>();
+            batch_reports.push_back(report);
+            if (errors[i].empty()) {
+                cout << "Pulled " << reference << "\n";
+            } else {
+                cout << "Failed to pull " << reference << "\n";
+                //the layer errors of an image are nested one level deeper
+                string error = errors[i];
+                for (size_t pos = error.find("\n\t"); pos != string::npos; pos = error.find("\n\t", pos + 3)) {
+                    error.insert(pos + 1, "\t");
+                }
+                failures += "\n\t" + reference + " : " + error;
+            }
+        }
+
+        //one report for the whole batch, the layers shared by several images are only counted for the first of them
+        const string& report_path = images.front()->m_report_path;
+        if (!report_path.empty()) {
+            json report = {
+                { "success", failures.empty() },
+                { "images", batch_reports },
+                { "distinct_layers", layer_users.size() },
+                { "shared_layers", shared_layers },
+                { "layers_seconds", layer_seconds },
+                { "bytes_downloaded", bytes_downloaded }
+            };
+            if (PullReport::writeJson(report_path, report)) {
+                cout << "Pull report written to " << report_path << "\n";
+            } else {
+                cerr << "Warning: couldn't write the pull report to " << report_path << "\n";
+            }
+        }
+
+        if (!failures.empty()) {
+            throw ImageException("Failed to pull " + to_string(count_if(errors.begin(), errors.end(), [](const string& error) { return !error.empty(); }))
+                + " of " + to_string(images.size()) + " image(s):" + failures);
+        }
+        cout << "Success\n\n";
+    }
+
+    void Image::writePullReport() const
+    {
+        if (m_report_path.empty()) return;
+        if (m_pull_report->write(m_report_path)) {
+            cout << "Pull report written to " << m_report_path << "\n";
+        } else {
+            cerr << "Warning: couldn't write the pull report to " << m_report_path << "\n";
+        }
+    }
+
+    void Image::recordResponse(FetchRecord& record, const RegistryResponse& response)
+    {
+        record.m_source = "registry";
+        record.m_url = response.m_url;
+        record.m_http_code = response.m_http_code;
+        record.m_ttfb = response.m_ttfb;
+        record.m_seconds = response.m_total_time;
+        record.m_bytes = response.m_bytes;
+        record.m_redirects = response.m_redirect_count;
+    }
+
+    void Image::save(const string& archive_path)
+    {
+        cout << "Saving " << m_image_name << ":" << m_image_tag << " to " << archive_path << "...\n";
+        //from the image store, or fetched like a pull would if it isn't stored yet
         fetchManifest();
-        processImageLayers();
+        string manifest, config;
+        if (!m_image_store.getBlob(m_manifest_digest, manifest) || !m_image_store.getBlob(m_config_digest, config)) {
+            throw ImageArchiveException("Manifest or config of " + m_image_name + ":" + m_image_tag + " isn't stored locally !");
+        }
+
+        OciArchiveWriter archive(archive_path);
+        archive.addFile("oci-layout", json({ { "imageLayoutVersion", "1.0.0" } }).dump());
+        archive.addFile(getOciBlobName(m_config_digest), config);
+        json layer_names = json::array();
+        set<string> saved_layers; //a manifest may list the same (empty) layer more than once
+        for (const ImageLayer& layer : m_image_manifest.m_image_layers) {
+            string blob_name = getOciBlobName(layer.m_image_digest);
+            if (blob_name.empty()) {
+                throw ImageArchiveException("Invalid digest of Image Layer : " + layer.m_image_digest);
+            }
+            layer_names.push_back(blob_name);
+            if (saved_layers.insert(blob_name).second) {
+                saveLayerBlob(archive, layer, blob_name);
+            }
+        }
+        archive.addFile(getOciBlobName(m_manifest_digest), manifest);
+
+        json manifest_json = json::parse(manifest);
+        bool by_digest = m_image_tag.rfind("sha256:", 0) == 0;
+        json descriptor = {
+            { "mediaType", manifest_json.value("mediaType", "application/vnd.oci.image.manifest.v1+json") },
+            { "digest", m_manifest_digest },
+            { "size", manifest.size() },
+            { "annotations", { { "io.containerd.image.name", m_image_name + (by_digest ? "@" : ":") + m_image_tag } } }
+        };
+        if (!by_digest) {
+            descriptor["annotations"]["org.opencontainers.image.ref.name"] = m_image_tag;
+        }
+        archive.addFile("index.json", json({
+            { "schemaVersion", 2 },
+            { "mediaType", "application/vnd.oci.image.index.v1+json" },
+            { "manifests", json::array({ descriptor }) } }).dump());
+        //docker load looks for its own manifest.json
+        json repo_tags = by_digest ? json::array() : json::array({ m_image_name + ":" + m_image_tag });
+        archive.addFile("manifest.json", json::array({ { { "Config", getOciBlobName(m_config_digest) }, { "RepoTags", repo_tags }, { "Layers", layer_names } } }).dump());
+        archive.commit();
+        cout << "Saved " << m_image_name << ":" << m_image_tag << "\n";
+    }
+
+    string Image::findStoredBlob(const string& digest, uint64_t size) const
+    {
+        string digest_clean = digest.substr(digest.find(":") + 1); // remove "sha256:"
+        //extracted layers can't be turned back into their blob, it's only around if serve-cache stored it or tarballs are kept
+        for (const string& path : { m_image_store.getBlobPath(digest), tar_dir + "/" + digest_clean + ".tar" }) {
+            error_code ec;
+            if (!path.empty() && fs::is_regular_file(path, ec) && fs::file_size(path, ec) == size) {
+                return path;
+            }
+        }
+        return "";
+    }
+
+    void Image::saveLayerBlob(OciArchiveWriter& archive, const ImageLayer& layer, const string& blob_name)
+    {
+        uint64_t size = strtoull(layer.m_image_size.c_str(), nullptr, 10);
+        string digest_clean = layer.m_image_digest.substr(layer.m_image_digest.find(":") + 1); // remove "sha256:"
+
+        string stored_path = findStoredBlob(layer.m_image_digest, size);
+        if (!stored_path.empty()) {
+            cout << "Adding Image Layer " << layer.m_image_digest << " from " << stored_path << "\n";
+            archive.addFileFrom(blob_name, stored_path);
+            return;
+        }
+        if (m_pull_policy == PullPolicy::NEVER) {
+            throw ImageArchiveException("Blob of Image Layer " + layer.m_image_digest + " isn't stored locally and pulling is disabled (--pull=never) !");
+        }
+
+        //straight from the registry into the archive, no temporary copy
+        cout << "Downloading Image Layer " << layer.m_image_digest << " into the archive\n";
+        Sha256 hasher;
+        uint64_t received = 0;
+        string write_error;
+        archive.beginFile(blob_name, size);
+        //blob fetching can respond with 307 Redirect responses, so redirects are followed
+        RegistryResponse response = registryFetch(m_image_name + "/blobs/" + layer.m_image_digest, {}, true, [&](const char* data, size_t len) {
+            if (received + len > size) return false;
+            try {
+                archive.write(data, len);
+            } catch (const exception& ex) {
+                write_error = ex.what();
+                return false;
+            }
+            hasher.update(data, len);
+            received += len;
+            return true;
+        });
+        if (!write_error.empty()) {
+            throw ImageArchiveException(write_error);
+        }
+        if (response.m_http_code != 200 || received != size || hasher.finalDigest() != layer.m_image_digest) {
+            throw ImageArchiveException("Couldn't download Image Layer " + layer.m_image_digest + " (HTTP " + to_string(response.m_http_code) +
+                ", " + to_string(received) + " of " + to_string(size) + " bytes) !");
+        }
+        archive.endFile();
+    }
+
+    void Image::load(const string& archive_path)
+    {
+        cout << "Loading images from " << archive_path << "...\n";
+        OciArchiveReader archive(archive_path);
+        uint64_t offset, size;
+        if (!archive.getEntry("oci-layout", offset, size)) {
+            throw ImageArchiveException(archive_path + " isn't an OCI image layout (it has no oci-layout file) !");
+        }
+        json index_json = json::parse(archive.readFile("index.json", max_archived_document_size), nullptr, false);
+        if (index_json.is_discarded() || !index_json.contains("manifests") || !index_json["manifests"].is_array()) {
+            throw ImageArchiveException("index.json of " + archive_path + " isn't a valid image index !");
+        }
+
+        //the documents go to the image store and the tags point to them, like after a pull
+        ImageStore image_store;
+        vector<ImageArgs> images;
+        for (const auto& descriptor : index_json["manifests"]) {
+            if (!descriptor.contains("digest") || !descriptor["digest"].is_string()) continue;
+            string digest = descriptor["digest"].get<string>();
+            if (!storeArchivedDocument(archive, image_store, digest)) {
+                throw ImageArchiveException("Manifest " + digest + " is missing from the archive !");
+            }
+
+            ImageArgs image_args;
+            if (!parseArchivedReference(descriptor, image_args.name, image_args.tag)) {
+                cerr << "Warning: skipping " << digest << ", the archive doesn't name its image\n";
+                continue;
+            }
+            if (image_args.name.find('/') == string::npos) {
+                image_args.name = "library/" + image_args.name;  // Default namespace, the same one pull and run use
+            }
+            if (image_args.tag.rfind("sha256:", 0) != 0) {
+                //no ETag, the next pull of the tag checks with the registry again
+                image_store.putReference(image_args.name, image_args.tag, { digest, "" });
+            }
+            //everything has to come from the archive
+            image_args.pull_policy = PullPolicy::NEVER;
+            images.push_back(image_args);
+        }
+        if (images.empty()) {
+            throw ImageArchiveException(archive_path + " has no named images !");
+        }
+
+        //an image that fails doesn't stop the others
+        auto registry_client = make_shared<RegistryClient>();
+        string errors;
+        size_t failed = 0;
+        for (const ImageArgs& image_args : images) {
+            string reference = image_args.name + ":" + image_args.tag;
+            try {
+                Image image(image_args, registry_client);
+                image.fetchManifest();
+                image.loadLayers(archive);
+                cout << "Loaded " << reference << "\n";
+            } catch (const ImageException& ex) {
+                failed++;
+                errors += "\n\t" + reference + " : " + ex.what();
+                cerr << "Failed to load " << reference << "\n";
+            }
+        }
+        if (failed > 0) {
+            throw ImageArchiveException("Failed to load " + to_string(failed) + " of " + to_string(images.size()) + " image(s):" + errors);
+        }
+        cout << "Success\n";
+    }
+
+    void Image::loadLayers(const OciArchiveReader& archive)
+    {
+        fs::create_directories(cache_dir);
+        for (const ImageLayer& layer : m_image_manifest.m_image_layers) {
+            cout << "\nLoading Image Layer : " << layer.m_image_digest << "\n";
+            string image_layer_dir = getImageLayerDir(layer);
+            string blob_name = getOciBlobName(layer.m_image_digest);
+            uint64_t offset, size;
+            if (fs::exists(image_layer_dir)) {
+                cout << "Image Layer already extracted. Skipping.\n";
+            } else if (blob_name.empty() || !archive.getEntry(blob_name, offset, size)) {
+                throw ImageArchiveException("Image Layer " + layer.m_image_digest + " is missing from the archive !");
+            } else {
+                //a pull of the same layer may be extracting it right now
+                LayerLock layer_lock(layer.m_image_digest);
+                layer_lock.lock();
+                if (fs::exists(image_layer_dir)) {
+                    cout << "Image Layer was extracted by another mini-docker process\n";
+                } else {
+                    //read right out of the archive, there is no copy of the blob in between
+                    LayerTimings timings;
+                    extractImageLayer(archive.getFd(), offset, size, image_layer_dir, layer.m_image_digest, timings);
+                    cout << "Extracted Image Layer\n";
+                }
+            }
+            LayerCache::recordUse(layer.m_image_digest);
+        }
     }
 
     ImageManifest Image::getImageManifest() const
@@ -556,4 +1392,66 @@ namespace minidocker
         return m_image_manifest;
 	}
 
+    string Image::getImageName() const
+	{
+        return m_image_name;
+	}
+
+    string Image::getImageTag() const
+	{
+        return m_image_tag;
+	}
+
+    string Image::getManifestDigest() const
+	{
+        return m_manifest_digest;
+	}
+
+    string Image::getConfigDigest() const
+	{
+        return m_config_digest;
+	}
+
+    vector<shared_ptr<const LazyLayer>> Image::getLazyLayers() const
+    {
+        return m_lazy_layers;
+    }
+
+    string Image::fetchBlobRange(const string& image_digest, uint64_t offset, uint64_t len)
+    {
+        if (len == 0) return "";
+        //blob fetching can respond with 307 Redirect responses, so redirects are followed
+        RegistryResponse response = registryFetch(m_image_name + "/blobs/" + image_digest,
+            { "Range: bytes=" + to_string(offset) + "-" + to_string(offset + len - 1) }, true);
+        if (response.m_curl_code != CURLE_OK || response.m_http_code != 206 || response.m_body.size() != len) {
+            throw ImageTarballException("Couldn't fetch bytes " + to_string(offset) + "-" + to_string(offset + len - 1) + " of " + image_digest +
+                " ! (" + string(curl_easy_strerror(response.m_curl_code)) + ", HTTP " + to_string(response.m_http_code) + ")");
+        }
+        return response.m_body;
+    }
+
+    void Image::downloadLazyLayers(const atomic<bool>& cancelled)
+    {
+        vector<LayerDownloadJob> jobs;
+        vector<unique_ptr<LayerLock>> layer_locks;
+        for (size_t i = 0; i < m_lazy_layers.size(); i++) {
+            const ImageLayer& layer = m_image_manifest.m_image_layers[i];
+            if (!m_lazy_layers[i] || fs::exists(getImageLayerDir(layer))) continue;
+            //a layer another process is already downloading is left to it, the container keeps reading through FUSE
+            auto layer_lock = make_unique<LayerLock>(layer.m_image_digest);
+            if (layer_lock->tryLock() && !fs::exists(getImageLayerDir(layer))) {
+                jobs.push_back(getDownloadJob(layer, keepLayerTarballs()));
+                layer_locks.push_back(move(layer_lock));
+            }
+        }
+        if (jobs.empty()) return;
+
+        for (const LayerDownloadResult& result : downloadLayers(jobs, &cancelled)) {
+            //a cancelled download is journaled and resumed by the next pull, nothing to report
+            if (!result.m_success && !cancelled) {
+                cerr << "Warning: background download of lazily pulled layer " << result.m_image_digest << " failed : " << result.m_error << "\n";
+            }
+        }
+    }
+
 }
\ No newline at end of file
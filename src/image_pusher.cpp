@@ -0,0 +1,307 @@
+#include "../include/minidocker/image_pusher.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include "../include/minidocker/registry_client.hpp"
+#include "../include/minidocker/sha256.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+using namespace std;
+
+namespace fs = std::filesystem;
+static const size_t default_max_concurrent_uploads = 3;
+static const uint64_t upload_chunk_size = 32 * 1024 * 1024; //a chunk that fails is all that's sent again after a token refresh
+
+namespace
+{
+	//the target goes to the configured registry unless the push names another one
+	minidocker::ImageArgs withPushRegistry(minidocker::ImageArgs target_args)
+	{
+		if (target_args.push_registry.empty()) {
+			target_args.push_registry = minidocker::Image::getRegistryUrls().back();
+		}
+		return target_args;
+	}
+
+	//"sha256:<hex>" as a query parameter
+	string escapeDigest(const string& digest)
+	{
+		string escaped;
+		for (char c : digest) {
+			escaped += c == ':' ? string("%3A") : string(1, c);
+		}
+		return escaped;
+	}
+
+	bool writeAll(int fd, const char* data, size_t len)
+	{
+		while (len > 0) {
+			ssize_t n = write(fd, data, len);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			data += n;
+			len -= static_cast<size_t>(n);
+		}
+		return true;
+	}
+
+	string describeFailure(const minidocker::RegistryResponse& response)
+	{
+		if (response.m_curl_code != CURLE_OK) return curl_easy_strerror(response.m_curl_code);
+		return "HTTP " + to_string(response.m_http_code);
+	}
+}
+
+namespace minidocker
+{
+	ImagePusher::ImagePusher(const ImageArgs& source_args, const ImageArgs& target_args)
+		: m_registry_client(make_shared<RegistryClient>()), m_source(source_args, m_registry_client),
+		m_target(withPushRegistry(target_args), m_registry_client), m_pull_policy(source_args.pull_policy)
+	{
+		m_registry_url = m_target.getRegistryUrl();
+		m_registry_host = RegistryClient::getHost(m_registry_url);
+	}
+
+	size_t ImagePusher::getMaxConcurrentUploads()
+	{
+		const char* value = getenv("MINIDOCKER_MAX_CONCURRENT_UPLOADS");
+		if (!value) {
+			return default_max_concurrent_uploads;
+		}
+
+		char* end = nullptr;
+		long parsed = strtol(value, &end, 10);
+		if (end == value || *end != '\0' || parsed <= 0) {
+			cerr << "Warning: ignoring invalid MINIDOCKER_MAX_CONCURRENT_UPLOADS value \"" << value << "\"\n";
+			return default_max_concurrent_uploads;
+		}
+		return static_cast<size_t>(parsed);
+	}
+
+	void ImagePusher::push()
+	{
+		string target = m_target.getImageName() + ":" + m_target.getImageTag();
+		cout << "Pushing " << m_source.getImageName() << ":" << m_source.getImageTag() << " to " << target << " on " << m_registry_host << "...\n";
+		//from the image store, or pulled like run would if it isn't stored
+		m_source.fetchManifest();
+
+		string config;
+		if (!m_image_store.getBlob(m_source.getConfigDigest(), config)) {
+			throw ImagePushException("Config of " + m_source.getImageName() + ":" + m_source.getImageTag() + " isn't stored locally !");
+		}
+		//the config is a blob like the layers, a layer listed twice is pushed once
+		vector<pair<string, uint64_t>> blobs = { { m_source.getConfigDigest(), config.size() } };
+		set<string> seen = { m_source.getConfigDigest() };
+		for (const ImageLayer& layer : m_source.getImageManifest().m_image_layers) {
+			if (seen.insert(layer.m_image_digest).second) {
+				blobs.emplace_back(layer.m_image_digest, strtoull(layer.m_image_size.c_str(), nullptr, 10));
+			}
+		}
+
+		//a registry takes the chunks of one blob in order, so blobs are what's uploaded in parallel
+		size_t thread_count = min(getMaxConcurrentUploads(), blobs.size());
+		cout << "Pushing " << blobs.size() << " blob(s), up to " << thread_count << " at a time...\n";
+		vector<string> errors(blobs.size());
+		atomic<size_t> next_blob(0);
+		vector<thread> threads;
+		for (size_t t = 0; t < thread_count; t++) {
+			threads.emplace_back([&]() {
+				for (size_t i = next_blob++; i < blobs.size(); i = next_blob++) {
+					try {
+						pushBlob(blobs[i].first, blobs[i].second);
+					} catch (const exception& ex) {
+						errors[i] = ex.what();
+					}
+				}
+			});
+		}
+		for (thread& t : threads) {
+			t.join();
+		}
+
+		string failures;
+		for (size_t i = 0; i < blobs.size(); i++) {
+			if (!errors[i].empty()) failures += "\n\t" + blobs[i].first + " : " + errors[i];
+		}
+		if (!failures.empty()) {
+			throw ImagePushException("Failed to push blob(s) of " + target + ":" + failures);
+		}
+
+		pushManifest();
+		cout << "Pushed " << target << " (" << m_source.getManifestDigest() << ")\n";
+	}
+
+	void ImagePusher::pushBlob(const string& digest, uint64_t size)
+	{
+		RegistryResponse response = m_target.registrySend("HEAD", m_registry_url + m_target.getImageName() + "/blobs/" + digest, {});
+		if (response.m_curl_code != CURLE_OK) {
+			throw ImagePushException("Couldn't reach " + m_registry_host + " : " + describeFailure(response));
+		}
+
+		if (response.m_http_code == 200) {
+			cout << ("Blob " + digest + " already exists, skipping\n");
+		} else {
+			string location = startUpload(digest);
+			if (location.empty()) {
+				cout << ("Mounted Blob " + digest + " from another repository\n");
+			} else {
+				uploadBlob(location, getBlobFile(digest, size), digest, size);
+				cout << ("Pushed Blob " + digest + "\n");
+			}
+		}
+		//later pushes to other repositories of this registry can mount it from this one
+		m_image_store.putPushedRepository(m_registry_host, digest, m_target.getImageName());
+	}
+
+	string ImagePusher::startUpload(const string& digest)
+	{
+		//a base layer that's already in another repository of this registry doesn't need to be uploaded again
+		string from = m_image_store.getPushedRepository(m_registry_host, digest);
+		if (from.empty() && RegistryClient::getHost(m_source.getRegistryUrl()) == m_registry_host) {
+			from = m_source.getImageName();
+		}
+
+		string url = m_registry_url + m_target.getImageName() + "/blobs/uploads/";
+		bool mount = !from.empty() && from != m_target.getImageName();
+		if (mount) {
+			url += "?mount=" + escapeDigest(digest) + "&from=" + from;
+		}
+		RegistryResponse response = m_target.registrySend("POST", url, {});
+		if (mount && response.m_http_code == 201) {
+			return "";
+		}
+		//a mount the registry can't do (blob isn't there, or no pull access to that repository) opens a session as well
+		string location = RegistryClient::getHeader(response.m_headers, "Location");
+		if (response.m_http_code != 202 || location.empty()) {
+			throw ImagePushException("Couldn't start the upload (" + describeFailure(response) + ")");
+		}
+		return resolveLocation(location, url);
+	}
+
+	void ImagePusher::uploadBlob(string location, const string& path, const string& digest, uint64_t size)
+	{
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			throw ImagePushException("Couldn't open " + path + " : " + strerror(errno));
+		}
+		uint64_t offset = 0;
+		auto readAt = [&](char* buffer, size_t len, uint64_t body_offset) -> size_t {
+			ssize_t n = pread(fd, buffer, len, static_cast<off_t>(offset + body_offset));
+			return n > 0 ? static_cast<size_t>(n) : 0;
+		};
+
+		try {
+			//every chunk but the last one is a PATCH, the registry answers with the location of the next one
+			while (size - offset > upload_chunk_size) {
+				RegistryResponse response = m_target.registrySend("PATCH", location, {
+					"Content-Type: application/octet-stream",
+					"Content-Range: " + to_string(offset) + "-" + to_string(offset + upload_chunk_size - 1) }, upload_chunk_size, readAt);
+				string next_location = RegistryClient::getHeader(response.m_headers, "Location");
+				if (response.m_http_code != 202 || next_location.empty()) {
+					throw ImagePushException("Upload failed at byte " + to_string(offset) + " (" + describeFailure(response) + ")");
+				}
+				location = resolveLocation(next_location, location);
+				offset += upload_chunk_size;
+			}
+
+			//the last chunk (a small blob as a whole) goes with the PUT that completes the upload
+			string url = location + (location.find('?') == string::npos ? "?" : "&") + "digest=" + escapeDigest(digest);
+			RegistryResponse response = m_target.registrySend("PUT", url, { "Content-Type: application/octet-stream" }, size - offset, readAt);
+			if (response.m_http_code != 201) {
+				throw ImagePushException("Registry didn't accept the upload (" + describeFailure(response) + ")");
+			}
+		} catch (...) {
+			close(fd);
+			throw;
+		}
+		close(fd);
+	}
+
+	void ImagePusher::pushManifest()
+	{
+		string manifest;
+		if (!m_image_store.getBlob(m_source.getManifestDigest(), manifest)) {
+			throw ImagePushException("Manifest of " + m_source.getImageName() + ":" + m_source.getImageTag() + " isn't stored locally !");
+		}
+		//the stored bytes are sent as they are, so the manifest keeps its digest
+		json manifest_json = json::parse(manifest);
+		string media_type = manifest_json.value("mediaType", "application/vnd.oci.image.manifest.v1+json");
+		string url = m_registry_url + m_target.getImageName() + "/manifests/" + m_target.getImageTag();
+		RegistryResponse response = m_target.registrySend("PUT", url, { "Content-Type: " + media_type }, manifest.size(),
+			[&](char* buffer, size_t len, uint64_t offset) {
+				size_t n = min<size_t>(len, manifest.size() - static_cast<size_t>(offset));
+				memcpy(buffer, manifest.data() + offset, n);
+				return n;
+			});
+		if (response.m_http_code != 201) {
+			throw ImagePushException("Registry didn't accept the manifest of " + m_target.getImageName() + ":" + m_target.getImageTag() +
+				" (" + describeFailure(response) + ") " + response.m_body);
+		}
+	}
+
+	string ImagePusher::getBlobFile(const string& digest, uint64_t size)
+	{
+		string path = m_source.findStoredBlob(digest, size);
+		if (!path.empty()) return path;
+		if (m_pull_policy == PullPolicy::NEVER) {
+			throw ImagePushException("Blob isn't stored locally and pulling is disabled (--pull=never) !");
+		}
+
+		//extracted layers can't be turned back into their blob, it's fetched once more and kept in the image store like serve-cache does
+		path = m_image_store.getBlobPath(digest);
+		if (path.empty()) {
+			throw ImagePushException("Invalid blob digest " + digest);
+		}
+		cout << ("Fetching Blob " + digest + " from " + RegistryClient::getHost(m_source.getRegistryUrl()) + "\n");
+		fs::create_directories(fs::path(path).parent_path());
+		string tmp_path = path + ".push." + to_string(getpid());
+		int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			throw ImagePushException("Couldn't create " + tmp_path + " : " + strerror(errno));
+		}
+		Sha256 hasher;
+		bool write_failed = false;
+		//blob fetching can respond with 307 Redirect responses, so redirects are followed
+		RegistryResponse response = m_source.registryFetch(m_source.getImageName() + "/blobs/" + digest, {}, true, [&](const char* data, size_t len) {
+			if (!writeAll(fd, data, len)) {
+				write_failed = true;
+				return false;
+			}
+			hasher.update(data, len);
+			return true;
+		});
+		close(fd);
+		if (response.m_http_code != 200 || write_failed || hasher.finalDigest() != digest || rename(tmp_path.c_str(), path.c_str()) != 0) {
+			unlink(tmp_path.c_str());
+			throw ImagePushException("Couldn't fetch the blob from the source registry (" +
+				(write_failed ? string("write failed") : describeFailure(response)) + ")");
+		}
+		return path;
+	}
+
+	string ImagePusher::resolveLocation(const string& location, const string& request_url)
+	{
+		//registries answer with absolute urls or paths, a path is on the host the request went to
+		if (location.rfind("http://", 0) == 0 || location.rfind("https://", 0) == 0) {
+			return location;
+		}
+		size_t host_start = request_url.find("://");
+		host_start = host_start == string::npos ? 0 : host_start + 3;
+		size_t host_end = request_url.find('/', host_start);
+		string origin = request_url.substr(0, host_end);
+		return origin + (location.empty() || location[0] != '/' ? "/" : "") + location;
+	}
+}
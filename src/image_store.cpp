@@ -0,0 +1,179 @@
+#include "../include/minidocker/image_store.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include "../include/minidocker/sha256.hpp"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+using namespace std;
+
+namespace fs = std::filesystem;
+static string store_dir = "/var/lib/minidocker/images";
+
+namespace
+{
+	//image names and tags end up in paths, they must not be able to leave the refs directory
+	bool isSafePathPart(const string& part)
+	{
+		if (part.empty() || part[0] == '/') return false;
+		stringstream ss(part);
+		string component;
+		while (getline(ss, component, '/')) {
+			if (component.empty() || component == "." || component == "..") return false;
+		}
+		return true;
+	}
+}
+
+namespace minidocker
+{
+	ImageStore::ImageStore(const string& store_dir) : m_store_dir(store_dir) {}
+
+	string ImageStore::getDefaultStoreDir()
+	{
+		return store_dir;
+	}
+
+	string ImageStore::getReferencePath(const string& image_name, const string& image_tag) const
+	{
+		if (!isSafePathPart(image_name) || !isSafePathPart(image_tag) || image_tag.find('/') != string::npos) {
+			return "";
+		}
+		return m_store_dir + "/refs/" + image_name + "/" + image_tag;
+	}
+
+	string ImageStore::getBlobPath(const string& digest) const
+	{
+		size_t pos = digest.find(':');
+		if (pos == string::npos || !isSafePathPart(digest.substr(0, pos)) || !isSafePathPart(digest.substr(pos + 1))) {
+			return "";
+		}
+		return m_store_dir + "/blobs/" + digest.substr(0, pos) + "/" + digest.substr(pos + 1);
+	}
+
+	string ImageStore::getPushedPath(const string& registry_host, const string& digest) const
+	{
+		string blob_path = getBlobPath(digest);
+		if (blob_path.empty() || !isSafePathPart(registry_host) || registry_host.find('/') != string::npos) {
+			return "";
+		}
+		return m_store_dir + "/pushed/" + registry_host + blob_path.substr(m_store_dir.size() + 6);
+	}
+
+	void ImageStore::writeFileAtomically(const string& path, const string& content)
+	{
+		fs::create_directories(fs::path(path).parent_path());
+		//concurrent pulls of the same image may write the same file, each one renames its own copy into place
+		//threads of one process do too (serve-cache requests, several images resolved at once), the name has to differ per thread
+		string tmp_path = path + ".tmp." + to_string(getpid()) + "." + to_string(hash<thread::id>()(this_thread::get_id()));
+		{
+			ofstream ofs(tmp_path, ios::binary | ios::trunc);
+			ofs.write(content.data(), content.size());
+			if (!ofs) {
+				error_code ec;
+				fs::remove(tmp_path, ec);
+				throw ImageException("Couldn't write " + path + " to the image store!");
+			}
+		}
+		error_code ec;
+		fs::rename(tmp_path, path, ec);
+		if (ec) {
+			error_code remove_ec;
+			fs::remove(tmp_path, remove_ec);
+			//whoever won the race put the same content (or a newer reference) in place
+			if (!fs::exists(path, remove_ec)) {
+				throw ImageException("Couldn't write " + path + " to the image store! (" + ec.message() + ")");
+			}
+		}
+	}
+
+	bool ImageStore::getReference(const string& image_name, const string& image_tag, StoredReference& reference) const
+	{
+		string path = getReferencePath(image_name, image_tag);
+		if (path.empty()) return false;
+
+		ifstream ifs(path);
+		if (!ifs) return false;
+		json reference_json = json::parse(ifs, nullptr, false);
+		if (reference_json.is_discarded() || !reference_json.contains("digest") || !reference_json["digest"].is_string()) {
+			return false;
+		}
+		reference.m_digest = reference_json["digest"].get<string>();
+		reference.m_etag = reference_json.value("etag", "");
+		return true;
+	}
+
+	void ImageStore::putReference(const string& image_name, const string& image_tag, const StoredReference& reference)
+	{
+		string path = getReferencePath(image_name, image_tag);
+		if (path.empty()) return;
+		json reference_json = { { "digest", reference.m_digest }, { "etag", reference.m_etag } };
+		writeFileAtomically(path, reference_json.dump());
+	}
+
+	vector<string> ImageStore::getReferencedDigests() const
+	{
+		vector<string> digests;
+		error_code ec;
+		for (fs::recursive_directory_iterator it(m_store_dir + "/refs", ec), end; !ec && it != end; it.increment(ec)) {
+			//temporary copies of a reference that is being written are skipped
+			if (!it->is_regular_file() || it->path().filename().string().find(".tmp.") != string::npos) continue;
+			ifstream ifs(it->path());
+			json reference_json = json::parse(ifs, nullptr, false);
+			if (!reference_json.is_discarded() && reference_json.contains("digest") && reference_json["digest"].is_string()) {
+				digests.push_back(reference_json["digest"].get<string>());
+			}
+		}
+		return digests;
+	}
+
+	bool ImageStore::getBlob(const string& digest, string& content) const
+	{
+		string path = getBlobPath(digest);
+		if (path.empty()) return false;
+
+		ifstream ifs(path, ios::binary);
+		if (!ifs) return false;
+		stringstream buffer;
+		buffer << ifs.rdbuf();
+
+		//a document that was damaged on disk is treated as not stored, it gets fetched again
+		if (digest.rfind("sha256:", 0) == 0 && Sha256::digestOf(buffer.str()) != digest) {
+			return false;
+		}
+		content = buffer.str();
+		return true;
+	}
+
+	string ImageStore::getPushedRepository(const string& registry_host, const string& digest) const
+	{
+		string path = getPushedPath(registry_host, digest);
+		if (path.empty()) return "";
+		ifstream ifs(path);
+		string repository;
+		getline(ifs, repository);
+		return repository;
+	}
+
+	void ImageStore::putPushedRepository(const string& registry_host, const string& digest, const string& repository)
+	{
+		string path = getPushedPath(registry_host, digest);
+		if (path.empty()) return;
+		writeFileAtomically(path, repository);
+	}
+
+	string ImageStore::putBlob(const string& content)
+	{
+		string digest = Sha256::digestOf(content);
+		string path = getBlobPath(digest);
+		if (!fs::exists(path)) {
+			writeFileAtomically(path, content);
+		}
+		return digest;
+	}
+}
@@ -0,0 +1,364 @@
+#include "../include/minidocker/layer_cache.hpp"
+#include "../include/minidocker/background_task.hpp"
+#include "../include/minidocker/container_reaper.hpp"
+#include "../include/minidocker/content_store.hpp"
+#include "../include/minidocker/image_store.hpp"
+#include "../include/minidocker/layer_lock.hpp"
+#include "../include/minidocker/rootfs_image.hpp"
+#include "../include/minidocker/rootfs_snapshot.hpp"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+using namespace std;
+
+namespace fs = std::filesystem;
+static string cache_dir = "/var/lib/minidocker/layers";
+static string tar_dir = "/tmp/minidocker";
+static string usage_dir = "/var/lib/minidocker/layer-usage";
+static const time_t abandoned_journal_age = 7 * 24 * 60 * 60; //an interrupted download nobody resumed for a week is dropped
+static const int background_eviction_pause_ms = 100; //between two layers, so containers get the disk most of the time
+
+namespace
+{
+	bool isLayerDirName(const string& name)
+	{
+		return name.size() == 64 && all_of(name.begin(), name.end(), [](unsigned char c) { return isxdigit(c); });
+	}
+
+	string formatSize(uint64_t size)
+	{
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%.1f MiB", static_cast<double>(size) / (1024 * 1024));
+		return buffer;
+	}
+
+	time_t getModificationTime(const string& path)
+	{
+		struct stat st;
+		return lstat(path.c_str(), &st) == 0 ? st.st_mtime : 0;
+	}
+}
+
+namespace minidocker
+{
+	string LayerCache::getUsagePath(const string& image_digest)
+	{
+		string digest_clean = image_digest.substr(image_digest.find(":") + 1); // remove "sha256:"
+		return usage_dir + "/" + digest_clean;
+	}
+
+	uint64_t LayerCache::getDiskUsage(const string& path)
+	{
+		//like du : allocated blocks, hardlinked files counted once
+		uint64_t usage = 0;
+		set<pair<dev_t, ino_t>> seen_inodes;
+		struct stat st;
+		if (lstat(path.c_str(), &st) == 0) usage += static_cast<uint64_t>(st.st_blocks) * 512;
+
+		error_code ec;
+		for (fs::recursive_directory_iterator it(path, fs::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec)) {
+			if (lstat(it->path().c_str(), &st) != 0) continue;
+			if (st.st_nlink > 1 && !S_ISDIR(st.st_mode) && !seen_inodes.insert({ st.st_dev, st.st_ino }).second) continue;
+			usage += static_cast<uint64_t>(st.st_blocks) * 512;
+		}
+		return usage;
+	}
+
+	uint64_t LayerCache::readUsageRecord(const string& image_digest, const string& image_layer_dir)
+	{
+		string usage_path = getUsagePath(image_digest);
+		ifstream ifs(usage_path);
+		uint64_t size = 0;
+		if (ifs >> size) return size;
+
+		//layers extracted before usage was tracked are measured once, as last used when they were extracted
+		size = getDiskUsage(image_layer_dir);
+		error_code ec;
+		fs::create_directories(usage_dir, ec);
+		string tmp_path = usage_path + ".tmp." + to_string(getpid());
+		{
+			ofstream ofs(tmp_path, ios::trunc);
+			ofs << size;
+		}
+		fs::last_write_time(tmp_path, fs::last_write_time(image_layer_dir, ec), ec);
+		fs::rename(tmp_path, usage_path, ec);
+		if (ec) fs::remove(tmp_path, ec);
+		return size;
+	}
+
+	void LayerCache::recordUse(const string& image_digest)
+	{
+		string digest_clean = image_digest.substr(image_digest.find(":") + 1); // remove "sha256:"
+		string image_layer_dir = cache_dir + "/" + digest_clean;
+		if (!fs::exists(image_layer_dir)) return;
+
+		readUsageRecord(image_digest, image_layer_dir);
+		error_code ec;
+		fs::last_write_time(getUsagePath(image_digest), fs::file_time_type::clock::now(), ec);
+	}
+
+	set<string> LayerCache::getReferencedLayers(set<string>* referenced_manifests)
+	{
+		//tag -> manifest (or index -> stored platform manifests) -> layers
+		ImageStore image_store;
+		set<string> layers;
+		vector<string> manifest_digests = image_store.getReferencedDigests();
+		for (size_t i = 0; i < manifest_digests.size(); i++) {
+			if (referenced_manifests) referenced_manifests->insert(manifest_digests[i]);
+			string content;
+			if (!image_store.getBlob(manifest_digests[i], content)) continue;
+			json manifest_json = json::parse(content, nullptr, false);
+			if (manifest_json.is_discarded() || !manifest_json.is_object()) continue;
+
+			if (manifest_json.contains("manifests") && manifest_json["manifests"].is_array()) {
+				for (const auto& manifest : manifest_json["manifests"]) {
+					if (manifest.contains("digest") && manifest["digest"].is_string()) {
+						manifest_digests.push_back(manifest["digest"].get<string>());
+					}
+				}
+			}
+			if (manifest_json.contains("layers") && manifest_json["layers"].is_array()) {
+				for (const auto& layer : manifest_json["layers"]) {
+					if (layer.contains("digest") && layer["digest"].is_string()) {
+						layers.insert(layer["digest"].get<string>());
+					}
+				}
+			}
+		}
+		return layers;
+	}
+
+	vector<CachedLayer> LayerCache::listLayers()
+	{
+		set<string> referenced_layers = getReferencedLayers();
+		vector<CachedLayer> layers;
+		error_code ec;
+		for (fs::directory_iterator it(cache_dir, ec), end; !ec && it != end; it.increment(ec)) {
+			string name = it->path().filename().string();
+			if (!isLayerDirName(name) || !it->is_directory()) continue;
+
+			CachedLayer layer;
+			layer.m_digest = "sha256:" + name;
+			layer.m_size = readUsageRecord(layer.m_digest, it->path().string());
+			layer.m_last_used = getModificationTime(getUsagePath(layer.m_digest));
+			layer.m_referenced = referenced_layers.count(layer.m_digest) > 0;
+			layers.push_back(layer);
+		}
+		return layers;
+	}
+
+	bool LayerCache::evictLayer(const CachedLayer& layer)
+	{
+		//held by a running container (shared) or a pull (exclusive)
+		LayerLock layer_lock(layer.m_digest);
+		if (!layer_lock.tryLock()) return false;
+
+		string digest_clean = layer.m_digest.substr(layer.m_digest.find(":") + 1); // remove "sha256:"
+		string image_layer_dir = cache_dir + "/" + digest_clean;
+		string trash_dir = image_layer_dir + ".deleting";
+		error_code ec;
+		fs::remove_all(trash_dir, ec);
+		//the rename makes the layer disappear at once, the slow part happens outside the lock
+		fs::rename(image_layer_dir, trash_dir, ec);
+		if (ec) return false;
+		fs::remove(getUsagePath(layer.m_digest), ec);
+		fs::remove(tar_dir + "/" + digest_clean + ".tar", ec);
+		fs::remove(tar_dir + "/" + digest_clean + ".tar.partial", ec);
+		fs::remove(tar_dir + "/" + digest_clean + ".tar.partial.json", ec);
+		layer_lock.unlock();
+
+		fs::remove_all(trash_dir, ec);
+		return true;
+	}
+
+	uint64_t LayerCache::removeLeftovers()
+	{
+		uint64_t freed = 0;
+		error_code ec;
+
+		//layers whose eviction was interrupted, and staging dirs of pulls that died
+		for (fs::directory_iterator it(cache_dir, ec), end; !ec && it != end; it.increment(ec)) {
+			string name = it->path().filename().string();
+			size_t dot = name.find('.');
+			if (dot == string::npos || !isLayerDirName(name.substr(0, dot))) continue;
+			string suffix = name.substr(dot);
+			if (suffix != ".deleting" && suffix != ".extracting") continue;
+
+			LayerLock layer_lock("sha256:" + name.substr(0, dot));
+			if (suffix == ".extracting" && !layer_lock.tryLock()) continue;
+			freed += getDiskUsage(it->path().string());
+			error_code remove_ec;
+			fs::remove_all(it->path(), remove_ec);
+		}
+
+		//tarballs of extracted layers, and journals of downloads that are done or were given up on
+		time_t now = time(nullptr);
+		for (fs::directory_iterator it(tar_dir, ec), end; !ec && it != end; it.increment(ec)) {
+			string name = it->path().filename().string();
+			size_t dot = name.find('.');
+			if (dot == string::npos || !isLayerDirName(name.substr(0, dot)) || !it->is_regular_file()) continue;
+			string digest_clean = name.substr(0, dot);
+			bool extracted = fs::exists(cache_dir + "/" + digest_clean);
+			bool is_journal = name.find(".partial") != string::npos;
+
+			LayerLock layer_lock("sha256:" + digest_clean);
+			if (!layer_lock.tryLock()) continue;
+			//a finished download that wasn't extracted yet is kept, the next pull extracts it
+			if (!extracted && (!is_journal || now - getModificationTime(it->path().string()) < abandoned_journal_age)) continue;
+			freed += getDiskUsage(it->path().string());
+			error_code remove_ec;
+			fs::remove(it->path(), remove_ec);
+		}
+
+		//usage records of layers that are gone
+		for (fs::directory_iterator it(usage_dir, ec), end; !ec && it != end; it.increment(ec)) {
+			string name = it->path().filename().string();
+			if (!fs::exists(cache_dir + "/" + name.substr(0, name.find('.')))) {
+				error_code remove_ec;
+				fs::remove(it->path(), remove_ec);
+			}
+		}
+		return freed;
+	}
+
+	void LayerCache::prune(const PruneArgs& prune_args)
+	{
+		uint64_t budget = prune_args.budget_set ? prune_args.budget : getBudget();
+		bool background = prune_args.background;
+
+		//one collector at a time, a background one just leaves if another is already at it
+		LayerLock gc_lock("gc");
+		if (background) {
+			if (!gc_lock.tryLock()) return;
+			BackgroundTask::lowerPriority();
+		} else {
+			cout << "Pruning the layer cache...\n";
+			gc_lock.lock();
+		}
+
+		uint64_t freed = removeLeftovers();
+		if (!background) {
+			//container dirs whose reaper died with them
+			size_t reaped = ContainerReaper::reap(false);
+			if (reaped > 0) cout << "Deleted " << reaped << " container dir(s) left in the trash\n";
+		}
+		vector<CachedLayer> layers = listLayers();
+		uint64_t total = 0;
+		for (const CachedLayer& layer : layers) {
+			total += layer.m_size;
+		}
+
+		//layers no tag refers to go first, then the least recently used ones
+		sort(layers.begin(), layers.end(), [](const CachedLayer& a, const CachedLayer& b) {
+			if (a.m_referenced != b.m_referenced) return !a.m_referenced;
+			return a.m_last_used < b.m_last_used;
+		});
+
+		size_t evicted = 0;
+		for (const CachedLayer& layer : layers) {
+			bool over_budget = budget > 0 && total > budget;
+			//a background prune only makes room, an explicit one also drops the layers no image needs anymore
+			if (!over_budget && (background || layer.m_referenced)) break;
+			if (!evictLayer(layer)) continue;
+
+			total -= layer.m_size;
+			freed += layer.m_size;
+			evicted++;
+			if (background) {
+				this_thread::sleep_for(chrono::milliseconds(background_eviction_pause_ms));
+			} else {
+				cout << "Removed Image Layer " << layer.m_digest << " (" << formatSize(layer.m_size) << ")\n";
+			}
+		}
+		//files the evicted layers shared with the remaining ones stay, the rest of the content store goes with them
+		freed += ContentStore::prune(abandoned_journal_age);
+		if (background) return;
+
+		//flattened images and rootfs snapshots don't need their layers anymore, they go with the last image that has their layers
+		set<string> referenced_manifests;
+		getReferencedLayers(&referenced_manifests);
+		set<string> referenced_chain_ids = RootfsSnapshot::getReferencedChainIds(referenced_manifests);
+		freed += RootfsImage::prune(referenced_chain_ids);
+		freed += RootfsSnapshot::prune(referenced_chain_ids);
+
+		cout << "Removed " << evicted << " image layer(s) and freed " << formatSize(freed) << ", the layer cache now takes " << formatSize(total);
+		if (budget > 0) cout << " of its " << formatSize(budget) << " budget";
+		cout << "\n";
+		if (budget > 0 && total > budget) {
+			cerr << "Warning: the layer cache is still over budget, the remaining layers are in use\n";
+		}
+	}
+
+	void LayerCache::startBackgroundEviction()
+	{
+		uint64_t budget = getBudget();
+		if (budget == 0) return;
+
+		//the usage records keep this cheap, no layer has to be walked
+		uint64_t total = 0;
+		error_code ec;
+		for (fs::directory_iterator it(cache_dir, ec), end; !ec && it != end; it.increment(ec)) {
+			string name = it->path().filename().string();
+			if (isLayerDirName(name)) total += readUsageRecord("sha256:" + name, it->path().string());
+		}
+		if (total <= budget) return;
+
+		//a fresh process instead of a thread, it outlives a pull and doesn't share anything with a running container
+		if (!BackgroundTask::start({ "images", "prune", "--background" })) {
+			cerr << "Warning: couldn't start evicting layers in the background, the layer cache is over budget\n";
+			return;
+		}
+		cout << "Layer cache is over its " << formatSize(budget) << " budget (" << formatSize(total) << "), evicting layers in the background\n";
+	}
+
+	uint64_t LayerCache::getBudget()
+	{
+		const char* value = getenv("MINIDOCKER_LAYER_CACHE_BUDGET");
+		if (!value || *value == '\0') {
+			return 0;
+		}
+
+		uint64_t budget = 0;
+		if (!parseSize(value, budget)) {
+			cerr << "Warning: ignoring invalid MINIDOCKER_LAYER_CACHE_BUDGET value \"" << value << "\"\n";
+			return 0;
+		}
+		return budget;
+	}
+
+	bool LayerCache::parseSize(const string& value, uint64_t& size)
+	{
+		char* end = nullptr;
+		unsigned long long parsed = strtoull(value.c_str(), &end, 10);
+		if (end == value.c_str() || !isdigit(static_cast<unsigned char>(value[0]))) return false;
+
+		string unit = end;
+		transform(unit.begin(), unit.end(), unit.begin(), [](unsigned char c) { return toupper(c); });
+		uint64_t multiplier = 1;
+		if (unit == "" || unit == "B") multiplier = 1;
+		else if (unit == "K" || unit == "KB" || unit == "KIB") multiplier = 1ULL << 10;
+		else if (unit == "M" || unit == "MB" || unit == "MIB") multiplier = 1ULL << 20;
+		else if (unit == "G" || unit == "GB" || unit == "GIB") multiplier = 1ULL << 30;
+		else if (unit == "T" || unit == "TB" || unit == "TIB") multiplier = 1ULL << 40;
+		else return false;
+
+		if (parsed > UINT64_MAX / multiplier) return false;
+		size = parsed * multiplier;
+		return true;
+	}
+}
@@ -0,0 +1,865 @@
+#include "../include/minidocker/layer_downloader.hpp"
+#include "../include/minidocker/layer_extractor.hpp"
+#include "../include/minidocker/pull_report.hpp"
+#include "../include/minidocker/registry_client.hpp"
+#include "../include/minidocker/sha256.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include <curl/curl.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+using namespace std;
+
+namespace fs = std::filesystem;
+static const size_t default_max_concurrent_downloads = 3; //same default as docker's max-concurrent-downloads
+static const size_t default_segments_per_layer = 4;
+static const uint64_t resume_checkpoint_interval = 8 * 1024 * 1024; //how often the sidecar of a .partial file is updated
+static const uint64_t segmented_download_threshold = 64 * 1024 * 1024; //smaller blobs aren't worth the extra connections
+static const uint64_t min_segment_size = 16 * 1024 * 1024;
+static const int max_segment_retries = 3;
+
+namespace
+{
+	struct Transfer;
+
+	//A byte range [m_start, m_end) of a large blob, fetched on its own connection and written into the .partial file at its offset
+	struct Segment
+	{
+		Transfer* m_transfer = nullptr;
+		CURL* m_curl = nullptr;
+		struct curl_slist* m_headers = nullptr;
+		uint64_t m_start = 0;
+		uint64_t m_end = 0;
+		uint64_t m_received = 0;
+		bool m_done = false;
+		bool m_body_started = false;
+		bool m_range_ignored = false;
+		int m_retries = 0;
+		std::string m_write_error;
+		std::string m_auth_header;
+	};
+
+	//State of one in-flight job, it lives until the job succeeded or failed
+	//m_curl downloads the blob from m_resume_from, up to m_split_end when the rest is fetched by m_segments
+	struct Transfer
+	{
+		size_t m_job_index = 0;
+		const minidocker::LayerDownloadJob* m_job = nullptr;
+		CURL* m_curl = nullptr;
+		struct curl_slist* m_headers = nullptr;
+		std::unique_ptr<minidocker::LayerExtractor> m_extractor;
+		minidocker::Sha256 m_hasher;
+		int m_partial_fd = -1;
+		uint64_t m_resume_from = 0;
+		uint64_t m_unsaved_bytes = 0;
+		bool m_body_started = false;
+		bool m_range_ignored = false;
+		bool m_restarted_from_scratch = false;
+		std::string m_write_error;
+		std::string m_header_str;
+		std::string m_auth_header;
+		std::string m_token_used;
+		bool m_retried_after_unauthorized = false;
+
+		uint64_t m_split_end = 0; //0 if the blob is downloaded as a single stream
+		bool m_split_disabled = false; //set once the server turned out not to honor ranges
+		bool m_start_segments = false; //the first range was accepted, the other ones can be requested
+		bool m_draining = false; //m_curl is done, only segments are left
+		std::string m_segment_url; //where the first range was served from, after redirects
+		std::vector<std::unique_ptr<Segment>> m_segments;
+
+		minidocker::LayerTimings* m_timings = nullptr; //of the job's result
+		std::chrono::steady_clock::time_point m_started;
+		bool m_first_byte_seen = false;
+	};
+
+	std::string getPartialPath(const minidocker::LayerDownloadJob& job)
+	{
+		return job.m_image_tar_path + ".partial";
+	}
+
+	std::string getSidecarPath(const minidocker::LayerDownloadJob& job)
+	{
+		return getPartialPath(job) + ".json";
+	}
+
+	void discardPartial(const minidocker::LayerDownloadJob& job)
+	{
+		std::error_code ec;
+		fs::remove(getPartialPath(job), ec);
+		fs::remove(getSidecarPath(job), ec);
+	}
+
+	bool writeAt(int fd, const char* data, size_t size, uint64_t offset)
+	{
+		while (size > 0) {
+			ssize_t written = pwrite(fd, data, size, static_cast<off_t>(offset));
+			if (written < 0) {
+				if (errno == EINTR) continue;
+				return false;
+			}
+			data += written;
+			size -= static_cast<size_t>(written);
+			offset += static_cast<uint64_t>(written);
+		}
+		return true;
+	}
+
+	//records how many bytes of the .partial file can be trusted on the next run
+	//only the hashed prefix counts, segments further ahead are fetched again
+	void saveResumePoint(Transfer& transfer)
+	{
+		if (transfer.m_partial_fd < 0) return;
+
+		json sidecar = {
+			{ "digest", transfer.m_job->m_image_digest },
+			{ "size", transfer.m_job->m_image_size },
+			{ "bytes", transfer.m_hasher.getBytesHashed() }
+		};
+		std::string sidecar_path = getSidecarPath(*transfer.m_job);
+		std::string tmp_path = sidecar_path + ".tmp";
+		{
+			std::ofstream ofs(tmp_path, std::ios::trunc);
+			ofs << sidecar.dump();
+			if (!ofs) return;
+		}
+		std::error_code ec;
+		fs::rename(tmp_path, sidecar_path, ec);
+		transfer.m_unsaved_bytes = 0;
+	}
+
+	//returns the offset a previous, interrupted download of the same blob can be resumed from
+	uint64_t loadResumePoint(const minidocker::LayerDownloadJob& job)
+	{
+		std::error_code ec;
+		uint64_t partial_size = fs::file_size(getPartialPath(job), ec);
+		if (ec) return 0;
+
+		std::ifstream ifs(getSidecarPath(job));
+		if (!ifs) return 0;
+		json sidecar = json::parse(ifs, nullptr, false);
+		if (sidecar.is_discarded() || !sidecar.contains("digest") || !sidecar.contains("bytes") ||
+			sidecar["digest"] != job.m_image_digest || !sidecar["bytes"].is_number_unsigned()) {
+			return 0;
+		}
+
+		uint64_t resume_from = std::min(sidecar["bytes"].get<uint64_t>(), partial_size);
+		//a range starting at the very end would come back empty, always leave at least one byte to fetch
+		if (job.m_image_size > 0 && resume_from >= job.m_image_size) {
+			resume_from = job.m_image_size - 1;
+		}
+		return resume_from;
+	}
+
+	size_t writeHeaderCallback(char* ptr, size_t size, size_t nmemb, void* userdata)
+	{
+		std::string* header_str = static_cast<std::string*>(userdata);
+		header_str->append(ptr, size * nmemb);
+		return size * nmemb;
+	}
+
+	//the extractor is gone once the transfer is released, what it did is kept for the pull report
+	void recordExtraction(Transfer& transfer)
+	{
+		if (!transfer.m_extractor) return;
+		transfer.m_timings->m_uncompressed_bytes = transfer.m_extractor->getUncompressedBytes();
+		transfer.m_timings->m_compression = transfer.m_extractor->getCompressionName();
+		transfer.m_timings->m_deduped_bytes = transfer.m_extractor->getDedupedBytes();
+	}
+
+	size_t writeLayerCallback(char* ptr, size_t size, size_t nmemb, void* userdata)
+	{
+		Transfer* transfer = static_cast<Transfer*>(userdata);
+		size_t total = size * nmemb;
+		transfer->m_timings->m_bytes_downloaded += total;
+		//exceptions must not cross curl, the error is kept and returning a different count makes curl abort this transfer only
+		try {
+			if (!transfer->m_body_started) {
+				transfer->m_body_started = true;
+				if (!transfer->m_first_byte_seen) {
+					transfer->m_first_byte_seen = true;
+					transfer->m_timings->m_ttfb = std::chrono::duration<double>(std::chrono::steady_clock::now() - transfer->m_started).count();
+				}
+				long http_code = 0;
+				curl_easy_getinfo(transfer->m_curl, CURLINFO_RESPONSE_CODE, &http_code);
+				if (http_code != 206 && transfer->m_resume_from > 0) {
+					//the server sent the whole blob instead of the requested range
+					transfer->m_range_ignored = true;
+					return 0;
+				}
+				if (transfer->m_split_end > 0) {
+					if (http_code == 206) {
+						char* effective_url = nullptr;
+						curl_easy_getinfo(transfer->m_curl, CURLINFO_EFFECTIVE_URL, &effective_url);
+						transfer->m_segment_url = effective_url ? effective_url : transfer->m_job->m_blob_url;
+						transfer->m_start_segments = true;
+					} else {
+						//no range support, the whole blob simply comes over this one connection
+						transfer->m_split_end = 0;
+						transfer->m_split_disabled = true;
+					}
+				}
+			}
+
+			uint64_t offset = transfer->m_hasher.getBytesHashed();
+			uint64_t limit = transfer->m_split_end > 0 ? transfer->m_split_end : transfer->m_job->m_image_size;
+			if (limit > 0 && offset + total > limit) {
+				transfer->m_write_error = "Layer is larger than the size announced in the manifest!";
+				return 0;
+			}
+
+			if (!writeAt(transfer->m_partial_fd, ptr, total, offset)) {
+				transfer->m_write_error = "Failed to write tarball file!";
+				return 0;
+			}
+			{
+				//hashing happens on the same buffer the extractor gets, no extra pass over the data
+				minidocker::ScopedTimer timer(transfer->m_timings->m_extract_seconds);
+				transfer->m_hasher.update(ptr, total);
+				transfer->m_unsaved_bytes += total;
+
+				transfer->m_extractor->write(ptr, total);
+			}
+
+			if (transfer->m_unsaved_bytes >= resume_checkpoint_interval) {
+				saveResumePoint(*transfer);
+			}
+		} catch (const std::exception& ex) {
+			transfer->m_write_error = ex.what();
+			return 0;
+		} catch (...) {
+			transfer->m_write_error = "Failed to extract image layer!";
+			return 0;
+		}
+		return total;
+	}
+
+	//segments only land in the file, they are hashed and extracted once everything before them arrived
+	size_t writeSegmentCallback(char* ptr, size_t size, size_t nmemb, void* userdata)
+	{
+		Segment* segment = static_cast<Segment*>(userdata);
+		size_t total = size * nmemb;
+		segment->m_transfer->m_timings->m_bytes_downloaded += total;
+		if (!segment->m_body_started) {
+			segment->m_body_started = true;
+			long http_code = 0;
+			curl_easy_getinfo(segment->m_curl, CURLINFO_RESPONSE_CODE, &http_code);
+			if (http_code != 206) {
+				segment->m_range_ignored = true;
+				return 0;
+			}
+		}
+
+		uint64_t offset = segment->m_start + segment->m_received;
+		if (offset + total > segment->m_end) {
+			segment->m_write_error = "Registry sent more than the requested range of the layer!";
+			return 0;
+		}
+		if (!writeAt(segment->m_transfer->m_partial_fd, ptr, total, offset)) {
+			segment->m_write_error = "Failed to write tarball file!";
+			return 0;
+		}
+		segment->m_received += total;
+		return total;
+	}
+}
+
+namespace minidocker
+{
+	LayerDownloader::LayerDownloader(RegistryClient& registry_client, TokenProvider token_provider, TokenRefresher token_refresher,
+		size_t max_concurrent_downloads, size_t segments_per_layer)
+		: m_registry_client(registry_client), m_token_provider(move(token_provider)), m_token_refresher(move(token_refresher)),
+		m_max_concurrent_downloads(max_concurrent_downloads == 0 ? 1 : max_concurrent_downloads),
+		m_segments_per_layer(segments_per_layer == 0 ? 1 : segments_per_layer)
+	{
+	}
+
+	size_t LayerDownloader::getMaxConcurrentDownloads()
+	{
+		const char* value = getenv("MINIDOCKER_MAX_CONCURRENT_DOWNLOADS");
+		if (!value) {
+			return default_max_concurrent_downloads;
+		}
+
+		char* end = nullptr;
+		long parsed = strtol(value, &end, 10);
+		if (end == value || *end != '\0' || parsed <= 0) {
+			cerr << "Warning: ignoring invalid MINIDOCKER_MAX_CONCURRENT_DOWNLOADS value \"" << value << "\"\n";
+			return default_max_concurrent_downloads;
+		}
+		return static_cast<size_t>(parsed);
+	}
+
+	size_t LayerDownloader::getSegmentsPerLayer()
+	{
+		const char* value = getenv("MINIDOCKER_DOWNLOAD_SEGMENTS");
+		if (!value) {
+			return default_segments_per_layer;
+		}
+
+		char* end = nullptr;
+		long parsed = strtol(value, &end, 10);
+		if (end == value || *end != '\0' || parsed <= 0) {
+			cerr << "Warning: ignoring invalid MINIDOCKER_DOWNLOAD_SEGMENTS value \"" << value << "\"\n";
+			return default_segments_per_layer;
+		}
+		return static_cast<size_t>(parsed);
+	}
+
+	string LayerDownloader::getStagingDir(const string& image_layer_dir)
+	{
+		return image_layer_dir + ".extracting";
+	}
+
+	void LayerDownloader::addJob(const LayerDownloadJob& job)
+	{
+		addJob(job, m_token_provider, m_token_refresher);
+	}
+
+	void LayerDownloader::addJob(const LayerDownloadJob& job, TokenProvider token_provider, TokenRefresher token_refresher)
+	{
+		m_jobs.push_back(job);
+		m_job_tokens.emplace_back(move(token_provider), move(token_refresher));
+	}
+
+	void LayerDownloader::verifyDownloadedLayer(const LayerDownloadJob& job, Sha256& hasher)
+	{
+		uint64_t received = hasher.getBytesHashed();
+		if (job.m_image_size > 0 && received != job.m_image_size) {
+			throw ImageTarballException("Layer is truncated, received " + to_string(received) + " of " + to_string(job.m_image_size) + " bytes!");
+		}
+		if (job.m_image_digest.rfind("sha256:", 0) != 0) {
+			cerr << "Warning: can't verify layer with unsupported digest algorithm : " << job.m_image_digest << "\n";
+			return;
+		}
+		string actual_digest = hasher.finalDigest();
+		if (actual_digest != job.m_image_digest) {
+			throw ImageTarballException("Digest mismatch, got " + actual_digest + " !");
+		}
+	}
+
+	void LayerDownloader::publishLayer(const LayerDownloadJob& job)
+	{
+		string staging_dir = getStagingDir(job.m_image_layer_dir);
+		if (fs::exists(job.m_image_layer_dir)) {
+			//someone else extracted the same layer meanwhile
+			fs::remove_all(staging_dir);
+			return;
+		}
+		fs::rename(staging_dir, job.m_image_layer_dir);
+	}
+
+	vector<LayerDownloadResult> LayerDownloader::run(const atomic<bool>* cancelled)
+	{
+		vector<LayerDownloadResult> results(m_jobs.size());
+		if (m_jobs.empty()) {
+			return results;
+		}
+
+		//the multi handle belongs to the registry client, so its connection cache outlives this run
+		CURLM* multi = m_registry_client.getMultiHandle();
+
+		map<size_t, unique_ptr<Transfer>> transfers;
+		//every attached easy handle, either the main handle of a transfer or one of its segments
+		map<CURL*, pair<Transfer*, Segment*>> handles;
+
+		//takes an easy handle off the multi handle (if attached) and gives it back to the pool
+		auto detachHandle = [&](CURL*& curl) {
+			if (!curl) return;
+			if (handles.erase(curl) > 0) {
+				curl_multi_remove_handle(multi, curl);
+			}
+			m_registry_client.releaseHandle(curl);
+			curl = nullptr;
+		};
+
+		auto cancelSegments = [&](Transfer& transfer) {
+			for (auto& segment : transfer.m_segments) {
+				detachHandle(segment->m_curl);
+				if (segment->m_headers) curl_slist_free_all(segment->m_headers);
+			}
+			transfer.m_segments.clear();
+			transfer.m_start_segments = false;
+			transfer.m_draining = false;
+		};
+
+		//fresh staging directory, extractor and hash for a transfer
+		auto resetPipeline = [&](Transfer& transfer) {
+			const LayerDownloadJob& job = *transfer.m_job;
+			transfer.m_extractor.reset();
+			fs::remove_all(getStagingDir(job.m_image_layer_dir));
+			transfer.m_extractor = make_unique<LayerExtractor>(getStagingDir(job.m_image_layer_dir));
+			transfer.m_hasher.reset();
+		};
+
+		//feeds the bytes that are already in the .partial file through the hash and the extractor again
+		//re-extracting from local disk is cheap compared to fetching the same bytes from the registry again
+		auto replayPartial = [&](Transfer& transfer, uint64_t resume_from) {
+			ifstream ifs(getPartialPath(*transfer.m_job), ios::binary);
+			vector<char> buffer(1024 * 1024);
+			uint64_t replayed = 0;
+			ScopedTimer timer(transfer.m_timings->m_extract_seconds);
+			while (replayed < resume_from) {
+				size_t n = static_cast<size_t>(min<uint64_t>(buffer.size(), resume_from - replayed));
+				if (!ifs.read(buffer.data(), n)) {
+					throw ImageTarballException("Couldn't read back partial download!");
+				}
+				transfer.m_hasher.update(buffer.data(), n);
+				transfer.m_extractor->write(buffer.data(), n);
+				replayed += n;
+			}
+		};
+
+		//(re)configures the main easy handle of a transfer with the current token and attaches it to the multi handle
+		//with resume set, a previous partial download of the same blob is continued with a Range request
+		auto startTransfer = [&](Transfer& transfer, bool resume) -> bool {
+			const LayerDownloadJob& job = *transfer.m_job;
+
+			cancelSegments(transfer);
+			detachHandle(transfer.m_curl);
+			transfer.m_curl = m_registry_client.acquireHandle();
+			if (!transfer.m_curl) {
+				results[transfer.m_job_index].m_error = "Couldn't initialize curl to download tarball of layer!";
+				return false;
+			}
+			transfer.m_timings->m_connections++;
+
+			if (transfer.m_partial_fd >= 0) {
+				close(transfer.m_partial_fd);
+				transfer.m_partial_fd = -1;
+			}
+			transfer.m_write_error.clear();
+			transfer.m_body_started = false;
+			transfer.m_range_ignored = false;
+			transfer.m_unsaved_bytes = 0;
+
+			//a retry (or a run after a crash) starts from an empty staging directory again
+			try {
+				resetPipeline(transfer);
+				uint64_t resume_from = resume ? loadResumePoint(job) : 0;
+				if (resume_from > 0) {
+					try {
+						fs::resize_file(getPartialPath(job), resume_from);
+						replayPartial(transfer, resume_from);
+						cout << "Resuming download of Image Layer : " << job.m_image_digest << " from byte " << resume_from << "\n";
+					} catch (const exception&) {
+						//the partial file is unusable, start over
+						resume_from = 0;
+						resetPipeline(transfer);
+					}
+				}
+				if (resume_from == 0) {
+					discardPartial(job);
+				}
+				transfer.m_resume_from = resume_from;
+				transfer.m_timings->m_resumed_bytes = resume_from;
+			} catch (const exception& ex) {
+				results[transfer.m_job_index].m_error = ex.what();
+				return false;
+			}
+
+			transfer.m_partial_fd = open(getPartialPath(job).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+			if (transfer.m_partial_fd < 0) {
+				results[transfer.m_job_index].m_error = "Failed to open tarball file!";
+				return false;
+			}
+
+			//a large remainder is split, this handle only asks for the first range and the others follow once it's accepted
+			transfer.m_split_end = 0;
+			uint64_t remaining = job.m_image_size > transfer.m_resume_from ? job.m_image_size - transfer.m_resume_from : 0;
+			if (!transfer.m_split_disabled && m_segments_per_layer > 1 && remaining >= segmented_download_threshold) {
+				uint64_t segment_size = max(min_segment_size, (remaining + m_segments_per_layer - 1) / m_segments_per_layer);
+				transfer.m_split_end = min(job.m_image_size, transfer.m_resume_from + segment_size);
+			}
+
+			if (transfer.m_headers) {
+				curl_slist_free_all(transfer.m_headers);
+				transfer.m_headers = nullptr;
+			}
+			transfer.m_token_used = m_job_tokens[transfer.m_job_index].first();
+			if (!transfer.m_token_used.empty()) {
+				transfer.m_auth_header = "Authorization: Bearer " + transfer.m_token_used;
+				transfer.m_headers = curl_slist_append(transfer.m_headers, transfer.m_auth_header.c_str());
+			}
+			transfer.m_header_str.clear();
+
+			CURL* curl = transfer.m_curl;
+			curl_easy_setopt(curl, CURLOPT_URL, job.m_blob_url.c_str());
+			curl_easy_setopt(curl, CURLOPT_HTTPHEADER, transfer.m_headers);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer);
+			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeLayerCallback);
+			curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, writeHeaderCallback);
+			curl_easy_setopt(curl, CURLOPT_HEADERDATA, &transfer.m_header_str);
+			if (transfer.m_split_end > 0) {
+				string range = to_string(transfer.m_resume_from) + "-" + to_string(transfer.m_split_end - 1);
+				curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+			} else {
+				//sends "Range: bytes=<resume_from>-" to the final location after redirects
+				curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(transfer.m_resume_from));
+			}
+
+			//blob fetching can respond with 307 Redirect responses
+			//this is to handle redirect
+			curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+			curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5L); // limit to 5 redirects
+			curl_easy_setopt(curl, CURLOPT_AUTOREFERER, 1L);
+			//Also avoid curl writing http errors into the tar file
+			curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+
+			if (curl_multi_add_handle(multi, curl) != CURLM_OK) {
+				results[transfer.m_job_index].m_error = "Couldn't schedule the download of the layer!";
+				return false;
+			}
+			handles[curl] = { &transfer, nullptr };
+			return true;
+		};
+
+		//requests the rest of a segment from where it stopped
+		auto startSegment = [&](Transfer& transfer, Segment& segment, const string& url) -> bool {
+			detachHandle(segment.m_curl);
+			segment.m_curl = m_registry_client.acquireHandle();
+			if (!segment.m_curl) return false;
+			transfer.m_timings->m_connections++;
+			segment.m_body_started = false;
+			segment.m_range_ignored = false;
+			segment.m_write_error.clear();
+
+			CURL* curl = segment.m_curl;
+			string range = to_string(segment.m_start + segment.m_received) + "-" + to_string(segment.m_end - 1);
+			curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+			curl_easy_setopt(curl, CURLOPT_HTTPHEADER, segment.m_headers);
+			curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, &segment);
+			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeSegmentCallback);
+			curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+			curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5L);
+			curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+
+			if (curl_multi_add_handle(multi, curl) != CURLM_OK) {
+				m_registry_client.releaseHandle(curl);
+				segment.m_curl = nullptr;
+				return false;
+			}
+			handles[curl] = { &transfer, &segment };
+			return true;
+		};
+
+		//the first range came back as 206, the remaining ranges go straight to where the registry redirected us
+		//(usually a pre-signed blob storage URL), so the redirect is only followed once
+		auto startSegments = [&](Transfer& transfer) -> bool {
+			const LayerDownloadJob& job = *transfer.m_job;
+			const string& url = transfer.m_segment_url;
+			//the bearer token is for the registry, it's not sent along to a different host
+			bool send_token = !transfer.m_auth_header.empty() &&
+				RegistryClient::getHost(url) == RegistryClient::getHost(job.m_blob_url);
+
+			//reserves the space up front, the ranges are written at their offsets in whatever order they arrive
+			posix_fallocate(transfer.m_partial_fd, 0, static_cast<off_t>(job.m_image_size));
+
+			uint64_t segment_size = transfer.m_split_end - transfer.m_resume_from;
+			for (uint64_t start = transfer.m_split_end; start < job.m_image_size; start += segment_size) {
+				auto segment = make_unique<Segment>();
+				segment->m_transfer = &transfer;
+				segment->m_start = start;
+				segment->m_end = min(job.m_image_size, start + segment_size);
+				if (send_token) {
+					segment->m_auth_header = transfer.m_auth_header;
+					segment->m_headers = curl_slist_append(nullptr, segment->m_auth_header.c_str());
+				}
+				transfer.m_segments.push_back(move(segment));
+			}
+			for (auto& segment : transfer.m_segments) {
+				if (!startSegment(transfer, *segment, url)) return false;
+			}
+			return true;
+		};
+
+		//hashes and extracts what the segments wrote, as far as the bytes are contiguous
+		auto feedSegments = [&](Transfer& transfer) {
+			vector<char> buffer(1024 * 1024);
+			uint64_t fed = transfer.m_hasher.getBytesHashed();
+			ScopedTimer timer(transfer.m_timings->m_extract_seconds);
+			for (auto& segment : transfer.m_segments) {
+				if (fed >= segment->m_end) continue;
+				if (fed < segment->m_start) break;
+
+				uint64_t available = segment->m_start + segment->m_received;
+				while (fed < available) {
+					size_t n = static_cast<size_t>(min<uint64_t>(buffer.size(), available - fed));
+					ssize_t got = pread(transfer.m_partial_fd, buffer.data(), n, static_cast<off_t>(fed));
+					if (got <= 0) {
+						throw ImageTarballException("Couldn't read back downloaded range of the layer!");
+					}
+					transfer.m_hasher.update(buffer.data(), static_cast<size_t>(got));
+					transfer.m_extractor->write(buffer.data(), static_cast<size_t>(got));
+					transfer.m_unsaved_bytes += static_cast<uint64_t>(got);
+					fed += static_cast<uint64_t>(got);
+				}
+				if (!segment->m_done) break;
+			}
+			if (transfer.m_unsaved_bytes >= resume_checkpoint_interval) {
+				saveResumePoint(transfer);
+			}
+		};
+
+		auto releaseTransfer = [&](Transfer& transfer) {
+			cancelSegments(transfer);
+			detachHandle(transfer.m_curl);
+			if (transfer.m_headers) curl_slist_free_all(transfer.m_headers);
+			transfer.m_headers = nullptr;
+			if (transfer.m_partial_fd >= 0) close(transfer.m_partial_fd);
+			transfer.m_partial_fd = -1;
+			recordExtraction(transfer);
+			transfer.m_extractor.reset();
+			transfer.m_timings->m_download_seconds = chrono::duration<double>(chrono::steady_clock::now() - transfer.m_started).count();
+
+			//don't leave a half extracted layer behind, it would be picked up as a complete one on the next pull
+			//the .partial file is handled by the caller, it's kept whenever the download can be resumed later
+			const LayerDownloadResult& result = results[transfer.m_job_index];
+			if (!result.m_success) {
+				error_code ec;
+				fs::remove_all(getStagingDir(transfer.m_job->m_image_layer_dir), ec);
+			}
+		};
+
+		//a resumed download whose bytes turn out to be bad gets one more chance from byte 0
+		auto restartFromScratch = [&](Transfer& transfer) -> bool {
+			if (transfer.m_resume_from == 0 || transfer.m_restarted_from_scratch) return false;
+			transfer.m_restarted_from_scratch = true;
+			cerr << "Warning: couldn't resume download of " << transfer.m_job->m_image_digest << ", downloading it again\n";
+			return startTransfer(transfer, false);
+		};
+
+		//every byte of the blob went through the hash and the extractor, returns false if the transfer was restarted instead
+		auto completeTransfer = [&](Transfer& transfer) -> bool {
+			const LayerDownloadJob& job = *transfer.m_job;
+			LayerDownloadResult& result = results[transfer.m_job_index];
+			try {
+				verifyDownloadedLayer(job, transfer.m_hasher);
+				{
+					ScopedTimer timer(transfer.m_timings->m_extract_seconds);
+					transfer.m_extractor->finish();
+				}
+				recordExtraction(transfer);
+				transfer.m_extractor.reset();
+				publishLayer(job);
+
+				//only a verified blob is renamed into place
+				close(transfer.m_partial_fd);
+				transfer.m_partial_fd = -1;
+				error_code ec;
+				fs::remove(getSidecarPath(job), ec);
+				if (job.m_keep_tarball) {
+					fs::rename(getPartialPath(job), job.m_image_tar_path);
+				} else {
+					fs::remove(getPartialPath(job), ec);
+				}
+
+				result.m_success = true;
+				cout << "Downloaded and extracted Image Layer : " << result.m_image_digest << "\n";
+			} catch (const exception& ex) {
+				if (restartFromScratch(transfer)) return false;
+				result.m_error = ex.what();
+				discardPartial(job);
+			}
+			return true;
+		};
+
+		//a network error keeps what was verified so far, the next pull continues from there
+		auto failWithResumePoint = [&](Transfer& transfer, const string& error) {
+			saveResumePoint(transfer);
+			LayerDownloadResult& result = results[transfer.m_job_index];
+			result.m_error = error;
+			if (transfer.m_hasher.getBytesHashed() > 0) {
+				result.m_error += " - " + to_string(transfer.m_hasher.getBytesHashed()) + " bytes kept, the next pull resumes from there";
+			}
+		};
+
+		size_t next_job = 0;
+		while (next_job < m_jobs.size() || !transfers.empty()) {
+			//whatever arrived so far is journaled, the next pull resumes from there
+			if (cancelled && *cancelled) {
+				for (auto& [job_index, transfer] : transfers) {
+					failWithResumePoint(*transfer, "Download cancelled!");
+					releaseTransfer(*transfer);
+				}
+				transfers.clear();
+				for (; next_job < m_jobs.size(); next_job++) {
+					results[next_job].m_image_digest = m_jobs[next_job].m_image_digest;
+					results[next_job].m_blob_url = m_jobs[next_job].m_blob_url;
+					results[next_job].m_error = "Download cancelled!";
+				}
+				break;
+			}
+
+			//keep at most m_max_concurrent_downloads layers downloading
+			while (transfers.size() < m_max_concurrent_downloads && next_job < m_jobs.size()) {
+				auto transfer = make_unique<Transfer>();
+				transfer->m_job_index = next_job;
+				transfer->m_job = &m_jobs[next_job];
+				transfer->m_timings = &results[next_job].m_timings;
+				transfer->m_started = chrono::steady_clock::now();
+				results[next_job].m_image_digest = m_jobs[next_job].m_image_digest;
+				results[next_job].m_blob_url = m_jobs[next_job].m_blob_url;
+
+				if (startTransfer(*transfer, true)) {
+					transfers[next_job] = move(transfer);
+				} else {
+					releaseTransfer(*transfer);
+				}
+				next_job++;
+			}
+
+			int still_running = 0;
+			curl_multi_perform(multi, &still_running);
+
+			vector<size_t> finished;
+
+			CURLMsg* msg;
+			int msgs_left = 0;
+			while ((msg = curl_multi_info_read(multi, &msgs_left))) {
+				if (msg->msg != CURLMSG_DONE) continue;
+
+				CURL* curl = msg->easy_handle;
+				CURLcode res = msg->data.result;
+				auto it = handles.find(curl);
+				if (it == handles.end()) continue;
+				Transfer& transfer = *it->second.first;
+				Segment* segment = it->second.second;
+				const LayerDownloadJob& job = *transfer.m_job;
+				LayerDownloadResult& result = results[transfer.m_job_index];
+
+				long http_code = 0;
+				curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+				long redirects = 0;
+				curl_easy_getinfo(curl, CURLINFO_REDIRECT_COUNT, &redirects);
+				transfer.m_timings->m_redirects += redirects;
+
+				if (segment) {
+					detachHandle(segment->m_curl);
+					if (res == CURLE_OK && http_code == 206 && segment->m_received == segment->m_end - segment->m_start) {
+						segment->m_done = true;
+						continue;
+					}
+					if (segment->m_range_ignored) {
+						//blob storage doesn't do ranges after all, go back to one stream from what is verified so far
+						saveResumePoint(transfer);
+						transfer.m_split_disabled = true;
+						if (startTransfer(transfer, true)) continue;
+					} else if (segment->m_write_error.empty() && segment->m_retries < max_segment_retries) {
+						segment->m_retries++;
+						if (startSegment(transfer, *segment, transfer.m_segment_url)) continue;
+					} else if (!segment->m_write_error.empty()) {
+						result.m_error = segment->m_write_error;
+						saveResumePoint(transfer);
+					} else {
+						failWithResumePoint(transfer, "Failed to download a range of the layer! (" + string(curl_easy_strerror(res)) +
+							", HTTP " + to_string(http_code) + ")");
+					}
+					finished.push_back(transfer.m_job_index);
+					continue;
+				}
+
+				detachHandle(transfer.m_curl);
+
+				if (http_code == 401 && !transfer.m_retried_after_unauthorized) {
+					transfer.m_retried_after_unauthorized = true;
+					try {
+						//another transfer might have refreshed the token already while this one was running
+						const auto& [token_provider, token_refresher] = m_job_tokens[transfer.m_job_index];
+						if (token_provider() == transfer.m_token_used) {
+							//Update token as unauthorized error
+							token_refresher(transfer.m_header_str);
+							transfer.m_timings->m_token_refreshes++;
+						}
+						// Retry with Bearer token
+						if (startTransfer(transfer, true)) continue;
+					} catch (const exception& ex) {
+						result.m_error = ex.what();
+					} catch (...) {
+						result.m_error = "Couldn't refresh the bearer token!";
+					}
+				} else if (http_code == 401) {
+					result.m_error = "401 UNAUTHORIZED ERROR - while trying to download tarball of image layer!";
+				} else if (transfer.m_range_ignored || res == CURLE_RANGE_ERROR || http_code == 416) {
+					if (restartFromScratch(transfer)) continue;
+					result.m_error = "Registry refused to resume the download of the layer!";
+					discardPartial(job);
+				} else if (!transfer.m_write_error.empty()) {
+					if (restartFromScratch(transfer)) continue;
+					result.m_error = transfer.m_write_error;
+					discardPartial(job);
+				} else if (res != CURLE_OK || (http_code != 200 && http_code != 206)) {
+					//most likely a network issue, keep what we have so the next pull continues from there
+					failWithResumePoint(transfer, "Failed to download layer! (" + string(curl_easy_strerror(res)) + ", HTTP " + to_string(http_code) + ")");
+				} else if (transfer.m_split_end > 0) {
+					//the first range is in, the segments take care of the rest
+					if (transfer.m_hasher.getBytesHashed() == transfer.m_split_end) {
+						transfer.m_draining = true;
+						continue;
+					}
+					failWithResumePoint(transfer, "Registry sent a truncated range of the layer!");
+				} else if (!completeTransfer(transfer)) {
+					continue;
+				}
+				finished.push_back(transfer.m_job_index);
+			}
+
+			for (auto& [job_index, transfer] : transfers) {
+				if (find(finished.begin(), finished.end(), job_index) != finished.end()) continue;
+
+				//the first range was accepted, the remaining ones can go out now
+				if (transfer->m_start_segments) {
+					transfer->m_start_segments = false;
+					if (!startSegments(*transfer)) {
+						//not fatal, the blob can still come over a single connection
+						saveResumePoint(*transfer);
+						transfer->m_split_disabled = true;
+						if (!startTransfer(*transfer, true)) finished.push_back(job_index);
+					}
+					continue;
+				}
+
+				if (transfer->m_segments.empty()) continue;
+				try {
+					feedSegments(*transfer);
+				} catch (const exception& ex) {
+					if (!restartFromScratch(*transfer)) {
+						results[job_index].m_error = ex.what();
+						discardPartial(*transfer->m_job);
+						finished.push_back(job_index);
+					}
+					continue;
+				}
+				if (transfer->m_draining && transfer->m_hasher.getBytesHashed() >= transfer->m_job->m_image_size) {
+					if (completeTransfer(*transfer)) finished.push_back(job_index);
+				}
+			}
+
+			for (size_t job_index : finished) {
+				auto it = transfers.find(job_index);
+				if (it == transfers.end()) continue;
+				releaseTransfer(*it->second);
+				transfers.erase(it);
+			}
+
+			if (!transfers.empty()) {
+				curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+			}
+		}
+
+		return results;
+	}
+}
@@ -0,0 +1,934 @@
+#include "../include/minidocker/layer_extractor.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include "../include/minidocker/layer_whiteouts.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <zstd_errors.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+static const size_t inflate_buffer_size = 256 * 1024;
+static const size_t max_meta_entry_size = 1024 * 1024; //pax headers and GNU long names are tiny, anything bigger is bogus
+static const size_t tar_block_size = 512;
+static const size_t zstd_batch_size = 8 * 1024 * 1024; //complete frames are collected up to this many compressed bytes, then decompressed together
+static const size_t zstd_max_collected_frame = 8 * 1024 * 1024; //a frame bigger than this is streamed instead of collected
+static const unsigned long long zstd_max_batch_output = 64 * 1024 * 1024; //decompressed bytes held at once, frames that declare more are streamed
+static const unsigned int zstd_max_threads = 8;
+
+namespace minidocker
+{
+	LayerExtractor::LayerExtractor(const string& target_dir)
+		: m_target_dir(target_dir), m_preserve_owner(geteuid() == 0), m_inflate_buffer(inflate_buffer_size),
+		m_dedup_mode(ContentStore::getDedupMode())
+	{
+		memset(&m_zstream, 0, sizeof(m_zstream));
+		memset(m_header, 0, sizeof(m_header));
+
+		fs::create_directories(target_dir);
+		m_root_fd = open(target_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (m_root_fd < 0) {
+			throw ImageExtractionException("Couldn't open " + target_dir + " to extract the image layer into!");
+		}
+	}
+
+	LayerExtractor::~LayerExtractor()
+	{
+		closeFds();
+		if (m_zstream_initialized) {
+			inflateEnd(&m_zstream);
+		}
+		if (m_zstd_stream) {
+			ZSTD_freeDStream(m_zstd_stream);
+		}
+	}
+
+	void LayerExtractor::closeFds()
+	{
+		if (m_file_fd >= 0) close(m_file_fd);
+		if (m_cached_parent_fd >= 0) close(m_cached_parent_fd);
+		if (m_root_fd >= 0) close(m_root_fd);
+		m_file_fd = -1;
+		m_cached_parent_fd = -1;
+		m_root_fd = -1;
+	}
+
+	void LayerExtractor::write(const char* data, size_t len)
+	{
+		if (m_finished) {
+			throw ImageExtractionException("Received data for an image layer that was already extracted!");
+		}
+		if (len == 0) return;
+
+		if (m_compression == Compression::UNKNOWN) {
+			//the gzip magic number is 2 bytes long and the zstd one 4, the very first write could be shorter than that
+			m_magic.append(data, len);
+			if (m_magic.size() < 4) return;
+			detectCompression(reinterpret_cast<const unsigned char*>(m_magic.data()), m_magic.size());
+			string buffered;
+			buffered.swap(m_magic);
+			write(buffered.data(), buffered.size());
+			return;
+		}
+
+		if (m_compression == Compression::GZIP) {
+			gzipChunk(reinterpret_cast<const unsigned char*>(data), len);
+		} else if (m_compression == Compression::ZSTD) {
+			zstdChunk(reinterpret_cast<const unsigned char*>(data), len);
+		} else {
+			consumeTar(reinterpret_cast<const unsigned char*>(data), len);
+		}
+	}
+
+	void LayerExtractor::detectCompression(const unsigned char* data, size_t len)
+	{
+		uint32_t magic = len >= 4 ? data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24) : 0;
+
+		//gzip streams start with 0x1f 0x8b, a tar header starts with its file name, which could start with 0x1f too
+		if (len >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+			if (inflateInit2(&m_zstream, 15 + 32) != Z_OK) { // 15 + 32 -> max window and auto detect gzip/zlib header
+				throw ImageExtractionException("Couldn't initialize zlib to decompress the image layer!");
+			}
+			m_zstream_initialized = true;
+			m_compression = Compression::GZIP;
+
+			unsigned int threads = ParallelInflater::getThreadCount();
+			if (threads > 1) {
+				m_parallel_inflater = make_unique<ParallelInflater>(threads, [this](const unsigned char* output, size_t output_len) {
+					consumeTar(output, output_len);
+				});
+			}
+		} else if (magic == ZSTD_MAGICNUMBER || (magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START) {
+			//zstd:chunked layers can start with a skippable frame
+			m_zstd_stream = ZSTD_createDStream();
+			if (!m_zstd_stream) {
+				throw ImageExtractionException("Couldn't initialize zstd to decompress the image layer!");
+			}
+			m_compression = Compression::ZSTD;
+		} else {
+			m_compression = Compression::NONE;
+		}
+	}
+
+	void LayerExtractor::gzipChunk(const unsigned char* data, size_t len)
+	{
+		if (!m_parallel_inflater) {
+			inflateChunk(data, len);
+			return;
+		}
+		m_parallel_inflater->write(data, len);
+		if (m_parallel_inflater->ended()) {
+			endParallelInflate();
+		}
+	}
+
+	void LayerExtractor::endParallelInflate()
+	{
+		//whatever follows the first member (more members or padding) goes through the streaming decoder
+		vector<unsigned char> rest = m_parallel_inflater->takeInput();
+		m_parallel_inflater.reset();
+		m_gzip_member_ended = true;
+		inflateChunk(rest.data(), rest.size());
+	}
+
+	void LayerExtractor::inflateChunk(const unsigned char* data, size_t len)
+	{
+		m_zstream.next_in = const_cast<unsigned char*>(data);
+		m_zstream.avail_in = static_cast<uInt>(len);
+
+		do {
+			if (m_gzip_member_ended) {
+				if (m_zstream.avail_in == 0 || m_tar_state == TarState::END_OF_ARCHIVE) {
+					//nothing left, or just trailing garbage/padding after the tar archive
+					return;
+				}
+				//a gzip file can be made of several concatenated members
+				inflateReset(&m_zstream);
+				m_gzip_member_ended = false;
+			}
+
+			m_zstream.next_out = m_inflate_buffer.data();
+			m_zstream.avail_out = static_cast<uInt>(m_inflate_buffer.size());
+			int ret = inflate(&m_zstream, Z_NO_FLUSH);
+			if (ret == Z_STREAM_END) {
+				m_gzip_member_ended = true;
+			} else if (ret == Z_BUF_ERROR) {
+				//no progress possible until more input arrives
+				return;
+			} else if (ret != Z_OK) {
+				throw ImageExtractionException("Corrupted gzip stream in image layer : " + string(m_zstream.msg ? m_zstream.msg : "unknown error"));
+			}
+
+			size_t produced = m_inflate_buffer.size() - m_zstream.avail_out;
+			if (produced > 0) {
+				consumeTar(m_inflate_buffer.data(), produced);
+			}
+		} while (m_zstream.avail_in > 0 || m_zstream.avail_out == 0);
+	}
+
+	void LayerExtractor::zstdChunk(const unsigned char* data, size_t len)
+	{
+		size_t pos = 0;
+		while (pos < len) {
+			if (m_zstd_streaming_frame) {
+				size_t consumed = 0;
+				if (streamZstd(data + pos, len - pos, consumed)) {
+					m_zstd_streaming_frame = false;
+				}
+				pos += consumed;
+				continue;
+			}
+			m_zstd_input.insert(m_zstd_input.end(), data + pos, data + len);
+			pos = len;
+			collectZstdFrames(false);
+		}
+	}
+
+	void LayerExtractor::collectZstdFrames(bool final)
+	{
+		while (m_zstd_scanned < m_zstd_input.size()) {
+			size_t frame_size = ZSTD_findFrameCompressedSize(m_zstd_input.data() + m_zstd_scanned, m_zstd_input.size() - m_zstd_scanned);
+			if (ZSTD_isError(frame_size)) {
+				if (ZSTD_getErrorCode(frame_size) == ZSTD_error_srcSize_wrong) break; //rest of the frame didn't arrive yet
+				throw ImageExtractionException("Corrupted zstd stream in image layer : " + string(ZSTD_getErrorName(frame_size)));
+			}
+			m_zstd_frames.push_back({ m_zstd_scanned, frame_size });
+			m_zstd_scanned += frame_size;
+		}
+
+		if (final || m_zstd_scanned >= zstd_batch_size) {
+			decompressZstdFrames();
+		}
+
+		//a frame this big is most likely the only one of the blob, collecting it would mean buffering the whole layer
+		if (m_zstd_input.size() - m_zstd_scanned > zstd_max_collected_frame) {
+			decompressZstdFrames(); //the frames before it have to be extracted first
+			vector<unsigned char> pending;
+			pending.swap(m_zstd_input);
+			ZSTD_DCtx_reset(m_zstd_stream, ZSTD_reset_session_only);
+			m_zstd_streaming_frame = true;
+			zstdChunk(pending.data(), pending.size());
+		}
+	}
+
+	void LayerExtractor::decompressZstdFrames()
+	{
+		if (m_zstd_frames.empty()) return;
+
+		//frames that don't declare their size (or a huge one) are streamed, the others are decompressed side by side
+		//a group at a time, so highly compressible frames (or lying headers) can't make the outputs of a batch add up to gigabytes
+		size_t frame_count = m_zstd_frames.size();
+		vector<unsigned long long> content_sizes(frame_count);
+		for (size_t i = 0; i < frame_count; i++) {
+			unsigned long long content_size = ZSTD_getFrameContentSize(m_zstd_input.data() + m_zstd_frames[i].first, m_zstd_frames[i].second);
+			bool known = content_size != ZSTD_CONTENTSIZE_UNKNOWN && content_size != ZSTD_CONTENTSIZE_ERROR && content_size <= zstd_max_batch_output;
+			content_sizes[i] = known ? content_size : ZSTD_CONTENTSIZE_UNKNOWN;
+		}
+
+		size_t group_start = 0;
+		while (group_start < frame_count) {
+			size_t group_end = group_start;
+			unsigned long long group_output = 0;
+			while (group_end < frame_count) {
+				unsigned long long content_size = content_sizes[group_end];
+				if (content_size != ZSTD_CONTENTSIZE_UNKNOWN) {
+					if (group_end > group_start && group_output + content_size > zstd_max_batch_output) break;
+					group_output += content_size;
+				}
+				group_end++;
+			}
+			decompressZstdGroup(group_start, group_end, content_sizes);
+			group_start = group_end;
+		}
+
+		m_zstd_input.erase(m_zstd_input.begin(), m_zstd_input.begin() + m_zstd_scanned);
+		m_zstd_scanned = 0;
+		m_zstd_frames.clear();
+	}
+
+	void LayerExtractor::decompressZstdGroup(size_t begin, size_t end, const vector<unsigned long long>& content_sizes)
+	{
+		vector<vector<unsigned char>> outputs(end - begin);
+		vector<size_t> parallel_frames;
+		for (size_t i = begin; i < end; i++) {
+			if (content_sizes[i] == ZSTD_CONTENTSIZE_UNKNOWN) continue;
+			outputs[i - begin].resize(static_cast<size_t>(content_sizes[i]));
+			parallel_frames.push_back(i);
+		}
+
+		atomic<size_t> next_frame(0);
+		mutex error_mutex;
+		string error;
+		auto decompressFrames = [&](ZSTD_DCtx* dctx) {
+			for (size_t n = next_frame++; n < parallel_frames.size(); n = next_frame++) {
+				size_t i = parallel_frames[n];
+				vector<unsigned char>& output = outputs[i - begin];
+				size_t ret = ZSTD_decompressDCtx(dctx, output.data(), output.size(),
+					m_zstd_input.data() + m_zstd_frames[i].first, m_zstd_frames[i].second);
+				if (ZSTD_isError(ret) || ret != output.size()) {
+					lock_guard<mutex> lock(error_mutex);
+					error = ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "frame size doesn't match its header";
+				}
+			}
+		};
+
+		unsigned int thread_count = min<size_t>(max(1u, min(thread::hardware_concurrency(), zstd_max_threads)), parallel_frames.size());
+		if (thread_count <= 1) {
+			decompressFrames(m_zstd_stream);
+		} else {
+			vector<thread> workers;
+			vector<ZSTD_DCtx*> contexts;
+			for (unsigned int t = 0; t < thread_count; t++) {
+				ZSTD_DCtx* dctx = ZSTD_createDCtx();
+				if (!dctx) break;
+				contexts.push_back(dctx);
+				workers.emplace_back(decompressFrames, dctx);
+			}
+			if (contexts.empty()) {
+				decompressFrames(m_zstd_stream);
+			}
+			for (thread& worker : workers) worker.join();
+			for (ZSTD_DCtx* dctx : contexts) ZSTD_freeDCtx(dctx);
+		}
+		if (!error.empty()) {
+			throw ImageExtractionException("Corrupted zstd stream in image layer : " + error);
+		}
+
+		//the tar stream is consumed in frame order
+		for (size_t i = begin; i < end; i++) {
+			if (content_sizes[i] == ZSTD_CONTENTSIZE_UNKNOWN) {
+				size_t consumed = 0;
+				ZSTD_DCtx_reset(m_zstd_stream, ZSTD_reset_session_only);
+				if (!streamZstd(m_zstd_input.data() + m_zstd_frames[i].first, m_zstd_frames[i].second, consumed) || consumed != m_zstd_frames[i].second) {
+					throw ImageExtractionException("Corrupted zstd stream in image layer : truncated frame");
+				}
+			} else {
+				consumeTar(outputs[i - begin].data(), outputs[i - begin].size());
+				vector<unsigned char>().swap(outputs[i - begin]);
+			}
+		}
+	}
+
+	bool LayerExtractor::streamZstd(const unsigned char* data, size_t len, size_t& consumed)
+	{
+		ZSTD_inBuffer in = { data, len, 0 };
+		while (true) {
+			ZSTD_outBuffer out = { m_inflate_buffer.data(), m_inflate_buffer.size(), 0 };
+			size_t ret = ZSTD_decompressStream(m_zstd_stream, &out, &in);
+			if (ZSTD_isError(ret)) {
+				throw ImageExtractionException("Corrupted zstd stream in image layer : " + string(ZSTD_getErrorName(ret)));
+			}
+			if (out.pos > 0) {
+				consumeTar(m_inflate_buffer.data(), out.pos);
+			}
+			//0 means the frame is fully decoded and flushed
+			if (ret == 0 || (in.pos == in.size && out.pos < out.size)) {
+				consumed = in.pos;
+				return ret == 0;
+			}
+		}
+	}
+
+	void LayerExtractor::consumeTar(const unsigned char* data, size_t len)
+	{
+		m_tar_bytes += len;
+		while (len > 0) {
+			size_t n = 0;
+			switch (m_tar_state) {
+			case TarState::HEADER:
+				n = min(len, tar_block_size - m_header_filled);
+				memcpy(m_header + m_header_filled, data, n);
+				m_header_filled += n;
+				if (m_header_filled == tar_block_size) {
+					m_header_filled = 0;
+					processHeader();
+				}
+				break;
+			case TarState::FILE_DATA:
+				n = static_cast<size_t>(min<uint64_t>(len, m_remaining));
+				for (size_t written = 0; written < n;) {
+					ssize_t ret = ::write(m_file_fd, data + written, n - written);
+					if (ret < 0) {
+						if (errno == EINTR) continue;
+						throw ImageExtractionException("Couldn't write " + m_entry.m_path + " : " + strerror(errno));
+					}
+					written += static_cast<size_t>(ret);
+				}
+				if (m_hash_file) m_file_hasher.update(data, n);
+				m_remaining -= n;
+				if (m_remaining == 0) {
+					finishFileEntry();
+					m_tar_state = m_padding > 0 ? TarState::PADDING : TarState::HEADER;
+				}
+				break;
+			case TarState::META_DATA:
+				n = static_cast<size_t>(min<uint64_t>(len, m_remaining));
+				m_meta_data.append(reinterpret_cast<const char*>(data), n);
+				m_remaining -= n;
+				if (m_remaining == 0) {
+					processMetaEntry();
+					m_tar_state = m_padding > 0 ? TarState::PADDING : TarState::HEADER;
+				}
+				break;
+			case TarState::SKIP_DATA:
+				n = static_cast<size_t>(min<uint64_t>(len, m_remaining));
+				m_remaining -= n;
+				if (m_remaining == 0) {
+					m_tar_state = m_padding > 0 ? TarState::PADDING : TarState::HEADER;
+				}
+				break;
+			case TarState::PADDING:
+				n = static_cast<size_t>(min<uint64_t>(len, m_padding));
+				m_padding -= n;
+				if (m_padding == 0) {
+					m_tar_state = TarState::HEADER;
+				}
+				break;
+			case TarState::END_OF_ARCHIVE:
+				//whatever follows the two zero blocks is just padding
+				return;
+			}
+			data += n;
+			len -= n;
+		}
+	}
+
+	void LayerExtractor::processHeader()
+	{
+		bool all_zero = true;
+		for (size_t i = 0; i < tar_block_size; i++) {
+			if (m_header[i] != 0) {
+				all_zero = false;
+				break;
+			}
+		}
+		if (all_zero) {
+			//two consecutive zero blocks mark the end of the archive
+			if (++m_zero_blocks >= 2) {
+				m_tar_state = TarState::END_OF_ARCHIVE;
+			}
+			return;
+		}
+		m_zero_blocks = 0;
+
+		//the checksum is computed with the checksum field itself filled with spaces
+		uint64_t expected_checksum = parseNumeric(m_header + 148, 8);
+		uint64_t unsigned_sum = 0;
+		int64_t signed_sum = 0;
+		for (size_t i = 0; i < tar_block_size; i++) {
+			unsigned char c = (i >= 148 && i < 156) ? ' ' : m_header[i];
+			unsigned_sum += c;
+			signed_sum += static_cast<signed char>(c);
+		}
+		if (expected_checksum != unsigned_sum && static_cast<int64_t>(expected_checksum) != signed_sum) {
+			throw ImageExtractionException("Invalid tar header checksum in image layer!");
+		}
+
+		char type = static_cast<char>(m_header[156]);
+		uint64_t size = parseNumeric(m_header + 124, 12);
+
+		if (type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+			if (size > max_meta_entry_size) {
+				throw ImageExtractionException("Tar extension header in image layer is too large!");
+			}
+			m_meta_type = type;
+			m_meta_data.clear();
+			m_remaining = size;
+			m_padding = (tar_block_size - size % tar_block_size) % tar_block_size;
+			if (size == 0) {
+				processMetaEntry();
+				m_tar_state = TarState::HEADER;
+			} else {
+				m_tar_state = TarState::META_DATA;
+			}
+			return;
+		}
+
+		TarEntry entry;
+		entry.m_type = type;
+		entry.m_path = parseString(m_header, 100);
+		//ustar splits long paths into prefix + name
+		if (memcmp(m_header + 257, "ustar", 5) == 0) {
+			string prefix = parseString(m_header + 345, 155);
+			if (!prefix.empty()) {
+				entry.m_path = prefix + "/" + entry.m_path;
+			}
+		}
+		entry.m_link_path = parseString(m_header + 157, 100);
+		entry.m_mode = static_cast<mode_t>(parseNumeric(m_header + 100, 8) & 07777);
+		entry.m_uid = static_cast<uid_t>(parseNumeric(m_header + 108, 8));
+		entry.m_gid = static_cast<gid_t>(parseNumeric(m_header + 116, 8));
+		entry.m_mtime = static_cast<time_t>(parseNumeric(m_header + 136, 12));
+		entry.m_dev_major = static_cast<dev_t>(parseNumeric(m_header + 329, 8));
+		entry.m_dev_minor = static_cast<dev_t>(parseNumeric(m_header + 337, 8));
+		entry.m_size = size;
+
+		//pax and GNU extensions override the values from the ustar header
+		if (!m_next_path.empty()) entry.m_path = m_next_path;
+		if (!m_next_link_path.empty()) entry.m_link_path = m_next_link_path;
+		if (!m_pax_size.empty()) entry.m_size = strtoull(m_pax_size.c_str(), nullptr, 10);
+		if (!m_pax_uid.empty()) entry.m_uid = static_cast<uid_t>(strtoul(m_pax_uid.c_str(), nullptr, 10));
+		if (!m_pax_gid.empty()) entry.m_gid = static_cast<gid_t>(strtoul(m_pax_gid.c_str(), nullptr, 10));
+		if (!m_pax_mtime.empty()) entry.m_mtime = static_cast<time_t>(strtoll(m_pax_mtime.c_str(), nullptr, 10));
+		m_next_path.clear();
+		m_next_link_path.clear();
+		m_pax_size.clear();
+		m_pax_uid.clear();
+		m_pax_gid.clear();
+		m_pax_mtime.clear();
+
+		//old tar versions mark directories with a trailing slash on a regular entry
+		if ((entry.m_type == '0' || entry.m_type == '\0') && !entry.m_path.empty() && entry.m_path.back() == '/') {
+			entry.m_type = '5';
+		}
+
+		//links, directories and special files never carry data, whatever their size field says
+		bool header_only = entry.m_type == '1' || entry.m_type == '2' || entry.m_type == '3' ||
+			entry.m_type == '4' || entry.m_type == '5' || entry.m_type == '6';
+		if (header_only) {
+			entry.m_size = 0;
+		}
+
+		m_entry = entry;
+		m_padding = (tar_block_size - entry.m_size % tar_block_size) % tar_block_size;
+		beginEntry();
+	}
+
+	void LayerExtractor::processMetaEntry()
+	{
+		switch (m_meta_type) {
+		case 'L':
+			m_next_path = m_meta_data.substr(0, m_meta_data.find('\0'));
+			break;
+		case 'K':
+			m_next_link_path = m_meta_data.substr(0, m_meta_data.find('\0'));
+			break;
+		case 'x':
+			parsePaxRecords(m_meta_data);
+			break;
+		default:
+			//global pax headers don't carry anything we make use of
+			break;
+		}
+		m_meta_data.clear();
+	}
+
+	void LayerExtractor::parsePaxRecords(const string& records)
+	{
+		//each record looks like "<length> <key>=<value>\n", length includes the whole record
+		size_t pos = 0;
+		while (pos < records.size()) {
+			size_t space = records.find(' ', pos);
+			if (space == string::npos) break;
+			size_t record_len = strtoul(records.substr(pos, space - pos).c_str(), nullptr, 10);
+			if (record_len <= space - pos + 1 || pos + record_len > records.size()) {
+				throw ImageExtractionException("Malformed pax header in image layer!");
+			}
+
+			string record = records.substr(space + 1, record_len - (space - pos) - 1);
+			if (!record.empty() && record.back() == '\n') record.pop_back();
+			size_t equals = record.find('=');
+			if (equals != string::npos) {
+				string key = record.substr(0, equals);
+				string value = record.substr(equals + 1);
+				if (key == "path") m_next_path = value;
+				else if (key == "linkpath") m_next_link_path = value;
+				else if (key == "size") m_pax_size = value;
+				else if (key == "uid") m_pax_uid = value;
+				else if (key == "gid") m_pax_gid = value;
+				else if (key == "mtime") m_pax_mtime = value;
+			}
+			pos += record_len;
+		}
+	}
+
+	void LayerExtractor::beginEntry()
+	{
+		TarEntry& entry = m_entry;
+		m_remaining = entry.m_size;
+
+		auto skipEntry = [&]() {
+			m_tar_state = m_remaining > 0 ? TarState::SKIP_DATA : (m_padding > 0 ? TarState::PADDING : TarState::HEADER);
+		};
+
+		string path = entry.m_path;
+		if (!sanitizePath(path)) {
+			cerr << "Warning: skipping unsafe path in image layer : " << entry.m_path << "\n";
+			skipEntry();
+			return;
+		}
+
+		if (path.empty()) {
+			//entry for the layer root itself ("./")
+			if (entry.m_type == '5') {
+				m_deferred_directories.push_back({ "", entry.m_mode, entry.m_uid, entry.m_gid, entry.m_mtime });
+			}
+			skipEntry();
+			return;
+		}
+
+		string parent, name;
+		splitPath(path, parent, name);
+
+		//whiteouts are stored the way overlayfs reads them, so the layer dir can be an overlay lower dir as it is
+		if (name.rfind(".wh.", 0) == 0) {
+			int parent_fd = openParentDir(parent);
+			if (name != ".wh..wh..opq") removeExisting(parent_fd, name.substr(4), false);
+			if (LayerWhiteouts::apply(parent_fd, name)) {
+				skipEntry();
+				return;
+			}
+			//not allowed without privileges, the OCI whiteout is extracted as it is
+			m_whiteouts_converted = false;
+		}
+
+		switch (entry.m_type) {
+		case '0':
+		case '\0':
+		case '7': {
+			int parent_fd = openParentDir(parent);
+			removeExisting(parent_fd, name, false);
+			//readable as well when deduplicating, a reflink clones from the open file
+			int access_mode = m_dedup_mode == DedupMode::OFF ? O_WRONLY : O_RDWR;
+			m_file_fd = openat(parent_fd, name.c_str(), access_mode | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+			if (m_file_fd < 0) {
+				throw ImageExtractionException("Couldn't create " + path + " : " + strerror(errno));
+			}
+			m_file_parent_fd = parent_fd;
+			m_file_name = name;
+			//empty files take no data blocks, nothing to share
+			m_hash_file = m_dedup_mode != DedupMode::OFF && m_remaining > 0;
+			if (m_hash_file) m_file_hasher.reset();
+			if (m_remaining == 0) {
+				finishFileEntry();
+				m_tar_state = TarState::HEADER;
+			} else {
+				m_tar_state = TarState::FILE_DATA;
+			}
+			return;
+		}
+		case '5': {
+			int parent_fd = openParentDir(parent);
+			removeExisting(parent_fd, name, true);
+			if (mkdirat(parent_fd, name.c_str(), 0700) != 0 && errno != EEXIST) {
+				throw ImageExtractionException("Couldn't create directory " + path + " : " + strerror(errno));
+			}
+			m_deferred_directories.push_back({ path, entry.m_mode, entry.m_uid, entry.m_gid, entry.m_mtime });
+			break;
+		}
+		case '2': {
+			int parent_fd = openParentDir(parent);
+			removeExisting(parent_fd, name, false);
+			//symlink targets are left untouched, they are only resolved once chrooted into the container
+			if (symlinkat(entry.m_link_path.c_str(), parent_fd, name.c_str()) != 0) {
+				throw ImageExtractionException("Couldn't create symlink " + path + " : " + strerror(errno));
+			}
+			applyMetadata(parent_fd, name, entry, true);
+			break;
+		}
+		case '1': {
+			string link_path = entry.m_link_path;
+			if (!sanitizePath(link_path) || link_path.empty()) {
+				cerr << "Warning: skipping hardlink with unsafe target in image layer : " << entry.m_path << "\n";
+				break;
+			}
+			string link_parent, link_name;
+			splitPath(link_path, link_parent, link_name);
+			int link_parent_fd = walkToDir(link_parent, false);
+			int parent_fd = openParentDir(parent);
+			removeExisting(parent_fd, name, false);
+			int ret = linkat(link_parent_fd, link_name.c_str(), parent_fd, name.c_str(), 0);
+			int saved_errno = errno;
+			close(link_parent_fd);
+			if (ret != 0) {
+				throw ImageExtractionException("Couldn't create hardlink " + path + " : " + strerror(saved_errno));
+			}
+			break;
+		}
+		case '3':
+		case '4':
+		case '6': {
+			int parent_fd = openParentDir(parent);
+			removeExisting(parent_fd, name, false);
+			mode_t node_type = entry.m_type == '3' ? S_IFCHR : (entry.m_type == '4' ? S_IFBLK : S_IFIFO);
+			if (mknodat(parent_fd, name.c_str(), node_type | 0600, makedev(entry.m_dev_major, entry.m_dev_minor)) != 0) {
+				//device nodes need privileges, the container doesn't rely on them anyway
+				cerr << "Warning: couldn't create special file " << path << " : " << strerror(errno) << "\n";
+				break;
+			}
+			applyMetadata(parent_fd, name, entry, false);
+			break;
+		}
+		default:
+			cerr << "Warning: skipping unsupported tar entry type '" << entry.m_type << "' for " << path << "\n";
+			break;
+		}
+
+		skipEntry();
+	}
+
+	void LayerExtractor::finishFileEntry()
+	{
+		//ownership first, as chown clears setuid/setgid bits
+		if (m_preserve_owner && fchown(m_file_fd, m_entry.m_uid, m_entry.m_gid) != 0) {
+			cerr << "Warning: couldn't change owner of " << m_entry.m_path << " : " << strerror(errno) << "\n";
+		}
+		fchmod(m_file_fd, m_entry.m_mode);
+		struct timespec times[2];
+		times[0].tv_sec = m_entry.m_mtime;
+		times[0].tv_nsec = 0;
+		times[1] = times[0];
+		futimens(m_file_fd, times);
+
+		if (m_hash_file) {
+			m_hash_file = false;
+			string digest = m_file_hasher.finalDigest();
+			m_deduped_bytes += ContentStore::dedupFile(m_dedup_mode, m_file_parent_fd, m_file_name, m_file_fd, digest.substr(digest.find(':') + 1));
+		}
+
+		if (close(m_file_fd) != 0) {
+			m_file_fd = -1;
+			throw ImageExtractionException("Couldn't write " + m_entry.m_path + " : " + strerror(errno));
+		}
+		m_file_fd = -1;
+	}
+
+	void LayerExtractor::applyMetadata(int parent_fd, const string& name, const TarEntry& entry, bool is_symlink)
+	{
+		if (m_preserve_owner) {
+			fchownat(parent_fd, name.c_str(), entry.m_uid, entry.m_gid, AT_SYMLINK_NOFOLLOW);
+		}
+		if (!is_symlink) {
+			fchmodat(parent_fd, name.c_str(), entry.m_mode, 0);
+		}
+		struct timespec times[2];
+		times[0].tv_sec = entry.m_mtime;
+		times[0].tv_nsec = 0;
+		times[1] = times[0];
+		utimensat(parent_fd, name.c_str(), times, AT_SYMLINK_NOFOLLOW);
+	}
+
+	void LayerExtractor::applyDeferredDirectories()
+	{
+		//deepest directories first, so setting a parent's mtime isn't undone by its children
+		for (auto it = m_deferred_directories.rbegin(); it != m_deferred_directories.rend(); ++it) {
+			TarEntry entry;
+			entry.m_mode = it->m_mode;
+			entry.m_uid = it->m_uid;
+			entry.m_gid = it->m_gid;
+			entry.m_mtime = it->m_mtime;
+
+			if (it->m_path.empty()) {
+				applyMetadata(m_root_fd, ".", entry, false);
+				continue;
+			}
+
+			string parent, name;
+			splitPath(it->m_path, parent, name);
+			try {
+				int parent_fd = openParentDir(parent);
+				applyMetadata(parent_fd, name, entry, false);
+			} catch (...) {
+				cerr << "Warning: couldn't restore metadata of directory " << it->m_path << "\n";
+			}
+		}
+		m_deferred_directories.clear();
+	}
+
+	int LayerExtractor::openParentDir(const string& parent_path)
+	{
+		if (m_cached_parent_fd >= 0 && parent_path == m_cached_parent_path) {
+			return m_cached_parent_fd;
+		}
+		if (m_cached_parent_fd >= 0) {
+			close(m_cached_parent_fd);
+			m_cached_parent_fd = -1;
+		}
+		m_cached_parent_fd = walkToDir(parent_path, true);
+		m_cached_parent_path = parent_path;
+		return m_cached_parent_fd;
+	}
+
+	int LayerExtractor::walkToDir(const string& path, bool create)
+	{
+		//walk one component at a time without following symlinks
+		//this keeps a crafted layer from writing outside of the target directory through a symlinked parent
+		int fd = openat(m_root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) {
+			throw ImageExtractionException("Couldn't open " + m_target_dir + " : " + strerror(errno));
+		}
+
+		size_t start = 0;
+		while (start < path.size()) {
+			size_t end = path.find('/', start);
+			if (end == string::npos) end = path.size();
+			string component = path.substr(start, end - start);
+			start = end + 1;
+
+			int next = openat(fd, component.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (next < 0 && errno == ENOENT && create) {
+				if (mkdirat(fd, component.c_str(), 0755) != 0 && errno != EEXIST) {
+					int saved_errno = errno;
+					close(fd);
+					throw ImageExtractionException("Couldn't create directory " + path + " : " + strerror(saved_errno));
+				}
+				next = openat(fd, component.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			}
+			int saved_errno = errno;
+			close(fd);
+			if (next < 0) {
+				throw ImageExtractionException("Couldn't open directory " + path + " inside the image layer : " + strerror(saved_errno));
+			}
+			fd = next;
+		}
+		return fd;
+	}
+
+	void LayerExtractor::removeExisting(int parent_fd, const string& name, bool keep_directory)
+	{
+		struct stat st;
+		if (fstatat(parent_fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			return;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			if (keep_directory) return;
+			//same as tar, only an empty directory can be replaced by another kind of entry
+			unlinkat(parent_fd, name.c_str(), AT_REMOVEDIR);
+		} else {
+			unlinkat(parent_fd, name.c_str(), 0);
+		}
+	}
+
+	void LayerExtractor::splitPath(const string& path, string& parent, string& name) const
+	{
+		size_t slash = path.rfind('/');
+		if (slash == string::npos) {
+			parent = "";
+			name = path;
+		} else {
+			parent = path.substr(0, slash);
+			name = path.substr(slash + 1);
+		}
+	}
+
+	bool LayerExtractor::sanitizePath(string& path)
+	{
+		//drop leading "/" and "./", "." components and repeated slashes; reject anything escaping with ".."
+		string clean;
+		size_t start = 0;
+		while (start <= path.size()) {
+			size_t end = path.find('/', start);
+			if (end == string::npos) end = path.size();
+			string component = path.substr(start, end - start);
+			start = end + 1;
+
+			if (component.empty() || component == ".") continue;
+			if (component == "..") return false;
+			if (!clean.empty()) clean += "/";
+			clean += component;
+		}
+		path = clean;
+		return true;
+	}
+
+	uint64_t LayerExtractor::parseNumeric(const unsigned char* field, size_t len)
+	{
+		//GNU base-256 encoding for values that don't fit the octal field
+		if (field[0] & 0x80) {
+			if (field[0] == 0xff) return 0; //negative values don't make sense for us
+			uint64_t value = field[0] & 0x7f;
+			for (size_t i = 1; i < len; i++) {
+				value = (value << 8) | field[i];
+			}
+			return value;
+		}
+
+		size_t i = 0;
+		while (i < len && (field[i] == ' ' || field[i] == '\0')) i++;
+		uint64_t value = 0;
+		while (i < len && field[i] >= '0' && field[i] <= '7') {
+			value = (value << 3) | static_cast<uint64_t>(field[i] - '0');
+			i++;
+		}
+		return value;
+	}
+
+	string LayerExtractor::parseString(const unsigned char* field, size_t len)
+	{
+		size_t n = 0;
+		while (n < len && field[n] != '\0') n++;
+		return string(reinterpret_cast<const char*>(field), n);
+	}
+
+	void LayerExtractor::finish()
+	{
+		if (m_finished) return;
+
+		if (m_compression == Compression::UNKNOWN) {
+			throw ImageExtractionException(m_magic.empty() ? "Image layer tarball is empty!" : "Image layer tarball is truncated!");
+		}
+		if (m_parallel_inflater && !m_parallel_inflater->started()) {
+			//blob is smaller than a batch, not worth the threads
+			vector<unsigned char> buffered = m_parallel_inflater->takeInput();
+			m_parallel_inflater.reset();
+			inflateChunk(buffered.data(), buffered.size());
+		} else if (m_parallel_inflater) {
+			m_parallel_inflater->finish();
+			if (m_parallel_inflater->ended()) {
+				endParallelInflate();
+			}
+		}
+		if (m_compression == Compression::GZIP && (m_parallel_inflater || !m_gzip_member_ended)) {
+			throw ImageExtractionException("Image layer ended before the end of its gzip stream!");
+		}
+		if (m_compression == Compression::ZSTD) {
+			collectZstdFrames(true);
+			if (m_zstd_streaming_frame || !m_zstd_input.empty()) {
+				throw ImageExtractionException("Image layer ended before the end of its zstd stream!");
+			}
+		}
+		//some tools don't write the two trailing zero blocks, that's fine as long as we stopped on an entry boundary
+		bool on_boundary = m_tar_state == TarState::END_OF_ARCHIVE || (m_tar_state == TarState::HEADER && m_header_filled == 0);
+		if (!on_boundary) {
+			throw ImageExtractionException("Image layer tarball is truncated!");
+		}
+
+		applyDeferredDirectories();
+		if (m_whiteouts_converted) LayerWhiteouts::markConverted(m_root_fd);
+		closeFds();
+		m_finished = true;
+	}
+
+	uint64_t LayerExtractor::getUncompressedBytes() const
+	{
+		return m_tar_bytes;
+	}
+
+	string LayerExtractor::getCompressionName() const
+	{
+		switch (m_compression) {
+		case Compression::GZIP: return "gzip";
+		case Compression::ZSTD: return "zstd";
+		case Compression::NONE: return "none";
+		default: return "unknown";
+		}
+	}
+
+	uint64_t LayerExtractor::getDedupedBytes() const
+	{
+		return m_deduped_bytes;
+	}
+}
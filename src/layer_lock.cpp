@@ -0,0 +1,84 @@
+#include "../include/minidocker/layer_lock.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+static string lock_dir = "/var/lib/minidocker/locks";
+
+namespace minidocker
+{
+	LayerLock::LayerLock(const string& image_digest) : m_digest(image_digest), m_path(getLockPath(image_digest))
+	{
+		error_code ec;
+		fs::create_directories(lock_dir, ec);
+		//lock files are never removed, deleting one while another process waits on it would let two holders in
+		m_fd = open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (m_fd < 0) {
+			throw ImageTarballException("Couldn't open layer lock " + m_path + " : " + strerror(errno));
+		}
+	}
+
+	LayerLock::~LayerLock()
+	{
+		unlock();
+		close(m_fd);
+	}
+
+	bool LayerLock::acquire(int operation)
+	{
+		if (m_locked) return true;
+		while (flock(m_fd, operation) != 0) {
+			if (errno == EINTR) continue;
+			if (errno == EWOULDBLOCK && (operation & LOCK_NB)) return false;
+			throw ImageTarballException("Couldn't lock " + m_path + " : " + strerror(errno));
+		}
+		m_locked = true;
+		return true;
+	}
+
+	bool LayerLock::tryLock()
+	{
+		return acquire(LOCK_EX | LOCK_NB);
+	}
+
+	void LayerLock::lock()
+	{
+		acquire(LOCK_EX);
+	}
+
+	bool LayerLock::tryLockShared()
+	{
+		return acquire(LOCK_SH | LOCK_NB);
+	}
+
+	void LayerLock::lockShared()
+	{
+		acquire(LOCK_SH);
+	}
+
+	void LayerLock::unlock()
+	{
+		if (!m_locked) return;
+		flock(m_fd, LOCK_UN);
+		m_locked = false;
+	}
+
+	const string& LayerLock::getDigest() const
+	{
+		return m_digest;
+	}
+
+	string LayerLock::getLockPath(const string& image_digest)
+	{
+		string digest_clean = image_digest.substr(image_digest.find(":") + 1); // remove "sha256:"
+		return lock_dir + "/" + digest_clean + ".lock";
+	}
+}
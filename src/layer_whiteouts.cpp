@@ -0,0 +1,189 @@
+#include "../include/minidocker/layer_whiteouts.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+static const char* opaque_xattr = "trusted.overlay.opaque";
+static const char* converted_xattr = "trusted.minidocker.whiteouts";
+static const string whiteout_prefix = ".wh.";
+static const string opaque_marker = ".wh..wh..opq";
+
+namespace
+{
+	void copyMetadata(const string& path, const struct stat& st)
+	{
+		//best effort, like the extractor : an unprivileged copy can't give files away
+		if (lchown(path.c_str(), st.st_uid, st.st_gid) != 0) {}
+		if (!S_ISLNK(st.st_mode)) chmod(path.c_str(), st.st_mode & 07777);
+		struct timespec times[2] = { st.st_atim, st.st_mtim };
+		utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+	}
+
+	void removeEntries(const string& dir)
+	{
+		error_code ec;
+		vector<fs::path> entries;
+		for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+			entries.push_back(it->path());
+		}
+		for (const fs::path& path : entries) {
+			fs::remove_all(path, ec);
+		}
+	}
+}
+
+namespace minidocker
+{
+	bool LayerWhiteouts::apply(int parent_fd, const string& name)
+	{
+		if (name == opaque_marker) {
+			return fsetxattr(parent_fd, opaque_xattr, "y", 1, 0) == 0;
+		}
+		string hidden = name.substr(whiteout_prefix.size());
+		if (hidden.empty() || hidden == "." || hidden == "..") return true;
+		return mknodat(parent_fd, hidden.c_str(), S_IFCHR | 0, makedev(0, 0)) == 0;
+	}
+
+	void LayerWhiteouts::markConverted(int layer_fd)
+	{
+		fsetxattr(layer_fd, converted_xattr, "1", 1, 0);
+	}
+
+	bool LayerWhiteouts::isConverted(const string& layer_dir)
+	{
+		char value[1];
+		return getxattr(layer_dir.c_str(), converted_xattr, value, sizeof(value)) == 1;
+	}
+
+	bool LayerWhiteouts::convertLayer(const string& layer_dir)
+	{
+		if (isConverted(layer_dir)) return true;
+
+		//collected first, converting changes the directories being walked
+		vector<fs::path> whiteouts;
+		error_code ec;
+		for (fs::recursive_directory_iterator it(layer_dir, ec), end; !ec && it != end; it.increment(ec)) {
+			if (it->path().filename().string().rfind(whiteout_prefix, 0) == 0) {
+				whiteouts.push_back(it->path());
+			}
+		}
+
+		bool converted = true;
+		for (const fs::path& path : whiteouts) {
+			string parent = path.parent_path().string();
+			int parent_fd = open(parent.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (parent_fd < 0) {
+				converted = false;
+				continue;
+			}
+			//the directory keeps its mtime, like it had when it was extracted
+			struct stat parent_st;
+			fstat(parent_fd, &parent_st);
+			string name = path.filename().string();
+			if (name != opaque_marker) {
+				//a whiteout takes the place of whatever the layer itself put there
+				fs::remove_all(path.parent_path() / name.substr(whiteout_prefix.size()), ec);
+			}
+			if (apply(parent_fd, name)) {
+				unlinkat(parent_fd, name.c_str(), 0);
+			} else {
+				converted = false;
+			}
+			struct timespec times[2] = { parent_st.st_atim, parent_st.st_mtim };
+			futimens(parent_fd, times);
+			close(parent_fd);
+		}
+
+		int layer_fd = open(layer_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (layer_fd < 0) return false;
+		if (converted) markConverted(layer_fd);
+		close(layer_fd);
+		return converted;
+	}
+
+	bool LayerWhiteouts::isWhiteout(const struct stat& st)
+	{
+		return S_ISCHR(st.st_mode) && st.st_rdev == makedev(0, 0);
+	}
+
+	bool LayerWhiteouts::isOpaque(const string& dir)
+	{
+		char value[1];
+		return getxattr(dir.c_str(), opaque_xattr, value, sizeof(value)) == 1 && value[0] == 'y';
+	}
+
+	void LayerWhiteouts::mergeLayer(const string& layer_dir, const string& target_dir, bool link_files)
+	{
+		//an opaque directory hides whatever the layers below put in it
+		struct stat st;
+		if (isOpaque(layer_dir) || lstat((layer_dir + "/" + opaque_marker).c_str(), &st) == 0) {
+			removeEntries(target_dir);
+		}
+
+		for (const fs::directory_entry& entry : fs::directory_iterator(layer_dir)) {
+			string name = entry.path().filename().string();
+			string source = entry.path().string();
+			string target = target_dir + "/" + name;
+			error_code ec;
+			if (name == opaque_marker) continue;
+			//".wh.<name>" deletes <name> of the layers below
+			if (name.rfind(whiteout_prefix, 0) == 0) {
+				fs::remove_all(target_dir + "/" + name.substr(whiteout_prefix.size()), ec);
+				continue;
+			}
+			if (lstat(source.c_str(), &st) != 0) continue;
+			if (isWhiteout(st)) {
+				fs::remove_all(target, ec);
+				continue;
+			}
+
+			struct stat target_st;
+			bool exists = lstat(target.c_str(), &target_st) == 0;
+			if (S_ISDIR(st.st_mode)) {
+				//directories are merged, the upper layer's metadata wins
+				if (exists && !S_ISDIR(target_st.st_mode)) {
+					fs::remove(target, ec);
+					exists = false;
+				}
+				if (!exists && mkdir(target.c_str(), 0700) != 0) {
+					throw ContainerRuntimeException("Couldn't create " + target + " : " + strerror(errno));
+				}
+				mergeLayer(source, target, link_files);
+				copyMetadata(target, st);
+				continue;
+			}
+
+			if (exists) fs::remove_all(target, ec);
+			if (link_files) {
+				//links don't follow symlinks, so those are linked as they are
+				if (link(source.c_str(), target.c_str()) == 0) continue;
+				//a file of a base layer can be in more snapshots and images than the file system allows links, it's copied then
+				if (errno != EMLINK) {
+					throw ContainerRuntimeException("Couldn't link " + source + " : " + strerror(errno));
+				}
+			}
+			if (S_ISREG(st.st_mode)) {
+				fs::copy_file(source, target, ec);
+			} else if (S_ISLNK(st.st_mode)) {
+				fs::copy_symlink(source, target, ec);
+			} else if (mknod(target.c_str(), st.st_mode, st.st_rdev) != 0) {
+				//device nodes need privileges, the container doesn't rely on them anyway
+				continue;
+			}
+			if (ec) {
+				throw ContainerRuntimeException("Couldn't copy " + source + " : " + ec.message());
+			}
+			copyMetadata(target, st);
+		}
+	}
+}
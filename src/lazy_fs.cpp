@@ -0,0 +1,387 @@
+#include "../include/minidocker/lazy_fs.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <linux/fuse.h>
+#include <poll.h>
+#include <string>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+static const unsigned int server_threads = 4;
+static const uint32_t max_write = 128 * 1024;
+static const size_t request_buffer_size = max_write + 64 * 1024;
+static const uint64_t cache_timeout = 24 * 60 * 60; //a layer never changes, the kernel may cache names and attributes for as long as it likes
+
+namespace minidocker
+{
+	LazyFs::LazyFs(shared_ptr<const LazyLayer> layer, LazyLayer::RangeReader reader, const string& mount_dir, const string& cache_dir)
+		: m_layer(move(layer)), m_reader(move(reader)), m_mount_dir(mount_dir), m_cache_dir(cache_dir)
+	{
+		fs::create_directories(m_mount_dir);
+		fs::create_directories(m_cache_dir);
+
+		//non blocking, so the server threads notice when they should stop
+		m_fuse_fd = open("/dev/fuse", O_RDWR | O_CLOEXEC | O_NONBLOCK);
+		if (m_fuse_fd < 0) {
+			throw MountException("Couldn't open /dev/fuse to serve a lazily pulled layer! (" + string(strerror(errno)) + ")");
+		}
+		string options = "fd=" + to_string(m_fuse_fd) + ",rootmode=40000,user_id=" + to_string(getuid()) +
+			",group_id=" + to_string(getgid()) + ",allow_other,default_permissions";
+		if (mount("minidocker-lazy", m_mount_dir.c_str(), "fuse", MS_RDONLY | MS_NOSUID | MS_NODEV, options.c_str()) != 0) {
+			int mount_errno = errno;
+			close(m_fuse_fd);
+			throw MountException("Couldn't mount lazily pulled layer " + m_layer->getDigest() + " ! (" + string(strerror(mount_errno)) + ")");
+		}
+
+		for (unsigned int i = 0; i < server_threads; i++) {
+			m_threads.emplace_back(&LazyFs::serve, this);
+		}
+	}
+
+	LazyFs::~LazyFs()
+	{
+		umount2(m_mount_dir.c_str(), MNT_DETACH);
+		m_stopping = true;
+		for (thread& t : m_threads) {
+			t.join();
+		}
+		//closing the device aborts whatever the kernel still has queued
+		close(m_fuse_fd);
+		for (auto& [index, fd] : m_cache_fds) {
+			close(fd);
+		}
+	}
+
+	void LazyFs::useExtractedLayer(const string& image_layer_dir)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_image_layer_dir = image_layer_dir;
+	}
+
+	void LazyFs::serve()
+	{
+		vector<char> buffer(request_buffer_size);
+		while (!m_stopping) {
+			pollfd pfd = { m_fuse_fd, POLLIN, 0 };
+			if (poll(&pfd, 1, 200) <= 0) continue;
+
+			ssize_t len = read(m_fuse_fd, buffer.data(), buffer.size());
+			if (len < 0) {
+				//another thread took the request, or it was interrupted before we got to it
+				if (errno == EAGAIN || errno == EINTR || errno == ENOENT) continue;
+				break; //ENODEV - the file system was unmounted
+			}
+			if (static_cast<size_t>(len) < sizeof(fuse_in_header)) continue;
+			handleRequest(buffer.data(), static_cast<size_t>(len));
+		}
+	}
+
+	void LazyFs::reply(uint64_t unique, int error, const void* data, size_t len)
+	{
+		fuse_out_header header = {};
+		header.len = sizeof(header) + (error == 0 ? len : 0);
+		header.error = -error;
+		header.unique = unique;
+		iovec iov[2] = { { &header, sizeof(header) }, { const_cast<void*>(data), len } };
+		//fails with ENOENT if the request was interrupted meanwhile, nobody is waiting for the answer then
+		ssize_t written = writev(m_fuse_fd, iov, error == 0 && len > 0 ? 2 : 1);
+		(void)written;
+	}
+
+	static void fillAttr(const LazyEntry& entry, size_t index, fuse_attr& attr)
+	{
+		attr = {};
+		attr.ino = index + 1;
+		attr.size = S_ISLNK(entry.m_mode) ? entry.m_link_target.size() : entry.m_size;
+		attr.blocks = (attr.size + 511) / 512;
+		attr.atime = attr.mtime = attr.ctime = static_cast<uint64_t>(entry.m_mtime);
+		attr.mode = entry.m_mode;
+		attr.nlink = entry.m_nlink;
+		attr.uid = entry.m_uid;
+		attr.gid = entry.m_gid;
+		attr.rdev = static_cast<uint32_t>(entry.m_rdev);
+		attr.blksize = 4096;
+	}
+
+	static const string* findXattr(const LazyEntry& entry, const string& name)
+	{
+		static const string opaque = "y";
+		if (entry.m_opaque && name == "trusted.overlay.opaque") return &opaque;
+		auto it = entry.m_xattrs.find(name);
+		return it == entry.m_xattrs.end() ? nullptr : &it->second;
+	}
+
+	void LazyFs::handleRequest(const char* request, size_t len)
+	{
+		const fuse_in_header* in = reinterpret_cast<const fuse_in_header*>(request);
+		const char* arg = request + sizeof(fuse_in_header);
+		size_t arg_len = len - sizeof(fuse_in_header);
+		const vector<LazyEntry>& entries = m_layer->getEntries();
+
+		//these are never answered
+		if (in->opcode == FUSE_FORGET || in->opcode == FUSE_BATCH_FORGET || in->opcode == FUSE_INTERRUPT) {
+			return;
+		}
+		if (in->opcode == FUSE_INIT) {
+			const fuse_init_in* init = reinterpret_cast<const fuse_init_in*>(arg);
+			if (arg_len < 16 || init->major < 7) {
+				reply(in->unique, EPROTO, nullptr, 0);
+				return;
+			}
+			fuse_init_out out = {};
+			out.major = FUSE_KERNEL_VERSION;
+			out.minor = FUSE_KERNEL_MINOR_VERSION;
+			out.max_readahead = init->max_readahead;
+			out.flags = init->flags & (FUSE_ASYNC_READ | FUSE_PARALLEL_DIROPS | FUSE_CACHE_SYMLINKS);
+			out.max_background = 16;
+			out.congestion_threshold = 12;
+			out.max_write = max_write;
+			out.time_gran = 1;
+			reply(in->unique, 0, &out, init->minor < 23 ? FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof(out));
+			return;
+		}
+
+		if (in->nodeid == 0 || in->nodeid > entries.size()) {
+			reply(in->unique, ENOENT, nullptr, 0);
+			return;
+		}
+		size_t index = in->nodeid - 1;
+		const LazyEntry& entry = entries[index];
+
+		switch (in->opcode) {
+		case FUSE_LOOKUP: {
+			string name(arg, strnlen(arg, arg_len));
+			fuse_entry_out out = {};
+			auto child = entry.m_children.find(name);
+			//a miss is answered with node 0, so the kernel caches it as well (think of $PATH lookups)
+			if (child != entry.m_children.end()) {
+				out.nodeid = child->second + 1;
+				fillAttr(entries[child->second], child->second, out.attr);
+				out.attr_valid = cache_timeout;
+			}
+			out.entry_valid = cache_timeout;
+			reply(in->unique, 0, &out, sizeof(out));
+			break;
+		}
+		case FUSE_GETATTR: {
+			fuse_attr_out out = {};
+			fillAttr(entry, index, out.attr);
+			out.attr_valid = cache_timeout;
+			reply(in->unique, 0, &out, sizeof(out));
+			break;
+		}
+		case FUSE_READLINK:
+			if (!S_ISLNK(entry.m_mode)) {
+				reply(in->unique, EINVAL, nullptr, 0);
+			} else {
+				reply(in->unique, 0, entry.m_link_target.data(), entry.m_link_target.size());
+			}
+			break;
+		case FUSE_OPEN:
+		case FUSE_OPENDIR: {
+			const fuse_open_in* open_in = reinterpret_cast<const fuse_open_in*>(arg);
+			if ((open_in->flags & O_ACCMODE) != O_RDONLY) {
+				reply(in->unique, EROFS, nullptr, 0);
+				break;
+			}
+			fuse_open_out out = {};
+			out.open_flags = FOPEN_KEEP_CACHE | (in->opcode == FUSE_OPENDIR ? FOPEN_CACHE_DIR : 0);
+			reply(in->unique, 0, &out, sizeof(out));
+			break;
+		}
+		case FUSE_READ: {
+			const fuse_read_in* read_in = reinterpret_cast<const fuse_read_in*>(arg);
+			string data;
+			int error = readFile(index, read_in->offset, read_in->size, data);
+			reply(in->unique, error, data.data(), data.size());
+			break;
+		}
+		case FUSE_READDIR: {
+			//offset is the position in ". .. children...", entries beyond what fits are asked for again
+			const fuse_read_in* read_in = reinterpret_cast<const fuse_read_in*>(arg);
+			vector<char> out;
+			uint64_t position = 0;
+			auto addEntry = [&](const string& name, size_t child_index) {
+				position++;
+				if (position <= read_in->offset) return true;
+				size_t record_len = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + name.size());
+				if (out.size() + record_len > read_in->size) return false;
+				size_t at = out.size();
+				out.resize(at + record_len, 0);
+				fuse_dirent* dirent = reinterpret_cast<fuse_dirent*>(out.data() + at);
+				dirent->ino = child_index + 1;
+				dirent->off = position;
+				dirent->namelen = name.size();
+				dirent->type = (entries[child_index].m_mode & S_IFMT) >> 12;
+				memcpy(dirent->name, name.data(), name.size());
+				return true;
+			};
+			if (addEntry(".", index) && addEntry("..", entry.m_parent)) {
+				for (const auto& [name, child_index] : entry.m_children) {
+					if (!addEntry(name, child_index)) break;
+				}
+			}
+			reply(in->unique, 0, out.data(), out.size());
+			break;
+		}
+		case FUSE_STATFS: {
+			fuse_statfs_out out = {};
+			for (const LazyEntry& e : entries) out.st.blocks += (e.m_size + 4095) / 4096;
+			out.st.files = entries.size();
+			out.st.bsize = 4096;
+			out.st.frsize = 4096;
+			out.st.namelen = 255;
+			reply(in->unique, 0, &out, sizeof(out));
+			break;
+		}
+		case FUSE_GETXATTR: {
+			const fuse_getxattr_in* getxattr_in = reinterpret_cast<const fuse_getxattr_in*>(arg);
+			const char* name = arg + sizeof(fuse_getxattr_in);
+			const string* value = findXattr(entry, string(name, strnlen(name, arg_len - sizeof(fuse_getxattr_in))));
+			if (!value) {
+				reply(in->unique, ENODATA, nullptr, 0);
+			} else if (getxattr_in->size == 0) {
+				fuse_getxattr_out out = {};
+				out.size = value->size();
+				reply(in->unique, 0, &out, sizeof(out));
+			} else if (getxattr_in->size < value->size()) {
+				reply(in->unique, ERANGE, nullptr, 0);
+			} else {
+				reply(in->unique, 0, value->data(), value->size());
+			}
+			break;
+		}
+		case FUSE_LISTXATTR: {
+			const fuse_getxattr_in* getxattr_in = reinterpret_cast<const fuse_getxattr_in*>(arg);
+			string names;
+			if (entry.m_opaque) names.append("trusted.overlay.opaque", 23);
+			for (const auto& [name, value] : entry.m_xattrs) names.append(name.c_str(), name.size() + 1);
+			if (getxattr_in->size == 0) {
+				fuse_getxattr_out out = {};
+				out.size = names.size();
+				reply(in->unique, 0, &out, sizeof(out));
+			} else if (getxattr_in->size < names.size()) {
+				reply(in->unique, ERANGE, nullptr, 0);
+			} else {
+				reply(in->unique, 0, names.data(), names.size());
+			}
+			break;
+		}
+		case FUSE_RELEASE:
+		case FUSE_RELEASEDIR:
+		case FUSE_FLUSH:
+		case FUSE_ACCESS:
+		case FUSE_DESTROY:
+			reply(in->unique, 0, nullptr, 0);
+			break;
+		default:
+			reply(in->unique, ENOSYS, nullptr, 0);
+			break;
+		}
+	}
+
+	string LazyFs::getPath(size_t index) const
+	{
+		const vector<LazyEntry>& entries = m_layer->getEntries();
+		string path;
+		for (size_t i = index; i != 0; i = entries[i].m_parent) {
+			path = "/" + entries[i].m_name + path;
+		}
+		return path;
+	}
+
+	int LazyFs::getCacheFd(size_t index)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		auto it = m_cache_fds.find(index);
+		if (it != m_cache_fds.end()) return it->second;
+
+		//sparse, chunks are written into place as they arrive
+		string cache_path = m_cache_dir + "/" + to_string(index + 1);
+		int fd = open(cache_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (fd < 0) return -1;
+		if (ftruncate(fd, static_cast<off_t>(m_layer->getEntries()[index].m_size)) != 0) {
+			close(fd);
+			return -1;
+		}
+		m_cache_fds[index] = fd;
+		m_cached_chunks[index].assign(m_layer->getEntries()[index].m_chunks.size(), false);
+		return fd;
+	}
+
+	bool LazyFs::readExtractedFile(size_t index, uint64_t offset, uint64_t len, string& data)
+	{
+		string image_layer_dir;
+		{
+			lock_guard<mutex> lock(m_mutex);
+			image_layer_dir = m_image_layer_dir;
+		}
+		if (image_layer_dir.empty()) return false;
+
+		int fd = open((image_layer_dir + getPath(index)).c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+		if (fd < 0) return false;
+		data.resize(len);
+		ssize_t n = pread(fd, &data[0], len, static_cast<off_t>(offset));
+		close(fd);
+		if (n < 0) return false;
+		data.resize(static_cast<size_t>(n));
+		return true;
+	}
+
+	int LazyFs::readFile(size_t index, uint64_t offset, uint32_t size, string& data)
+	{
+		const LazyEntry& entry = m_layer->getEntries()[index];
+		if (!S_ISREG(entry.m_mode)) return EINVAL;
+		if (offset >= entry.m_size) return 0;
+		uint64_t end = min<uint64_t>(entry.m_size, offset + size);
+
+		if (readExtractedFile(index, offset, end - offset, data)) return 0;
+
+		int fd = getCacheFd(index);
+		if (fd < 0) return EIO;
+
+		//fetch the chunks the read touches that aren't in the cache file yet
+		const vector<LazyChunk>& chunks = entry.m_chunks;
+		auto first = upper_bound(chunks.begin(), chunks.end(), offset,
+			[](uint64_t value, const LazyChunk& chunk) { return value < chunk.m_file_offset; });
+		size_t chunk_index = first == chunks.begin() ? 0 : static_cast<size_t>(first - chunks.begin()) - 1;
+		for (; chunk_index < chunks.size() && chunks[chunk_index].m_file_offset < end; chunk_index++) {
+			{
+				lock_guard<mutex> lock(m_mutex);
+				if (m_cached_chunks[index][chunk_index]) continue;
+			}
+			const LazyChunk& chunk = chunks[chunk_index];
+			try {
+				string compressed = chunk.m_zeros ? "" : m_reader(chunk.m_blob_offset, chunk.m_blob_end - chunk.m_blob_offset);
+				string chunk_data = m_layer->decodeChunk(chunk, compressed);
+				if (pwrite(fd, chunk_data.data(), chunk_data.size(), static_cast<off_t>(chunk.m_file_offset)) != static_cast<ssize_t>(chunk_data.size())) {
+					return EIO;
+				}
+			} catch (const exception& ex) {
+				cerr << "Warning: couldn't fetch " << getPath(index) << " of lazily pulled layer " << m_layer->getDigest() << " : " << ex.what() << "\n";
+				return EIO;
+			}
+			//two readers of the same chunk may both fetch it, they write the same bytes
+			lock_guard<mutex> lock(m_mutex);
+			m_cached_chunks[index][chunk_index] = true;
+		}
+
+		data.resize(end - offset);
+		ssize_t n = pread(fd, &data[0], data.size(), static_cast<off_t>(offset));
+		if (n < 0) return EIO;
+		data.resize(static_cast<size_t>(n));
+		return 0;
+	}
+}
@@ -0,0 +1,403 @@
+#include "../include/minidocker/lazy_layer.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include "../include/minidocker/image.hpp"
+#include "../include/minidocker/sha256.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <vector>
+#include <zlib.h>
+#include <zstd.h>
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+using namespace std;
+
+static const string estargz_toc_digest_annotation = "containerd.io/snapshot/stargz/toc.digest";
+static const string zstd_chunked_position_annotation = "io.github.containers.zstd-chunked.manifest-position";
+static const string zstd_chunked_checksum_annotation = "io.github.containers.zstd-chunked.manifest-checksum";
+static const size_t estargz_footer_size = 51;
+static const size_t estargz_legacy_footer_size = 47;
+static const uint64_t max_toc_size = 256 * 1024 * 1024;
+
+namespace minidocker
+{
+	//gzip member or zstd frames, up to limit bytes of output
+	static string decompress(const string& compressed, uint64_t limit)
+	{
+		const unsigned char* in = reinterpret_cast<const unsigned char*>(compressed.data());
+		uint32_t magic = compressed.size() >= 4 ? in[0] | (in[1] << 8) | (in[2] << 16) | (static_cast<uint32_t>(in[3]) << 24) : 0;
+		string output;
+		if (compressed.size() >= 2 && in[0] == 0x1f && in[1] == 0x8b) {
+			z_stream zs = {};
+			if (inflateInit2(&zs, 15 + 32) != Z_OK) { // 15 + 32 -> detect gzip header
+				throw ImageTarballException("Couldn't initialize zlib!");
+			}
+			zs.next_in = const_cast<Bytef*>(in);
+			zs.avail_in = compressed.size();
+			int ret = Z_OK;
+			while (ret != Z_STREAM_END && output.size() < limit) {
+				size_t filled = output.size();
+				output.resize(filled + min<uint64_t>(limit - filled, 256 * 1024));
+				zs.next_out = reinterpret_cast<Bytef*>(&output[filled]);
+				zs.avail_out = output.size() - filled;
+				ret = inflate(&zs, Z_NO_FLUSH);
+				output.resize(output.size() - zs.avail_out);
+				if (ret == Z_BUF_ERROR && zs.avail_in == 0) break; // all input used up
+				if (ret != Z_OK && ret != Z_STREAM_END) {
+					inflateEnd(&zs);
+					throw ImageTarballException("Corrupted gzip data in seekable layer! (" + string(zs.msg ? zs.msg : "inflate failed") + ")");
+				}
+				if (ret == Z_OK && zs.avail_in == 0 && zs.avail_out > 0) break;
+			}
+			inflateEnd(&zs);
+		} else if (magic == ZSTD_MAGICNUMBER || (magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START) {
+			ZSTD_DStream* stream = ZSTD_createDStream();
+			ZSTD_initDStream(stream);
+			ZSTD_inBuffer input = { in, compressed.size(), 0 };
+			while (output.size() < limit && input.pos < input.size) {
+				size_t filled = output.size();
+				output.resize(filled + min<uint64_t>(limit - filled, 256 * 1024));
+				ZSTD_outBuffer out = { &output[filled], output.size() - filled, 0 };
+				size_t ret = ZSTD_decompressStream(stream, &out, &input);
+				output.resize(filled + out.pos);
+				if (ZSTD_isError(ret)) {
+					ZSTD_freeDStream(stream);
+					throw ImageTarballException("Corrupted zstd data in seekable layer! (" + string(ZSTD_getErrorName(ret)) + ")");
+				}
+				if (out.pos == 0 && input.pos == input.size) break;
+			}
+			ZSTD_freeDStream(stream);
+		} else {
+			throw ImageTarballException("Seekable layer chunk is neither gzip nor zstd compressed!");
+		}
+		return output;
+	}
+
+	//"./usr//bin/" -> "usr/bin", empty if it tries to leave the layer
+	static string cleanPath(const string& path)
+	{
+		string cleaned;
+		size_t start = 0;
+		while (start <= path.size()) {
+			size_t end = path.find('/', start);
+			if (end == string::npos) end = path.size();
+			string part = path.substr(start, end - start);
+			start = end + 1;
+			if (part.empty() || part == ".") continue;
+			if (part == "..") return "";
+			cleaned += (cleaned.empty() ? "" : "/") + part;
+		}
+		return cleaned;
+	}
+
+	static time_t parseTime(const string& value)
+	{
+		//RFC 3339, the TOCs are written in UTC
+		struct tm tm = {};
+		if (!strptime(value.c_str(), "%Y-%m-%dT%H:%M:%S", &tm)) return 0;
+		return timegm(&tm);
+	}
+
+	static string decodeBase64(const string& value)
+	{
+		static const string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		string output;
+		unsigned int buffer = 0;
+		int bits = 0;
+		for (char c : value) {
+			size_t pos = alphabet.find(c);
+			if (pos == string::npos) continue; // padding
+			buffer = (buffer << 6) | static_cast<unsigned int>(pos);
+			bits += 6;
+			if (bits >= 8) {
+				bits -= 8;
+				output.push_back(static_cast<char>((buffer >> bits) & 0xff));
+			}
+		}
+		return output;
+	}
+
+	bool LazyLayer::isSeekable(const ImageLayer& layer)
+	{
+		return layer.m_annotations.count(estargz_toc_digest_annotation) > 0 ||
+			layer.m_annotations.count(zstd_chunked_position_annotation) > 0;
+	}
+
+	LazyLayer::LazyLayer(const ImageLayer& layer, const RangeReader& reader) : m_digest(layer.m_image_digest)
+	{
+		uint64_t toc_offset = 0;
+		string toc = layer.m_annotations.count(zstd_chunked_position_annotation) > 0
+			? fetchZstdChunkedToc(layer, reader, toc_offset)
+			: fetchEstargzToc(layer, reader, toc_offset);
+		buildTree(toc, toc_offset);
+	}
+
+	const vector<LazyEntry>& LazyLayer::getEntries() const
+	{
+		return m_entries;
+	}
+
+	const string& LazyLayer::getDigest() const
+	{
+		return m_digest;
+	}
+
+	string LazyLayer::fetchEstargzToc(const ImageLayer& layer, const RangeReader& reader, uint64_t& toc_offset)
+	{
+		uint64_t blob_size = strtoull(layer.m_image_size.c_str(), nullptr, 10);
+		if (blob_size < estargz_footer_size) {
+			throw ImageTarballException("Layer " + m_digest + " is too small to be an eStargz blob!");
+		}
+
+		//the footer is an empty gzip member whose extra field holds "<toc offset as 16 hex digits>STARGZ"
+		//the current one wraps it in an "SG" subfield, the legacy one is 4 bytes shorter and doesn't
+		string footer = reader(blob_size - estargz_footer_size, estargz_footer_size);
+		auto isGzipWithExtra = [&](size_t at, size_t xlen) {
+			const unsigned char* f = reinterpret_cast<const unsigned char*>(footer.data()) + at;
+			return f[0] == 0x1f && f[1] == 0x8b && (f[3] & 0x04) && (f[10] | (f[11] << 8)) == static_cast<int>(xlen);
+		};
+		size_t footer_size = 0;
+		string hex_offset;
+		if (footer.size() != estargz_footer_size) {
+			throw ImageTarballException("Registry sent a truncated eStargz footer for layer " + m_digest + " !");
+		} else if (isGzipWithExtra(0, 26) && footer[12] == 'S' && footer[13] == 'G' && footer.compare(32, 6, "STARGZ") == 0) {
+			footer_size = estargz_footer_size;
+			hex_offset = footer.substr(16, 16);
+		} else if (isGzipWithExtra(4, 22) && footer.compare(32, 6, "STARGZ") == 0) {
+			footer_size = estargz_legacy_footer_size;
+			hex_offset = footer.substr(16, 16);
+		} else {
+			throw ImageTarballException("Layer " + m_digest + " has no eStargz footer!");
+		}
+		toc_offset = strtoull(hex_offset.c_str(), nullptr, 16);
+		if (toc_offset >= blob_size - footer_size) {
+			throw ImageTarballException("eStargz footer of layer " + m_digest + " points outside of the blob!");
+		}
+
+		//the TOC is a tar with a single stargz.index.json entry, in its own gzip member
+		string tar = decompress(reader(toc_offset, blob_size - footer_size - toc_offset), max_toc_size);
+		if (tar.size() < 512 || tar.compare(0, 17, "stargz.index.json") != 0) {
+			throw ImageTarballException("eStargz TOC of layer " + m_digest + " is missing!");
+		}
+		uint64_t toc_size = strtoull(tar.substr(124, 12).c_str(), nullptr, 8);
+		if (tar.size() < 512 + toc_size) {
+			throw ImageTarballException("eStargz TOC of layer " + m_digest + " is truncated!");
+		}
+		string toc = tar.substr(512, toc_size);
+
+		const string& toc_digest = layer.m_annotations.at(estargz_toc_digest_annotation);
+		if (Sha256::digestOf(toc) != toc_digest) {
+			throw ImageTarballException("eStargz TOC of layer " + m_digest + " doesn't match digest " + toc_digest + " !");
+		}
+		return toc;
+	}
+
+	string LazyLayer::fetchZstdChunkedToc(const ImageLayer& layer, const RangeReader& reader, uint64_t& toc_offset)
+	{
+		//"<offset>:<compressed length>:<uncompressed length>:<type>", type 1 is the JSON TOC
+		unsigned long long offset = 0, length = 0, uncompressed_length = 0, type = 0;
+		const string& position = layer.m_annotations.at(zstd_chunked_position_annotation);
+		if (sscanf(position.c_str(), "%llu:%llu:%llu:%llu", &offset, &length, &uncompressed_length, &type) != 4 ||
+			type != 1 || uncompressed_length > max_toc_size) {
+			throw ImageTarballException("Unsupported zstd:chunked manifest position \"" + position + "\" for layer " + m_digest + " !");
+		}
+
+		string compressed = reader(offset, length);
+		auto checksum = layer.m_annotations.find(zstd_chunked_checksum_annotation);
+		if (checksum != layer.m_annotations.end() && Sha256::digestOf(compressed) != checksum->second) {
+			throw ImageTarballException("zstd:chunked TOC of layer " + m_digest + " doesn't match digest " + checksum->second + " !");
+		}
+		string toc = decompress(compressed, uncompressed_length);
+		if (toc.size() != uncompressed_length) {
+			throw ImageTarballException("zstd:chunked TOC of layer " + m_digest + " is truncated!");
+		}
+		toc_offset = offset;
+		return toc;
+	}
+
+	size_t LazyLayer::makeEntry(const string& path, bool create_dirs)
+	{
+		size_t current = 0;
+		size_t start = 0;
+		while (start < path.size()) {
+			size_t end = path.find('/', start);
+			if (end == string::npos) end = path.size();
+			string name = path.substr(start, end - start);
+			start = end + 1;
+
+			auto child = m_entries[current].m_children.find(name);
+			if (child != m_entries[current].m_children.end()) {
+				current = child->second;
+				continue;
+			}
+			if (!create_dirs) return string::npos;
+
+			//parent directories don't have to be listed before their content
+			LazyEntry entry;
+			entry.m_name = name;
+			entry.m_parent = current;
+			entry.m_mode = S_IFDIR | 0755;
+			m_entries.push_back(move(entry));
+			m_entries[current].m_children[name] = m_entries.size() - 1;
+			current = m_entries.size() - 1;
+		}
+		return current;
+	}
+
+	void LazyLayer::buildTree(const string& toc, uint64_t toc_offset)
+	{
+		json toc_json = json::parse(toc, nullptr, false);
+		if (toc_json.is_discarded() || !toc_json.contains("entries") || !toc_json["entries"].is_array()) {
+			throw ImageTarballException("TOC of layer " + m_digest + " isn't valid JSON!");
+		}
+
+		m_entries.clear();
+		LazyEntry root;
+		root.m_mode = S_IFDIR | 0755;
+		m_entries.push_back(root);
+
+		vector<uint64_t> blob_offsets;
+		vector<pair<size_t, string>> file_digests;
+		size_t last_file = string::npos;
+		for (const json& item : toc_json["entries"]) {
+			string type = item.value("type", "");
+			string path = cleanPath(item.value("name", ""));
+
+			auto readChunk = [&](uint64_t file_offset) {
+				LazyChunk chunk;
+				chunk.m_file_offset = file_offset;
+				chunk.m_blob_offset = item.value("offset", uint64_t(0));
+				chunk.m_blob_end = item.value("endOffset", uint64_t(0));
+				chunk.m_inner_offset = item.value("innerOffset", uint64_t(0));
+				chunk.m_digest = item.value("chunkDigest", "");
+				chunk.m_zeros = item.value("chunkType", "") == "zeros";
+				if (!chunk.m_zeros) blob_offsets.push_back(chunk.m_blob_offset);
+				return chunk;
+			};
+
+			if (type == "chunk") {
+				//the next piece of the file listed right before it
+				if (last_file != string::npos) {
+					m_entries[last_file].m_chunks.push_back(readChunk(item.value("chunkOffset", uint64_t(0))));
+				}
+				continue;
+			}
+			last_file = string::npos;
+
+			size_t slash = path.rfind('/');
+			string parent = slash == string::npos ? "" : path.substr(0, slash);
+			string name = slash == string::npos ? path : path.substr(slash + 1);
+			if (parent.empty() && (name == ".prefetch.landmark" || name == ".no.prefetch.landmark")) {
+				continue; //eStargz markers, not part of the image
+			}
+
+			if (name == ".wh..wh..opq") {
+				size_t dir = makeEntry(parent, true);
+				m_entries[dir].m_opaque = true;
+				continue;
+			}
+			bool whiteout = name.rfind(".wh.", 0) == 0;
+			if (whiteout) {
+				path = (parent.empty() ? "" : parent + "/") + name.substr(4);
+			}
+
+			if (type == "hardlink") {
+				size_t target = makeEntry(cleanPath(item.value("linkName", "")), false);
+				if (target == string::npos || path.empty()) continue;
+				size_t dir = makeEntry(parent, true);
+				m_entries[dir].m_children[name] = target;
+				m_entries[target].m_nlink++;
+				continue;
+			}
+
+			mode_t format = 0;
+			if (whiteout) format = S_IFCHR;
+			else if (type == "dir") format = S_IFDIR;
+			else if (type == "reg") format = S_IFREG;
+			else if (type == "symlink") format = S_IFLNK;
+			else if (type == "char") format = S_IFCHR;
+			else if (type == "block") format = S_IFBLK;
+			else if (type == "fifo") format = S_IFIFO;
+			else continue;
+			if (path.empty() && format != S_IFDIR) continue;
+
+			size_t index = makeEntry(path, true);
+			LazyEntry& entry = m_entries[index];
+			entry.m_mode = format | (whiteout ? 0 : (item.value("mode", 0u) & 07777));
+			entry.m_uid = item.value("uid", 0u);
+			entry.m_gid = item.value("gid", 0u);
+			entry.m_mtime = parseTime(item.value("modtime", ""));
+			entry.m_size = 0;
+			entry.m_rdev = whiteout ? 0 : makedev(item.value("devMajor", 0u), item.value("devMinor", 0u));
+			entry.m_link_target = item.value("linkName", "");
+			entry.m_chunks.clear();
+			entry.m_xattrs.clear();
+			if (format != S_IFDIR) entry.m_children.clear();
+			if (item.contains("xattrs") && item["xattrs"].is_object() && !whiteout) {
+				for (const auto& [key, value] : item["xattrs"].items()) {
+					if (value.is_string()) entry.m_xattrs[key] = decodeBase64(value.get<string>());
+				}
+			}
+
+			if (format == S_IFREG) {
+				entry.m_size = item.value("size", uint64_t(0));
+				if (entry.m_size > 0) {
+					entry.m_chunks.push_back(readChunk(0));
+					file_digests.push_back({ index, item.value("digest", "") });
+				}
+				last_file = index;
+			}
+		}
+
+		//a chunk ends where the next one in the blob starts, unless the TOC says so itself (zstd:chunked does)
+		sort(blob_offsets.begin(), blob_offsets.end());
+		for (LazyEntry& entry : m_entries) {
+			for (size_t i = 0; i < entry.m_chunks.size(); i++) {
+				LazyChunk& chunk = entry.m_chunks[i];
+				uint64_t next_file_offset = i + 1 < entry.m_chunks.size() ? entry.m_chunks[i + 1].m_file_offset : entry.m_size;
+				if (next_file_offset < chunk.m_file_offset) {
+					throw ImageTarballException("TOC of layer " + m_digest + " has overlapping chunks!");
+				}
+				chunk.m_size = next_file_offset - chunk.m_file_offset;
+				if (chunk.m_blob_end == 0) {
+					auto next = upper_bound(blob_offsets.begin(), blob_offsets.end(), chunk.m_blob_offset);
+					chunk.m_blob_end = next != blob_offsets.end() ? *next : toc_offset;
+				}
+				if (!chunk.m_zeros && chunk.m_blob_end <= chunk.m_blob_offset) {
+					throw ImageTarballException("TOC of layer " + m_digest + " has a chunk outside of the blob!");
+				}
+			}
+			if (S_ISDIR(entry.m_mode)) entry.m_nlink = 2;
+		}
+		//files stored as one chunk are checked against the digest of the whole file
+		for (const auto& [index, digest] : file_digests) {
+			vector<LazyChunk>& chunks = m_entries[index].m_chunks;
+			if (chunks.size() == 1 && chunks[0].m_digest.empty()) chunks[0].m_digest = digest;
+		}
+		for (size_t i = 1; i < m_entries.size(); i++) {
+			if (S_ISDIR(m_entries[i].m_mode)) m_entries[m_entries[i].m_parent].m_nlink++;
+		}
+	}
+
+	string LazyLayer::decodeChunk(const LazyChunk& chunk, const string& compressed) const
+	{
+		if (chunk.m_zeros) {
+			return string(chunk.m_size, '\0');
+		}
+		//several small files can share one compressed range, innerOffset says where this one starts in it
+		string data = decompress(compressed, chunk.m_inner_offset + chunk.m_size);
+		if (data.size() != chunk.m_inner_offset + chunk.m_size) {
+			throw ImageTarballException("Chunk of layer " + m_digest + " is truncated!");
+		}
+		data.erase(0, chunk.m_inner_offset);
+		if (chunk.m_digest.rfind("sha256:", 0) == 0 && Sha256::digestOf(data) != chunk.m_digest) {
+			throw ImageTarballException("Chunk of layer " + m_digest + " doesn't match digest " + chunk.m_digest + " !");
+		}
+		return data;
+	}
+}
@@ -1,8 +1,13 @@
+#include "../include/minidocker/cache_server.hpp"
 #include "../include/minidocker/cli_parser.hpp"
 #include "../include/minidocker/image_args.hpp"
 #include "../include/minidocker/image.hpp"
+#include "../include/minidocker/image_pusher.hpp"
 #include "../include/minidocker/container.hpp"
+#include "../include/minidocker/container_reaper.hpp"
 #include "../include/minidocker/custom_specific_exceptions.hpp"
+#include "../include/minidocker/layer_cache.hpp"
+#include "../include/minidocker/rootfs_snapshot.hpp"
 #include <iostream>
 #include <string>
 
@@ -25,9 +30,35 @@ int main(int argc, char* argv[]) {
 			container.runDockerCommand();
 
 		} else if (cliParser.getSubCommand() == "pull") {
-			minidocker::ImageArgs imageArgs(cliParser.getDockerImageArgs());
-			minidocker::Image image(imageArgs);
-			image.pull();
+			//one or more images, layers they share are only downloaded once
+			minidocker::Image::pullAll(cliParser.getPullImageArgs());
+			minidocker::LayerCache::startBackgroundEviction();
+		} else if (cliParser.getSubCommand() == "images") {
+			//images prune (or gc), and the snapshot builds containers start
+			minidocker::PruneArgs pruneArgs = cliParser.getPruneArgs();
+			if (!cliParser.getSnapshotManifest().empty()) {
+				minidocker::RootfsSnapshot::buildForManifest(cliParser.getSnapshotManifest());
+			} else if (pruneArgs.trash) {
+				//the detached reaper of a container teardown
+				minidocker::ContainerReaper::reap(true);
+			} else {
+				minidocker::LayerCache::prune(pruneArgs);
+			}
+		} else if (cliParser.getSubCommand() == "save") {
+			//OCI image layout archive, for moving images to hosts without a registry
+			minidocker::Image image(cliParser.getDockerImageArgs());
+			image.save(cliParser.getArchivePath());
+		} else if (cliParser.getSubCommand() == "load") {
+			minidocker::Image::load(cliParser.getArchivePath());
+			minidocker::LayerCache::startBackgroundEviction();
+		} else if (cliParser.getSubCommand() == "push") {
+			//the image is pushed from the local store, pulled first if it isn't stored
+			minidocker::ImagePusher pusher(cliParser.getDockerImageArgs(), cliParser.getPushTargetArgs());
+			pusher.push();
+		} else if (cliParser.getSubCommand() == "serve-cache") {
+			//registry mirror for the other nodes, runs until it's stopped
+			minidocker::CacheServer cacheServer(cliParser.getListenAddress());
+			cacheServer.run();
 		} else {
 			throw minidocker::CLIParserException("Unrecognized subcommand !\n");
 		}
@@ -0,0 +1,379 @@
+#include "../include/minidocker/oci_archive.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const size_t tar_block_size = 512;
+static const uint64_t max_octal_size = 077777777777ULL; //what fits the 11 octal digits of a ustar size field
+static const size_t max_copy_chunk = 1024 * 1024 * 1024; //per copy_file_range/sendfile call
+static const size_t max_meta_entry_size = 1024 * 1024; //pax headers and GNU long names are tiny, anything bigger is bogus
+
+namespace
+{
+	uint64_t parseNumeric(const char* field, size_t len)
+	{
+		//base-256 (GNU) for values that don't fit the octal digits
+		if (static_cast<unsigned char>(field[0]) & 0x80) {
+			uint64_t value = static_cast<unsigned char>(field[0]) & 0x7f;
+			for (size_t i = 1; i < len; i++) {
+				value = (value << 8) | static_cast<unsigned char>(field[i]);
+			}
+			return value;
+		}
+		uint64_t value = 0;
+		for (size_t i = 0; i < len && field[i]; i++) {
+			if (field[i] == ' ') continue;
+			if (field[i] < '0' || field[i] > '7') break;
+			value = value * 8 + static_cast<uint64_t>(field[i] - '0');
+		}
+		return value;
+	}
+
+	string parseString(const char* field, size_t len)
+	{
+		return string(field, strnlen(field, len));
+	}
+
+	//tar stores names relative to the archive root, "./index.json" and "index.json" are the same file
+	string normalizeName(string name)
+	{
+		while (name.rfind("./", 0) == 0) name.erase(0, 2);
+		return name;
+	}
+
+	bool readAt(int fd, char* data, size_t len, uint64_t offset)
+	{
+		while (len > 0) {
+			ssize_t n = pread(fd, data, len, static_cast<off_t>(offset));
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			data += n;
+			len -= static_cast<size_t>(n);
+			offset += static_cast<uint64_t>(n);
+		}
+		return true;
+	}
+}
+
+namespace minidocker
+{
+	string getOciBlobName(const string& digest)
+	{
+		size_t pos = digest.find(':');
+		if (pos == string::npos || pos == 0 || pos + 1 == digest.size()) return "";
+		string algorithm = digest.substr(0, pos);
+		string hex = digest.substr(pos + 1);
+		if (!all_of(algorithm.begin(), algorithm.end(), [](unsigned char c) { return isalnum(c); }) ||
+			!all_of(hex.begin(), hex.end(), [](unsigned char c) { return isxdigit(c); })) {
+			return "";
+		}
+		return "blobs/" + algorithm + "/" + hex;
+	}
+
+	OciArchiveWriter::OciArchiveWriter(const string& path) : m_path(path), m_tmp_path(path + ".tmp." + to_string(getpid()))
+	{
+		m_fd = open(m_tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (m_fd < 0) {
+			throw ImageArchiveException("Couldn't create " + m_tmp_path + " : " + strerror(errno));
+		}
+	}
+
+	OciArchiveWriter::~OciArchiveWriter()
+	{
+		if (m_fd >= 0) close(m_fd);
+		//a save that failed halfway leaves nothing behind
+		if (!m_committed) unlink(m_tmp_path.c_str());
+	}
+
+	void OciArchiveWriter::writeAll(const char* data, size_t len)
+	{
+		while (len > 0) {
+			ssize_t n = ::write(m_fd, data, len);
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0) {
+				throw ImageArchiveException("Couldn't write " + m_tmp_path + " : " + strerror(errno));
+			}
+			data += n;
+			len -= static_cast<size_t>(n);
+			m_offset += static_cast<uint64_t>(n);
+		}
+	}
+
+	void OciArchiveWriter::writeHeader(const string& name, uint64_t size)
+	{
+		if (m_in_file) {
+			throw ImageArchiveException("Started " + name + " before the previous archive entry was complete !");
+		}
+		//blob names are "blobs/sha256/<hex>", always short enough for the plain ustar name field
+		if (name.empty() || name.size() >= 100) {
+			throw ImageArchiveException("Invalid archive entry name " + name + " !");
+		}
+
+		char header[tar_block_size];
+		memset(header, 0, sizeof(header));
+		memcpy(header, name.c_str(), name.size());
+		snprintf(header + 100, 8, "%07o", 0644);
+		snprintf(header + 108, 8, "%07o", 0);
+		snprintf(header + 116, 8, "%07o", 0);
+		if (size <= max_octal_size) {
+			snprintf(header + 124, 12, "%011llo", static_cast<unsigned long long>(size));
+		} else {
+			//base-256, understood by GNU tar and every OCI tool
+			header[124] = static_cast<char>(0x80);
+			for (int i = 11; i >= 4; i--, size >>= 8) {
+				header[124 + i] = static_cast<char>(size & 0xff);
+			}
+		}
+		//mtime 0, saving the same image twice gives the same archive
+		snprintf(header + 136, 12, "%011o", 0);
+		header[156] = '0';
+		memcpy(header + 257, "ustar", 6);
+		memcpy(header + 263, "00", 2);
+
+		memset(header + 148, ' ', 8);
+		unsigned int checksum = 0;
+		for (size_t i = 0; i < tar_block_size; i++) {
+			checksum += static_cast<unsigned char>(header[i]);
+		}
+		snprintf(header + 148, 8, "%06o", checksum);
+		header[155] = ' ';
+		writeAll(header, sizeof(header));
+	}
+
+	void OciArchiveWriter::writePadding()
+	{
+		static const char zeros[tar_block_size] = {};
+		size_t padding = static_cast<size_t>((tar_block_size - m_offset % tar_block_size) % tar_block_size);
+		writeAll(zeros, padding);
+	}
+
+	void OciArchiveWriter::addFile(const string& name, const string& content)
+	{
+		beginFile(name, content.size());
+		write(content.data(), content.size());
+		endFile();
+	}
+
+	void OciArchiveWriter::addFileFrom(const string& name, const string& source_path)
+	{
+		int source_fd = open(source_path.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (source_fd < 0 || fstat(source_fd, &st) != 0) {
+			if (source_fd >= 0) close(source_fd);
+			throw ImageArchiveException("Couldn't open " + source_path + " : " + strerror(errno));
+		}
+		uint64_t size = static_cast<uint64_t>(st.st_size);
+		writeHeader(name, size);
+
+		//the data goes from one file to the other inside the kernel, reflinked where the file system can
+		off_t source_offset = 0;
+		uint64_t remaining = size;
+		bool use_sendfile = false;
+		while (remaining > 0) {
+			size_t chunk = static_cast<size_t>(min<uint64_t>(remaining, max_copy_chunk));
+			ssize_t n;
+			if (!use_sendfile) {
+				n = copy_file_range(source_fd, &source_offset, m_fd, nullptr, chunk, 0);
+				//older kernels only copy within one file system
+				if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+					use_sendfile = true;
+					continue;
+				}
+			} else {
+				n = sendfile(m_fd, source_fd, &source_offset, chunk);
+			}
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) {
+				int error = errno;
+				close(source_fd);
+				throw ImageArchiveException("Couldn't copy " + source_path + " into the archive : " +
+					(n == 0 ? string("it got shorter") : string(strerror(error))));
+			}
+			remaining -= static_cast<uint64_t>(n);
+			m_offset += static_cast<uint64_t>(n);
+		}
+		close(source_fd);
+		writePadding();
+	}
+
+	void OciArchiveWriter::beginFile(const string& name, uint64_t size)
+	{
+		writeHeader(name, size);
+		m_in_file = true;
+		m_file_remaining = size;
+	}
+
+	void OciArchiveWriter::write(const char* data, size_t len)
+	{
+		if (!m_in_file || len > m_file_remaining) {
+			throw ImageArchiveException("Archive entry got more data than its size !");
+		}
+		writeAll(data, len);
+		m_file_remaining -= len;
+	}
+
+	void OciArchiveWriter::endFile()
+	{
+		if (m_file_remaining != 0) {
+			throw ImageArchiveException("Archive entry is missing " + to_string(m_file_remaining) + " bytes !");
+		}
+		m_in_file = false;
+		writePadding();
+	}
+
+	void OciArchiveWriter::commit()
+	{
+		//two zero blocks end a tar archive
+		static const char zeros[2 * tar_block_size] = {};
+		writeAll(zeros, sizeof(zeros));
+		if (close(m_fd) != 0) {
+			m_fd = -1;
+			throw ImageArchiveException("Couldn't write " + m_tmp_path + " : " + strerror(errno));
+		}
+		m_fd = -1;
+		if (rename(m_tmp_path.c_str(), m_path.c_str()) != 0) {
+			throw ImageArchiveException("Couldn't rename " + m_tmp_path + " to " + m_path + " : " + strerror(errno));
+		}
+		m_committed = true;
+	}
+
+	OciArchiveReader::OciArchiveReader(const string& path) : m_path(path)
+	{
+		m_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (m_fd < 0) {
+			throw ImageArchiveException("Couldn't open " + path + " : " + strerror(errno));
+		}
+		try {
+			readEntries();
+		} catch (...) {
+			close(m_fd);
+			throw;
+		}
+	}
+
+	OciArchiveReader::~OciArchiveReader()
+	{
+		if (m_fd >= 0) close(m_fd);
+	}
+
+	void OciArchiveReader::readEntries()
+	{
+		struct stat st;
+		if (fstat(m_fd, &st) != 0) {
+			throw ImageArchiveException("Couldn't read " + m_path + " : " + strerror(errno));
+		}
+		uint64_t archive_size = static_cast<uint64_t>(st.st_size);
+
+		//pax / GNU long name values that apply to the next entry only
+		string next_path;
+		string pax_size;
+		uint64_t offset = 0;
+		char header[tar_block_size];
+		while (offset + tar_block_size <= archive_size) {
+			if (!readAt(m_fd, header, sizeof(header), offset)) {
+				throw ImageArchiveException("Couldn't read " + m_path + " : " + strerror(errno));
+			}
+			if (all_of(header, header + sizeof(header), [](char c) { return c == 0; })) break;
+
+			unsigned int checksum = 0;
+			for (size_t i = 0; i < tar_block_size; i++) {
+				checksum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(header[i]);
+			}
+			if (checksum != parseNumeric(header + 148, 8)) {
+				throw ImageArchiveException(m_path + " isn't a tar archive (bad header checksum at offset " + to_string(offset) + ") !");
+			}
+
+			char type = header[156];
+			uint64_t size = parseNumeric(header + 124, 12);
+			if (!pax_size.empty() && type != 'x' && type != 'L') {
+				size = strtoull(pax_size.c_str(), nullptr, 10);
+			}
+			uint64_t data_offset = offset + tar_block_size;
+			if (size > archive_size - data_offset) {
+				throw ImageArchiveException(m_path + " is truncated !");
+			}
+
+			if (type == 'x' || type == 'L') {
+				if (size > max_meta_entry_size) {
+					throw ImageArchiveException(m_path + " has a bogus tar header at offset " + to_string(offset) + " !");
+				}
+				string data(size, '\0');
+				if (!readAt(m_fd, &data[0], data.size(), data_offset)) {
+					throw ImageArchiveException("Couldn't read " + m_path + " : " + strerror(errno));
+				}
+				if (type == 'L') {
+					next_path = parseString(data.data(), data.size());
+				} else {
+					//"<length> <key>=<value>\n" records
+					size_t pos = 0;
+					while (pos < data.size()) {
+						size_t space = data.find(' ', pos);
+						size_t length = strtoull(data.c_str() + pos, nullptr, 10);
+						if (space == string::npos || length == 0 || pos + length > data.size()) break;
+						string record = data.substr(space + 1, pos + length - space - 2);
+						size_t equals = record.find('=');
+						if (equals != string::npos) {
+							if (record.substr(0, equals) == "path") next_path = record.substr(equals + 1);
+							if (record.substr(0, equals) == "size") pax_size = record.substr(equals + 1);
+						}
+						pos += length;
+					}
+				}
+			} else {
+				string name = next_path;
+				if (name.empty()) {
+					name = parseString(header, 100);
+					string prefix = memcmp(header + 257, "ustar", 5) == 0 ? parseString(header + 345, 155) : "";
+					if (!prefix.empty()) name = prefix + "/" + name;
+				}
+				//only regular files matter, the layout's directories are implied by the names
+				if (type == '0' || type == '\0' || type == '7') {
+					m_entries[normalizeName(name)] = { data_offset, size };
+				}
+				next_path.clear();
+				pax_size.clear();
+			}
+			offset = data_offset + (size + tar_block_size - 1) / tar_block_size * tar_block_size;
+		}
+	}
+
+	bool OciArchiveReader::getEntry(const string& name, uint64_t& offset, uint64_t& size) const
+	{
+		auto it = m_entries.find(name);
+		if (it == m_entries.end()) return false;
+		offset = it->second.first;
+		size = it->second.second;
+		return true;
+	}
+
+	string OciArchiveReader::readFile(const string& name, size_t max_size) const
+	{
+		uint64_t offset, size;
+		if (!getEntry(name, offset, size)) {
+			throw ImageArchiveException(m_path + " has no " + name + " !");
+		}
+		if (size > max_size) {
+			throw ImageArchiveException(name + " in " + m_path + " is too big (" + to_string(size) + " bytes) !");
+		}
+		string content(static_cast<size_t>(size), '\0');
+		if (!content.empty() && !readAt(m_fd, &content[0], content.size(), offset)) {
+			throw ImageArchiveException("Couldn't read " + name + " from " + m_path + " : " + strerror(errno));
+		}
+		return content;
+	}
+
+	int OciArchiveReader::getFd() const
+	{
+		return m_fd;
+	}
+}
@@ -0,0 +1,482 @@
+#include "../include/minidocker/parallel_inflater.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+using namespace std;
+
+static const size_t chunk_size = 2 * 1024 * 1024; //compressed bytes per thread in a batch
+static const size_t min_final_chunk_size = 512 * 1024; //the last batch of a member is only split while chunks stay at least this big
+static const unsigned int max_threads = 16;
+static const size_t window_size = 32768; //how far back a deflate match can reach
+static const uint64_t no_bit = UINT64_MAX;
+
+namespace
+{
+	//Raw deflate decoder that starts at any bit of a buffer, with an optional window of earlier output
+	struct RawInflate
+	{
+		z_stream m_zstream;
+		bool m_initialized = false;
+		const unsigned char* m_input = nullptr;
+
+		RawInflate()
+		{
+			memset(&m_zstream, 0, sizeof(m_zstream));
+			m_initialized = inflateInit2(&m_zstream, -15) == Z_OK; // -15 -> raw deflate, no header
+		}
+
+		~RawInflate()
+		{
+			if (m_initialized) inflateEnd(&m_zstream);
+		}
+
+		void start(const vector<unsigned char>& input, uint64_t bit, const unsigned char* window, size_t window_len)
+		{
+			inflateReset(&m_zstream);
+			if (window_len > 0) {
+				inflateSetDictionary(&m_zstream, window, static_cast<uInt>(window_len));
+			}
+			size_t byte = bit / 8;
+			unsigned int shift = bit % 8;
+			if (shift > 0) {
+				//the block starts in the middle of a byte, zlib gets the remaining bits of that byte up front
+				inflatePrime(&m_zstream, 8 - shift, input[byte] >> shift);
+				byte++;
+			}
+			m_input = input.data();
+			m_zstream.next_in = const_cast<unsigned char*>(input.data() + byte);
+			m_zstream.avail_in = static_cast<uInt>(input.size() - byte);
+		}
+
+		//only meaningful right after inflate() returned on a block boundary
+		uint64_t bitPosition() const
+		{
+			return static_cast<uint64_t>(m_zstream.next_in - m_input) * 8 - (m_zstream.data_type & 7);
+		}
+
+		bool atBlockBoundary() const
+		{
+			return (m_zstream.data_type & 128) != 0;
+		}
+	};
+
+	//Windows used to decode a chunk whose real window isn't known yet, LOW holds the low byte of each window offset
+	//and HIGH the high bits, or'ed with 0x80 where they would equal the low byte. So a byte that was copied from the window
+	//always comes out differently in the two decodes, and the pair tells which offset it was copied from
+	enum class MarkerWindow { LOW, HIGH };
+
+	const unsigned char* markerWindow(MarkerWindow which)
+	{
+		static const vector<vector<unsigned char>> windows = []() {
+			vector<vector<unsigned char>> built(2, vector<unsigned char>(window_size));
+			for (size_t i = 0; i < window_size; i++) {
+				unsigned char low = static_cast<unsigned char>(i & 0xff);
+				unsigned char high = static_cast<unsigned char>(i >> 8);
+				built[0][i] = low;
+				built[1][i] = high != low ? high : high | 0x80;
+			}
+			return built;
+		}();
+		return windows[static_cast<size_t>(which)].data();
+	}
+
+	uint64_t load64(const unsigned char* data)
+	{
+		uint64_t value = 0;
+		for (int i = 7; i >= 0; i--) {
+			value = (value << 8) | data[i];
+		}
+		return value;
+	}
+
+	//cheap test for the header of a non-final dynamic huffman block at a bit offset, zlib only gets to see what passes
+	bool looksLikeDynamicBlock(const vector<unsigned char>& input, uint64_t bit)
+	{
+		size_t byte = bit / 8;
+		if (byte + 24 > input.size()) return false;
+		uint64_t bits = load64(input.data() + byte) >> (bit % 8);
+		if ((bits & 7) != 4) return false; //BFINAL 0, BTYPE 10
+		if (((bits >> 3) & 31) > 29 || ((bits >> 8) & 31) > 29) return false; //at most 286 literal/length and 30 distance codes
+		size_t code_length_codes = ((bits >> 13) & 15) + 4;
+
+		//the code length code has to be complete, zlib refuses it otherwise
+		uint64_t lengths = load64(input.data() + (bit + 17) / 8) >> ((bit + 17) % 8);
+		unsigned int kraft = 0;
+		for (size_t i = 0; i < code_length_codes; i++) {
+			unsigned int length = (lengths >> (3 * i)) & 7;
+			if (length > 0) kraft += 128 >> length;
+		}
+		return kraft == 128;
+	}
+
+	bool isFixedBlock(const vector<unsigned char>& input, uint64_t bit)
+	{
+		size_t byte = bit / 8;
+		if (byte + 1 >= input.size()) return false;
+		unsigned int header = (input[byte] | (input[byte + 1] << 8)) >> (bit % 8);
+		return ((header >> 1) & 3) == 1;
+	}
+
+	void runOnThreads(size_t task_count, unsigned int thread_count, const function<void(size_t)>& task)
+	{
+		atomic<size_t> next_task(0);
+		auto worker = [&]() {
+			for (size_t i = next_task++; i < task_count; i = next_task++) {
+				task(i);
+			}
+		};
+		vector<thread> workers;
+		for (unsigned int t = 1; t < min<size_t>(thread_count, task_count); t++) {
+			workers.emplace_back(worker);
+		}
+		worker();
+		for (thread& w : workers) w.join();
+	}
+}
+
+namespace minidocker
+{
+	ParallelInflater::ParallelInflater(unsigned int thread_count, OutputHandler output_handler)
+		: m_thread_count(max(1u, thread_count)), m_output_handler(move(output_handler)), m_crc(crc32(0, Z_NULL, 0)) {}
+
+	unsigned int ParallelInflater::getThreadCount()
+	{
+		unsigned int default_threads = max(1u, min(thread::hardware_concurrency(), max_threads));
+		const char* value = getenv("MINIDOCKER_GZIP_THREADS");
+		if (!value) {
+			return default_threads;
+		}
+
+		char* end = nullptr;
+		long parsed = strtol(value, &end, 10);
+		if (end == value || *end != '\0' || parsed <= 0) {
+			cerr << "Warning: ignoring invalid MINIDOCKER_GZIP_THREADS value \"" << value << "\"\n";
+			return default_threads;
+		}
+		return static_cast<unsigned int>(parsed);
+	}
+
+	size_t ParallelInflater::getBatchSize() const
+	{
+		return m_thread_count * chunk_size;
+	}
+
+	bool ParallelInflater::ended() const
+	{
+		return m_state == State::ENDED;
+	}
+
+	bool ParallelInflater::started() const
+	{
+		return m_started;
+	}
+
+	vector<unsigned char> ParallelInflater::takeInput()
+	{
+		vector<unsigned char> input;
+		input.swap(m_input);
+		m_bit_offset = 0;
+		return input;
+	}
+
+	void ParallelInflater::write(const unsigned char* data, size_t len)
+	{
+		m_input.insert(m_input.end(), data, data + len);
+		if (!m_started && m_input.size() < getBatchSize()) return;
+		m_started = true;
+		process(false);
+	}
+
+	void ParallelInflater::finish()
+	{
+		m_started = true;
+		process(true);
+	}
+
+	void ParallelInflater::process(bool final)
+	{
+		if (m_state == State::HEADER && !parseHeader()) return;
+
+		while (m_state == State::DEFLATE && (final || m_input.size() >= getBatchSize())) {
+			//no progress means the rest of the current block didn't arrive yet
+			if (!decodeBatch(final)) break;
+		}
+
+		if (m_state == State::TRAILER) {
+			parseTrailer();
+		}
+	}
+
+	bool ParallelInflater::parseHeader()
+	{
+		//ID1 ID2 CM FLG MTIME(4) XFL OS, then the optional fields FLG announces
+		if (m_input.size() < 10) return false;
+		if (m_input[0] != 0x1f || m_input[1] != 0x8b || m_input[2] != 8) {
+			throw ImageExtractionException("Corrupted gzip stream in image layer : incorrect header check");
+		}
+		unsigned char flags = m_input[3];
+		size_t pos = 10;
+		if (flags & 4) { //FEXTRA
+			if (m_input.size() < pos + 2) return false;
+			pos += 2 + (m_input[pos] | (m_input[pos + 1] << 8));
+		}
+		for (unsigned char zero_terminated : { 8, 16 }) { //FNAME, FCOMMENT
+			if (!(flags & zero_terminated)) continue;
+			auto end = find(m_input.begin() + min(pos, m_input.size()), m_input.end(), 0);
+			if (end == m_input.end()) return false;
+			pos = static_cast<size_t>(end - m_input.begin()) + 1;
+		}
+		if (flags & 2) pos += 2; //FHCRC
+		if (m_input.size() < pos) return false;
+
+		m_input.erase(m_input.begin(), m_input.begin() + pos);
+		m_state = State::DEFLATE;
+		return true;
+	}
+
+	void ParallelInflater::parseTrailer()
+	{
+		//CRC32 and ISIZE, both little endian
+		if (m_input.size() < 8) return;
+		uint32_t crc = m_input[0] | (m_input[1] << 8) | (m_input[2] << 16) | (static_cast<uint32_t>(m_input[3]) << 24);
+		uint32_t size = m_input[4] | (m_input[5] << 8) | (m_input[6] << 16) | (static_cast<uint32_t>(m_input[7]) << 24);
+		if (crc != static_cast<uint32_t>(m_crc) || size != static_cast<uint32_t>(m_total_out)) {
+			throw ImageExtractionException("Corrupted gzip stream in image layer : incorrect data check");
+		}
+		m_input.erase(m_input.begin(), m_input.begin() + 8);
+		m_state = State::ENDED;
+	}
+
+	uint64_t ParallelInflater::findBlockStart(uint64_t from_bit, uint64_t to_bit) const
+	{
+		RawInflate inflater;
+		if (!inflater.m_initialized) return no_bit;
+		vector<unsigned char> scratch(64 * 1024);
+
+		for (uint64_t bit = from_bit; bit < to_bit; bit++) {
+			if (!looksLikeDynamicBlock(m_input, bit)) continue;
+
+			//a real block start decodes cleanly into the block after it, random bits almost never do
+			inflater.start(m_input, bit, markerWindow(MarkerWindow::LOW), window_size);
+			uint64_t last_boundary = bit;
+			int boundaries = 0;
+			while (true) {
+				inflater.m_zstream.next_out = scratch.data();
+				inflater.m_zstream.avail_out = static_cast<uInt>(scratch.size());
+				int ret = inflate(&inflater.m_zstream, Z_BLOCK);
+				//the end of a stream is rejected too, those are mostly gzip files stored inside the layer
+				if (ret != Z_OK) break;
+				if (inflater.atBlockBoundary() && inflater.bitPosition() != last_boundary) {
+					last_boundary = inflater.bitPosition();
+					//random bits pass as a fixed huffman block far too often, compressors hardly ever write them in the middle of a stream
+					if (isFixedBlock(m_input, last_boundary)) break;
+					if (++boundaries >= 2) break;
+				}
+			}
+			if (boundaries >= 2) return bit;
+		}
+		return no_bit;
+	}
+
+	void ParallelInflater::decodeChunk(Chunk& chunk, const vector<uint64_t>& stop_bits) const
+	{
+		RawInflate inflater;
+		if (!inflater.m_initialized) {
+			chunk.m_error = "out of memory";
+			return;
+		}
+		if (chunk.m_speculative) {
+			inflater.start(m_input, chunk.m_start_bit, markerWindow(MarkerWindow::LOW), window_size);
+		} else {
+			inflater.start(m_input, chunk.m_start_bit, m_window.data(), m_window.size());
+		}
+
+		//the chunk stops where one of the following chunks starts, one whose start turns out to be wrong is decoded through
+		size_t next_stop = 0;
+		uint64_t compressed_bits = min<uint64_t>(stop_bits.empty() ? no_bit : stop_bits[0], m_input.size() * 8) - chunk.m_start_bit;
+		chunk.m_output.resize(max<size_t>(256 * 1024, compressed_bits / 8 * 4));
+		chunk.m_end_bit = chunk.m_start_bit;
+		size_t produced = 0;
+		while (true) {
+			if (chunk.m_output.size() - produced < 64 * 1024) {
+				chunk.m_output.resize(chunk.m_output.size() * 2);
+			}
+			inflater.m_zstream.next_out = chunk.m_output.data() + produced;
+			inflater.m_zstream.avail_out = static_cast<uInt>(min<size_t>(chunk.m_output.size() - produced, UINT32_MAX));
+			int ret = inflate(&inflater.m_zstream, Z_BLOCK);
+			produced = static_cast<size_t>(inflater.m_zstream.next_out - chunk.m_output.data());
+
+			if (ret == Z_STREAM_END) {
+				chunk.m_end_bit = inflater.bitPosition();
+				chunk.m_end_output = produced;
+				chunk.m_stream_end = true;
+				break;
+			}
+			if (ret == Z_BUF_ERROR) break; //out of input, the chunk ends at the last block boundary it got to
+			if (ret != Z_OK) {
+				chunk.m_error = inflater.m_zstream.msg ? inflater.m_zstream.msg : "unknown error";
+				break;
+			}
+			if (inflater.atBlockBoundary()) {
+				chunk.m_end_bit = inflater.bitPosition();
+				chunk.m_end_output = produced;
+				while (next_stop < stop_bits.size() && stop_bits[next_stop] < chunk.m_end_bit) next_stop++;
+				if (next_stop < stop_bits.size() && stop_bits[next_stop] == chunk.m_end_bit) break;
+			}
+		}
+		chunk.m_output.resize(chunk.m_end_output);
+
+		if (chunk.m_speculative && chunk.m_error.empty()) {
+			findMarkers(chunk);
+		}
+	}
+
+	void ParallelInflater::findMarkers(Chunk& chunk) const
+	{
+		RawInflate inflater;
+		if (!inflater.m_initialized) {
+			chunk.m_error = "out of memory";
+			return;
+		}
+
+		//decode the chunk again with the other marker window, the output bytes that change were copied from the window
+		//once 32 KiB went by without any, nothing later can reach back into the window anymore
+		vector<unsigned char>& offsets = chunk.m_window_offsets;
+		offsets.resize(chunk.m_end_output);
+		size_t produced = 0;
+		size_t marked_until = 0;
+		inflater.start(m_input, chunk.m_start_bit, markerWindow(MarkerWindow::HIGH), window_size);
+		while (produced < chunk.m_end_output && produced < marked_until + window_size) {
+			inflater.m_zstream.next_out = offsets.data() + produced;
+			inflater.m_zstream.avail_out = static_cast<uInt>(min<size_t>(offsets.size() - produced, UINT32_MAX));
+			int ret = inflate(&inflater.m_zstream, Z_NO_FLUSH);
+			size_t got = static_cast<size_t>(inflater.m_zstream.next_out - offsets.data()) - produced;
+			for (size_t i = produced; i < produced + got; i++) {
+				if (offsets[i] != chunk.m_output[i]) marked_until = i + 1;
+			}
+			produced += got;
+			if (ret != Z_OK || got == 0) break;
+		}
+		offsets.resize(marked_until);
+		if (marked_until < chunk.m_end_output / 2) {
+			offsets.shrink_to_fit();
+		}
+	}
+
+	void ParallelInflater::emitChunk(Chunk& chunk)
+	{
+		//fill in the bytes that came from the window, a window shorter than 32 KiB means we are close to the start of the member
+		size_t missing = window_size - m_window.size();
+		unsigned char* output = chunk.m_output.data();
+		const unsigned char* offsets = chunk.m_window_offsets.data();
+		const unsigned char* window = m_window.data();
+		size_t marked = chunk.m_window_offsets.size();
+		if (missing > 0) {
+			for (size_t i = 0; i < marked; i++) {
+				if (output[i] == offsets[i]) continue;
+				size_t offset = (static_cast<size_t>(offsets[i] & 0x7f) << 8) | output[i];
+				if (offset < missing) {
+					throw ImageExtractionException("Corrupted gzip stream in image layer : invalid distance too far back");
+				}
+				output[i] = window[offset - missing];
+			}
+		} else {
+			//no branch on whether it's a marker, in repetitive data they come and go with every other byte
+			for (size_t i = 0; i < marked; i++) {
+				unsigned char from_window = window[(static_cast<size_t>(offsets[i] & 0x7f) << 8) | output[i]];
+				output[i] = output[i] != offsets[i] ? from_window : output[i];
+			}
+		}
+		vector<unsigned char>().swap(chunk.m_window_offsets);
+
+		size_t len = chunk.m_end_output;
+		if (len > 0) {
+			m_output_handler(chunk.m_output.data(), len);
+			m_crc = crc32(m_crc, chunk.m_output.data(), static_cast<uInt>(len));
+			m_total_out += len;
+
+			if (len >= window_size) {
+				m_window.assign(chunk.m_output.end() - window_size, chunk.m_output.end());
+			} else {
+				m_window.insert(m_window.end(), chunk.m_output.begin(), chunk.m_output.end());
+				if (m_window.size() > window_size) {
+					m_window.erase(m_window.begin(), m_window.end() - window_size);
+				}
+			}
+		}
+		vector<unsigned char>().swap(chunk.m_output);
+	}
+
+	bool ParallelInflater::decodeBatch(bool final)
+	{
+		size_t input_size = m_input.size();
+		size_t chunk_count = m_thread_count;
+		if (final) {
+			chunk_count = max<size_t>(1, min<size_t>(m_thread_count, input_size / min_final_chunk_size));
+		}
+
+		//the first chunk continues where the last batch stopped, the others start at the first block found after an even split
+		vector<Chunk> chunks(chunk_count);
+		chunks[0].m_start_bit = m_bit_offset;
+		chunks[0].m_has_start = true;
+		runOnThreads(chunk_count - 1, m_thread_count, [&](size_t task) {
+			size_t i = task + 1;
+			uint64_t from_bit = static_cast<uint64_t>(input_size * i / chunk_count) * 8;
+			uint64_t to_bit = static_cast<uint64_t>(input_size * (i + 1) / chunk_count) * 8;
+			chunks[i].m_start_bit = findBlockStart(from_bit, to_bit);
+			chunks[i].m_has_start = chunks[i].m_start_bit != no_bit;
+			chunks[i].m_speculative = true;
+		});
+
+		vector<size_t> started;
+		for (size_t i = 0; i < chunk_count; i++) {
+			if (chunks[i].m_has_start) started.push_back(i);
+		}
+		runOnThreads(started.size(), m_thread_count, [&](size_t task) {
+			vector<uint64_t> stop_bits;
+			for (size_t later = task + 1; later < started.size(); later++) {
+				stop_bits.push_back(chunks[started[later]].m_start_bit);
+			}
+			decodeChunk(chunks[started[task]], stop_bits);
+		});
+
+		//the first chunk had the real window, so any error there is a corrupted stream
+		if (!chunks[0].m_error.empty()) {
+			throw ImageExtractionException("Corrupted gzip stream in image layer : " + chunks[0].m_error);
+		}
+
+		//a chunk is only used if the chunk before it ended exactly on its first block, the ones that were decoded through
+		//had a false start (often a gzip file stored inside the layer)
+		emitChunk(chunks[0]);
+		uint64_t end_bit = chunks[0].m_end_bit;
+		bool stream_end = chunks[0].m_stream_end;
+		for (size_t task = 1; task < started.size() && !stream_end; task++) {
+			Chunk& chunk = chunks[started[task]];
+			if (chunk.m_start_bit < end_bit) continue;
+			if (chunk.m_start_bit > end_bit || !chunk.m_error.empty()) break;
+			emitChunk(chunk);
+			end_bit = chunk.m_end_bit;
+			stream_end = chunk.m_stream_end;
+		}
+
+		bool progress = stream_end || end_bit > m_bit_offset;
+		if (stream_end) {
+			//the trailer starts at the next byte
+			m_input.erase(m_input.begin(), m_input.begin() + (end_bit + 7) / 8);
+			m_bit_offset = 0;
+			m_state = State::TRAILER;
+		} else {
+			m_input.erase(m_input.begin(), m_input.begin() + end_bit / 8);
+			m_bit_offset = end_bit % 8;
+		}
+		return progress;
+	}
+}
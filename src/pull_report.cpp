@@ -0,0 +1,229 @@
+#include "../include/minidocker/pull_report.hpp"
+#include "../include/minidocker/registry_client.hpp"
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+using namespace std;
+
+namespace
+{
+	//durations are reported in seconds, rounded to the microsecond
+	double roundSeconds(double seconds)
+	{
+		return static_cast<double>(static_cast<int64_t>(seconds * 1e6 + 0.5)) / 1e6;
+	}
+
+	uint64_t bytesPerSecond(uint64_t bytes, double seconds)
+	{
+		return seconds > 0 ? static_cast<uint64_t>(static_cast<double>(bytes) / seconds) : 0;
+	}
+
+	json hitsAndMisses(size_t hits, size_t misses)
+	{
+		size_t total = hits + misses;
+		return { { "hits", hits }, { "misses", misses }, { "hit_ratio", total > 0 ? static_cast<double>(hits) / static_cast<double>(total) : 0.0 } };
+	}
+}
+
+namespace minidocker
+{
+	void PullReport::start(const string& image, const vector<string>& registry_urls)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_image = image;
+		m_registry_urls = registry_urls;
+		m_start = chrono::steady_clock::now();
+
+		time_t now = time(nullptr);
+		struct tm utc;
+		char buffer[32];
+		gmtime_r(&now, &utc);
+		strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%SZ", &utc);
+		m_started_at = buffer;
+	}
+
+	void PullReport::addFetch(const FetchRecord& record)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_fetches.push_back(record);
+	}
+
+	void PullReport::addLayer(const LayerRecord& record)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_layers.push_back(record);
+	}
+
+	void PullReport::countTokenRefresh(bool from_auth_server)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_token_refreshes++;
+		if (from_auth_server) m_token_fetches++;
+	}
+
+	void PullReport::setPhaseSeconds(const string& phase, double seconds)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_phases.emplace_back(phase, seconds);
+	}
+
+	void PullReport::finish(bool success, const string& error)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_total_seconds = chrono::duration<double>(chrono::steady_clock::now() - m_start).count();
+		m_success = success;
+		m_error = error;
+	}
+
+	json PullReport::toJson() const
+	{
+		lock_guard<mutex> lock(m_mutex);
+		json report = {
+			{ "image", m_image },
+			{ "started_at", m_started_at },
+			{ "success", m_success },
+			{ "total_seconds", roundSeconds(m_total_seconds) },
+			{ "registry_endpoints", m_registry_urls }
+		};
+		if (!m_success) report["error"] = m_error;
+
+		json phases = json::object();
+		for (const auto& [phase, seconds] : m_phases) {
+			phases[phase] = roundSeconds(seconds);
+		}
+		report["phases"] = phases;
+
+		size_t manifest_hits = 0, manifest_misses = 0, config_hits = 0, config_misses = 0;
+		json fetches = json::array();
+		for (const FetchRecord& fetch : m_fetches) {
+			bool hit = fetch.m_source != "registry";
+			if (fetch.m_kind == "config") {
+				(hit ? config_hits : config_misses)++;
+			} else {
+				(hit ? manifest_hits : manifest_misses)++;
+			}
+
+			json entry = { { "kind", fetch.m_kind }, { "reference", fetch.m_reference }, { "source", fetch.m_source } };
+			if (!fetch.m_url.empty()) {
+				entry["endpoint"] = RegistryClient::getHost(fetch.m_url);
+				entry["http_code"] = fetch.m_http_code;
+				entry["ttfb_seconds"] = roundSeconds(fetch.m_ttfb);
+				entry["seconds"] = roundSeconds(fetch.m_seconds);
+				entry["bytes"] = fetch.m_bytes;
+				entry["redirects"] = fetch.m_redirects;
+			}
+			fetches.push_back(entry);
+		}
+		report["fetches"] = fetches;
+
+		size_t layer_hits = 0, tarball_hits = 0, fetched_layers = 0;
+		uint64_t bytes_downloaded = 0, resumed_bytes = 0, compressed_bytes = 0, uncompressed_bytes = 0, deduped_bytes = 0;
+		double extract_seconds = 0;
+		long redirects = 0;
+		json layers = json::array();
+		for (const LayerRecord& layer : m_layers) {
+			const LayerTimings& timings = layer.m_timings;
+			if (layer.m_source == "cache") {
+				layer_hits++;
+			} else if (layer.m_source == "tarball") {
+				tarball_hits++;
+			} else {
+				fetched_layers++;
+			}
+			bytes_downloaded += timings.m_bytes_downloaded;
+			resumed_bytes += timings.m_resumed_bytes;
+			redirects += timings.m_redirects;
+			if (timings.m_extract_seconds > 0) {
+				extract_seconds += timings.m_extract_seconds;
+				compressed_bytes += layer.m_size;
+				uncompressed_bytes += timings.m_uncompressed_bytes;
+				deduped_bytes += timings.m_deduped_bytes;
+			}
+
+			json entry = { { "digest", layer.m_digest }, { "size", layer.m_size }, { "source", layer.m_source }, { "success", layer.m_success } };
+			if (!layer.m_success) entry["error"] = layer.m_error;
+			if (!layer.m_endpoint.empty()) {
+				entry["endpoint"] = RegistryClient::getHost(layer.m_endpoint);
+				entry["download"] = {
+					{ "bytes", timings.m_bytes_downloaded },
+					{ "resumed_bytes", timings.m_resumed_bytes },
+					{ "ttfb_seconds", roundSeconds(timings.m_ttfb) },
+					{ "seconds", roundSeconds(timings.m_download_seconds) },
+					{ "bytes_per_second", bytesPerSecond(timings.m_bytes_downloaded, timings.m_download_seconds) },
+					{ "redirects", timings.m_redirects },
+					{ "token_refreshes", timings.m_token_refreshes },
+					{ "connections", timings.m_connections }
+				};
+			}
+			if (timings.m_extract_seconds > 0) {
+				entry["extraction"] = {
+					{ "compression", timings.m_compression },
+					{ "seconds", roundSeconds(timings.m_extract_seconds) },
+					{ "uncompressed_bytes", timings.m_uncompressed_bytes },
+					{ "bytes_per_second", bytesPerSecond(layer.m_size, timings.m_extract_seconds) },
+					{ "uncompressed_bytes_per_second", bytesPerSecond(timings.m_uncompressed_bytes, timings.m_extract_seconds) },
+					{ "deduplicated_bytes", timings.m_deduped_bytes }
+				};
+			}
+			layers.push_back(entry);
+		}
+		report["layers"] = layers;
+
+		//layers that weren't extracted yet either came from a kept tarball or had to be fetched
+		report["cache"] = {
+			{ "manifests", hitsAndMisses(manifest_hits, manifest_misses) },
+			{ "configs", hitsAndMisses(config_hits, config_misses) },
+			{ "layers", hitsAndMisses(layer_hits, tarball_hits + fetched_layers) },
+			{ "tarballs", hitsAndMisses(tarball_hits, fetched_layers) },
+			{ "resumed_bytes", resumed_bytes }
+		};
+
+		double layer_seconds = 0;
+		for (const auto& [phase, seconds] : m_phases) {
+			if (phase == "layers") layer_seconds = seconds;
+		}
+		report["totals"] = {
+			{ "bytes_downloaded", bytes_downloaded },
+			//layers download concurrently, so this is over the wall time of the layer phase
+			{ "bytes_per_second", bytesPerSecond(bytes_downloaded, layer_seconds) },
+			{ "redirects", redirects },
+			{ "token_refreshes", m_token_refreshes },
+			{ "token_fetches", m_token_fetches },
+			{ "extract_seconds", roundSeconds(extract_seconds) },
+			{ "extract_bytes_per_second", bytesPerSecond(compressed_bytes, extract_seconds) },
+			{ "extract_uncompressed_bytes_per_second", bytesPerSecond(uncompressed_bytes, extract_seconds) },
+			{ "deduplicated_bytes", deduped_bytes }
+		};
+		return report;
+	}
+
+	bool PullReport::write(const string& path) const
+	{
+		return writeJson(path, toJson());
+	}
+
+	bool PullReport::writeJson(const string& path, const json& report)
+	{
+		string tmp_path = path + ".tmp." + to_string(getpid());
+		{
+			ofstream ofs(tmp_path, ios::trunc);
+			ofs << report.dump(2) << "\n";
+			if (!ofs) {
+				ofs.close();
+				remove(tmp_path.c_str());
+				return false;
+			}
+		}
+		if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+			remove(tmp_path.c_str());
+			return false;
+		}
+		return true;
+	}
+}
@@ -0,0 +1,304 @@
+#include "../include/minidocker/registry_client.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//a transfer below this many bytes/s for that many seconds has stalled, it fails with CURLE_OPERATION_TIMEDOUT so
+//whoever started it can retry or resume it instead of waiting on a dead connection forever
+static const long low_speed_limit = 1024;
+static const long low_speed_time = 60;
+
+namespace
+{
+	size_t appendToString(char* ptr, size_t size, size_t nmemb, void* userdata)
+	{
+		std::string* output = static_cast<std::string*>(userdata);
+		output->append(ptr, size * nmemb);
+		return size * nmemb;
+	}
+
+	struct BodyContext
+	{
+		CURL* m_curl;
+		minidocker::RegistryResponse* m_response;
+		const minidocker::RegistryClient::BodyHandler* m_handler;
+	};
+
+	size_t handleBody(char* ptr, size_t size, size_t nmemb, void* userdata)
+	{
+		BodyContext* context = static_cast<BodyContext*>(userdata);
+		long http_code = 0;
+		curl_easy_getinfo(context->m_curl, CURLINFO_RESPONSE_CODE, &http_code);
+		if (http_code < 200 || http_code >= 300) {
+			context->m_response->m_body.append(ptr, size * nmemb);
+			return size * nmemb;
+		}
+		return (*context->m_handler)(ptr, size * nmemb) ? size * nmemb : 0;
+	}
+
+	struct UploadContext
+	{
+		const minidocker::RegistryClient::BodySource* m_source;
+		uint64_t m_offset;
+		uint64_t m_size;
+	};
+
+	size_t readBody(char* buffer, size_t size, size_t nitems, void* userdata)
+	{
+		UploadContext* context = static_cast<UploadContext*>(userdata);
+		size_t len = static_cast<size_t>(std::min<uint64_t>(size * nitems, context->m_size - context->m_offset));
+		if (len == 0) return 0;
+		size_t n = (*context->m_source)(buffer, len, context->m_offset);
+		if (n == 0) return CURL_READFUNC_ABORT;
+		context->m_offset += n;
+		return n;
+	}
+
+	string toLower(string value)
+	{
+		transform(value.begin(), value.end(), value.begin(), [](unsigned char c) { return tolower(c); });
+		return value;
+	}
+
+	//curl_global_init isn't thread safe, so it's done once before the first client is created
+	void initCurlOnce()
+	{
+		static once_flag flag;
+		call_once(flag, []() { curl_global_init(CURL_GLOBAL_DEFAULT); });
+	}
+}
+
+namespace minidocker
+{
+	RegistryClient::RegistryClient()
+	{
+		initCurlOnce();
+
+		m_share = curl_share_init();
+		if (!m_share) {
+			throw ImageException("Couldn't initialize curl share handle for the registry client!");
+		}
+		//DNS lookups and TLS sessions are reused by every handle of this client
+		//connections aren't, libcurl can't share them between handles running on different threads at the same time
+		//a pooled handle keeps its own connections across requests (curl_easy_reset leaves them open), transfers on the
+		//multi handle use its connection cache
+		curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, lockShare);
+		curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, unlockShare);
+		curl_share_setopt(m_share, CURLSHOPT_USERDATA, this);
+		curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+		m_multi = curl_multi_init();
+		if (!m_multi) {
+			curl_share_cleanup(m_share);
+			throw ImageException("Couldn't initialize curl multi handle for the registry client!");
+		}
+		//let transfers to the same host run as streams of one HTTP/2 connection
+		curl_multi_setopt(m_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	}
+
+	RegistryClient::~RegistryClient()
+	{
+		for (CURL* curl : m_idle_handles) {
+			curl_easy_cleanup(curl);
+		}
+		curl_multi_cleanup(m_multi);
+		curl_share_cleanup(m_share);
+	}
+
+	void RegistryClient::lockShare(CURL*, curl_lock_data data, curl_lock_access, void* userptr)
+	{
+		RegistryClient* client = static_cast<RegistryClient*>(userptr);
+		client->m_share_mutexes[data].lock();
+	}
+
+	void RegistryClient::unlockShare(CURL*, curl_lock_data data, void* userptr)
+	{
+		RegistryClient* client = static_cast<RegistryClient*>(userptr);
+		client->m_share_mutexes[data].unlock();
+	}
+
+	void RegistryClient::applyDefaults(CURL* curl)
+	{
+		curl_easy_setopt(curl, CURLOPT_SHARE, m_share);
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, low_speed_limit);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, low_speed_time);
+	}
+
+	CURL* RegistryClient::acquireHandle()
+	{
+		CURL* curl = nullptr;
+		{
+			lock_guard<mutex> lock(m_pool_mutex);
+			if (!m_idle_handles.empty()) {
+				curl = m_idle_handles.back();
+				m_idle_handles.pop_back();
+			}
+		}
+
+		if (curl) {
+			//drops the options of the previous request, its open connections stay for the next one
+			curl_easy_reset(curl);
+		} else {
+			curl = curl_easy_init();
+			if (!curl) return nullptr;
+		}
+		applyDefaults(curl);
+		return curl;
+	}
+
+	void RegistryClient::releaseHandle(CURL* curl)
+	{
+		if (!curl) return;
+		lock_guard<mutex> lock(m_pool_mutex);
+		m_idle_handles.push_back(curl);
+	}
+
+	CURLM* RegistryClient::getMultiHandle()
+	{
+		return m_multi;
+	}
+
+	TokenCache& RegistryClient::getTokenCache()
+	{
+		return m_token_cache;
+	}
+
+	string RegistryClient::getHeader(const string& header_str, const string& name)
+	{
+		string value;
+		string lower_name = toLower(name);
+		size_t line_start = 0;
+		while (line_start < header_str.size()) {
+			size_t line_end = header_str.find('\n', line_start);
+			if (line_end == string::npos) line_end = header_str.size();
+			string line = header_str.substr(line_start, line_end - line_start);
+			line_start = line_end + 1;
+
+			//a status line starts the headers of the next response
+			if (line.rfind("HTTP/", 0) == 0) {
+				value.clear();
+				continue;
+			}
+			size_t colon = line.find(':');
+			if (colon == string::npos || toLower(line.substr(0, colon)) != lower_name) continue;
+			size_t start = line.find_first_not_of(" \t", colon + 1);
+			size_t end = line.find_last_not_of(" \t\r");
+			value = (start == string::npos || end < start) ? "" : line.substr(start, end - start + 1);
+		}
+		return value;
+	}
+
+	string RegistryClient::getHost(const string& url)
+	{
+		size_t start = url.find("://");
+		start = start == string::npos ? 0 : start + 3;
+		size_t end = url.find_first_of("/?#", start);
+		return url.substr(start, end == string::npos ? string::npos : end - start);
+	}
+
+	RegistryResponse RegistryClient::get(const string& url, const vector<string>& headers, bool follow_redirects, const BodyHandler& body_handler)
+	{
+		RegistryResponse response;
+		response.m_url = url;
+		CURL* curl = acquireHandle();
+		if (!curl) {
+			response.m_curl_code = CURLE_FAILED_INIT;
+			return response;
+		}
+
+		struct curl_slist* header_list = nullptr;
+		for (const string& header : headers) {
+			header_list = curl_slist_append(header_list, header.c_str());
+		}
+
+		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, header_list);
+		BodyContext body_context = { curl, &response, &body_handler };
+		if (body_handler) {
+			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, handleBody);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body_context);
+		} else {
+			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, appendToString);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response.m_body);
+		}
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, appendToString);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response.m_headers);
+		if (follow_redirects) {
+			//blob fetching can respond with 307 Redirect responses
+			curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+			curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5L); // limit to 5 redirects
+			curl_easy_setopt(curl, CURLOPT_AUTOREFERER, 1L);
+		}
+
+		response.m_curl_code = curl_easy_perform(curl);
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.m_http_code);
+		curl_off_t ttfb = 0, total_time = 0, bytes = 0;
+		curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+		curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total_time);
+		curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+		curl_easy_getinfo(curl, CURLINFO_REDIRECT_COUNT, &response.m_redirect_count);
+		response.m_ttfb = static_cast<double>(ttfb) / 1e6;
+		response.m_total_time = static_cast<double>(total_time) / 1e6;
+		response.m_bytes = static_cast<uint64_t>(bytes);
+
+		curl_slist_free_all(header_list);
+		releaseHandle(curl);
+		return response;
+	}
+
+	RegistryResponse RegistryClient::send(const string& method, const string& url, const vector<string>& headers, uint64_t body_size,
+		const BodySource& body_source)
+	{
+		RegistryResponse response;
+		response.m_url = url;
+		CURL* curl = acquireHandle();
+		if (!curl) {
+			response.m_curl_code = CURLE_FAILED_INIT;
+			return response;
+		}
+
+		struct curl_slist* header_list = nullptr;
+		for (const string& header : headers) {
+			header_list = curl_slist_append(header_list, header.c_str());
+		}
+		UploadContext upload_context = { &body_source, 0, body_source ? body_size : 0 };
+		if (method == "HEAD") {
+			curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+		} else {
+			//an upload without a body still sends "Content-Length: 0", registries insist on it
+			curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+			curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method.c_str());
+			curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(upload_context.m_size));
+			curl_easy_setopt(curl, CURLOPT_READFUNCTION, readBody);
+			curl_easy_setopt(curl, CURLOPT_READDATA, &upload_context);
+			//no "Expect: 100-continue" round trip before every chunk
+			header_list = curl_slist_append(header_list, "Expect:");
+		}
+
+		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, header_list);
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, appendToString);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response.m_body);
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, appendToString);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response.m_headers);
+
+		response.m_curl_code = curl_easy_perform(curl);
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.m_http_code);
+		curl_off_t total_time = 0;
+		curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total_time);
+		response.m_total_time = static_cast<double>(total_time) / 1e6;
+
+		curl_slist_free_all(header_list);
+		releaseHandle(curl);
+		return response;
+	}
+}
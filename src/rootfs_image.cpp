@@ -0,0 +1,254 @@
+#include "../include/minidocker/rootfs_image.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include "../include/minidocker/image.hpp"
+#include "../include/minidocker/layer_lock.hpp"
+#include "../include/minidocker/rootfs_snapshot.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <linux/loop.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+static string rootfs_dir = "/var/lib/minidocker/rootfs";
+static const int max_loop_attempts = 8; //another process can grab the free loop device first
+
+namespace
+{
+	string getExtension(minidocker::RootfsImageFormat format)
+	{
+		return format == minidocker::RootfsImageFormat::SQUASHFS_IMAGE ? ".squashfs" : ".erofs";
+	}
+
+	//"<hex>.erofs" and "<hex>.squashfs" of a chain ID are locked separately, and apart from the snapshot they're built from
+	string getLockName(const string& image_name)
+	{
+		return "sha256:" + image_name;
+	}
+
+	int openLoopDevice(int image_fd, const string& image_path, string& loop_path)
+	{
+		int control_fd = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+		if (control_fd < 0) return -1;
+		int loop_fd = -1;
+		for (int attempt = 0; attempt < max_loop_attempts && loop_fd < 0; attempt++) {
+			int index = ioctl(control_fd, LOOP_CTL_GET_FREE);
+			if (index < 0) break;
+			loop_path = "/dev/loop" + to_string(index);
+			loop_fd = open(loop_path.c_str(), O_RDWR | O_CLOEXEC);
+			if (loop_fd < 0) break;
+
+			//direct I/O keeps the image's pages out of the page cache, the file system on top caches what it reads
+			struct loop_info64 info;
+			memset(&info, 0, sizeof(info));
+			info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR | LO_FLAGS_DIRECT_IO;
+			strncpy(reinterpret_cast<char*>(info.lo_file_name), image_path.c_str(), LO_NAME_SIZE - 1);
+#ifdef LOOP_CONFIGURE
+			struct loop_config config;
+			memset(&config, 0, sizeof(config));
+			config.fd = static_cast<uint32_t>(image_fd);
+			config.info = info;
+			if (ioctl(loop_fd, LOOP_CONFIGURE, &config) == 0) break;
+			if (errno != EINVAL && errno != ENOTTY && errno != EBUSY) {
+				close(loop_fd);
+				loop_fd = -1;
+				break;
+			}
+			if (errno == EBUSY) {
+				close(loop_fd);
+				loop_fd = -1;
+				continue;
+			}
+#endif
+			//kernels before 5.8 attach the file and set the flags in two steps
+			if (ioctl(loop_fd, LOOP_SET_FD, image_fd) != 0) {
+				int error = errno;
+				close(loop_fd);
+				loop_fd = -1;
+				if (error == EBUSY) continue;
+				break;
+			}
+			info.lo_flags &= ~LO_FLAGS_DIRECT_IO; //LOOP_SET_STATUS64 refuses it, it has its own ioctl
+			if (ioctl(loop_fd, LOOP_SET_STATUS64, &info) != 0) {
+				ioctl(loop_fd, LOOP_CLR_FD, 0);
+				close(loop_fd);
+				loop_fd = -1;
+				break;
+			}
+			ioctl(loop_fd, LOOP_SET_DIRECT_IO, 1UL);
+		}
+		int error = errno;
+		close(control_fd);
+		errno = error;
+		return loop_fd;
+	}
+}
+
+namespace minidocker
+{
+	RootfsImageFormat RootfsImage::getFormat()
+	{
+		const char* value = getenv("MINIDOCKER_ROOTFS_IMAGE");
+		if (!value || string(value) == "" || string(value) == "0" || string(value) == "off") {
+			return RootfsImageFormat::NONE;
+		}
+		if (string(value) == "erofs") return RootfsImageFormat::EROFS_IMAGE;
+		if (string(value) == "squashfs") return RootfsImageFormat::SQUASHFS_IMAGE;
+		cerr << "Warning: ignoring invalid MINIDOCKER_ROOTFS_IMAGE value \"" << value << "\"\n";
+		return RootfsImageFormat::NONE;
+	}
+
+	string RootfsImage::getImagePath(const string& chain_id, RootfsImageFormat format)
+	{
+		string chain_id_clean = chain_id.substr(chain_id.find(":") + 1); // remove "sha256:"
+		return rootfs_dir + "/" + chain_id_clean + getExtension(format);
+	}
+
+	string RootfsImage::build(const vector<ImageLayer>& layers, const vector<string>& chain_ids, RootfsImageFormat format,
+		unique_ptr<LayerLock>* image_lock)
+	{
+		if (chain_ids.empty()) {
+			throw RootfsImageException("The image has no layers to flatten");
+		}
+		string image_path = getImagePath(chain_ids.back(), format);
+		//one build per image, a container or pull that comes along meanwhile waits for it
+		//containers running the image hold it shared, they don't keep the next one from using it
+		auto lock = make_unique<LayerLock>(getLockName(fs::path(image_path).filename().string()));
+		lock->lockShared();
+		if (!fs::exists(image_path)) {
+			lock->unlock();
+			lock->lock();
+		}
+
+		if (!fs::exists(image_path)) {
+			//the snapshot of the image's layers is already the flattened tree, mkfs only reads it
+			unique_ptr<LayerLock> snapshot_lock;
+			string snapshot_dir = RootfsSnapshot::build(layers, chain_ids, &snapshot_lock);
+			cout << "Flattening " << layers.size() << " image layer(s) into " << image_path << "...\n";
+			auto start = chrono::steady_clock::now();
+			string tmp_path = image_path + ".tmp." + to_string(getpid());
+			error_code ec;
+			fs::create_directories(rootfs_dir);
+			try {
+				if (format == RootfsImageFormat::SQUASHFS_IMAGE) {
+					runMkfs({ "mksquashfs", snapshot_dir, tmp_path, "-comp", "zstd", "-noappend", "-no-progress" });
+				} else {
+					//lz4hc decompresses fastest, a container start reads the image's files through it
+					runMkfs({ "mkfs.erofs", "-zlz4hc", tmp_path, snapshot_dir });
+				}
+				if (rename(tmp_path.c_str(), image_path.c_str()) != 0) {
+					throw RootfsImageException("Couldn't move " + tmp_path + " into place : " + strerror(errno));
+				}
+			} catch (...) {
+				fs::remove(tmp_path, ec);
+				throw;
+			}
+
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			cout << "Flattened image (" << fs::file_size(image_path, ec) / (1024 * 1024) << " MiB) in " << seconds << "s\n";
+		}
+
+		if (image_lock) {
+			lock->unlock();
+			lock->lockShared();
+			if (!fs::exists(image_path)) {
+				throw RootfsImageException(image_path + " was removed while it was locked");
+			}
+			*image_lock = move(lock);
+		}
+		return image_path;
+	}
+
+	void RootfsImage::runMkfs(const vector<string>& args)
+	{
+		vector<char*> argv;
+		for (const string& arg : args) {
+			argv.push_back(const_cast<char*>(arg.c_str()));
+		}
+		argv.push_back(nullptr);
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			//its summary isn't interesting, errors still go to stderr
+			int null_fd = open("/dev/null", O_WRONLY);
+			dup2(null_fd, STDOUT_FILENO);
+			execvp(argv[0], argv.data());
+			_exit(127);
+		}
+		if (pid < 0) {
+			throw RootfsImageException("Couldn't start " + args.front() + " : " + strerror(errno));
+		}
+
+		int status = 0;
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+			throw RootfsImageException(args.front() + " isn't installed, it's needed to flatten images");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			throw RootfsImageException(args.front() + " failed to build the image");
+		}
+	}
+
+	void RootfsImage::mount(const string& image_path, RootfsImageFormat format, const string& target_dir)
+	{
+		int image_fd = open(image_path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (image_fd < 0) {
+			throw RootfsImageException("Couldn't open " + image_path + " : " + strerror(errno));
+		}
+		string loop_path;
+		int loop_fd = openLoopDevice(image_fd, image_path, loop_path);
+		int error = errno;
+		close(image_fd);
+		if (loop_fd < 0) {
+			throw RootfsImageException("Couldn't attach " + image_path + " to a loop device : " + strerror(error));
+		}
+
+		string fs_type = format == RootfsImageFormat::SQUASHFS_IMAGE ? "squashfs" : "erofs";
+		int result = ::mount(loop_path.c_str(), target_dir.c_str(), fs_type.c_str(), MS_RDONLY | MS_NODEV, nullptr);
+		error = errno;
+		//the mount holds the loop device now, it's detached as soon as the image is unmounted (or right away if the mount failed)
+		close(loop_fd);
+		if (result != 0) {
+			throw RootfsImageException("Couldn't mount " + image_path + " : " + strerror(error));
+		}
+	}
+
+	uint64_t RootfsImage::prune(const set<string>& referenced_chain_ids)
+	{
+		uint64_t freed = 0;
+		error_code ec;
+		for (fs::directory_iterator it(rootfs_dir, ec), end; !ec && it != end; it.increment(ec)) {
+			string name = it->path().filename().string();
+			size_t dot = name.find('.');
+			if (dot == string::npos) continue;
+			string chain_id = "sha256:" + name.substr(0, dot);
+			string image_name = name.substr(0, name.find('.', dot + 1));
+			bool leftover = image_name != name || (image_name.substr(dot) != ".erofs" && image_name.substr(dot) != ".squashfs");
+			if (!leftover && referenced_chain_ids.count(chain_id) > 0) continue;
+
+			//held shared by the containers running the image, exclusively by a build
+			LayerLock image_lock(getLockName(image_name));
+			if (!image_lock.tryLock()) continue;
+			struct stat st;
+			if (!leftover && lstat(it->path().c_str(), &st) == 0) {
+				freed += static_cast<uint64_t>(st.st_blocks) * 512;
+			}
+			error_code remove_ec;
+			fs::remove_all(it->path(), remove_ec);
+		}
+		return freed;
+	}
+}
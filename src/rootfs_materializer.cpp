@@ -0,0 +1,350 @@
+#include "../include/minidocker/rootfs_materializer.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const unsigned int max_threads = 16; //past that the disk is the limit, not the syscalls
+static const size_t copy_buffer_size = 128 * 1024;
+static const char* opaque_xattr = "trusted.overlay.opaque";
+static const string whiteout_prefix = ".wh.";
+static const string opaque_marker = ".wh..wh..opq";
+
+namespace
+{
+	string joinPath(const string& dir, const string& path)
+	{
+		return path.empty() ? dir : dir + "/" + path;
+	}
+}
+
+namespace minidocker
+{
+	RootfsMaterializer::RootfsMaterializer(unsigned int thread_count)
+		: m_thread_count(max(1u, thread_count))
+	{
+	}
+
+	unsigned int RootfsMaterializer::getThreadCount()
+	{
+		unsigned int default_threads = max(1u, min(thread::hardware_concurrency(), max_threads));
+		const char* value = getenv("MINIDOCKER_MATERIALIZE_THREADS");
+		if (!value) {
+			return default_threads;
+		}
+
+		char* end = nullptr;
+		long parsed = strtol(value, &end, 10);
+		if (end == value || *end != '\0' || parsed <= 0) {
+			cerr << "Warning: ignoring invalid MINIDOCKER_MATERIALIZE_THREADS value \"" << value << "\"\n";
+			return default_threads;
+		}
+		return static_cast<unsigned int>(parsed);
+	}
+
+	uint64_t RootfsMaterializer::getFileCount() const
+	{
+		return m_file_count;
+	}
+
+	uint64_t RootfsMaterializer::getClonedCount() const
+	{
+		return m_cloned_count;
+	}
+
+	uint64_t RootfsMaterializer::getCopiedBytes() const
+	{
+		return m_copied_bytes;
+	}
+
+	void RootfsMaterializer::materialize(const vector<string>& layer_dirs, const string& target_dir)
+	{
+		m_layer_dirs = layer_dirs;
+		m_target_dir = target_dir;
+		m_entries.clear();
+
+		//the layers are independent until they're merged, one thread walks each
+		vector<vector<LayerEntry>> layer_entries(layer_dirs.size());
+		runOnThreads(layer_dirs.size(), [&](size_t i) { scanLayer(layer_dirs[i], layer_entries[i]); });
+		for (size_t i = 0; i < layer_entries.size(); i++) {
+			mergeEntries(i, layer_entries[i]);
+			vector<LayerEntry>().swap(layer_entries[i]);
+		}
+
+		//directories first (the map has a directory before its entries), then everything in them on all threads
+		vector<const pair<const string, RootfsEntry>*> dirs;
+		vector<const pair<const string, RootfsEntry>*> files;
+		for (const auto& entry : m_entries) {
+			if (S_ISDIR(entry.second.m_stat.st_mode)) {
+				string path = joinPath(m_target_dir, entry.first);
+				if (mkdir(path.c_str(), 0700) != 0 && errno != EEXIST) {
+					throw ContainerRuntimeException("Couldn't create " + path + " : " + strerror(errno));
+				}
+				dirs.push_back(&entry);
+			} else {
+				files.push_back(&entry);
+			}
+		}
+		runOnThreads(files.size(), [&](size_t i) { writeEntry(files[i]->first, files[i]->second); });
+		//writing into a directory changes its mtime, so directories get their metadata last
+		runOnThreads(dirs.size(), [&](size_t i) { writeEntry(dirs[i]->first, dirs[i]->second); });
+	}
+
+	void RootfsMaterializer::scanLayer(const string& layer_dir, vector<LayerEntry>& entries) const
+	{
+		//the root of the layer is an entry too, only for its opaque flag
+		LayerEntry root;
+		if (lstat(layer_dir.c_str(), &root.m_stat) != 0) {
+			throw ContainerRuntimeException("Image Layer " + layer_dir + " doesn't exist : " + strerror(errno));
+		}
+		vector<size_t> pending_dirs = { 0 };
+		entries.push_back(root);
+
+		while (!pending_dirs.empty()) {
+			size_t dir_index = pending_dirs.back();
+			pending_dirs.pop_back();
+			string dir_path = entries[dir_index].m_path;
+			string host_dir = joinPath(layer_dir, dir_path);
+			char value[1];
+			if (lgetxattr(host_dir.c_str(), opaque_xattr, value, sizeof(value)) == 1 && value[0] == 'y') {
+				entries[dir_index].m_opaque = true;
+			}
+
+			DIR* dir = opendir(host_dir.c_str());
+			if (!dir) {
+				throw ContainerRuntimeException("Couldn't read " + host_dir + " : " + strerror(errno));
+			}
+			size_t first_child = entries.size();
+			while (struct dirent* dirent = readdir(dir)) {
+				string name = dirent->d_name;
+				if (name == "." || name == "..") continue;
+				if (name == opaque_marker) {
+					entries[dir_index].m_opaque = true;
+					continue;
+				}
+
+				LayerEntry entry;
+				string prefix = dir_path.empty() ? "" : dir_path + "/";
+				if (name.rfind(whiteout_prefix, 0) == 0) {
+					//OCI whiteout of a layer that wasn't converted to overlayfs whiteouts
+					entry.m_path = prefix + name.substr(whiteout_prefix.size());
+					entry.m_whiteout = true;
+					entries.push_back(entry);
+					continue;
+				}
+				entry.m_path = prefix + name;
+				if (fstatat(dirfd(dir), name.c_str(), &entry.m_stat, AT_SYMLINK_NOFOLLOW) != 0) continue;
+				entry.m_whiteout = S_ISCHR(entry.m_stat.st_mode) && entry.m_stat.st_rdev == makedev(0, 0);
+				entries.push_back(entry);
+			}
+			closedir(dir);
+
+			//subdirectories come after the directory's own entries, whiteouts included, so those are merged first
+			for (size_t i = entries.size(); i > first_child; i--) {
+				if (!entries[i - 1].m_whiteout && S_ISDIR(entries[i - 1].m_stat.st_mode)) {
+					pending_dirs.push_back(i - 1);
+				}
+			}
+		}
+	}
+
+	void RootfsMaterializer::mergeEntries(size_t layer, const vector<LayerEntry>& entries)
+	{
+		for (const LayerEntry& entry : entries) {
+			if (entry.m_whiteout) {
+				removeTree(entry.m_path);
+				continue;
+			}
+			if (S_ISDIR(entry.m_stat.st_mode)) {
+				auto it = m_entries.find(entry.m_path);
+				//a directory replaces a file of the layers below, and is merged with a directory
+				if (it != m_entries.end() && !S_ISDIR(it->second.m_stat.st_mode)) {
+					m_entries.erase(it);
+				}
+				if (entry.m_opaque) {
+					//the directory itself stays, what the layers below have in it goes
+					removeTree(entry.m_path);
+				}
+				//the root of the layer is the target dir, it keeps its own metadata
+				if (entry.m_path.empty()) continue;
+				m_entries[entry.m_path] = { layer, entry.m_stat };
+				continue;
+			}
+			removeTree(entry.m_path);
+			m_entries[entry.m_path] = { layer, entry.m_stat };
+		}
+	}
+
+	void RootfsMaterializer::removeTree(const string& path)
+	{
+		if (path.empty()) {
+			m_entries.clear();
+			return;
+		}
+		m_entries.erase(path);
+		//the entries of a directory sort right after "<path>/"
+		string prefix = path + "/";
+		auto it = m_entries.lower_bound(prefix);
+		while (it != m_entries.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+			it = m_entries.erase(it);
+		}
+	}
+
+	void RootfsMaterializer::writeEntry(const string& path, const RootfsEntry& entry)
+	{
+		const struct stat& st = entry.m_stat;
+		string source = joinPath(m_layer_dirs[entry.m_layer], path);
+		string target = joinPath(m_target_dir, path);
+		struct timespec times[2] = { st.st_atim, st.st_mtim };
+
+		if (S_ISDIR(st.st_mode)) {
+			//best effort, like the extractor : an unprivileged copy can't give files away
+			if (lchown(target.c_str(), st.st_uid, st.st_gid) != 0) {}
+			chmod(target.c_str(), st.st_mode & 07777);
+			utimensat(AT_FDCWD, target.c_str(), times, AT_SYMLINK_NOFOLLOW);
+			return;
+		}
+
+		if (S_ISREG(st.st_mode)) {
+			int source_fd = open(source.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+			if (source_fd < 0) {
+				throw ContainerRuntimeException("Couldn't open " + source + " : " + strerror(errno));
+			}
+			int target_fd = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+			if (target_fd < 0) {
+				int error = errno;
+				close(source_fd);
+				throw ContainerRuntimeException("Couldn't create " + target + " : " + strerror(error));
+			}
+			try {
+				copyFile(source, source_fd, target_fd, st);
+			} catch (...) {
+				close(source_fd);
+				close(target_fd);
+				throw;
+			}
+			close(source_fd);
+			//set on the open file, no more path lookups
+			if (fchown(target_fd, st.st_uid, st.st_gid) != 0) {}
+			fchmod(target_fd, st.st_mode & 07777);
+			futimens(target_fd, times);
+			close(target_fd);
+			m_file_count++;
+			return;
+		}
+
+		if (S_ISLNK(st.st_mode)) {
+			vector<char> link_target(max<size_t>(st.st_size, 255) + 1);
+			ssize_t len = readlink(source.c_str(), link_target.data(), link_target.size());
+			if (len < 0 || static_cast<size_t>(len) >= link_target.size()) {
+				throw ContainerRuntimeException("Couldn't read the symlink " + source);
+			}
+			if (symlink(string(link_target.data(), len).c_str(), target.c_str()) != 0) {
+				throw ContainerRuntimeException("Couldn't create " + target + " : " + strerror(errno));
+			}
+		} else if (mknod(target.c_str(), st.st_mode, st.st_rdev) != 0) {
+			//device nodes need privileges, the container doesn't rely on them anyway
+			return;
+		}
+		if (lchown(target.c_str(), st.st_uid, st.st_gid) != 0) {}
+		if (!S_ISLNK(st.st_mode)) chmod(target.c_str(), st.st_mode & 07777);
+		utimensat(AT_FDCWD, target.c_str(), times, AT_SYMLINK_NOFOLLOW);
+		m_file_count++;
+	}
+
+	void RootfsMaterializer::copyFile(const string& source, int source_fd, int target_fd, const struct stat& st)
+	{
+		//a reflink shares the extents of the layer's file, nothing is copied until either one is written
+		if (st.st_size == 0) return;
+		if (ioctl(target_fd, FICLONE, source_fd) == 0) {
+			m_cloned_count++;
+			return;
+		}
+
+		//copied inside the kernel, without passing through user space
+		uint64_t copied = 0;
+		while (copied < static_cast<uint64_t>(st.st_size)) {
+			ssize_t n = copy_file_range(source_fd, nullptr, target_fd, nullptr, st.st_size - copied, 0);
+			if (n > 0) {
+				copied += n;
+				continue;
+			}
+			if (n == 0) break; //the file shrank
+			if (copied == 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) break;
+			throw ContainerRuntimeException("Couldn't copy " + source + " : " + strerror(errno));
+		}
+		if (copied > 0) {
+			m_copied_bytes += copied;
+			return;
+		}
+
+		//kernels and file systems without copy_file_range
+		vector<char> buffer(copy_buffer_size);
+		while (true) {
+			ssize_t n = read(source_fd, buffer.data(), buffer.size());
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0) {
+				throw ContainerRuntimeException("Couldn't read " + source + " : " + strerror(errno));
+			}
+			if (n == 0) break;
+			for (ssize_t written = 0; written < n;) {
+				ssize_t w = write(target_fd, buffer.data() + written, n - written);
+				if (w < 0 && errno == EINTR) continue;
+				if (w < 0) {
+					throw ContainerRuntimeException("Couldn't copy " + source + " : " + strerror(errno));
+				}
+				written += w;
+			}
+			m_copied_bytes += n;
+		}
+	}
+
+	void RootfsMaterializer::runOnThreads(size_t count, const function<void(size_t)>& task)
+	{
+		size_t thread_count = min<size_t>(m_thread_count, count);
+		if (thread_count <= 1) {
+			for (size_t i = 0; i < count; i++) task(i);
+			return;
+		}
+
+		atomic<size_t> next(0);
+		mutex error_mutex;
+		string error;
+		vector<thread> threads;
+		for (size_t t = 0; t < thread_count; t++) {
+			threads.emplace_back([&]() {
+				for (size_t i = next++; i < count; i = next++) {
+					try {
+						task(i);
+					} catch (const exception& ex) {
+						//the others stop at their next task, the first error is the one reported
+						lock_guard<mutex> lock(error_mutex);
+						if (error.empty()) error = ex.what();
+						next = count;
+					}
+				}
+			});
+		}
+		for (thread& t : threads) {
+			t.join();
+		}
+		if (!error.empty()) {
+			throw ContainerRuntimeException(error);
+		}
+	}
+}
@@ -0,0 +1,274 @@
+#include "../include/minidocker/rootfs_snapshot.hpp"
+#include "../include/minidocker/background_task.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include "../include/minidocker/image.hpp"
+#include "../include/minidocker/image_store.hpp"
+#include "../include/minidocker/layer_cache.hpp"
+#include "../include/minidocker/layer_lock.hpp"
+#include "../include/minidocker/layer_whiteouts.hpp"
+#include "../include/minidocker/sha256.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <nlohmann/json.hpp>
+
+using namespace std;
+using json = nlohmann::json;
+
+namespace fs = std::filesystem;
+static string snapshot_dir = "/var/lib/minidocker/snapshots"; //next to the layers, their files are linked into the snapshots
+
+namespace
+{
+	vector<string> chainIds(const vector<string>& layer_digests, const vector<string>& diff_ids)
+	{
+		const vector<string>& ids = diff_ids.size() == layer_digests.size() ? diff_ids : layer_digests;
+		vector<string> chain_ids;
+		for (const string& id : ids) {
+			chain_ids.push_back(chain_ids.empty() ? id : minidocker::Sha256::digestOf(chain_ids.back() + " " + id));
+		}
+		return chain_ids;
+	}
+
+	//the layer digests of a stored manifest and the chain IDs of its stacks, false if it isn't an image manifest
+	bool readManifestChain(minidocker::ImageStore& image_store, const string& manifest_digest, vector<string>& layer_digests, vector<string>& chain_ids)
+	{
+		string content;
+		if (!image_store.getBlob(manifest_digest, content)) return false;
+		json manifest_json = json::parse(content, nullptr, false);
+		if (manifest_json.is_discarded() || !manifest_json.is_object() || !manifest_json.contains("layers")
+			|| !manifest_json["layers"].is_array()) return false;
+
+		for (const auto& layer : manifest_json["layers"]) {
+			if (layer.contains("digest") && layer["digest"].is_string()) layer_digests.push_back(layer["digest"].get<string>());
+		}
+		vector<string> diff_ids;
+		string config;
+		if (manifest_json.contains("config") && manifest_json["config"].is_object() && manifest_json["config"].contains("digest")
+			&& manifest_json["config"]["digest"].is_string() && image_store.getBlob(manifest_json["config"]["digest"].get<string>(), config)) {
+			json config_json = json::parse(config, nullptr, false);
+			if (!config_json.is_discarded() && config_json.is_object() && config_json.contains("rootfs") && config_json["rootfs"].is_object()
+				&& config_json["rootfs"].contains("diff_ids") && config_json["rootfs"]["diff_ids"].is_array()) {
+				for (const auto& diff_id : config_json["rootfs"]["diff_ids"]) {
+					if (diff_id.is_string()) diff_ids.push_back(diff_id.get<string>());
+				}
+			}
+		}
+		chain_ids = chainIds(layer_digests, diff_ids);
+		return true;
+	}
+
+	//the snapshot's own directories, and files the layers it was built from don't have anymore
+	uint64_t getOwnUsage(const string& path)
+	{
+		uint64_t usage = 0;
+		struct stat st;
+		error_code ec;
+		for (fs::recursive_directory_iterator it(path, fs::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec)) {
+			if (lstat(it->path().c_str(), &st) != 0) continue;
+			if (S_ISDIR(st.st_mode) || st.st_nlink == 1) usage += static_cast<uint64_t>(st.st_blocks) * 512;
+		}
+		return usage;
+	}
+}
+
+namespace minidocker
+{
+	bool RootfsSnapshot::isEnabled()
+	{
+		const char* value = getenv("MINIDOCKER_ROOTFS_SNAPSHOTS");
+		return !value || (string(value) != "0" && string(value) != "off");
+	}
+
+	vector<string> RootfsSnapshot::getChainIds(const ImageManifest& manifest)
+	{
+		vector<string> layer_digests;
+		for (const ImageLayer& layer : manifest.m_image_layers) {
+			layer_digests.push_back(layer.m_image_digest);
+		}
+		return chainIds(layer_digests, manifest.m_image_config.m_diff_ids);
+	}
+
+	string RootfsSnapshot::getSnapshotDir(const string& chain_id)
+	{
+		string chain_id_clean = chain_id.substr(chain_id.find(":") + 1); // remove "sha256:"
+		return snapshot_dir + "/" + chain_id_clean;
+	}
+
+	string RootfsSnapshot::findSnapshot(const vector<string>& chain_ids, unique_ptr<LayerLock>* snapshot_lock)
+	{
+		if (chain_ids.size() < 2) return "";
+		string dir = getSnapshotDir(chain_ids.back());
+		//a build holds it exclusively until it's in place, a container doesn't wait for that
+		auto lock = make_unique<LayerLock>(chain_ids.back());
+		if (!lock->tryLockShared() || !fs::is_directory(dir)) return "";
+		if (snapshot_lock) *snapshot_lock = move(lock);
+		return dir;
+	}
+
+	string RootfsSnapshot::build(const vector<ImageLayer>& layers, const vector<string>& chain_ids, unique_ptr<LayerLock>* snapshot_lock)
+	{
+		if (layers.empty() || chain_ids.size() != layers.size()) {
+			throw RootfsSnapshotException("The image has no layers to build a rootfs snapshot of");
+		}
+		//the layers can't be evicted while their files are linked into a snapshot
+		vector<unique_ptr<LayerLock>> layer_locks;
+		for (const ImageLayer& layer : layers) {
+			auto layer_lock = make_unique<LayerLock>(layer.m_image_digest);
+			layer_lock->lockShared();
+			layer_locks.push_back(move(layer_lock));
+			if (!fs::is_directory(Image::getImageLayerDir(layer))) {
+				throw RootfsSnapshotException("Image Layer " + layer.m_image_digest + " isn't extracted, the rootfs snapshot can't be built");
+			}
+		}
+		string base_dir = Image::getImageLayerDir(layers[0]);
+		if (layers.size() == 1) return base_dir;
+
+		//a stack in between only gets a snapshot of its own when another image has it too, the one above is built
+		//from the nearest snapshot below with every layer up to it merged on top, so an image costs one tree not one per layer
+		set<string> shared_chain_ids = getSharedChainIds();
+
+		//every snapshot is locked until the one above it is built from it, shared if it's there already
+		//a snapshot stays locked (shared) while a container uses it, so waiting for the exclusive lock is only for a missing one
+		unique_ptr<LayerLock> base_lock;
+		size_t base_index = 0;
+		auto start = chrono::steady_clock::now();
+		size_t built = 0;
+		for (size_t i = 1; i < layers.size(); i++) {
+			string dir = getSnapshotDir(chain_ids[i]);
+			bool needed = i == layers.size() - 1 || shared_chain_ids.count(chain_ids[i]) > 0;
+			auto lock = make_unique<LayerLock>(chain_ids[i]);
+			lock->lockShared();
+			if (!fs::is_directory(dir)) {
+				if (!needed) continue;
+				lock->unlock();
+				lock->lock();
+			}
+			if (!fs::is_directory(dir)) {
+				if (built == 0) cout << "Building rootfs snapshots of " << layers.size() << " image layer(s)...\n";
+				string staging_dir = dir + ".building";
+				error_code ec;
+				fs::remove_all(staging_dir, ec);
+				fs::create_directories(staging_dir);
+				chmod(staging_dir.c_str(), 0755);
+				try {
+					//files are linked rather than copied, a snapshot is only ever read
+					LayerWhiteouts::mergeLayer(base_dir, staging_dir, true);
+					for (size_t layer_index = base_index + 1; layer_index <= i; layer_index++) {
+						LayerWhiteouts::mergeLayer(Image::getImageLayerDir(layers[layer_index]), staging_dir, true);
+					}
+				} catch (const ContainerRuntimeException& ex) {
+					fs::remove_all(staging_dir, ec);
+					throw RootfsSnapshotException("Couldn't build the rootfs snapshot " + chain_ids[i] + " : " + ex.what());
+				}
+				if (rename(staging_dir.c_str(), dir.c_str()) != 0) {
+					fs::remove_all(staging_dir, ec);
+					throw RootfsSnapshotException("Couldn't move the rootfs snapshot " + chain_ids[i] + " into place");
+				}
+				built++;
+			}
+			base_dir = dir;
+			base_index = i;
+			base_lock = move(lock);
+		}
+		if (built > 0) {
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			cout << "Built " << built << " rootfs snapshot(s) in " << seconds << "s\n";
+		}
+
+		if (snapshot_lock) {
+			//flock turns the exclusive lock into a shared one in place
+			base_lock->unlock();
+			base_lock->lockShared();
+			if (!fs::is_directory(base_dir)) {
+				throw RootfsSnapshotException("The rootfs snapshot " + chain_ids.back() + " was removed while it was locked");
+			}
+			*snapshot_lock = move(base_lock);
+		}
+		return base_dir;
+	}
+
+	bool RootfsSnapshot::startBackgroundBuild(const string& manifest_digest)
+	{
+		if (manifest_digest.empty()) return false;
+		return BackgroundTask::start({ "images", "snapshot", manifest_digest });
+	}
+
+	void RootfsSnapshot::buildForManifest(const string& manifest_digest)
+	{
+		BackgroundTask::lowerPriority();
+		ImageStore image_store;
+		vector<string> layer_digests;
+		vector<string> chain_ids;
+		if (!readManifestChain(image_store, manifest_digest, layer_digests, chain_ids)) {
+			throw RootfsSnapshotException("Manifest " + manifest_digest + " isn't stored, its rootfs snapshot can't be built");
+		}
+		vector<ImageLayer> layers;
+		for (const string& layer_digest : layer_digests) {
+			ImageLayer layer;
+			layer.m_image_digest = layer_digest;
+			layers.push_back(layer);
+		}
+		build(layers, chain_ids);
+	}
+
+	set<string> RootfsSnapshot::getSharedChainIds()
+	{
+		set<string> manifest_digests;
+		LayerCache::getReferencedLayers(&manifest_digests);
+		ImageStore image_store;
+		map<string, size_t> manifest_counts;
+		for (const string& manifest_digest : manifest_digests) {
+			vector<string> layer_digests;
+			vector<string> chain_ids;
+			if (!readManifestChain(image_store, manifest_digest, layer_digests, chain_ids)) continue;
+			for (const string& chain_id : chain_ids) {
+				manifest_counts[chain_id]++;
+			}
+		}
+		set<string> shared_chain_ids;
+		for (const auto& [chain_id, count] : manifest_counts) {
+			if (count > 1) shared_chain_ids.insert(chain_id);
+		}
+		return shared_chain_ids;
+	}
+
+	set<string> RootfsSnapshot::getReferencedChainIds(const set<string>& manifest_digests)
+	{
+		ImageStore image_store;
+		set<string> chain_ids;
+		for (const string& manifest_digest : manifest_digests) {
+			vector<string> layer_digests;
+			vector<string> manifest_chain_ids;
+			if (!readManifestChain(image_store, manifest_digest, layer_digests, manifest_chain_ids)) continue;
+			chain_ids.insert(manifest_chain_ids.begin(), manifest_chain_ids.end());
+		}
+		return chain_ids;
+	}
+
+	uint64_t RootfsSnapshot::prune(const set<string>& referenced_chain_ids)
+	{
+		uint64_t freed = 0;
+		error_code ec;
+		for (fs::directory_iterator it(snapshot_dir, ec), end; !ec && it != end; it.increment(ec)) {
+			string name = it->path().filename().string();
+			size_t dot = name.find('.');
+			string chain_id = "sha256:" + name.substr(0, dot);
+			bool leftover = dot != string::npos;
+			if (!leftover && referenced_chain_ids.count(chain_id) > 0) continue;
+
+			//held shared by the containers using the snapshot, exclusively by a build
+			LayerLock snapshot_lock(chain_id);
+			if (!snapshot_lock.tryLock()) continue;
+			freed += getOwnUsage(it->path().string());
+			error_code remove_ec;
+			fs::remove_all(it->path(), remove_ec);
+		}
+		return freed;
+	}
+}
@@ -0,0 +1,276 @@
+#include "../include/minidocker/sha256.hpp"
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define MINIDOCKER_SHA256_X86 1
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+//the ARMv8 path needs the crypto extension enabled at compile time (e.g. -march=armv8-a+crypto)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define MINIDOCKER_SHA256_ARMV8 1
+#endif
+
+using namespace std;
+
+namespace
+{
+	alignas(16) const uint32_t K[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+	};
+
+	const uint32_t initial_state[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	inline uint32_t rotr(uint32_t x, int n)
+	{
+		return (x >> n) | (x << (32 - n));
+	}
+
+	void compressPortable(uint32_t state[8], const unsigned char* blocks, size_t num_blocks)
+	{
+		uint32_t w[64];
+		for (size_t block = 0; block < num_blocks; block++, blocks += 64) {
+			for (int i = 0; i < 16; i++) {
+				w[i] = (uint32_t(blocks[4 * i]) << 24) | (uint32_t(blocks[4 * i + 1]) << 16) |
+					(uint32_t(blocks[4 * i + 2]) << 8) | uint32_t(blocks[4 * i + 3]);
+			}
+			for (int i = 16; i < 64; i++) {
+				uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+				uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+				w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+			}
+
+			uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+			uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+			for (int i = 0; i < 64; i++) {
+				uint32_t S1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+				uint32_t ch = (e & f) ^ (~e & g);
+				uint32_t t1 = h + S1 + ch + K[i] + w[i];
+				uint32_t S0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+				uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+				uint32_t t2 = S0 + maj;
+				h = g; g = f; f = e; e = d + t1;
+				d = c; c = b; b = a; a = t1 + t2;
+			}
+			state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+			state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+		}
+	}
+
+#ifdef MINIDOCKER_SHA256_X86
+	//SHA-NI keeps the state as ABEF/CDGH pairs and does two rounds per sha256rnds2
+	__attribute__((target("sha,sse4.1,ssse3")))
+	void compressShaNi(uint32_t state[8], const unsigned char* blocks, size_t num_blocks)
+	{
+		const __m128i byte_swap_mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+		__m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0]));
+		__m128i state1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4]));
+		tmp = _mm_shuffle_epi32(tmp, 0xB1);              // CDAB
+		state1 = _mm_shuffle_epi32(state1, 0x1B);        // EFGH
+		__m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+		state1 = _mm_blend_epi16(state1, tmp, 0xF0);     // CDGH
+
+		for (size_t block = 0; block < num_blocks; block++, blocks += 64) {
+			__m128i abef_save = state0;
+			__m128i cdgh_save = state1;
+			__m128i w[4];
+
+			for (int t = 0; t < 16; t++) {
+				//w[t % 4] holds W[t-4], w[(t+1) % 4] W[t-3], w[(t+2) % 4] W[t-2], w[(t+3) % 4] W[t-1]
+				if (t < 4) {
+					w[t] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 16 * t)), byte_swap_mask);
+				} else {
+					__m128i next = _mm_sha256msg1_epu32(w[t % 4], w[(t + 1) % 4]);
+					next = _mm_add_epi32(next, _mm_alignr_epi8(w[(t + 3) % 4], w[(t + 2) % 4], 4));
+					w[t % 4] = _mm_sha256msg2_epu32(next, w[(t + 3) % 4]);
+				}
+
+				__m128i msg = _mm_add_epi32(w[t % 4], _mm_load_si128(reinterpret_cast<const __m128i*>(&K[4 * t])));
+				state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+				msg = _mm_shuffle_epi32(msg, 0x0E);
+				state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+			}
+
+			state0 = _mm_add_epi32(state0, abef_save);
+			state1 = _mm_add_epi32(state1, cdgh_save);
+		}
+
+		tmp = _mm_shuffle_epi32(state0, 0x1B);           // FEBA
+		state1 = _mm_shuffle_epi32(state1, 0xB1);        // DCHG
+		state0 = _mm_blend_epi16(tmp, state1, 0xF0);     // DCBA
+		state1 = _mm_alignr_epi8(state1, tmp, 8);        // ABEF
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+	}
+
+	bool cpuHasShaNi()
+	{
+		unsigned int eax, ebx, ecx, edx;
+		if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+		bool has_ssse3 = ecx & (1u << 9);
+		bool has_sse41 = ecx & (1u << 19);
+		if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+		bool has_sha = ebx & (1u << 29);
+		return has_ssse3 && has_sse41 && has_sha;
+	}
+#endif
+
+#ifdef MINIDOCKER_SHA256_ARMV8
+	void compressArmv8(uint32_t state[8], const unsigned char* blocks, size_t num_blocks)
+	{
+		uint32x4_t state0 = vld1q_u32(&state[0]);
+		uint32x4_t state1 = vld1q_u32(&state[4]);
+
+		for (size_t block = 0; block < num_blocks; block++, blocks += 64) {
+			uint32x4_t abcd_save = state0;
+			uint32x4_t efgh_save = state1;
+			uint32x4_t w[4];
+
+			for (int t = 0; t < 16; t++) {
+				if (t < 4) {
+					w[t] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks + 16 * t)));
+				} else {
+					w[t % 4] = vsha256su1q_u32(vsha256su0q_u32(w[t % 4], w[(t + 1) % 4]), w[(t + 2) % 4], w[(t + 3) % 4]);
+				}
+
+				uint32x4_t msg = vaddq_u32(w[t % 4], vld1q_u32(&K[4 * t]));
+				uint32x4_t abcd = state0;
+				state0 = vsha256hq_u32(state0, state1, msg);
+				state1 = vsha256h2q_u32(state1, abcd, msg);
+			}
+
+			state0 = vaddq_u32(state0, abcd_save);
+			state1 = vaddq_u32(state1, efgh_save);
+		}
+
+		vst1q_u32(&state[0], state0);
+		vst1q_u32(&state[4], state1);
+	}
+#endif
+
+	struct Dispatch
+	{
+		minidocker::Sha256::CompressFunction m_compress = compressPortable;
+		const char* m_name = "portable";
+
+		Dispatch()
+		{
+#ifdef MINIDOCKER_SHA256_X86
+			if (cpuHasShaNi()) {
+				m_compress = compressShaNi;
+				m_name = "sha-ni";
+			}
+#endif
+#ifdef MINIDOCKER_SHA256_ARMV8
+			if (getauxval(AT_HWCAP) & HWCAP_SHA2) {
+				m_compress = compressArmv8;
+				m_name = "armv8-crypto";
+			}
+#endif
+		}
+	};
+
+	const Dispatch& getDispatch()
+	{
+		static const Dispatch dispatch;
+		return dispatch;
+	}
+}
+
+namespace minidocker
+{
+	Sha256::Sha256(Implementation implementation)
+		: m_compress(implementation == Implementation::PORTABLE ? compressPortable : getDispatch().m_compress)
+	{
+		reset();
+	}
+
+	void Sha256::reset()
+	{
+		memcpy(m_state, initial_state, sizeof(m_state));
+		m_buffer_len = 0;
+		m_total_len = 0;
+	}
+
+	void Sha256::update(const void* data, size_t len)
+	{
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		m_total_len += len;
+
+		if (m_buffer_len > 0) {
+			size_t n = min(len, sizeof(m_buffer) - m_buffer_len);
+			memcpy(m_buffer + m_buffer_len, bytes, n);
+			m_buffer_len += n;
+			bytes += n;
+			len -= n;
+			if (m_buffer_len < sizeof(m_buffer)) return;
+			m_compress(m_state, m_buffer, 1);
+			m_buffer_len = 0;
+		}
+
+		//whole blocks are hashed straight from the caller's buffer
+		size_t whole_blocks = len / 64;
+		if (whole_blocks > 0) {
+			m_compress(m_state, bytes, whole_blocks);
+			bytes += whole_blocks * 64;
+			len -= whole_blocks * 64;
+		}
+
+		if (len > 0) {
+			memcpy(m_buffer, bytes, len);
+			m_buffer_len = len;
+		}
+	}
+
+	string Sha256::finalDigest()
+	{
+		uint64_t bit_len = m_total_len * 8;
+		unsigned char padding[72] = { 0x80 };
+		size_t pad_len = (m_buffer_len < 56) ? (56 - m_buffer_len) : (120 - m_buffer_len);
+		for (int i = 0; i < 8; i++) {
+			padding[pad_len + i] = static_cast<unsigned char>(bit_len >> (56 - 8 * i));
+		}
+		uint64_t total_len = m_total_len;
+		update(padding, pad_len + 8);
+		m_total_len = total_len;
+
+		static const char hex[] = "0123456789abcdef";
+		string digest = "sha256:";
+		for (uint32_t word : m_state) {
+			for (int shift = 28; shift >= 0; shift -= 4) {
+				digest += hex[(word >> shift) & 0xf];
+			}
+		}
+		return digest;
+	}
+
+	uint64_t Sha256::getBytesHashed() const
+	{
+		return m_total_len;
+	}
+
+	string Sha256::getImplementationName()
+	{
+		return getDispatch().m_name;
+	}
+
+	string Sha256::digestOf(const string& data)
+	{
+		Sha256 hasher;
+		hasher.update(data.data(), data.size());
+		return hasher.finalDigest();
+	}
+}
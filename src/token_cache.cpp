@@ -0,0 +1,302 @@
+#include "../include/minidocker/token_cache.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include "../include/minidocker/registry_client.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+using namespace std;
+
+namespace fs = std::filesystem;
+static string token_cache_path = "/var/lib/minidocker/auth/tokens.json";
+
+namespace
+{
+	//the registry default when the token server doesn't say how long a token lives
+	const long default_expires_in = 60;
+	//a token this close to expiring isn't handed out anymore, it could expire while a request is in flight
+	const long expiry_margin = 30;
+
+	string toLower(string value)
+	{
+		transform(value.begin(), value.end(), value.begin(), [](unsigned char c) { return tolower(c); });
+		return value;
+	}
+
+	//RFC 3339 timestamp like "2024-01-02T03:04:05.123456Z", fractions and offsets other than Z are ignored
+	bool parseTimestamp(const string& value, time_t& result)
+	{
+		struct tm tm = {};
+		if (sscanf(value.c_str(), "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+			return false;
+		}
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		result = timegm(&tm);
+		return result != static_cast<time_t>(-1);
+	}
+}
+
+namespace minidocker
+{
+	TokenCache::TokenCache(const string& cache_path) : m_cache_path(cache_path)
+	{
+		load();
+	}
+
+	string TokenCache::getDefaultCachePath()
+	{
+		return token_cache_path;
+	}
+
+	string TokenCache::getTokenKey(const string& realm, const string& service, const string& scope)
+	{
+		return realm + "\n" + service + "\n" + scope;
+	}
+
+	bool TokenCache::canPersist() const
+	{
+		//tokens are credentials, they only go to disk when the file can be kept root only
+		return !m_cache_path.empty() && geteuid() == 0;
+	}
+
+	void TokenCache::load()
+	{
+		if (!canPersist()) return;
+
+		struct stat st;
+		if (stat(m_cache_path.c_str(), &st) != 0) return;
+		if (st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+			cerr << "Warning: ignoring token cache " << m_cache_path << ", it's accessible to other users\n";
+			return;
+		}
+
+		try {
+			ifstream ifs(m_cache_path);
+			json cache_json = json::parse(ifs);
+			time_t now = time(nullptr);
+
+			for (const auto& entry : cache_json.value("tokens", json::array())) {
+				CachedToken token;
+				token.m_token = entry.at("token").get<string>();
+				token.m_expires_at = entry.at("expires_at").get<time_t>();
+				if (token.m_expires_at > now) {
+					m_tokens[getTokenKey(entry.at("realm").get<string>(), entry.at("service").get<string>(), entry.at("scope").get<string>())] = token;
+				}
+			}
+			json challenges_json = cache_json.value("challenges", json::object());
+			for (const auto& [host, entry] : challenges_json.items()) {
+				AuthChallenge challenge;
+				challenge.m_scheme = entry.value("scheme", "bearer");
+				challenge.m_realm = entry.at("realm").get<string>();
+				challenge.m_service = entry.value("service", "");
+				m_challenges[host] = challenge;
+			}
+		} catch (const exception&) {
+			//a broken cache only costs a round trip to the token server
+			m_tokens.clear();
+			m_challenges.clear();
+		}
+	}
+
+	void TokenCache::save()
+	{
+		if (!canPersist()) return;
+
+		try {
+			fs::path cache_path(m_cache_path);
+			fs::create_directories(cache_path.parent_path());
+			chmod(cache_path.parent_path().c_str(), 0700);
+
+			//several invocations can refresh tokens at the same time, they take turns and merge with what's on disk
+			string lock_path = m_cache_path + ".lock";
+			int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+			if (lock_fd < 0) return;
+			flock(lock_fd, LOCK_EX);
+
+			map<string, CachedToken> own_tokens = m_tokens;
+			map<string, AuthChallenge> own_challenges = m_challenges;
+			load();
+			for (const auto& [key, token] : own_tokens) m_tokens[key] = token;
+			for (const auto& [host, challenge] : own_challenges) m_challenges[host] = challenge;
+
+			json cache_json;
+			cache_json["tokens"] = json::array();
+			cache_json["challenges"] = json::object();
+			time_t now = time(nullptr);
+			for (const auto& [key, token] : m_tokens) {
+				if (token.m_expires_at <= now) continue;
+				size_t first = key.find('\n');
+				size_t second = key.find('\n', first + 1);
+				cache_json["tokens"].push_back({
+					{ "realm", key.substr(0, first) },
+					{ "service", key.substr(first + 1, second - first - 1) },
+					{ "scope", key.substr(second + 1) },
+					{ "token", token.m_token },
+					{ "expires_at", token.m_expires_at } });
+			}
+			for (const auto& [host, challenge] : m_challenges) {
+				cache_json["challenges"][host] = { { "scheme", challenge.m_scheme }, { "realm", challenge.m_realm }, { "service", challenge.m_service } };
+			}
+
+			//written next to the cache and renamed over it, readers never see half a file
+			string tmp_path = m_cache_path + ".tmp";
+			int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+			if (fd >= 0) {
+				string data = cache_json.dump();
+				bool written = write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size());
+				fchmod(fd, 0600);
+				close(fd);
+				if (written) {
+					fs::rename(tmp_path, m_cache_path);
+				} else {
+					fs::remove(tmp_path);
+				}
+			}
+			close(lock_fd);
+		} catch (const exception& ex) {
+			cerr << "Warning: couldn't save token cache : " << ex.what() << "\n";
+		}
+	}
+
+	string TokenCache::lookup(const string& realm, const string& service, const string& scope)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		auto it = m_tokens.find(getTokenKey(realm, service, scope));
+		if (it == m_tokens.end()) return "";
+		if (it->second.m_expires_at <= time(nullptr) + expiry_margin) {
+			m_tokens.erase(it);
+			return "";
+		}
+		return it->second.m_token;
+	}
+
+	string TokenCache::lookupForHost(const string& host, const string& scope)
+	{
+		AuthChallenge challenge;
+		{
+			lock_guard<mutex> lock(m_mutex);
+			auto it = m_challenges.find(host);
+			if (it == m_challenges.end()) return "";
+			challenge = it->second;
+		}
+		return lookup(challenge.m_realm, challenge.m_service, scope);
+	}
+
+	void TokenCache::store(const string& realm, const string& service, const string& scope, const CachedToken& token)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_tokens[getTokenKey(realm, service, scope)] = token;
+		save();
+	}
+
+	void TokenCache::storeChallenge(const string& host, const AuthChallenge& challenge)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		auto it = m_challenges.find(host);
+		if (it != m_challenges.end() && it->second.m_realm == challenge.m_realm && it->second.m_service == challenge.m_service) {
+			return;
+		}
+		//the scope is per request, only realm and service describe the host
+		AuthChallenge host_challenge = challenge;
+		host_challenge.m_scope.clear();
+		m_challenges[host] = host_challenge;
+	}
+
+	void TokenCache::invalidate(const string& realm, const string& service, const string& scope)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		//kept as an expired entry, so merging with the file on the next save doesn't bring it back
+		auto it = m_tokens.find(getTokenKey(realm, service, scope));
+		if (it != m_tokens.end()) it->second.m_expires_at = 0;
+	}
+
+	bool TokenCache::parseChallenge(const string& header_str, AuthChallenge& challenge)
+	{
+		string value = RegistryClient::getHeader(header_str, "WWW-Authenticate");
+		if (value.empty()) return false;
+
+		//scheme, then comma separated key=value pairs whose values may be quoted
+		size_t pos = value.find_first_not_of(" \t");
+		if (pos == string::npos) return false;
+		size_t scheme_end = value.find_first_of(" \t", pos);
+		challenge = AuthChallenge();
+		challenge.m_scheme = toLower(value.substr(pos, scheme_end == string::npos ? string::npos : scheme_end - pos));
+		pos = scheme_end;
+
+		while (pos != string::npos && pos < value.size()) {
+			pos = value.find_first_not_of(" \t,", pos);
+			if (pos == string::npos) break;
+			size_t eq = value.find('=', pos);
+			if (eq == string::npos) break;
+			string key = toLower(value.substr(pos, eq - pos));
+			while (!key.empty() && (key.back() == ' ' || key.back() == '\t')) key.pop_back();
+
+			string param;
+			pos = eq + 1;
+			if (pos < value.size() && value[pos] == '"') {
+				pos++;
+				while (pos < value.size() && value[pos] != '"') {
+					if (value[pos] == '\\' && pos + 1 < value.size()) pos++;
+					param += value[pos++];
+				}
+				pos++; // closing quote
+			} else {
+				size_t end = value.find(',', pos);
+				param = value.substr(pos, end == string::npos ? string::npos : end - pos);
+				while (!param.empty() && (param.back() == ' ' || param.back() == '\t')) param.pop_back();
+				pos = end;
+			}
+
+			if (key == "realm") challenge.m_realm = param;
+			else if (key == "service") challenge.m_service = param;
+			else if (key == "scope") challenge.m_scope = param;
+		}
+		return challenge.m_scheme == "bearer" && !challenge.m_realm.empty();
+	}
+
+	CachedToken TokenCache::parseTokenResponse(const string& response_body)
+	{
+		json token_json = json::parse(response_body, nullptr, false);
+		if (token_json.is_discarded() || !token_json.is_object()) {
+			throw ImageAuthException("Token server sent an invalid response!");
+		}
+
+		CachedToken token;
+		//"access_token" is the OAuth2 name for the same thing
+		if (token_json.contains("token") && token_json["token"].is_string()) {
+			token.m_token = token_json["token"].get<string>();
+		} else if (token_json.contains("access_token") && token_json["access_token"].is_string()) {
+			token.m_token = token_json["access_token"].get<string>();
+		}
+		if (token.m_token.empty()) {
+			throw ImageAuthException("Token server response doesn't contain a token!");
+		}
+
+		long expires_in = default_expires_in;
+		if (token_json.contains("expires_in") && token_json["expires_in"].is_number()) {
+			expires_in = token_json["expires_in"].get<long>();
+		}
+		time_t now = time(nullptr);
+		time_t issued_at = now;
+		if (token_json.contains("issued_at") && token_json["issued_at"].is_string()) {
+			time_t parsed;
+			//a token server clock ahead of ours must not make the token live longer here
+			if (parseTimestamp(token_json["issued_at"].get<string>(), parsed)) issued_at = min(parsed, now);
+		}
+		token.m_expires_at = issued_at + expires_in;
+		return token;
+	}
+}
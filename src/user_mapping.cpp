@@ -0,0 +1,231 @@
+#include "../include/minidocker/user_mapping.hpp"
+#include "../include/minidocker/custom_specific_exceptions.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <linux/mount.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const size_t max_map_lines = 340; //the kernel takes at most that many ranges (5 before 4.15)
+
+namespace minidocker
+{
+	UserMapping::UserMapping()
+	{
+		m_uid_ranges = { { 0, static_cast<uint32_t>(getuid()), 1 } };
+		m_gid_ranges = { { 0, static_cast<uint32_t>(getgid()), 1 } };
+
+		const char* value = getenv("MINIDOCKER_USERNS_REMAP");
+		if (!value || *value == '\0') {
+			return;
+		}
+
+		//a user name or a uid, /etc/subuid may list the user by either
+		string user_name = value;
+		uid_t uid = static_cast<uid_t>(-1);
+		char* end = nullptr;
+		long parsed = strtol(value, &end, 10);
+		struct passwd* pw = nullptr;
+		if (end != value && *end == '\0' && parsed >= 0) {
+			uid = static_cast<uid_t>(parsed);
+			pw = getpwuid(uid);
+			if (pw) user_name = pw->pw_name;
+		} else if ((pw = getpwnam(value))) {
+			uid = pw->pw_uid;
+		}
+
+		vector<IdRange> uid_ranges = readSubordinateIds("/etc/subuid", user_name, uid);
+		vector<IdRange> gid_ranges = readSubordinateIds("/etc/subgid", user_name, uid);
+		if (uid_ranges.empty() || gid_ranges.empty()) {
+			cerr << "Warning: ignoring invalid MINIDOCKER_USERNS_REMAP value \"" << value << "\", it has no ranges in /etc/subuid and /etc/subgid\n";
+			return;
+		}
+		m_uid_ranges = uid_ranges;
+		m_gid_ranges = gid_ranges;
+		m_remapped = true;
+	}
+
+	bool UserMapping::isRemapped() const
+	{
+		return m_remapped;
+	}
+
+	uid_t UserMapping::getRootUid() const
+	{
+		return m_uid_ranges.front().m_outside;
+	}
+
+	gid_t UserMapping::getRootGid() const
+	{
+		return m_gid_ranges.front().m_outside;
+	}
+
+	vector<IdRange> UserMapping::readSubordinateIds(const string& path, const string& user_name, uid_t uid)
+	{
+		vector<IdRange> ranges;
+		ifstream ifs(path);
+		string line;
+		uint32_t inside = 0;
+		while (getline(ifs, line) && ranges.size() < max_map_lines) {
+			stringstream ss(line);
+			string name, start, count;
+			if (!getline(ss, name, ':') || !getline(ss, start, ':') || !getline(ss, count)) continue;
+			if (name != user_name && (uid == static_cast<uid_t>(-1) || name != to_string(uid))) continue;
+
+			IdRange range;
+			range.m_inside = inside;
+			range.m_outside = static_cast<uint32_t>(strtoul(start.c_str(), nullptr, 10));
+			range.m_count = static_cast<uint32_t>(strtoul(count.c_str(), nullptr, 10));
+			if (range.m_count == 0) continue;
+			//the ranges are laid out one after another inside the container
+			inside += range.m_count;
+			ranges.push_back(range);
+		}
+		return ranges;
+	}
+
+	void UserMapping::writeMap(const string& path, const vector<IdRange>& ranges)
+	{
+		string map;
+		for (const IdRange& range : ranges) {
+			map += to_string(range.m_inside) + " " + to_string(range.m_outside) + " " + to_string(range.m_count) + "\n";
+		}
+		//the kernel wants the whole map in one write
+		int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+		if (fd < 0) {
+			throw UserMapException(path + " couldn't be opened : " + strerror(errno));
+		}
+		ssize_t written = write(fd, map.data(), map.size());
+		int error = errno;
+		close(fd);
+		if (written != static_cast<ssize_t>(map.size())) {
+			throw UserMapException(path + " write failed : " + strerror(error));
+		}
+	}
+
+	void UserMapping::apply(pid_t pid) const
+	{
+		string proc_dir = "/proc/" + to_string(pid);
+		if (!m_remapped) {
+			// Write to /proc/[pid]/setgroups to "deny" group changes
+			// Required before gid_map changes (unless the writer is privileged), so as to prevent permission escalations by changing groups
+			ofstream setgroups(proc_dir + "/setgroups");
+			if (setgroups) {
+				setgroups << "deny";
+			}
+			else {
+				throw UserMapException("setgroups write failed");
+			}
+		}
+		writeMap(proc_dir + "/uid_map", m_uid_ranges);
+		writeMap(proc_dir + "/gid_map", m_gid_ranges);
+	}
+
+	void UserMapping::switchToRoot() const
+	{
+		//setgroups is denied with the default mapping, the host's supplementary groups are dropped otherwise
+		if (m_remapped && setgroups(0, nullptr) != 0) {
+			throw UserMapException(string("Couldn't drop the supplementary groups of the host : ") + strerror(errno));
+		}
+		if (setgid(0) != 0 || setuid(0) != 0) {
+			throw UserMapException(string("Couldn't switch to the root user of the container : ") + strerror(errno));
+		}
+	}
+
+	int UserMapping::createUserNamespace() const
+	{
+		//a child unshares its user namespace, gets the maps and waits until the namespace is opened
+		int ready_pipe[2];
+		int done_pipe[2];
+		if (pipe2(ready_pipe, O_CLOEXEC) != 0) {
+			throw UserMapException(string("Couldn't create a user namespace : ") + strerror(errno));
+		}
+		if (pipe2(done_pipe, O_CLOEXEC) != 0) {
+			int error = errno;
+			close(ready_pipe[0]);
+			close(ready_pipe[1]);
+			throw UserMapException(string("Couldn't create a user namespace : ") + strerror(error));
+		}
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(ready_pipe[0]);
+			close(done_pipe[1]);
+			char status = unshare(CLONE_NEWUSER) == 0 ? 1 : 0;
+			if (write(ready_pipe[1], &status, 1) != 1) _exit(1);
+			//returns once the parent closes its end
+			char done;
+			while (read(done_pipe[0], &done, 1) < 0 && errno == EINTR) {}
+			_exit(0);
+		}
+		close(ready_pipe[1]);
+		close(done_pipe[0]);
+		if (pid < 0) {
+			int error = errno;
+			close(ready_pipe[0]);
+			close(done_pipe[1]);
+			throw UserMapException(string("Couldn't create a user namespace : ") + strerror(error));
+		}
+
+		char status = 0;
+		ssize_t n;
+		while ((n = read(ready_pipe[0], &status, 1)) < 0 && errno == EINTR) {}
+		close(ready_pipe[0]);
+		int userns_fd = -1;
+		string error;
+		if (n == 1 && status == 1) {
+			try {
+				apply(pid);
+				userns_fd = open(("/proc/" + to_string(pid) + "/ns/user").c_str(), O_RDONLY | O_CLOEXEC);
+				if (userns_fd < 0) error = strerror(errno);
+			} catch (const UserMapException& ex) {
+				error = ex.what();
+			}
+		} else {
+			error = "unshare(CLONE_NEWUSER) failed";
+		}
+		close(done_pipe[1]);
+		while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {}
+		if (userns_fd < 0) {
+			throw UserMapException("Couldn't create a user namespace : " + error);
+		}
+		return userns_fd;
+	}
+
+	void UserMapping::mountIdmapped(const string& source, const string& target, int userns_fd)
+	{
+		//a detached copy of the mount source is on, idmapped, then attached at target
+		int tree_fd = static_cast<int>(syscall(SYS_open_tree, AT_FDCWD, source.c_str(), OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC));
+		if (tree_fd < 0) {
+			throw MountException("Couldn't clone the mount of " + source + " : " + strerror(errno));
+		}
+		struct mount_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.attr_set = MOUNT_ATTR_IDMAP;
+		attr.userns_fd = static_cast<uint64_t>(userns_fd);
+		if (syscall(SYS_mount_setattr, tree_fd, "", AT_EMPTY_PATH, &attr, sizeof(attr)) != 0) {
+			int error = errno;
+			close(tree_fd);
+			throw MountException("Couldn't idmap " + source + " (" + strerror(error) + "), the kernel or its file system doesn't support idmapped mounts");
+		}
+		if (syscall(SYS_move_mount, tree_fd, "", AT_FDCWD, target.c_str(), MOVE_MOUNT_F_EMPTY_PATH) != 0) {
+			int error = errno;
+			close(tree_fd);
+			throw MountException("Couldn't mount the idmapped " + source + " : " + strerror(error));
+		}
+		close(tree_fd);
+	}
+}